@@ -0,0 +1,289 @@
+#!/usr/bin/env python3
+"""
+Benchmark s3zip on synthetic databases.
+
+Builds a set of representative inputs in a scratch directory:
+
+  vacuumed    text-heavy tables and an index, freshly VACUUMed
+  fragmented  the same after deletes, updates and inserts, not VACUUMed
+  blob        mostly random (incompressible) BLOBs
+  wal         like vacuumed, with a quarter of it rewritten in a WAL
+              that is never checkpointed (the writer stays connected)
+  small       many small databases in one archive
+
+and runs the s3zip binary under test over each of them for every
+combination of codec, level, flush policy and thread count asked for,
+reporting throughput (uncompressed MB per second of wall time),
+compression ratio and the peak RSS of the s3zip process.  Thread counts
+mean -p for single databases and -j for the small ones.
+
+Python 3 standard library only.  Needs an s3zip built against an SQLite
+with sqlite_dbpage, and Linux or macOS for the RSS figures, which are
+s3zip's own --stats=json peak_rss.
+"""
+
+import argparse
+import json
+import os
+import random
+import shutil
+import sqlite3
+import sys
+import tempfile
+import time
+
+WORDS = ("select insert update delete from where order group table index "
+         "customer invoice amount total status pending shipped returned "
+         "alpha bravo charlie delta echo foxtrot golf hotel india juliet "
+         "north south east west red green blue yellow black white").split()
+
+PAGE_SIZE = 4096
+
+
+def sentence(rng, n):
+    return " ".join(rng.choice(WORDS) for _ in range(n))
+
+
+def create_rows(db, rng, size, start=0):
+    """Insert text rows until the database holds about size bytes."""
+    db.execute("create table if not exists t(id integer primary key,"
+               " name text, note text, n integer)")
+    db.execute("create index if not exists t_name on t(name)")
+    row_id = start
+    while True:
+        batch = []
+        for _ in range(2000):
+            row_id += 1
+            batch.append((row_id, sentence(rng, 3),
+                          sentence(rng, rng.randint(5, 60)),
+                          rng.randint(0, 1 << 40)))
+        db.executemany("insert into t values(?,?,?,?)", batch)
+        db.commit()
+        pages = db.execute("pragma page_count").fetchone()[0]
+        if pages*PAGE_SIZE >= size:
+            return row_id
+
+
+def open_db(path):
+    db = sqlite3.connect(path)
+    db.execute("pragma page_size=%d" % PAGE_SIZE)
+    return db
+
+
+def make_vacuumed(path, rng, size):
+    db = open_db(path)
+    create_rows(db, rng, size)
+    db.execute("vacuum")
+    db.close()
+
+
+def make_fragmented(path, rng, size):
+    db = open_db(path)
+    last = create_rows(db, rng, size*2//3)
+    db.execute("delete from t where abs(random())%3=0")
+    db.commit()
+    for _ in range(last//10):
+        db.execute("update t set note=? where id=?",
+                   (sentence(rng, rng.randint(20, 120)),
+                    rng.randint(1, last)))
+    db.commit()
+    create_rows(db, rng, size, last)
+    db.close()
+
+
+def make_blob(path, rng, size):
+    db = open_db(path)
+    db.execute("create table b(id integer primary key, name text, data blob)")
+    row_id = 0
+    while True:
+        row_id += 1
+        data = rng.randbytes(rng.randint(2048, 65536))
+        db.execute("insert into b values(?,?,?)",
+                   (row_id, sentence(rng, 2), data))
+        if row_id % 64 == 0:
+            db.commit()
+            pages = db.execute("pragma page_count").fetchone()[0]
+            if pages*PAGE_SIZE >= size:
+                break
+    db.commit()
+    db.close()
+
+
+def make_wal(path, rng, size):
+    """Returns the writer, which must stay open to keep the WAL."""
+    make_vacuumed(path, rng, size)
+    db = sqlite3.connect(path)
+    db.execute("pragma journal_mode=wal")
+    db.execute("pragma wal_autocheckpoint=0")
+    last = db.execute("select max(id) from t").fetchone()[0]
+    for row_id in range(1, last+1, 4):
+        db.execute("update t set note=? where id=?",
+                   (sentence(rng, rng.randint(5, 60)), row_id))
+    db.commit()
+    return db
+
+
+def make_small(directory, rng, size, count):
+    paths = []
+    for ix in range(count):
+        path = os.path.join(directory, "small-%03d.db" % ix)
+        db = open_db(path)
+        create_rows(db, rng, max(size//count, 2*PAGE_SIZE))
+        db.close()
+        paths.append(path)
+    return paths
+
+
+def logical_size(paths):
+    """Bytes an s3zip copy of paths will hold, WAL included."""
+    total = 0
+    for path in paths:
+        db = sqlite3.connect("file:%s?mode=ro" % path, uri=True)
+        count, = db.execute("pragma page_count").fetchone()
+        page_size, = db.execute("pragma page_size").fetchone()
+        db.close()
+        total += count*page_size
+    return total
+
+
+def run(s3zip, args, archive):
+    """Run s3zip once; returns (seconds, peak RSS in bytes)."""
+    if os.path.exists(archive):
+        os.remove(archive)
+# The child's ru_maxrss would start from this process's, which Linux
+# carries across exec, so the peak is the one s3zip reports itself.
+    with tempfile.TemporaryFile("w+") as report:
+        start = time.monotonic()
+        pid = os.fork()
+        if not pid:
+            os.dup2(report.fileno(), 2)
+            try:
+                os.execv(s3zip, [s3zip, "--stats=json"] + args)
+            finally:
+                os._exit(127)
+        _, status = os.waitpid(pid, 0)
+        elapsed = time.monotonic()-start
+        report.seek(0)
+        text = report.read()
+    if not os.WIFEXITED(status) or os.WEXITSTATUS(status):
+        return None, None
+    try:
+        stats = json.loads(text[text.index("{\n"):])
+    except ValueError:
+        return None, None
+    return elapsed, stats["memory"]["peak_rss"]
+
+
+def supported_codecs(s3zip, candidates, sample):
+    result = []
+    for codec in candidates:
+        seconds, _ = run(s3zip, ["-m", codec, "codec.zip", sample],
+                         "codec.zip")
+        if seconds is not None:
+            result.append(codec)
+        else:
+            print("skipping %s: not supported by this build" % codec,
+                  file=sys.stderr)
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[1])
+    parser.add_argument("--s3zip", default="./s3zip",
+                        help="binary to benchmark (default ./s3zip)")
+    parser.add_argument("--size", type=int, default=64,
+                        help="MiB per generated database (default 64)")
+    parser.add_argument("--small-count", type=int, default=200,
+                        help="number of small databases (default 200)")
+    parser.add_argument("--datasets",
+                        default="vacuumed,fragmented,blob,wal,small")
+    parser.add_argument("--codecs", default="deflate,zstd,lz4")
+    parser.add_argument("--levels", default="1,6")
+    parser.add_argument("--flush", default="adaptive,block")
+    parser.add_argument("--threads", default="1,4")
+    parser.add_argument("--repeat", type=int, default=1,
+                        help="runs per case; the fastest counts")
+    parser.add_argument("--dir", help="scratch directory (kept)")
+    parser.add_argument("--seed", type=int, default=1)
+    opts = parser.parse_args()
+
+    s3zip = os.path.abspath(opts.s3zip)
+    if not os.access(s3zip, os.X_OK):
+        parser.error("%s: not executable" % s3zip)
+    scratch = opts.dir or tempfile.mkdtemp(prefix="s3zip-bench-")
+    scratch = os.path.abspath(scratch)
+    os.makedirs(scratch, exist_ok=True)
+# Archive entries are named after the paths given, which must be relative.
+    os.chdir(scratch)
+    rng = random.Random(opts.seed)
+    size = opts.size << 20
+    writers = []
+    try:
+        datasets = []
+        for name in opts.datasets.split(","):
+            print("generating %s" % name, file=sys.stderr)
+            path = name + ".db"
+            if name == "small":
+                directory = "small"
+                shutil.rmtree(directory, ignore_errors=True)
+                os.mkdir(directory)
+                paths = make_small(directory, rng, size, opts.small_count)
+            else:
+                for suffix in ("", "-wal", "-shm"):
+                    if os.path.exists(path + suffix):
+                        os.remove(path + suffix)
+                if name == "vacuumed":
+                    make_vacuumed(path, rng, size)
+                elif name == "fragmented":
+                    make_fragmented(path, rng, size)
+                elif name == "blob":
+                    make_blob(path, rng, size)
+                elif name == "wal":
+                    writers.append(make_wal(path, rng, size))
+                else:
+                    parser.error("%s: unknown dataset" % name)
+                paths = [path]
+            datasets.append((name, paths, logical_size(paths)))
+
+        codecs = supported_codecs(s3zip, opts.codecs.split(","),
+                                  datasets[0][1][0])
+        archive = "out.zip"
+        print("%-11s %-8s %5s %-8s %7s %9s %7s %9s" %
+              ("dataset", "codec", "level", "flush", "threads",
+               "MB/s", "ratio", "RSS MiB"))
+        for name, paths, total in datasets:
+            for codec in codecs:
+                for level in opts.levels.split(","):
+                    for flush in opts.flush.split(","):
+                        for threads in opts.threads.split(","):
+                            args = ["-m", codec, "-l", level,
+                                    "--flush=" + flush]
+                            args += ["-j" if len(paths) > 1 else "-p",
+                                     threads]
+                            best = None
+                            for _ in range(opts.repeat):
+                                seconds, rss = run(s3zip, args+[archive]+paths,
+                                                   archive)
+                                if seconds is None:
+                                    break
+                                if best is None or seconds < best[0]:
+                                    best = (seconds, rss)
+                            if best is None:
+                                print("%-11s %-8s %5s %-8s %7s    failed" %
+                                      (name, codec, level, flush, threads))
+                                continue
+                            print("%-11s %-8s %5s %-8s %7s %9.1f %7.3f %9.1f" %
+                                  (name, codec, level, flush, threads,
+                                   total/best[0]/1e6,
+                                   os.path.getsize(archive)/total,
+                                   best[1]/1048576.0))
+                            sys.stdout.flush()
+    finally:
+        for db in writers:
+            db.close()
+        if not opts.dir:
+            shutil.rmtree(scratch, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    main()
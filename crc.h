@@ -0,0 +1,211 @@
+/*
+ * The Zip CRC-32, shared by s3zip and s3unzip.
+ *
+ * Where the processor can help, it does: carry-less multiplication
+ * (PCLMULQDQ) on x86, detected at run time, or the CRC32 instructions
+ * of ARMv8, when the compiler targets them.  Anything else, or anything
+ * built with S3ZIP_ZLIB_CRC, uses zlib's crc32, which is also what
+ * the short heads and tails of buffers go to.
+ *
+ * crc_init picks the kernel and says which it is; it must be called
+ * before any threads are started.  crc_update works like crc32.
+ */
+
+#ifndef CRC_H
+#define CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#if !defined(S3ZIP_ZLIB_CRC) && defined(__GNUC__) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define CRC_PCLMUL
+#include <immintrin.h>
+#elif !defined(S3ZIP_ZLIB_CRC) && defined(__ARM_FEATURE_CRC32)
+#define CRC_ARMV8
+#include <arm_acle.h>
+#endif
+
+static uint32_t crc_zlib(
+    uint32_t crc,
+    uint8_t const *p,
+    size_t len)
+{
+    while (len) {
+        uInt part;
+
+        part=len>0x40000000 ? 0x40000000 : (uInt)len;
+        crc=crc32(crc,p,part);
+        p+=part;
+        len-=part;
+    }
+    return crc;
+}
+
+#ifdef CRC_PCLMUL
+
+/*
+ * Folding by four 128-bit lanes and Barrett reduction, as in Intel's
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ".
+ * The constants are powers of x modulo the bit-reflected polynomial.
+ * Takes and returns the CRC register without the final inversion,
+ * and a length of at least 64 that is a multiple of 16.
+ */
+
+static uint64_t const crc_k1k2[2] = { 0x0154442BD4, 0x01C6E41596 };
+static uint64_t const crc_k3k4[2] = { 0x01751997D0, 0x00CCAA009E };
+static uint64_t const crc_k5k0[2] = { 0x0163CD6124, 0x0000000000 };
+static uint64_t const crc_poly[2] = { 0x01DB710641, 0x01F7011641 };
+
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc_fold(
+    uint32_t crc,
+    uint8_t const *p,
+    size_t len)
+{
+    __m128i x0,x1,x2,x3,x4,x5,x6,x7,x8;
+
+    x0=_mm_loadu_si128((__m128i const *)crc_k1k2);
+    x1=_mm_loadu_si128((__m128i const *)(p+0x00));
+    x2=_mm_loadu_si128((__m128i const *)(p+0x10));
+    x3=_mm_loadu_si128((__m128i const *)(p+0x20));
+    x4=_mm_loadu_si128((__m128i const *)(p+0x30));
+    x1=_mm_xor_si128(x1,_mm_cvtsi32_si128((int)crc));
+    p+=64;
+    len-=64;
+    while (len>=64) {
+        x5=_mm_clmulepi64_si128(x1,x0,0x00);
+        x6=_mm_clmulepi64_si128(x2,x0,0x00);
+        x7=_mm_clmulepi64_si128(x3,x0,0x00);
+        x8=_mm_clmulepi64_si128(x4,x0,0x00);
+        x1=_mm_clmulepi64_si128(x1,x0,0x11);
+        x2=_mm_clmulepi64_si128(x2,x0,0x11);
+        x3=_mm_clmulepi64_si128(x3,x0,0x11);
+        x4=_mm_clmulepi64_si128(x4,x0,0x11);
+        x1=_mm_xor_si128(_mm_xor_si128(x1,x5),
+                         _mm_loadu_si128((__m128i const *)(p+0x00)));
+        x2=_mm_xor_si128(_mm_xor_si128(x2,x6),
+                         _mm_loadu_si128((__m128i const *)(p+0x10)));
+        x3=_mm_xor_si128(_mm_xor_si128(x3,x7),
+                         _mm_loadu_si128((__m128i const *)(p+0x20)));
+        x4=_mm_xor_si128(_mm_xor_si128(x4,x8),
+                         _mm_loadu_si128((__m128i const *)(p+0x30)));
+        p+=64;
+        len-=64;
+    }
+/*
+ * Four lanes into one, then whatever 16-byte blocks are left.
+ */
+    x0=_mm_loadu_si128((__m128i const *)crc_k3k4);
+    x5=_mm_clmulepi64_si128(x1,x0,0x00);
+    x1=_mm_clmulepi64_si128(x1,x0,0x11);
+    x1=_mm_xor_si128(_mm_xor_si128(x1,x2),x5);
+    x5=_mm_clmulepi64_si128(x1,x0,0x00);
+    x1=_mm_clmulepi64_si128(x1,x0,0x11);
+    x1=_mm_xor_si128(_mm_xor_si128(x1,x3),x5);
+    x5=_mm_clmulepi64_si128(x1,x0,0x00);
+    x1=_mm_clmulepi64_si128(x1,x0,0x11);
+    x1=_mm_xor_si128(_mm_xor_si128(x1,x4),x5);
+    while (len>=16) {
+        x2=_mm_loadu_si128((__m128i const *)p);
+        x5=_mm_clmulepi64_si128(x1,x0,0x00);
+        x1=_mm_clmulepi64_si128(x1,x0,0x11);
+        x1=_mm_xor_si128(_mm_xor_si128(x1,x2),x5);
+        p+=16;
+        len-=16;
+    }
+/*
+ * 128 bits down to 64, then Barrett reduction down to 32.
+ */
+    x2=_mm_clmulepi64_si128(x1,x0,0x10);
+    x3=_mm_setr_epi32(~0,0,~0,0);
+    x1=_mm_srli_si128(x1,8);
+    x1=_mm_xor_si128(x1,x2);
+    x0=_mm_loadl_epi64((__m128i const *)crc_k5k0);
+    x2=_mm_srli_si128(x1,4);
+    x1=_mm_and_si128(x1,x3);
+    x1=_mm_clmulepi64_si128(x1,x0,0x00);
+    x1=_mm_xor_si128(x1,x2);
+    x0=_mm_loadu_si128((__m128i const *)crc_poly);
+    x2=_mm_and_si128(x1,x3);
+    x2=_mm_clmulepi64_si128(x2,x0,0x10);
+    x2=_mm_and_si128(x2,x3);
+    x2=_mm_clmulepi64_si128(x2,x0,0x00);
+    x1=_mm_xor_si128(x1,x2);
+    return (uint32_t)_mm_extract_epi32(x1,1);
+}
+
+static char crc_have_pclmul;
+
+#endif
+
+#ifdef CRC_ARMV8
+
+static uint32_t crc_armv8(
+    uint32_t crc,
+    uint8_t const *p,
+    size_t len)
+{
+    crc=~crc;
+    while (len && ((uintptr_t)p & 7)) {
+        crc=__crc32b(crc,*p++);
+        len--;
+    }
+    while (len>=8) {
+        uint64_t word;
+
+        memcpy(&word,p,8);
+        crc=__crc32d(crc,word);
+        p+=8;
+        len-=8;
+    }
+    while (len) {
+        crc=__crc32b(crc,*p++);
+        len--;
+    }
+    return ~crc;
+}
+
+#endif
+
+static char const *crc_init(void)
+{
+#if defined(CRC_PCLMUL)
+    __builtin_cpu_init();
+    crc_have_pclmul=__builtin_cpu_supports("pclmul")
+        && __builtin_cpu_supports("sse4.1");
+    return crc_have_pclmul ? "pclmul" : "zlib";
+#elif defined(CRC_ARMV8)
+    return "armv8";
+#else
+    return "zlib";
+#endif
+}
+
+static uint32_t crc_update(
+    uint32_t crc,
+    void const *data,
+    size_t len)
+{
+    uint8_t const *p;
+
+    p=data;
+#if defined(CRC_PCLMUL)
+    if (crc_have_pclmul && len>=64) {
+        size_t bulk;
+
+        bulk=len & ~(size_t)15;
+        crc=~crc_fold(~crc,p,bulk);
+        p+=bulk;
+        len-=bulk;
+    }
+#elif defined(CRC_ARMV8)
+    return crc_armv8(crc,p,len);
+#endif
+    return crc_zlib(crc,p,len);
+}
+
+#endif
@@ -0,0 +1,282 @@
+/*
+ * Page hashes, manifests, delta and grouped entries,
+ * shared by s3zip and s3unzip.
+ *
+ * A manifest records a hash of every page of every input archived
+ * in one run.  A later run given that manifest archives only the pages
+ * whose hashes differ, as a delta entry named after the input with
+ * ".delta" appended.  The uncompressed content of a delta entry is:
+ *
+ *   a delta_header;
+ *   a bitmap of (page_count+7)/8 bytes, where bit (pgno-1)%8
+ *   of byte (pgno-1)/8 is set for every page included;
+ *   the included pages, in pgno order.
+ *
+ * Pages past base_page_count are always included.  The header also has
+ * the fingerprint of the database the delta applies to, so that deltas
+ * can't be applied out of order or to the wrong file.  A fingerprint is
+ * the hash of all the page hashes, in order, as little-endian integers.
+ *
+ * A manifest file is a manifest_header followed, for each input,
+ * by a manifest_entry, the path, and page_count hashes.
+ *
+ * A full copy of an input can instead be a grouped entry, named after
+ * the input with ".grouped" appended, which has the pages sorted by
+ * kind so that similar ones are near each other for the compressor:
+ *
+ *   a grouped_header;
+ *   page_count bytes, the group (see below) of each page in pgno order;
+ *   zeros up to a multiple of page_size;
+ *   the pages of group 0 in pgno order, then those of group 1, and so on.
+ *
+ * The hash is XXH64 with a zero seed.
+ */
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "zipkit.h"
+
+typedef struct manifest_header {
+    ule32 sig;
+    ule32 entry_cnt;
+} manifest_header;
+
+/*
+ * The identity of the main database file (device, inode, size and
+ * modification time) lets a later run tell that it hasn't been written
+ * since, not even by a checkpoint.
+ */
+
+typedef struct manifest_entry {
+    ule64 page_count;
+    ule64 fingerprint;
+    ule64 dev;
+    ule64 ino;
+    ule64 file_size;
+    ule64 mtime;
+    ule32 mtime_nsec;
+    ule32 page_size;
+    ule16 path_len;
+    ule16 reserved;
+} manifest_entry;
+
+typedef struct delta_header {
+    ule32 sig;
+    ule32 page_size;
+    ule64 page_count;
+    ule64 base_page_count;
+    ule64 base_fingerprint;
+    ule64 fingerprint;
+    ule64 changed_cnt;
+} delta_header;
+
+typedef struct grouped_header {
+    ule32 sig;
+    ule32 page_size;
+    ule64 page_count;
+} grouped_header;
+
+/*
+ * Pages are grouped by their b-tree page type, and the rest
+ * (overflow, freelist, pointer map and lock-byte pages) go last.
+ */
+
+enum {
+    group_index_interior,
+    group_index_leaf,
+    group_table_interior,
+    group_table_leaf,
+    group_other,
+    group_cnt
+};
+
+static ule32 const manifest_sig =       { 'S', '3', 'Z', 'M' };
+static ule32 const delta_sig =          { 'S', '3', 'Z', 'D' };
+static ule32 const grouped_sig =        { 'S', '3', 'Z', 'G' };
+
+static char const delta_suffix[] = ".delta";
+static char const grouped_suffix[] = ".grouped";
+
+enum {
+    delta_suffix_len    = sizeof delta_suffix-1,
+    grouped_suffix_len  = sizeof grouped_suffix-1
+};
+
+/*
+ * XXH64, streaming and one-shot.
+ */
+
+typedef struct xxh64_state {
+    uint64_t v[4];
+    uint64_t total_len;
+    uint8_t mem[32];
+    size_t mem_len;
+} xxh64_state;
+
+#define XXH_P1 UINT64_C(0x9E3779B185EBCA87)
+#define XXH_P2 UINT64_C(0xC2B2AE3D27D4EB4F)
+#define XXH_P3 UINT64_C(0x165667B19E3779F9)
+#define XXH_P4 UINT64_C(0x85EBCA77C2B2AE63)
+#define XXH_P5 UINT64_C(0x27D4EB2F165667C5)
+
+#define XXH_ROTL(x,r) ((x)<<(r) | (x)>>(64-(r)))
+
+static uint64_t xxh64_load64(
+    uint8_t const *p)
+{
+    return (uint64_t)p[0]     | (uint64_t)p[1]<<8
+        | (uint64_t)p[2]<<16 | (uint64_t)p[3]<<24
+        | (uint64_t)p[4]<<32 | (uint64_t)p[5]<<40
+        | (uint64_t)p[6]<<48 | (uint64_t)p[7]<<56;
+}
+
+static uint64_t xxh64_round(
+    uint64_t acc,
+    uint64_t input)
+{
+    acc+=input*XXH_P2;
+    acc=XXH_ROTL(acc,31);
+    return acc*XXH_P1;
+}
+
+static uint64_t xxh64_merge(
+    uint64_t acc,
+    uint64_t v)
+{
+    acc^=xxh64_round(0,v);
+    return acc*XXH_P1+XXH_P4;
+}
+
+static void xxh64_init(
+    xxh64_state *state)
+{
+    state->v[0]=XXH_P1+XXH_P2;
+    state->v[1]=XXH_P2;
+    state->v[2]=0;
+    state->v[3]=-XXH_P1;
+    state->total_len=0;
+    state->mem_len=0;
+}
+
+static void xxh64_stripes(
+    uint64_t *v,
+    uint8_t const *p,
+    size_t len)
+{
+    uint8_t const *end;
+
+    end=p+len;
+    for (; p<end; p+=32) {
+        v[0]=xxh64_round(v[0],xxh64_load64(p));
+        v[1]=xxh64_round(v[1],xxh64_load64(p+8));
+        v[2]=xxh64_round(v[2],xxh64_load64(p+16));
+        v[3]=xxh64_round(v[3],xxh64_load64(p+24));
+    }
+}
+
+static void xxh64_update(
+    xxh64_state *state,
+    void const *data,
+    size_t len)
+{
+    uint8_t const *p;
+    size_t bulk;
+
+    p=data;
+    state->total_len+=len;
+    if (state->mem_len) {
+        size_t fill;
+
+        fill=32-state->mem_len;
+        if (fill>len)
+            fill=len;
+        memcpy(state->mem+state->mem_len,p,fill);
+        state->mem_len+=fill;
+        p+=fill;
+        len-=fill;
+        if (state->mem_len<32)
+            return;
+        xxh64_stripes(state->v,state->mem,32);
+        state->mem_len=0;
+    }
+    bulk=len & ~(size_t)31;
+    xxh64_stripes(state->v,p,bulk);
+    memcpy(state->mem,p+bulk,len-bulk);
+    state->mem_len=len-bulk;
+}
+
+static uint64_t xxh64_digest(
+    xxh64_state const *state)
+{
+    uint64_t h;
+    uint8_t const *p,*end;
+
+    if (state->total_len>=32) {
+        uint64_t const *v;
+
+        v=state->v;
+        h=XXH_ROTL(v[0],1)+XXH_ROTL(v[1],7)
+            +XXH_ROTL(v[2],12)+XXH_ROTL(v[3],18);
+        h=xxh64_merge(h,v[0]);
+        h=xxh64_merge(h,v[1]);
+        h=xxh64_merge(h,v[2]);
+        h=xxh64_merge(h,v[3]);
+    } else {
+        h=XXH_P5;
+    }
+    h+=state->total_len;
+    p=state->mem;
+    end=p+state->mem_len;
+    for (; p+8<=end; p+=8) {
+        h^=xxh64_round(0,xxh64_load64(p));
+        h=XXH_ROTL(h,27)*XXH_P1+XXH_P4;
+    }
+    if (p+4<=end) {
+        h^=((uint64_t)p[0] | (uint64_t)p[1]<<8
+            | (uint64_t)p[2]<<16 | (uint64_t)p[3]<<24)*XXH_P1;
+        h=XXH_ROTL(h,23)*XXH_P2+XXH_P3;
+        p+=4;
+    }
+    for (; p<end; p++) {
+        h^=*p*XXH_P5;
+        h=XXH_ROTL(h,11)*XXH_P1;
+    }
+    h^=h>>33;
+    h*=XXH_P2;
+    h^=h>>29;
+    h*=XXH_P3;
+    h^=h>>32;
+    return h;
+}
+
+static uint64_t xxh64(
+    void const *data,
+    size_t len)
+{
+    xxh64_state state;
+
+    xxh64_init(&state);
+    xxh64_update(&state,data,len);
+    return xxh64_digest(&state);
+}
+
+/*
+ * Fingerprints are built one page hash at a time.
+ */
+
+static void fingerprint_add(
+    xxh64_state *state,
+    uint64_t hash)
+{
+    ule64 u;
+
+    STORE64(u,hash);
+    xxh64_update(state,&u,sizeof u);
+}
+
+#endif
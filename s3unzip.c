@@ -0,0 +1,1897 @@
+/*
+ * Restore from s3zip archives.
+ *
+ * Archives are processed in the order given, so that a full backup
+ * followed by the deltas made since restores the latest state:
+ *
+ *   s3unzip [-C dir] full.zip delta-1.zip delta-2.zip ...
+ *
+ * An entry named X.delta is applied to the file X, which must be
+ * exactly the database the delta was made from; applying a delta
+ * checks that first, and checks the result afterwards.  An entry
+ * named X.grouped has the pages of X sorted by kind, and they are put
+ * back in place as they come.  Any other entry replaces its file,
+ * except for a shared dictionary, which is only used for decompressing
+ * the other entries of its archive.
+ *
+ * With -j, the entries of each archive are extracted by that many
+ * threads at once, biggest first.  Either way, output is gathered into
+ * large writes, aligned to their size wherever the data is contiguous.
+ *
+ * With -r first-last, only those pages of each full copy are written
+ * into their files, which are otherwise left alone.  In an archive made
+ * with --seekable, decompression starts at the last index point before
+ * them and stops after them.  There's no CRC to check a part against.
+ *
+ * With -t, nothing is written: each entry is only decompressed and its
+ * CRC checked.  In an archive made with --verify, the pages of every
+ * full copy are also hashed and compared with the archive's manifest,
+ * and any that differ are reported.  A delta only has its CRC checked.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* for pread, pwrite and ftruncate */
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+#ifdef S3ZIP_ZSTD
+#include <zstd.h>
+#endif
+#ifdef S3ZIP_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "zipkit.h"
+#include "delta.h"
+#include "crc.h"
+
+typedef struct entry_info {
+    char *path;
+    size_t path_len;
+    off_t local_offset;
+    off_t compressed_size;
+    off_t size;
+    uint32_t crc;
+    unsigned int method;
+    uint32_t page_size;
+    index_point const *points;
+    size_t point_cnt;
+    ule64 const *hashes;
+    uint64_t hash_cnt;
+    uint32_t hash_size;
+} entry_info;
+
+typedef struct archive_info {
+    char const *path;
+    int fd;
+    entry_info *entries;
+    size_t entry_cnt;
+    entry_info *dict_entry;
+    uint8_t *dict;
+    size_t dict_len;
+    entry_info *index_entry;
+    uint8_t *index;
+    entry_info *manifest_entry;
+    uint8_t *manifest;
+    entry_info **order;
+    size_t next_entry;
+    int failed;
+} archive_info;
+
+/*
+ * Where decompressed data goes: straight into a file,
+ * or for a delta or a grouped entry, into the right pages of one.
+ * When testing, it goes nowhere, but the pages may be hashed.
+ */
+
+typedef struct sink_info {
+    char const *path;
+    int fd;
+    char delta;
+    char grouped;
+    off_t size;
+    uint32_t crc;
+    delta_header header;
+    size_t header_len;
+    uint8_t *bitmap;
+    size_t bitmap_len;
+    size_t bitmap_got;
+    uint64_t page_size;
+    uint64_t page_count;
+    uint64_t changed_left;
+    uint64_t pgno;
+    uint64_t page_got;
+    uint64_t *hashes;
+    xxh64_state page_hash;
+    uint8_t *buf;
+    size_t buf_len;
+    off_t buf_offset;
+    char range;
+    char range_done;
+    off_t range_start;
+    off_t range_end;
+    grouped_header grouped_header;
+    uint8_t *groups;
+    uint64_t prefix_len;
+    uint64_t prefix_got;
+    int group;
+    char test;
+    ule64 const *test_hashes;
+    uint64_t test_page_cnt;
+    uint32_t test_page_size;
+    xxh64_state test_hash;
+    uint8_t *differ;
+} sink_info;
+
+enum {
+    buf_size            = 0x10000,
+    write_size          = 0x100000,
+    write_align         = 0x1000
+};
+
+typedef struct extract_info {
+    pthread_t thread;
+    archive_info *archive;
+    entry_info *entry;
+    sink_info sink;
+    off_t offset;
+    off_t remaining;
+    uint64_t first_pgno;
+    uint64_t last_pgno;
+    char test;
+    char resumed;
+    uint8_t in_buf[buf_size];
+    uint8_t out_buf[buf_size];
+} extract_info;
+
+/*
+ * Reading the central directory.
+ */
+
+/*
+ * Reading the archive is all pread, since extracting threads share it.
+ */
+
+static int read_at(
+    archive_info *archive,
+    void *buf,
+    size_t len,
+    off_t offset)
+{
+    uint8_t *p;
+
+    p=buf;
+    while (len>0) {
+        ssize_t got;
+
+        got=pread(archive->fd,p,len,offset);
+        if (got<0) {
+            if (errno==EINTR)
+                continue;
+            fprintf(stderr,"%s: pread: %s\n",archive->path,strerror(errno));
+            return -1;
+        }
+        if (!got) {
+            fprintf(stderr,"%s: Truncated archive\n",archive->path);
+            return -1;
+        }
+        p+=got;
+        len-=got;
+        offset+=got;
+    }
+    return 0;
+}
+
+/*
+ * Nothing we extract may land outside the current directory.
+ */
+
+static int safe_path(
+    char const *path)
+{
+    char const *p;
+
+    if (!path[0] || path[0]=='/')
+        return 0;
+    for (p=path; p; p=strchr(p,'/')) {
+        if (*p=='/')
+            p++;
+        if (p[0]=='.' && p[1]=='.' && (!p[2] || p[2]=='/'))
+            return 0;
+    }
+    return 1;
+}
+
+static int parse_directory(
+    archive_info *archive,
+    uint8_t const *cd,
+    size_t cd_size)
+{
+    uint8_t const *p,*end;
+    size_t ix;
+
+    p=cd;
+    end=cd+cd_size;
+    for (ix=0; ix<archive->entry_cnt; ix++) {
+        central_entry const *central;
+        entry_info *entry;
+        uint8_t const *ext,*ext_end;
+        size_t path_len,ext_len,comment_len;
+
+        central=(central_entry const *)p;
+        if ((size_t)(end-p)<sizeof (central_entry)
+                || memcmp(&central->sig,&central_entry_sig,
+                          sizeof central_entry_sig))
+            goto bad;
+        path_len=LOAD16(central->path_len);
+        ext_len=LOAD16(central->extra_len);
+        comment_len=LOAD16(central->comment_len);
+        p+=sizeof (central_entry);
+        if ((size_t)(end-p)<path_len+ext_len+comment_len)
+            goto bad;
+        entry=archive->entries+ix;
+        entry->path=malloc(path_len+1);
+        if (!entry->path) {
+            perror("malloc");
+            return -1;
+        }
+        memcpy(entry->path,p,path_len);
+        entry->path[path_len]=0;
+        entry->path_len=path_len;
+        if (strlen(entry->path)!=path_len || !safe_path(entry->path)) {
+            fprintf(stderr,"%s: %s: Unsafe path\n",
+                    archive->path,entry->path);
+            return -1;
+        }
+        entry->method=LOAD16(central->compression);
+        entry->crc=LOAD32(central->crc);
+        entry->size=LOAD32(central->size);
+        entry->compressed_size=LOAD32(central->compressed_size);
+        entry->local_offset=LOAD32(central->local_offset);
+        ext=p+path_len;
+        ext_end=ext+ext_len;
+        while (ext_end-ext>=4) {
+            unsigned int id,size;
+            uint8_t const *data,*data_end;
+
+            id=ext[0] | ext[1]<<8;
+            size=ext[2] | ext[3]<<8;
+            data=ext+4;
+            if ((size_t)(ext_end-data)<size)
+                goto bad;
+            data_end=data+size;
+            if (id==0x0001) {
+                if (entry->size==0xFFFFFFFF) {
+                    if (data_end-data<8)
+                        goto bad;
+                    entry->size=LOAD64(*(ule64 const *)data);
+                    data+=8;
+                }
+                if (entry->compressed_size==0xFFFFFFFF) {
+                    if (data_end-data<8)
+                        goto bad;
+                    entry->compressed_size=LOAD64(*(ule64 const *)data);
+                    data+=8;
+                }
+                if (entry->local_offset==0xFFFFFFFF) {
+                    if (data_end-data<8)
+                        goto bad;
+                    entry->local_offset=LOAD64(*(ule64 const *)data);
+                    data+=8;
+                }
+            }
+            ext=data_end;
+        }
+        p+=path_len+ext_len+comment_len;
+    }
+    return 0;
+
+bad:
+    fprintf(stderr,"%s: Bad central directory\n",archive->path);
+    return -1;
+}
+
+static int read_directory(
+    archive_info *archive)
+{
+    uint8_t *tail=NULL;
+    uint8_t *cd=NULL;
+    off_t file_size,tail_offset,eocd_offset;
+    size_t tail_len,pos;
+    eocd const *end;
+    uint64_t entry_cnt,cd_size,cd_offset;
+    int found;
+    struct stat stat_buf;
+
+    if (fstat(archive->fd,&stat_buf)) {
+        fprintf(stderr,"%s: fstat: %s\n",archive->path,strerror(errno));
+        goto cleanup;
+    }
+    file_size=stat_buf.st_size;
+    tail_len=0xFFFF+sizeof (eocd)+sizeof (eocd64_locator);
+    if (file_size<(off_t)tail_len)
+        tail_len=file_size;
+    if (tail_len<sizeof (eocd)) {
+        fprintf(stderr,"%s: Not a Zip archive\n",archive->path);
+        goto cleanup;
+    }
+    tail=malloc(tail_len);
+    if (!tail) {
+        perror("malloc");
+        goto cleanup;
+    }
+    tail_offset=file_size-tail_len;
+    if (read_at(archive,tail,tail_len,tail_offset))
+        goto cleanup;
+    found=0;
+    for (pos=tail_len-sizeof (eocd)+1; pos-->0; ) {
+        end=(eocd const *)(tail+pos);
+        if (!memcmp(&end->sig,&eocd_sig,sizeof eocd_sig)
+                && LOAD16(end->comment_len)==tail_len-sizeof (eocd)-pos) {
+            found=1;
+            break;
+        }
+    }
+    if (!found) {
+        fprintf(stderr,"%s: Not a Zip archive\n",archive->path);
+        goto cleanup;
+    }
+    eocd_offset=tail_offset+pos;
+    entry_cnt=LOAD16(end->total_entry_cnt);
+    cd_size=LOAD32(end->cd_size);
+    cd_offset=LOAD32(end->cd_offset);
+    if (pos>=sizeof (eocd64_locator)) {
+        eocd64_locator const *loc64;
+
+        loc64=(eocd64_locator const *)(tail+pos-sizeof (eocd64_locator));
+        if (!memcmp(&loc64->sig,&eocd64_locator_sig,sizeof eocd64_locator_sig)) {
+            eocd64 end64;
+
+            if (read_at(archive,&end64,sizeof end64,
+                    LOAD64(loc64->eocd_offset)))
+                goto cleanup;
+            if (memcmp(&end64.sig,&eocd64_sig,sizeof eocd64_sig)) {
+                fprintf(stderr,"%s: Bad Zip64 trailer\n",archive->path);
+                goto cleanup;
+            }
+            entry_cnt=LOAD64(end64.total_entry_cnt);
+            cd_size=LOAD64(end64.cd_size);
+            cd_offset=LOAD64(end64.cd_offset);
+        }
+    }
+    free(tail);
+    tail=NULL;
+    if (cd_offset>(uint64_t)eocd_offset || cd_size>eocd_offset-cd_offset
+            || entry_cnt>cd_size/sizeof (central_entry)) {
+        fprintf(stderr,"%s: Bad central directory\n",archive->path);
+        goto cleanup;
+    }
+    cd=malloc(cd_size+1);
+    archive->entries=calloc(entry_cnt+1,sizeof (entry_info));
+    if (!cd || !archive->entries) {
+        perror("malloc");
+        goto cleanup;
+    }
+    archive->entry_cnt=entry_cnt;
+    if (read_at(archive,cd,cd_size,cd_offset))
+        goto cleanup;
+    if (parse_directory(archive,cd,cd_size))
+        goto cleanup;
+    free(cd);
+    return 0;
+
+cleanup:
+    if (tail)
+        free(tail);
+    if (cd)
+        free(cd);
+    return -1;
+}
+
+/*
+ * Find where an entry's data starts, past its local header.
+ */
+
+static int find_data(
+    archive_info *archive,
+    entry_info *entry,
+    off_t *data_offset)
+{
+    local_entry local;
+
+    if (read_at(archive,&local,sizeof local,entry->local_offset))
+        return -1;
+    if (memcmp(&local.sig,&local_entry_sig,sizeof local_entry_sig)) {
+        fprintf(stderr,"%s: %s: Bad local header\n",
+                archive->path,entry->path);
+        return -1;
+    }
+    *data_offset=entry->local_offset+sizeof local
+        +LOAD16(local.path_len)+LOAD16(local.extra_len);
+    return 0;
+}
+
+static int load_dictionary(
+    archive_info *archive)
+{
+    entry_info *entry,*entries_end;
+    off_t data_offset;
+
+    entries_end=archive->entries+archive->entry_cnt;
+    for (entry=archive->entries; entry<entries_end; entry++) {
+        if (!strcmp(entry->path,dictionary_path))
+            break;
+    }
+    if (entry==entries_end)
+        return 0;
+    if (entry->method!=method_stored || entry->size>dictionary_max
+            || entry->compressed_size!=entry->size || !entry->size) {
+        fprintf(stderr,"%s: Bad dictionary\n",archive->path);
+        return -1;
+    }
+    archive->dict_entry=entry;
+    archive->dict=malloc(entry->size);
+    if (!archive->dict) {
+        perror("malloc");
+        return -1;
+    }
+    archive->dict_len=entry->size;
+    if (find_data(archive,entry,&data_offset))
+        return -1;
+    if (read_at(archive,archive->dict,archive->dict_len,data_offset))
+        return -1;
+    if (crc_update(0,archive->dict,archive->dict_len)!=entry->crc) {
+        fprintf(stderr,"%s: Bad dictionary\n",archive->path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * An index tells where decompression can start, and each entry's
+ * page size.  Its entries are in archive order, like the directory's.
+ */
+
+static int load_index(
+    archive_info *archive)
+{
+    entry_info *entry,*entries_end,*cursor;
+    off_t data_offset;
+    index_header const *header;
+    uint8_t const *p,*end;
+    uint32_t ix,entry_cnt;
+
+    entries_end=archive->entries+archive->entry_cnt;
+    for (entry=archive->entries; entry<entries_end; entry++) {
+        if (!strcmp(entry->path,index_path))
+            break;
+    }
+    if (entry==entries_end)
+        return 0;
+    if (entry->method!=method_stored || entry->size<(off_t)sizeof *header
+            || entry->compressed_size!=entry->size
+            || (uint64_t)entry->size>(size_t)-1)
+        goto bad;
+    archive->index_entry=entry;
+    archive->index=malloc(entry->size);
+    if (!archive->index) {
+        perror("malloc");
+        return -1;
+    }
+    if (find_data(archive,entry,&data_offset))
+        return -1;
+    if (read_at(archive,archive->index,entry->size,data_offset))
+        return -1;
+    if (crc_update(0,archive->index,entry->size)!=entry->crc)
+        goto bad;
+    header=(index_header const *)archive->index;
+    if (memcmp(&header->sig,&index_sig,sizeof index_sig))
+        goto bad;
+    entry_cnt=LOAD32(header->entry_cnt);
+    p=archive->index+sizeof *header;
+    end=archive->index+entry->size;
+    cursor=archive->entries;
+    for (ix=0; ix<entry_cnt; ix++) {
+        index_entry const *ientry;
+        index_point const *points;
+        size_t point_cnt,point_ix;
+        uint64_t local_offset;
+
+        ientry=(index_entry const *)p;
+        if ((size_t)(end-p)<sizeof *ientry)
+            goto bad;
+        p+=sizeof *ientry;
+        point_cnt=LOAD32(ientry->point_cnt);
+        if ((size_t)(end-p)/sizeof (index_point)<point_cnt)
+            goto bad;
+        points=(index_point const *)p;
+        p+=point_cnt*sizeof (index_point);
+        local_offset=LOAD64(ientry->local_offset);
+        while (cursor<entries_end
+               && (uint64_t)cursor->local_offset<local_offset)
+            cursor++;
+        if (cursor==entries_end
+                || (uint64_t)cursor->local_offset!=local_offset)
+            goto bad;
+        cursor->page_size=LOAD32(ientry->page_size);
+        if (cursor->page_size<512 || cursor->page_size>0x10000)
+            goto bad;
+        for (point_ix=0; point_ix<point_cnt; point_ix++) {
+            uint64_t offset,compressed_offset;
+
+            offset=LOAD64(points[point_ix].offset);
+            compressed_offset=LOAD64(points[point_ix].compressed_offset);
+            if (offset>(uint64_t)cursor->size
+                    || compressed_offset>(uint64_t)cursor->compressed_size
+                    || point_ix && offset<=LOAD64(points[point_ix-1].offset))
+                goto bad;
+        }
+        cursor->points=points;
+        cursor->point_cnt=point_cnt;
+    }
+    if (p!=end)
+        goto bad;
+    return 0;
+
+bad:
+    fprintf(stderr,"%s: Bad index\n",archive->path);
+    return -1;
+}
+
+/*
+ * The manifest of an archive made with --verify has an entry
+ * for each database, in archive order, under its plain name.
+ * Its hashes go with a full or grouped copy; a delta has none.
+ */
+
+static char const *input_suffix(
+    entry_info const *entry,
+    uint8_t const *path,
+    size_t path_len)
+{
+    char const *suffix;
+
+    if (entry->path_len<path_len || memcmp(entry->path,path,path_len))
+        return NULL;
+    suffix=entry->path+path_len;
+    if (*suffix && strcmp(suffix,grouped_suffix)
+            && strcmp(suffix,delta_suffix))
+        return NULL;
+    return suffix;
+}
+
+static int load_manifest(
+    archive_info *archive)
+{
+    entry_info *entry,*entries_end,*cursor;
+    off_t data_offset;
+    manifest_header const *header;
+    uint8_t const *p,*end;
+    uint32_t ix,entry_cnt;
+
+    entries_end=archive->entries+archive->entry_cnt;
+    for (entry=archive->entries; entry<entries_end; entry++) {
+        if (!strcmp(entry->path,archive_manifest_path))
+            break;
+    }
+    if (entry==entries_end)
+        return 0;
+    if (entry->method!=method_stored || entry->size<(off_t)sizeof *header
+            || entry->compressed_size!=entry->size
+            || (uint64_t)entry->size>(size_t)-1)
+        goto bad;
+    archive->manifest_entry=entry;
+    archive->manifest=malloc(entry->size);
+    if (!archive->manifest) {
+        perror("malloc");
+        return -1;
+    }
+    if (find_data(archive,entry,&data_offset))
+        return -1;
+    if (read_at(archive,archive->manifest,entry->size,data_offset))
+        return -1;
+    if (crc_update(0,archive->manifest,entry->size)!=entry->crc)
+        goto bad;
+    header=(manifest_header const *)archive->manifest;
+    if (memcmp(&header->sig,&manifest_sig,sizeof manifest_sig))
+        goto bad;
+    entry_cnt=LOAD32(header->entry_cnt);
+    p=archive->manifest+sizeof *header;
+    end=archive->manifest+entry->size;
+    cursor=archive->entries;
+    for (ix=0; ix<entry_cnt; ix++) {
+        manifest_entry const *mentry;
+        size_t path_len;
+        uint64_t page_count;
+        uint32_t page_size;
+        char const *suffix;
+
+        mentry=(manifest_entry const *)p;
+        if ((size_t)(end-p)<sizeof *mentry)
+            goto bad;
+        p+=sizeof *mentry;
+        path_len=LOAD16(mentry->path_len);
+        page_count=LOAD64(mentry->page_count);
+        page_size=LOAD32(mentry->page_size);
+        if ((size_t)(end-p)<path_len
+                || (uint64_t)(end-p-path_len)/8<page_count
+                || page_size<512 || page_size>0x10000)
+            goto bad;
+        suffix=NULL;
+        while (cursor<entries_end
+               && !(suffix=input_suffix(cursor,p,path_len)))
+            cursor++;
+        if (cursor==entries_end)
+            goto bad;
+        if (!*suffix && (uint64_t)cursor->size!=page_count*page_size)
+            goto bad;
+        if (strcmp(suffix,delta_suffix)) {
+            cursor->hashes=(ule64 const *)(p+path_len);
+            cursor->hash_cnt=page_count;
+            cursor->hash_size=page_size;
+        }
+        cursor++;
+        p+=path_len+page_count*8;
+    }
+    if (p!=end)
+        goto bad;
+    return 0;
+
+bad:
+    fprintf(stderr,"%s: Bad manifest\n",archive->path);
+    return -1;
+}
+
+/*
+ * Writing files.
+ */
+
+static int write_at(
+    int fd,
+    char const *path,
+    void const *buf,
+    size_t len,
+    off_t offset)
+{
+    uint8_t const *p;
+
+    p=buf;
+    while (len>0) {
+        ssize_t got;
+
+        got=pwrite(fd,p,len,offset);
+        if (got<0) {
+            if (errno==EINTR)
+                continue;
+            fprintf(stderr,"%s: pwrite: %s\n",path,strerror(errno));
+            return -1;
+        }
+        p+=got;
+        len-=got;
+        offset+=got;
+    }
+    return 0;
+}
+
+/*
+ * When testing, output is hashed page by page instead.  For both
+ * kinds of entry with hashes, each page comes whole and in order.
+ */
+
+static int test_write(
+    sink_info *sink,
+    uint8_t const *data,
+    size_t len,
+    off_t offset)
+{
+    if (!sink->test_hashes)
+        return 0;
+    while (len>0) {
+        size_t piece;
+        uint64_t pgno;
+
+        piece=sink->test_page_size-offset%sink->test_page_size;
+        if (piece>len)
+            piece=len;
+        xxh64_update(&sink->test_hash,data,piece);
+        data+=piece;
+        len-=piece;
+        offset+=piece;
+        if (offset%sink->test_page_size)
+            continue;
+        pgno=offset/sink->test_page_size;
+        if (pgno>sink->test_page_cnt) {
+            fprintf(stderr,"%s: More pages than in the manifest\n",
+                    sink->path);
+            return -1;
+        }
+        if (xxh64_digest(&sink->test_hash)
+                !=LOAD64(sink->test_hashes[pgno-1]))
+            sink->differ[(pgno-1)>>3]|=1<<((pgno-1)&7);
+        xxh64_init(&sink->test_hash);
+    }
+    return 0;
+}
+
+/*
+ * Output goes through a buffer, written out whenever it's full
+ * or the next piece doesn't follow on from it.
+ */
+
+static int sink_flush(
+    sink_info *sink)
+{
+    if (!sink->buf_len)
+        return 0;
+    if (write_at(sink->fd,sink->path,sink->buf,sink->buf_len,
+            sink->buf_offset))
+        return -1;
+    sink->buf_len=0;
+    return 0;
+}
+
+static int sink_write(
+    sink_info *sink,
+    void const *data,
+    size_t len,
+    off_t offset)
+{
+    uint8_t const *p;
+
+    p=data;
+    if (sink->test)
+        return test_write(sink,p,len,offset);
+    while (len>0) {
+        size_t piece;
+
+        if (sink->buf_len
+                && (sink->buf_len==write_size
+                    || offset!=sink->buf_offset+(off_t)sink->buf_len)) {
+            if (sink_flush(sink))
+                return -1;
+        }
+        if (!sink->buf_len)
+            sink->buf_offset=offset;
+        piece=write_size-sink->buf_len;
+        if (piece>len)
+            piece=len;
+        memcpy(sink->buf+sink->buf_len,p,piece);
+        sink->buf_len+=piece;
+        p+=piece;
+        len-=piece;
+        offset+=piece;
+    }
+    return 0;
+}
+
+static int make_parents(
+    char *path)
+{
+    char *slash;
+
+    for (slash=strchr(path,'/'); slash; slash=strchr(slash+1,'/')) {
+        *slash=0;
+        if (mkdir(path,0777) && errno!=EEXIST) {
+            fprintf(stderr,"%s: mkdir: %s\n",path,strerror(errno));
+            *slash='/';
+            return -1;
+        }
+        *slash='/';
+    }
+    return 0;
+}
+
+/*
+ * Before a delta goes in, hash the file it's going into.
+ * The page hashes are kept to check the result.
+ */
+
+static int check_base(
+    sink_info *sink)
+{
+    struct stat stat_buf;
+    uint64_t base_page_count,pgno;
+    xxh64_state fingerprint;
+    uint8_t *page;
+
+    base_page_count=LOAD64(sink->header.base_page_count);
+    if (fstat(sink->fd,&stat_buf)) {
+        fprintf(stderr,"%s: fstat: %s\n",sink->path,strerror(errno));
+        return -1;
+    }
+    if ((uint64_t)stat_buf.st_size!=base_page_count*sink->page_size) {
+        fprintf(stderr,"%s: Not the base of this delta\n",sink->path);
+        return -1;
+    }
+    page=malloc(sink->page_size);
+    sink->hashes=calloc(sink->page_count+1,sizeof (uint64_t));
+    if (!page || !sink->hashes) {
+        perror("malloc");
+        free(page);
+        return -1;
+    }
+    xxh64_init(&fingerprint);
+    for (pgno=1; pgno<=base_page_count; pgno++) {
+        ssize_t got;
+        uint64_t hash;
+
+        got=pread(sink->fd,page,sink->page_size,(pgno-1)*sink->page_size);
+        if (got!=(ssize_t)sink->page_size) {
+            if (got<0) {
+                fprintf(stderr,"%s: pread: %s\n",sink->path,strerror(errno));
+            } else {
+                fprintf(stderr,"%s: Short read\n",sink->path);
+            }
+            free(page);
+            return -1;
+        }
+        hash=xxh64(page,sink->page_size);
+        fingerprint_add(&fingerprint,hash);
+        if (pgno<=sink->page_count)
+            sink->hashes[pgno-1]=hash;
+    }
+    free(page);
+    if (xxh64_digest(&fingerprint)!=LOAD64(sink->header.base_fingerprint)) {
+        fprintf(stderr,"%s: Not the base of this delta\n",sink->path);
+        return -1;
+    }
+    return 0;
+}
+
+static void next_changed(
+    sink_info *sink)
+{
+    do {
+        sink->pgno++;
+    } while (sink->pgno<=sink->page_count
+             && !(sink->bitmap[(sink->pgno-1)>>3]>>((sink->pgno-1)&7) & 1));
+    xxh64_init(&sink->page_hash);
+}
+
+static int delta_parts(
+    sink_info *sink)
+{
+    if (memcmp(&sink->header.sig,&delta_sig,sizeof delta_sig)) {
+        fprintf(stderr,"%s: Not a delta\n",sink->path);
+        return -1;
+    }
+    sink->page_size=LOAD32(sink->header.page_size);
+    sink->page_count=LOAD64(sink->header.page_count);
+    sink->changed_left=LOAD64(sink->header.changed_cnt);
+    if (sink->page_size<512 || sink->page_size>0x10000
+            || sink->page_count>(uint64_t)1<<40) {
+        fprintf(stderr,"%s: Bad delta header\n",sink->path);
+        return -1;
+    }
+    sink->bitmap_len=(sink->page_count+7)/8;
+    sink->bitmap=malloc(sink->bitmap_len+1);
+    if (!sink->bitmap) {
+        perror("malloc");
+        return -1;
+    }
+    return check_base(sink);
+}
+
+static int count_changed(
+    sink_info *sink)
+{
+    uint64_t bit_cnt;
+    size_t ix;
+
+    bit_cnt=0;
+    for (ix=0; ix<sink->bitmap_len; ix++) {
+        unsigned int bits;
+
+        for (bits=sink->bitmap[ix]; bits; bits&=bits-1)
+            bit_cnt++;
+    }
+    if (bit_cnt!=sink->changed_left) {
+        fprintf(stderr,"%s: Bad delta bitmap\n",sink->path);
+        return -1;
+    }
+    sink->pgno=0;
+    next_changed(sink);
+    return 0;
+}
+
+/*
+ * The pages of a grouped entry come group by group, each group
+ * in pgno order, after the header and the group of every page.
+ */
+
+static void next_grouped(
+    sink_info *sink)
+{
+    for (;;) {
+        sink->pgno++;
+        if (sink->pgno>sink->page_count) {
+            sink->group++;
+            if (sink->group>=group_cnt)
+                return;
+            sink->pgno=1;
+        }
+        if (sink->groups[sink->pgno-1]==sink->group)
+            return;
+    }
+}
+
+static int grouped_parts(
+    sink_info *sink)
+{
+    grouped_header *header;
+
+    header=&sink->grouped_header;
+    if (memcmp(&header->sig,&grouped_sig,sizeof grouped_sig)) {
+        fprintf(stderr,"%s: Not a grouped entry\n",sink->path);
+        return -1;
+    }
+    sink->page_size=LOAD32(header->page_size);
+    sink->page_count=LOAD64(header->page_count);
+    if (sink->page_size<512 || sink->page_size>0x10000
+            || !sink->page_count || sink->page_count>(uint64_t)1<<40) {
+        fprintf(stderr,"%s: Bad grouped header\n",sink->path);
+        return -1;
+    }
+    if (sink->test_hashes && (sink->page_count!=sink->test_page_cnt
+                              || sink->page_size!=sink->test_page_size)) {
+        fprintf(stderr,"%s: Not as in the manifest\n",sink->path);
+        return -1;
+    }
+    sink->prefix_len=(sizeof *header+sink->page_count+sink->page_size-1)
+        /sink->page_size*sink->page_size;
+    sink->prefix_got=sizeof *header;
+    sink->groups=malloc(sink->page_count+1);
+    if (!sink->groups) {
+        perror("malloc");
+        return -1;
+    }
+    return 0;
+}
+
+static int grouped_map(
+    sink_info *sink)
+{
+    uint64_t ix;
+
+    for (ix=0; ix<sink->page_count; ix++) {
+        if (sink->groups[ix]>=group_cnt) {
+            fprintf(stderr,"%s: Bad group map\n",sink->path);
+            return -1;
+        }
+    }
+    sink->group=0;
+    sink->pgno=0;
+    next_grouped(sink);
+    return 0;
+}
+
+static int grouped_feed(
+    sink_info *sink,
+    uint8_t const *data,
+    size_t len)
+{
+    while (len>0) {
+        size_t piece;
+
+        if (sink->header_len<sizeof sink->grouped_header) {
+            piece=sizeof sink->grouped_header-sink->header_len;
+            if (piece>len)
+                piece=len;
+            memcpy((uint8_t *)&sink->grouped_header+sink->header_len,
+                   data,piece);
+            sink->header_len+=piece;
+            if (sink->header_len==sizeof sink->grouped_header
+                    && grouped_parts(sink))
+                return -1;
+        } else if (sink->prefix_got<sink->prefix_len) {
+            uint64_t map_end;
+
+            piece=sink->prefix_len-sink->prefix_got;
+            if (piece>len)
+                piece=len;
+            map_end=sizeof sink->grouped_header+sink->page_count;
+            if (sink->prefix_got<map_end) {
+                size_t map_piece;
+
+                map_piece=map_end-sink->prefix_got;
+                if (map_piece>piece)
+                    map_piece=piece;
+                memcpy(sink->groups+sink->prefix_got
+                           -sizeof sink->grouped_header,
+                       data,map_piece);
+            }
+            sink->prefix_got+=piece;
+            if (sink->prefix_got==sink->prefix_len && grouped_map(sink))
+                return -1;
+        } else {
+            if (sink->group>=group_cnt) {
+                fprintf(stderr,"%s: Too much grouped data\n",sink->path);
+                return -1;
+            }
+            piece=sink->page_size-sink->page_got;
+            if (piece>len)
+                piece=len;
+            if (sink_write(sink,data,piece,
+                    (sink->pgno-1)*sink->page_size+sink->page_got))
+                return -1;
+            sink->page_got+=piece;
+            if (sink->page_got==sink->page_size) {
+                sink->page_got=0;
+                next_grouped(sink);
+            }
+        }
+        data+=piece;
+        len-=piece;
+    }
+    return 0;
+}
+
+/*
+ * A page range takes only its own part of the data, and ends things
+ * as soon as it has all of it, by pretending to fail.
+ */
+
+static int range_feed(
+    sink_info *sink,
+    uint8_t const *data,
+    size_t len)
+{
+    off_t start,end;
+
+    start=sink->size-len;
+    end=sink->size;
+    if (start<sink->range_start) {
+        if (end<=sink->range_start)
+            return 0;
+        data+=sink->range_start-start;
+        start=sink->range_start;
+    }
+    if (end>sink->range_end)
+        end=sink->range_end;
+    if (end>start && sink_write(sink,data,end-start,start))
+        return -1;
+    if (end<sink->range_end)
+        return 0;
+    sink->range_done=1;
+    return -1;
+}
+
+static int sink_feed(
+    sink_info *sink,
+    uint8_t const *data,
+    size_t len)
+{
+    sink->crc=crc_update(sink->crc,data,len);
+    sink->size+=len;
+    if (sink->range)
+        return range_feed(sink,data,len);
+    if (sink->grouped)
+        return grouped_feed(sink,data,len);
+    if (!sink->delta)
+        return sink_write(sink,data,len,sink->size-len);
+    while (len>0) {
+        size_t piece;
+
+        if (sink->header_len<sizeof sink->header) {
+            piece=sizeof sink->header-sink->header_len;
+            if (piece>len)
+                piece=len;
+            memcpy((uint8_t *)&sink->header+sink->header_len,data,piece);
+            sink->header_len+=piece;
+            if (sink->header_len==sizeof sink->header) {
+                if (delta_parts(sink))
+                    return -1;
+                if (!sink->bitmap_len && count_changed(sink))
+                    return -1;
+            }
+        } else if (sink->bitmap_got<sink->bitmap_len) {
+            piece=sink->bitmap_len-sink->bitmap_got;
+            if (piece>len)
+                piece=len;
+            memcpy(sink->bitmap+sink->bitmap_got,data,piece);
+            sink->bitmap_got+=piece;
+            if (sink->bitmap_got==sink->bitmap_len && count_changed(sink))
+                return -1;
+        } else {
+            if (!sink->changed_left) {
+                fprintf(stderr,"%s: Too much delta data\n",sink->path);
+                return -1;
+            }
+            piece=sink->page_size-sink->page_got;
+            if (piece>len)
+                piece=len;
+            if (sink_write(sink,data,piece,
+                    (sink->pgno-1)*sink->page_size+sink->page_got))
+                return -1;
+            xxh64_update(&sink->page_hash,data,piece);
+            sink->page_got+=piece;
+            if (sink->page_got==sink->page_size) {
+                sink->hashes[sink->pgno-1]=xxh64_digest(&sink->page_hash);
+                sink->page_got=0;
+                sink->changed_left--;
+                next_changed(sink);
+            }
+        }
+        data+=piece;
+        len-=piece;
+    }
+    return 0;
+}
+
+static int sink_open(
+    sink_info *sink,
+    entry_info *entry,
+    int range,
+    int test)
+{
+    memset(sink,0,sizeof *sink);
+    sink->fd=-1;
+    sink->path=entry->path;
+    if (test) {
+        sink->test=1;
+        sink->grouped=entry->path_len>grouped_suffix_len
+            && !strcmp(entry->path+entry->path_len-grouped_suffix_len,
+                       grouped_suffix);
+        if (!entry->hashes)
+            return 0;
+        sink->test_hashes=entry->hashes;
+        sink->test_page_cnt=entry->hash_cnt;
+        sink->test_page_size=entry->hash_size;
+        sink->differ=calloc((size_t)(sink->test_page_cnt+7)/8+1,1);
+        if (!sink->differ) {
+            perror("calloc");
+            return -1;
+        }
+        xxh64_init(&sink->test_hash);
+        return 0;
+    }
+    if (posix_memalign((void **)&sink->buf,write_align,write_size)) {
+        sink->buf=NULL;
+        perror("posix_memalign");
+        return -1;
+    }
+    if (entry->path_len>delta_suffix_len
+            && !strcmp(entry->path+entry->path_len-delta_suffix_len,
+                       delta_suffix)) {
+        sink->delta=1;
+        entry->path[entry->path_len-delta_suffix_len]=0;
+        sink->fd=open(sink->path,O_RDWR);
+    } else if (range) {
+        sink->range=1;
+        if (make_parents(entry->path))
+            return -1;
+        sink->fd=open(sink->path,O_WRONLY | O_CREAT,0666);
+    } else {
+        if (entry->path_len>grouped_suffix_len
+                && !strcmp(entry->path+entry->path_len-grouped_suffix_len,
+                           grouped_suffix)) {
+            sink->grouped=1;
+            entry->path[entry->path_len-grouped_suffix_len]=0;
+        }
+        if (make_parents(entry->path))
+            return -1;
+        sink->fd=open(sink->path,O_WRONLY | O_CREAT | O_TRUNC,0666);
+    }
+    if (sink->fd<0) {
+        fprintf(stderr,"%s: open: %s\n",sink->path,strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * A finished delta has all its pages and the file is cut to size.
+ * The fingerprint of the result must then be the one in the header.
+ * A finished grouped entry has had every page put in place.
+ */
+
+static int sink_finish(
+    sink_info *sink)
+{
+    if (sink_flush(sink))
+        return -1;
+    if (sink->delta) {
+        xxh64_state fingerprint;
+        uint64_t pgno;
+
+        if (sink->header_len<sizeof sink->header
+                || sink->bitmap_got<sink->bitmap_len
+                || sink->changed_left || sink->page_got) {
+            fprintf(stderr,"%s: Truncated delta\n",sink->path);
+            return -1;
+        }
+        if (ftruncate(sink->fd,sink->page_count*sink->page_size)) {
+            fprintf(stderr,"%s: ftruncate: %s\n",sink->path,strerror(errno));
+            return -1;
+        }
+        xxh64_init(&fingerprint);
+        for (pgno=1; pgno<=sink->page_count; pgno++)
+            fingerprint_add(&fingerprint,sink->hashes[pgno-1]);
+        if (xxh64_digest(&fingerprint)!=LOAD64(sink->header.fingerprint)) {
+            fprintf(stderr,"%s: Wrong result after applying delta\n",
+                    sink->path);
+            return -1;
+        }
+    } else if (sink->grouped) {
+        if (sink->header_len<sizeof sink->grouped_header
+                || sink->prefix_got<sink->prefix_len
+                || sink->group<group_cnt) {
+            fprintf(stderr,"%s: Truncated grouped entry\n",sink->path);
+            return -1;
+        }
+        if (!sink->test
+                && ftruncate(sink->fd,sink->page_count*sink->page_size)) {
+            fprintf(stderr,"%s: ftruncate: %s\n",sink->path,strerror(errno));
+            return -1;
+        }
+    }
+    if (sink->test)
+        return 0;
+    if (close(sink->fd)) {
+        sink->fd=-1;
+        fprintf(stderr,"%s: close: %s\n",sink->path,strerror(errno));
+        return -1;
+    }
+    sink->fd=-1;
+    return 0;
+}
+
+static void sink_cleanup(
+    sink_info *sink)
+{
+    if (sink->fd>=0)
+        close(sink->fd);
+    free(sink->bitmap);
+    free(sink->hashes);
+    free(sink->groups);
+    free(sink->differ);
+    free(sink->buf);
+}
+
+/*
+ * A test passes if every page hashed as in the manifest.
+ */
+
+static int test_report(
+    sink_info *sink)
+{
+    uint64_t pgno,first;
+    int same;
+
+    same=1;
+    for (pgno=1; sink->test_hashes && pgno<=sink->test_page_cnt; pgno++) {
+        if (!(sink->differ[(pgno-1)>>3]>>((pgno-1)&7) & 1))
+            continue;
+        first=pgno;
+        while (pgno<sink->test_page_cnt
+               && sink->differ[pgno>>3]>>(pgno&7) & 1)
+            pgno++;
+        if (first==pgno) {
+            printf("%s: Page %llu differs\n",sink->path,
+                   (unsigned long long)first);
+        } else {
+            printf("%s: Pages %llu-%llu differ\n",sink->path,
+                   (unsigned long long)first,(unsigned long long)pgno);
+        }
+        same=0;
+    }
+    if (same)
+        printf("%s: OK\n",sink->path);
+    return same ? 0 : -1;
+}
+
+/*
+ * Decompression, one function per method.
+ */
+
+static size_t read_input(
+    extract_info *x)
+{
+    size_t len;
+
+    len=sizeof x->in_buf;
+    if ((off_t)len>x->remaining)
+        len=x->remaining;
+    if (!len)
+        return 0;
+    if (read_at(x->archive,x->in_buf,len,x->offset))
+        return 0;
+    x->offset+=len;
+    x->remaining-=len;
+    return len;
+}
+
+static int copy_stored(
+    extract_info *x)
+{
+    while (x->remaining>0) {
+        size_t len;
+
+        len=read_input(x);
+        if (!len)
+            return -1;
+        if (sink_feed(&x->sink,x->in_buf,len))
+            return -1;
+    }
+    return 0;
+}
+
+static int run_inflate(
+    extract_info *x)
+{
+    int status;
+    z_stream inflation;
+    int failed;
+
+    memset(&inflation,0,sizeof inflation);
+    status=inflateInit2(&inflation,-15);
+    if (status!=Z_OK) {
+        fprintf(stderr,"inflateInit2: error %d\n",status);
+        return -1;
+    }
+    if (x->archive->dict_len && !x->resumed) {
+        size_t dict_len;
+
+        dict_len=x->archive->dict_len;
+        if (dict_len>0x8000)
+            dict_len=0x8000;
+        status=inflateSetDictionary(
+            &inflation,x->archive->dict+x->archive->dict_len-dict_len,
+            dict_len);
+        if (status!=Z_OK) {
+            fprintf(stderr,"inflateSetDictionary: error %d\n",status);
+            inflateEnd(&inflation);
+            return -1;
+        }
+    }
+    status=Z_OK;
+    failed=0;
+    while (status!=Z_STREAM_END) {
+        if (!inflation.avail_in) {
+            inflation.avail_in=read_input(x);
+            inflation.next_in=x->in_buf;
+            if (!inflation.avail_in)
+                break;
+        }
+        inflation.next_out=x->out_buf;
+        inflation.avail_out=sizeof x->out_buf;
+        status=inflate(&inflation,Z_NO_FLUSH);
+        if (status!=Z_OK && status!=Z_STREAM_END) {
+            fprintf(stderr,"%s: inflate: error %d\n",x->entry->path,status);
+            failed=1;
+            break;
+        }
+        if (sink_feed(&x->sink,x->out_buf,inflation.next_out-x->out_buf)) {
+            failed=1;
+            break;
+        }
+    }
+    inflateEnd(&inflation);
+    if (!failed && status!=Z_STREAM_END) {
+        fprintf(stderr,"%s: Truncated entry\n",x->entry->path);
+        failed=1;
+    }
+    return failed ? -1 : 0;
+}
+
+#ifdef S3ZIP_ZSTD
+
+static int run_zstd(
+    extract_info *x)
+{
+    ZSTD_DCtx *dctx;
+    ZSTD_inBuffer in;
+    size_t status;
+    int failed;
+
+    dctx=ZSTD_createDCtx();
+    if (!dctx) {
+        fputs("ZSTD_createDCtx: Out of memory\n",stderr);
+        return -1;
+    }
+    if (x->archive->dict_len) {
+        status=ZSTD_DCtx_loadDictionary(
+            dctx,x->archive->dict,x->archive->dict_len);
+        if (ZSTD_isError(status)) {
+            fprintf(stderr,"ZSTD_DCtx_loadDictionary: %s\n",
+                    ZSTD_getErrorName(status));
+            ZSTD_freeDCtx(dctx);
+            return -1;
+        }
+    }
+    in.src=x->in_buf;
+    in.size=0;
+    in.pos=0;
+    status=1;
+    failed=0;
+    while (status) {
+        ZSTD_outBuffer out;
+
+        if (in.pos==in.size) {
+            in.size=read_input(x);
+            in.pos=0;
+            if (!in.size)
+                break;
+        }
+        out.dst=x->out_buf;
+        out.size=sizeof x->out_buf;
+        out.pos=0;
+        status=ZSTD_decompressStream(dctx,&out,&in);
+        if (ZSTD_isError(status)) {
+            fprintf(stderr,"%s: ZSTD_decompressStream: %s\n",
+                    x->entry->path,ZSTD_getErrorName(status));
+            failed=1;
+            break;
+        }
+        if (sink_feed(&x->sink,x->out_buf,out.pos)) {
+            failed=1;
+            break;
+        }
+    }
+    ZSTD_freeDCtx(dctx);
+    if (!failed && status) {
+        fprintf(stderr,"%s: Truncated entry\n",x->entry->path);
+        failed=1;
+    }
+    return failed ? -1 : 0;
+}
+
+#endif
+
+#ifdef S3ZIP_LZ4
+
+static int run_lz4(
+    extract_info *x)
+{
+    LZ4F_dctx *dctx;
+    size_t status;
+    size_t in_pos,in_len;
+    int failed;
+
+    status=LZ4F_createDecompressionContext(&dctx,LZ4F_VERSION);
+    if (LZ4F_isError(status)) {
+        fprintf(stderr,"LZ4F_createDecompressionContext: %s\n",
+                LZ4F_getErrorName(status));
+        return -1;
+    }
+    in_pos=0;
+    in_len=0;
+    status=1;
+    failed=0;
+    while (status) {
+        size_t in_size,out_size;
+
+        if (in_pos==in_len) {
+            in_len=read_input(x);
+            in_pos=0;
+            if (!in_len)
+                break;
+        }
+        in_size=in_len-in_pos;
+        out_size=sizeof x->out_buf;
+        status=LZ4F_decompress(dctx,x->out_buf,&out_size,
+                               x->in_buf+in_pos,&in_size,NULL);
+        if (LZ4F_isError(status)) {
+            fprintf(stderr,"%s: LZ4F_decompress: %s\n",
+                    x->entry->path,LZ4F_getErrorName(status));
+            failed=1;
+            break;
+        }
+        in_pos+=in_size;
+        if (sink_feed(&x->sink,x->out_buf,out_size)) {
+            failed=1;
+            break;
+        }
+    }
+    LZ4F_freeDecompressionContext(dctx);
+    if (!failed && status) {
+        fprintf(stderr,"%s: Truncated entry\n",x->entry->path);
+        failed=1;
+    }
+    return failed ? -1 : 0;
+}
+
+#endif
+
+/*
+ * Skip to where a page range can start: straight to it when stored,
+ * or else to the last index point before it.
+ */
+
+static void start_range(
+    extract_info *x)
+{
+    entry_info *entry;
+    sink_info *sink;
+    size_t ix;
+
+    entry=x->entry;
+    sink=&x->sink;
+    sink->range_start=(x->first_pgno-1)*entry->page_size;
+    sink->range_end=x->last_pgno*entry->page_size;
+    if (sink->range_end>entry->size)
+        sink->range_end=entry->size;
+    if (entry->method==method_stored) {
+        sink->size=sink->range_start;
+        x->offset+=sink->range_start;
+        x->remaining-=sink->range_start;
+        return;
+    }
+    for (ix=entry->point_cnt; ix-->0; ) {
+        off_t offset,compressed_offset;
+
+        offset=LOAD64(entry->points[ix].offset);
+        if (offset>sink->range_start)
+            continue;
+        compressed_offset=LOAD64(entry->points[ix].compressed_offset);
+        sink->size=offset;
+        x->offset+=compressed_offset;
+        x->remaining-=compressed_offset;
+        x->resumed=1;
+        break;
+    }
+}
+
+/*
+ * With a page range, only full copies from archives with an index
+ * qualify, and only if they are long enough.
+ */
+
+static int in_range(
+    extract_info *x)
+{
+    entry_info *entry;
+
+    entry=x->entry;
+    if (entry->path_len>delta_suffix_len
+            && !strcmp(entry->path+entry->path_len-delta_suffix_len,
+                       delta_suffix)
+            || entry->path_len>grouped_suffix_len
+            && !strcmp(entry->path+entry->path_len-grouped_suffix_len,
+                       grouped_suffix)) {
+        fprintf(stderr,"%s: Not a full copy, skipped\n",entry->path);
+        return 0;
+    }
+    if (!entry->page_size) {
+        fprintf(stderr,"%s: No index, skipped\n",entry->path);
+        return 0;
+    }
+    if ((x->first_pgno-1)*entry->page_size>=(uint64_t)entry->size) {
+        fprintf(stderr,"%s: Not that many pages, skipped\n",entry->path);
+        return 0;
+    }
+    return 1;
+}
+
+static int extract_entry(
+    extract_info *x)
+{
+    entry_info *entry;
+    int failed;
+
+    entry=x->entry;
+    if (find_data(x->archive,entry,&x->offset))
+        return -1;
+    x->remaining=entry->compressed_size;
+    x->resumed=0;
+    if (sink_open(&x->sink,entry,x->first_pgno>0,x->test)) {
+        sink_cleanup(&x->sink);
+        return -1;
+    }
+    if (x->first_pgno)
+        start_range(x);
+    switch (entry->method) {
+    case method_stored:
+        failed=copy_stored(x);
+        break;
+    case method_deflate:
+        failed=run_inflate(x);
+        break;
+#ifdef S3ZIP_ZSTD
+    case method_zstd:
+        failed=run_zstd(x);
+        break;
+#endif
+#ifdef S3ZIP_LZ4
+    case method_lz4:
+        failed=run_lz4(x);
+        break;
+#endif
+    default:
+        fprintf(stderr,"%s: Unsupported compression method %u\n",
+                entry->path,entry->method);
+        failed=1;
+        break;
+    }
+    if (x->sink.range) {
+        if (x->sink.range_done) {
+            failed=sink_finish(&x->sink);
+        } else if (!failed) {
+            fprintf(stderr,"%s: Truncated entry\n",entry->path);
+            failed=1;
+        }
+    } else if (!failed) {
+        if (x->sink.size!=entry->size || x->sink.crc!=entry->crc) {
+            fprintf(stderr,"%s: Bad size or CRC\n",entry->path);
+            failed=1;
+        } else if (sink_finish(&x->sink)) {
+            failed=1;
+        } else if (x->test && test_report(&x->sink)) {
+            failed=1;
+        }
+    }
+    sink_cleanup(&x->sink);
+    return failed ? -1 : 0;
+}
+
+/*
+ * Each thread takes the next entry until there are none left
+ * or one of them fails.
+ */
+
+static void *extract_main(
+    void *arg)
+{
+    extract_info *x;
+    archive_info *archive;
+
+    x=arg;
+    archive=x->archive;
+    while (!__atomic_load_n(&archive->failed,__ATOMIC_RELAXED)) {
+        size_t ix;
+
+        ix=__atomic_fetch_add(&archive->next_entry,1,__ATOMIC_RELAXED);
+        if (ix>=archive->entry_cnt)
+            break;
+        x->entry=archive->order[ix];
+        if (x->entry==archive->dict_entry || x->entry==archive->index_entry
+                || x->entry==archive->manifest_entry)
+            continue;
+        if (x->first_pgno && !in_range(x))
+            continue;
+        if (extract_entry(x))
+            __atomic_store_n(&archive->failed,1,__ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static int by_size(
+    void const *a,
+    void const *b)
+{
+    entry_info const *entry_a,*entry_b;
+
+    entry_a=*(entry_info * const *)a;
+    entry_b=*(entry_info * const *)b;
+    if (entry_a->compressed_size!=entry_b->compressed_size)
+        return entry_a->compressed_size>entry_b->compressed_size ? -1 : 1;
+    return entry_a<entry_b ? -1 : entry_a>entry_b;
+}
+
+static int extract_archive(
+    archive_info *archive,
+    extract_info *xs,
+    int job_cnt)
+{
+    size_t ix;
+    int failed;
+    int job_ix,started;
+
+    failed=read_directory(archive);
+    if (!failed)
+        failed=load_dictionary(archive);
+    if (!failed)
+        failed=load_index(archive);
+    if (!failed)
+        failed=load_manifest(archive);
+    if (!failed) {
+        archive->order=malloc((archive->entry_cnt+1)*sizeof (entry_info *));
+        if (!archive->order) {
+            perror("malloc");
+            failed=1;
+        }
+    }
+    if (!failed) {
+        for (ix=0; ix<archive->entry_cnt; ix++)
+            archive->order[ix]=archive->entries+ix;
+        if (job_cnt>1) {
+            qsort(archive->order,archive->entry_cnt,sizeof (entry_info *),
+                  by_size);
+        }
+        archive->next_entry=0;
+        archive->failed=0;
+        started=0;
+        for (job_ix=0; job_ix<job_cnt; job_ix++)
+            xs[job_ix].archive=archive;
+        for (job_ix=1; job_ix<job_cnt; job_ix++) {
+            int status;
+
+            status=pthread_create(&xs[job_ix].thread,NULL,extract_main,
+                                  xs+job_ix);
+            if (status) {
+                fprintf(stderr,"pthread_create: %s\n",strerror(status));
+                __atomic_store_n(&archive->failed,1,__ATOMIC_RELAXED);
+                break;
+            }
+            started++;
+        }
+        extract_main(xs);
+        for (job_ix=1; job_ix<=started; job_ix++)
+            pthread_join(xs[job_ix].thread,NULL);
+        failed=archive->failed;
+    }
+    free(archive->order);
+    archive->order=NULL;
+    for (ix=0; ix<archive->entry_cnt; ix++)
+        free(archive->entries[ix].path);
+    free(archive->entries);
+    archive->entries=NULL;
+    archive->entry_cnt=0;
+    free(archive->dict);
+    archive->dict=NULL;
+    archive->dict_len=0;
+    archive->dict_entry=NULL;
+    free(archive->index);
+    archive->index=NULL;
+    archive->index_entry=NULL;
+    free(archive->manifest);
+    archive->manifest=NULL;
+    archive->manifest_entry=NULL;
+    if (!failed && xs->test && fflush(stdout)) {
+        fprintf(stderr,"stdout: %s\n",strerror(errno));
+        failed=1;
+    }
+    return failed ? -1 : 0;
+}
+
+static int parse_count(
+    char const *arg,
+    char const *what,
+    long max,
+    int *result)
+{
+    char *end;
+    long value;
+
+    errno=0;
+    value=strtol(arg,&end,10);
+    if (errno || end==arg || *end || value<1 || value>max) {
+        fprintf(stderr,"%s: Invalid %s\n",arg,what);
+        return -1;
+    }
+    *result=value;
+    return 0;
+}
+
+static int parse_range(
+    char const *arg,
+    uint64_t *first,
+    uint64_t *last)
+{
+    char const *p;
+    char *end;
+    unsigned long long value;
+
+    errno=0;
+    value=strtoull(arg,&end,10);
+    if (errno || end==arg || *end!='-' || !value || value>(uint64_t)1<<40)
+        goto bad;
+    *first=value;
+    p=end+1;
+    value=strtoull(p,&end,10);
+    if (errno || end==p || *end || value<*first || value>(uint64_t)1<<40)
+        goto bad;
+    *last=value;
+    return 0;
+
+bad:
+    fprintf(stderr,"%s: Invalid page range\n",arg);
+    return -1;
+}
+
+static void usage(void)
+{
+    fputs("Usage: s3unzip [-C dir] [-j jobs] [-r first-last] archive.zip...\n"
+          "       s3unzip -t [-j jobs] archive.zip...\n",
+          stderr);
+}
+
+int main(
+    int argc,
+    char **argv)
+{
+    extract_info *xs=NULL;
+    archive_info *archives=NULL;
+    char const *dir=NULL;
+    int job_cnt=1;
+    uint64_t first_pgno=0,last_pgno=0;
+    int test=0;
+    int opt;
+    int ix;
+    int status=1;
+
+    while ((opt=getopt(argc,argv,"C:j:r:t"))!=-1) {
+        switch (opt) {
+        case 'C':
+            dir=optarg;
+            break;
+        case 'j':
+            if (parse_count(optarg,"job count",1024,&job_cnt))
+                return 1;
+            break;
+        case 'r':
+            if (parse_range(optarg,&first_pgno,&last_pgno))
+                return 1;
+            break;
+        case 't':
+            test=1;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    argc-=optind;
+    argv+=optind;
+    if (argc<1 || test && first_pgno) {
+        usage();
+        return 1;
+    }
+    crc_init();
+    xs=malloc(job_cnt*sizeof *xs);
+    archives=calloc(argc,sizeof (archive_info));
+    if (!xs || !archives) {
+        perror("malloc");
+        goto cleanup;
+    }
+    for (ix=0; ix<job_cnt; ix++) {
+        xs[ix].first_pgno=first_pgno;
+        xs[ix].last_pgno=last_pgno;
+        xs[ix].test=test;
+    }
+    for (ix=0; ix<argc; ix++)
+        archives[ix].fd=-1;
+/*
+ * Open every archive before changing directory,
+ * so that relative archive paths keep working.
+ */
+    for (ix=0; ix<argc; ix++) {
+        archives[ix].path=argv[ix];
+        archives[ix].fd=open(argv[ix],O_RDONLY);
+        if (archives[ix].fd<0) {
+            fprintf(stderr,"%s: open: %s\n",argv[ix],strerror(errno));
+            goto cleanup;
+        }
+    }
+    if (dir && !test && chdir(dir)) {
+        fprintf(stderr,"%s: chdir: %s\n",dir,strerror(errno));
+        goto cleanup;
+    }
+    for (ix=0; ix<argc; ix++) {
+        if (extract_archive(archives+ix,xs,job_cnt))
+            goto cleanup;
+    }
+    status=0;
+
+cleanup:
+    if (archives) {
+        for (ix=0; ix<argc; ix++) {
+            if (archives[ix].fd>=0)
+                close(archives[ix].fd);
+        }
+        free(archives);
+    }
+    free(xs);
+    return status;
+}
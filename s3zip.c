@@ -1,7 +1,8 @@
 /*
  * High-level operation description:
  *
- * 1. Open a single connection using an in-memory main database.
+ * 1. Open a single connection using an in-memory main database,
+ *    or more if there are more inputs than SQLite lets one attach.
  *
  * 2. Attach each input database in read-only mode.
  *
@@ -10,208 +11,686 @@
  *    the chance of getting a consistent multi-database backup.
  *
  * 4. Compress each input database to the output Zip archive,
- *    using the "sqlite_dbpage" virtual table to get pages
- *    from the database or WAL files as appropriate.
+ *    reading pages straight from the main database file where the
+ *    WAL has nothing newer, and using the "sqlite_dbpage" virtual
+ *    table for the rest (or for all of them, with --read=sql).
+ *
+ *    With more than one job, each input gets a connection of its own
+ *    in steps 1-3 (all the BEGINs still happen before any page is read),
+ *    and worker threads compress inputs to temporary spool files
+ *    that are copied to the archive in input order.
+ *
+ *    With more than one deflate thread, the pages of each input
+ *    are cut into chunks compressed in parallel, pigz style.
+ *
+ *    Given the manifest of a previous run, inputs found in it are
+ *    first scanned and hashed page by page, and only the pages that
+ *    changed are archived, as a delta entry (see delta.h).
+ *    With --quick, an input whose main file is untouched since then
+ *    has only its pages with frames in the write-ahead log read.
+ *
+ *    With --capture, each input is cloned before this step (see
+ *    capture_input) and step 5's ROLLBACK comes first, so the locks
+ *    are only held for as long as the cloning takes.
+ *
+ *    With --free-pages=zero, the leaf pages of each input's freelist
+ *    are neither read nor hashed, and go into the archive as zeros.
+ *
+ *    With --group-pages, a full copy of an input has its pages sorted
+ *    by b-tree page type, making a grouped entry (see delta.h).
+ *
+ *    With --seekable, deflate starts afresh every so many pages,
+ *    and where it did goes into an index entry after all the inputs
+ *    (see write_index), for restoring a few pages without the rest.
+ *
+ *    With --verify, the manifest goes into the archive too, and a later
+ *    --check of the same databases (steps 1-3 and only hashing here)
+ *    or s3unzip -t of the archive alone says which pages differ.
+ *
+ *    With --dictionary, the first pages of a sample of the inputs
+ *    become a preset dictionary for every deflate and zstd entry,
+ *    stored in the archive ahead of them (see build_dictionary).
+ *
+ *    Each input is compressed with deflate by default, or with
+ *    zstd (method 93) or LZ4 (a private method) when built with
+ *    S3ZIP_ZSTD or S3ZIP_LZ4 and asked to.  Only our own tools
+ *    can extract the latter.
+ *
+ *    With --max-memory, the number of workers and deflate threads,
+ *    the zlib settings, SQLite's page caches and the output buffers
+ *    are sized to fit a budget (see fit_memory).
  *
  * 5. ROLLBACK the transaction and close the database connection.
  *
  * 6. Write the Zip central directory and finalise the archive.
+ *
+ * The archive can also go to standard output ("-") or a pipe, in which
+ * case nothing is ever written twice: each entry's CRC and sizes
+ * follow its data in a data descriptor.  Built with S3ZIP_S3,
+ * it can also go straight to an S3 bucket.  Either way, the actual
+ * writing happens on a thread of its own, in big pieces.
+ *
+ * All of that is run_archive, given the options and paths of one run.
+ * With --serve, a daemon runs it for each job it gets over a socket,
+ * several at a time, keeping connections and deflate streams from one
+ * job to the next (see serve_jobs).
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* for fopencookie */
+#endif
+
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#ifdef __APPLE__
+#include <sys/clonefile.h>
+#endif
 
 #include <sqlite3.h>
 #include <zlib.h>
+#ifdef S3ZIP_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+#ifdef S3ZIP_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef S3ZIP_S3
+#include <strings.h>
+#include <curl/curl.h>
+#endif
+
+#include "zipkit.h"
+#include "delta.h"
+#include "crc.h"
+
+#ifdef __APPLE__
+#define ST_MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#else
+#define ST_MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#endif
 
 /*
- * Zip file construction kit, part 1:
- * Unsigned little-endian integers and how to store them.
- */
-
-typedef struct ule16 {
-    uint8_t a,b;
-} ule16;
-
-typedef struct ule32 {
-    uint8_t c,d,e,f;
-} ule32;
-
-typedef struct ule64 {
-    uint8_t g,h,i,j,k,l,m,n;
-} ule64;
-
-#define STORE16(u,v) \
-    ((u).a=(uint8_t)(v),       (u).b=(uint8_t)((v)>>8))
-
-#define STORE32(u,v) \
-    ((u).c=(uint8_t)(v),       (u).d=(uint8_t)((v)>>8), \
-     (u).e=(uint8_t)((v)>>16), (u).f=(uint8_t)((v)>>24))
-
-#define STORE64(u,v) \
-    ((u).g=(uint8_t)(v),       (u).h=(uint8_t)((v)>>8), \
-     (u).i=(uint8_t)((v)>>16), (u).j=(uint8_t)((v)>>24), \
-     (u).k=(uint8_t)((v)>>32), (u).l=(uint8_t)((v)>>40), \
-     (u).m=(uint8_t)((v)>>48), (u).n=(uint8_t)((v)>>56))
-
-/*
- * Zip file construction kit, part 2:
- * On-disk data structures.
- */
-
-typedef struct local_entry {
-    ule32 sig;
-    ule16 needed_version;
-    ule16 flags;
-    ule16 compression;
-    ule16 mod_time;
-    ule16 mod_date;
-    ule32 crc;
-    ule32 compressed_size;
-    ule32 size;
-    ule16 path_len;
-    ule16 extra_len;
-} local_entry;
-
-/*
- * A Zip64 local extension always contains both sizes and nothing more.
- */
-
-typedef struct local_zip64 {
-    ule16 ext_id;
-    ule16 ext_size;
-    ule64 size;
-    ule64 compressed_size;
-} local_zip64;
-
-typedef struct central_entry {
-    ule32 sig;
-    ule16 creator_version;
-    ule16 needed_version;
-    ule16 flags;
-    ule16 compression;
-    ule16 mod_time;
-    ule16 mod_date;
-    ule32 crc;
-    ule32 compressed_size;
-    ule32 size;
-    ule16 path_len;
-    ule16 extra_len;
-    ule16 comment_len;
-    ule16 first_diskno;
-    ule16 internal_attribs;
-    ule32 external_attribs;
-    ule32 local_offset;
-} central_entry;
-
-/*
- * A Zip64 central extension contains up to three 64-bit integers
- * (size, compressed size, local offset),
- * but no disk number since we only write single-part archives.
- */
-
-typedef struct central_zip64 {
-    ule16 ext_id;
-    ule16 ext_size;
-    ule64 data[3];
-} central_zip64;
-
-typedef struct eocd64 {
-    ule32 sig;
-    ule64 size;
-    ule16 creator_version;
-    ule16 needed_version;
-    ule32 this_diskno;
-    ule32 cd_diskno;
-    ule64 this_entry_cnt;
-    ule64 total_entry_cnt;
-    ule64 cd_size;
-    ule64 cd_offset;
-} eocd64;
-
-typedef struct eocd64_locator {
-    ule32 sig;
-    ule32 eocd_diskno;
-    ule64 eocd_offset;
-    ule32 disk_cnt;
-} eocd64_locator;
-
-typedef struct eocd {
-    ule32 sig;
-    ule16 this_diskno;
-    ule16 cd_diskno;
-    ule16 this_entry_cnt;
-    ule16 total_entry_cnt;
-    ule32 cd_size;
-    ule32 cd_offset;
-    ule16 comment_len;
-} eocd;
-
-static ule32 const local_entry_sig =    { 'P', 'K', 3, 4 };
-static ule32 const central_entry_sig =  { 'P', 'K', 1, 2 };
-static ule32 const eocd64_sig =         { 'P', 'K', 6, 6 };
-static ule32 const eocd64_locator_sig = { 'P', 'K', 6, 7 };
-static ule32 const eocd_sig =           { 'P', 'K', 5, 6 };
+ * A daemon collects each job's messages, and the report of a --check
+ * job, to send back with its status (see job_main), so everything
+ * in here writes to messages() and output() rather than to stderr
+ * and stdout, which are what threads given no streams of their own get.
+ */
 
-enum {
-    version_classic     = 20,   /* deflate compression needs 2.0 */
-    version_zip64       = 45,   /* Zip64 needs 4.5 */
+static pthread_key_t messages_key;
+static pthread_key_t output_key;
+static char have_stream_keys;
+
+static FILE *messages(void)
+{
+    FILE *stream=NULL;
+
+    if (have_stream_keys)
+        stream=pthread_getspecific(messages_key);
+    return stream ? stream : stderr;
+}
+
+static FILE *output(void)
+{
+    FILE *stream=NULL;
+
+    if (have_stream_keys)
+        stream=pthread_getspecific(output_key);
+    return stream ? stream : stdout;
+}
+
+static void use_messages(
+    FILE *stream)
+{
+    if (have_stream_keys)
+        pthread_setspecific(messages_key,stream);
+}
+
+static void use_output(
+    FILE *stream)
+{
+    if (have_stream_keys)
+        pthread_setspecific(output_key,stream);
+}
 
-    creator_unix        = 3<<8
-};
 
 /*
- * End of Zip stuff.
+ * perror, to messages().
  */
 
+static void report_errno(
+    char const *what)
+{
+    int error;
+
+    error=errno;
+    fprintf(messages(),"%s: %s\n",what,strerror(error));
+}
+
 /*
  * This program's specific data structures.
  */
 
+/*
+ * With --stats=json, each input's time is split into phases,
+ * and the main thread's into stages.  Deflate threads account
+ * for their time per chunk, and it goes to the chunk's input.
+ * Times are in nanoseconds.
+ */
+
+enum {
+    phase_plan,
+    phase_fetch,
+    phase_hash,
+    phase_crc,
+    phase_compress,
+    phase_write,
+    phase_seek,
+    phase_chunk_deflate,
+    phase_chunk_crc,
+    phase_cnt
+};
+
+static char const *const phase_names[phase_cnt]={
+    "plan",
+    "fetch",
+    "hash",
+    "crc",
+    "compress",
+    "write",
+    "seek",
+    "chunk_deflate",
+    "chunk_crc"
+};
+
+enum {
+    stage_open,
+    stage_lock,
+    stage_metainfo,
+    stage_capture,
+    stage_dictionary,
+    stage_compress,
+    stage_finish,
+    stage_cnt
+};
+
+static char const *const stage_names[stage_cnt]={
+    "open",
+    "lock",
+    "metainfo",
+    "capture",
+    "dictionary",
+    "compress",
+    "finish"
+};
+
+typedef struct phase_time {
+    uint64_t wall;
+    uint64_t cpu;
+} phase_time;
+
+enum {
+    stats_text,
+    stats_json
+};
+
+typedef struct conn_info {
+    sqlite3 *db;
+    uint64_t lock_wait;
+    char have_transaction;
+} conn_info;
+
+enum {
+    input_pending,
+    input_done,
+    input_failed
+};
+
+typedef struct codec_info codec_info;
+
 typedef struct input_info {
     char name[8];
     char const *path;
     size_t path_len;
+    char *entry_path;
+    size_t entry_path_len;
     dev_t dev;
     ino_t ino;
+    conn_info *conn;
+    codec_info const *codec;
+    FILE *spool;
     off_t local_offset;
     off_t size;
+    off_t compressed_size;
     off_t page_count;
     int page_size;
+    int level;
+    uint32_t crc;
+    off_t file_size;
+    time_t file_mtime;
+    long file_mtime_nsec;
+    dev_t file_dev;
+    ino_t file_ino;
+    int fd;
+    int wal_fd;
+    int capture_fd;
+    uint8_t *capture_dirty;
+    off_t manifest_offset;
+    off_t base_page_count;
+    uint64_t base_fingerprint;
+    ule64 const *base_hashes;
+    uint8_t *bitmap;
+    uint8_t *free_map;
+    uint8_t *groups;
+    off_t changed_cnt;
+    off_t free_cnt;
+    off_t archived_cnt;
+    off_t pages_read;
+    off_t pages_done;
+    uint64_t *seek_points;
+    size_t seek_cnt;
+    size_t seek_size;
+    phase_time times[phase_cnt];
+    xxh64_state fingerprint;
+    char l64;
+    char state;
+    char hashed;
+    char wal;
+    char quick;
+    char streamed;
+    char attached;
     uint16_t mode;
     uint16_t dos_mdate;
     uint16_t dos_mtime;
-    uint16_t ext_len;
-    central_entry entry;
-    central_zip64 ext;
 } input_info;
 
-typedef struct global_info {
+typedef struct global_info global_info;
+typedef struct warm_info warm_info;
+
+/*
+ * Throttling, to keep out of the way of the live databases' users.
+ * Input pages read and archive bytes written draw on one token bucket
+ * of rate bytes a second, which holds throttle_burst nanoseconds'
+ * worth; ready is when everything taken so far is paid for.
+ * With a latency target, the rate follows how long page fetches take.
+ * A duty cycle keeps each thread's CPU time to that percentage
+ * of the wall time, slice by slice.  All protected by lock.
+ */
+
+enum {
+    throttle_burst      = 250000000,
+    throttle_rate_min   = 0x100000,
+    duty_slice          = 10000000,
+    duty_check_pages    = 16,
+    latency_flush_pages = 64,
+    latency_window      = 50000000
+};
+
+typedef struct throttle_info {
+    pthread_mutex_t lock;
+    uint64_t rate;
+    uint64_t max_rate;
+    uint64_t latency;
+    uint64_t ready;
+    uint64_t window_start;
+    uint64_t window_time;
+    uint64_t window_bytes;
+    off_t window_pages;
+    uint64_t io_wait;
+    uint64_t cpu_wait;
+    int duty;
+} throttle_info;
+
+/*
+ * With deflate threads, each input's page stream is cut into chunks
+ * that are compressed independently and concatenated.  Every chunk
+ * but the last ends with a sync flush, which leaves the output
+ * byte-aligned and the final-block bit unset.  The 32 KiB preceding
+ * the chunk data is a copy of the end of the previous chunk,
+ * used as a preset dictionary to keep the compression ratio up.
+ */
+
+enum {
+    chunk_free,
+    chunk_queued,
+    chunk_done,
+    chunk_failed
+};
+
+enum {
+    dict_max            = 0x8000,
+    seek_pages_default  = 1024
+};
+
+typedef struct chunk_info {
+    struct chunk_info *next;
+    uint8_t *buf;
+    uint8_t *out;
+    size_t dict_len;
+    size_t data_len;
+    size_t out_size;
+    size_t out_len;
+    off_t first_pgno;
+    off_t seek_offset;
+    int page_size;
+    int level;
+    int flush;
+    uint32_t crc;
+    phase_time deflate_time;
+    phase_time crc_time;
+    char state;
+    char in_use;
+} chunk_info;
+
+typedef struct deflater_info {
+    global_info *g;
+    pthread_t thread;
+    z_stream *deflation;
+    phase_time duty_mark;
+    int level;
+    char have_deflation;
+    char have_thread;
+} deflater_info;
+
+/*
+ * Everything one thread needs to compress one input at a time.
+ */
+
+typedef struct worker_info {
+    global_info *g;
+    input_info *input;
+    phase_time mark;
+    phase_time duty_mark;
+    int duty_pages;
+    pthread_t thread;
+    z_stream *deflation;
+    int level;
+    char have_deflation;
+    char have_thread;
+    chunk_info *chunks;
+    int chunk_cnt;
+    int hash_cnt;
+    off_t hash_offset;
+    ule64 hash_buf[512];
+#ifdef S3ZIP_ZSTD
+    ZSTD_CCtx *zstd;
+    ZSTD_CDict *zstd_dict;
+    int zstd_dict_level;
+#endif
+#ifdef S3ZIP_LZ4
+    LZ4F_cctx *lz4;
+    uint8_t *lz4_buf;
+    size_t lz4_buf_size;
+#endif
+    uint8_t output_buf[0x1000B];
+} worker_info;
+
+/*
+ * Stored and deflate entries are handled by compress_input itself,
+ * since deflate has its own chunking and flushing machinery.
+ * Other codecs are fed one page (or delta prefix) at a time
+ * between begin and finish;
+ * end releases whatever the worker has kept around.
+ */
+
+struct codec_info {
+    char const *name;
+    char const *tag;
+    uint16_t method;
+    uint16_t version;
+    int max_level;
+    int default_level;
+    int (*begin)(
+        worker_info *w,
+        input_info *input,
+        FILE *out,
+        char const *out_path,
+        off_t *compressed_size);
+    int (*page)(
+        worker_info *w,
+        input_info *input,
+        void const *data,
+        size_t len,
+        FILE *out,
+        char const *out_path,
+        off_t *compressed_size);
+    int (*finish)(
+        worker_info *w,
+        input_info *input,
+        FILE *out,
+        char const *out_path,
+        off_t *compressed_size);
+    void (*end)(
+        worker_info *w);
+};
+
+/*
+ * Inputs whose paths match a pattern get its codec;
+ * the first match wins.
+ */
+
+typedef struct codec_rule {
+    codec_info const *codec;
+    char const *pattern;
+} codec_rule;
+
+/*
+ * Central directory records are built as each entry is finished,
+ * in directory order, into blocks of arena_block_size bytes
+ * (or more for a record that needs it), and written out as they are.
+ */
+
+enum {
+    arena_block_size    = 0x100000
+};
+
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+} arena_block;
+
+#ifdef S3ZIP_S3
+typedef struct s3_sink s3_sink;
+#endif
+
+struct global_info {
     char const *zip_path;
     FILE *zip;
+#ifdef S3ZIP_S3
+    s3_sink *s3;
+#endif
+    int part_size;
+    int upload_cnt;
+    int write_buffer;
+    char direct_output;
+    char const *manifest_path;
+    char *manifest_tmp;
+    int manifest_fd;
+    char have_manifest;
+    char verify;
+    char have_hashes;
+    char const *check_path;
+    char const *base_path;
+    uint8_t *base;
+    size_t base_size;
+    char base_mapped;
+    char quick;
+    char direct;
+    char capture;
+    char const *capture_dir;
+    char copy_warned;
+    int dict_samples;
+    int cache_size;
+    int mmap_size;
+    off_t max_memory;
+    off_t output_memory;
+    int read_ahead;
+    int window_bits;
+    int mem_level;
+    throttle_info throttle;
+    warm_info *warm;
+    uint8_t *deflate_pool;
+    size_t deflate_pool_size;
+    size_t deflate_pool_used;
+    size_t deflate_extra;
+    uint8_t *dict;
+    size_t dict_len;
+    off_t dict_end;
+    int seek_pages;
+    char have_index;
     off_t cd_offset;
     off_t cd_size;
+    arena_block *cd_head,*cd_tail;
     off_t total_size;
-    sqlite3 *db;
-    z_stream deflation;
+    off_t archive_size;
+    conn_info *conns;
+    worker_info *workers;
+    deflater_info *deflaters;
+    codec_info const *codec;
+    codec_rule const *codec_rules;
+    int codec_rule_cnt;
+    int conn_cnt;
+    int worker_cnt;
+    int deflater_cnt;
+    int chunk_pages;
+    int level;
+    int strategy;
+    int sample_pages;
+    char adaptive;
+    char zero_free;
+    char group_pages;
+    char store;
     char have_output;
-    char have_deflation;
-    char have_transaction;
-    uint8_t output_buf[0x1000B];
+    char streaming;
+    char stats;
+    char const *crc_kernel;
+    FILE *messages;
+    phase_time start;
+    phase_time stage_mark;
+    phase_time stage_times[stage_cnt];
+    char progress;
+    char const *progress_path;
+    char *progress_tmp;
+    int progress_fd;
+    FILE *progress_out;
+    int progress_interval;
+    off_t progress_pages;
+    off_t progress_bytes;
+    struct timespec progress_start;
+    pthread_t progress_thread;
+    char have_progress_thread;
+/*
+ * Protected by progress_lock: progress_stopping.
+ */
+    pthread_mutex_t progress_lock;
+    pthread_cond_t progress_wake;
+    char progress_stopping;
+/*
+ * Protected by lock: next_input, failed, and the state of every input.
+ */
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int next_input;
+    char failed;
+/*
+ * Protected by chunk_lock: the chunk queue, stopping,
+ * and the state of every chunk.
+ */
+    pthread_mutex_t chunk_lock;
+    pthread_cond_t chunk_work;
+    pthread_cond_t chunk_done;
+    chunk_info *chunk_head,*chunk_tail;
+    char stopping;
     int input_cnt;
     input_info inputs[1];
-} global_info;
+};
+
+/*
+ * Command line settings.
+ */
+
+enum {
+    level_auto          = -1,
+    level_default       = -2,
+
+    max_codec_rules     = 64
+};
+
+enum {
+    store_never,
+    store_auto,
+    store_always
+};
+
+typedef struct option_info {
+    int jobs;
+    int threads;
+    int chunk_pages;
+    int level;
+    int strategy;
+    int sample_pages;
+    char adaptive;
+    char zero_free;
+    char group_pages;
+    char store;
+    codec_info const *codec;
+    char const *manifest_path;
+    char const *base_path;
+    char verify;
+    char const *check_path;
+    char quick;
+    char direct;
+    char capture;
+    char const *capture_dir;
+    int dict_samples;
+    int seek_pages;
+    int cache_size;
+    int mmap_size;
+    int max_memory;
+    int io_rate;
+    int io_latency;
+    int cpu_duty;
+    char const *serve_path;
+    int part_size;
+    int upload_cnt;
+    int write_buffer;
+    char direct_output;
+    char stats;
+    char progress;
+    char const *progress_path;
+    int progress_fd;
+    int progress_interval;
+    int codec_rule_cnt;
+    codec_rule codec_rules[max_codec_rules];
+} option_info;
 
 /*
  * SQL statements.
  *
- * Only the first one needs to be run through snprintf to get
- * the database name as an identifier; every other use is
+ * Only the first few need to be run through snprintf to get
+ * the database name as an identifier (a pragma can't be set
+ * through its table-valued function); every other use is
  * through table-valued functions that take the database name
  * as a text value, letting us use bound parameters.
  *
@@ -222,12 +701,21 @@ typedef struct global_info {
 static char const attach_fmt[] =
     "attach database ?1 as %s";
 
+static char const cache_size_fmt[] =
+    "pragma %s.cache_size=%d";
+
+static char const mmap_size_fmt[] =
+    "pragma %s.mmap_size=%lld";
+
 static char const begin_sql[] =
     "begin immediate";
 
 static char const rollback_sql[] =
     "rollback";
 
+static char const detach_fmt[] =
+    "detach database %s";
+
 static char const metainfo_sql[] =
     "select page_size, page_count, journal_mode\n"
     "    from main.pragma_page_size(?1),\n"
@@ -238,857 +726,8905 @@ static char const pages_sql[] =
     "select data from main.sqlite_dbpage(?1)\n"
     "    order by pgno";
 
+static char const page_sql[] =
+    "select data from main.sqlite_dbpage(?1)\n"
+    "    where pgno=?2";
+
 /*
  * Finally, some actual code.
  */
 
 static global_info *make_global(
-    int input_cnt)
+    int input_cnt,
+    option_info const *opts)
 {
     global_info *g=NULL;
+    int jobs;
+    int ix;
 
     if (input_cnt>0x7FFFFFFF) {
-        fputs("Definitely too many inputs\n",stderr);
+        fputs("Definitely too many inputs\n",messages());
         return NULL;
     }
+    jobs=opts->jobs;
+    if (jobs>input_cnt)
+        jobs=input_cnt;
     g=malloc(offsetof(global_info,inputs)+input_cnt*sizeof (input_info));
     if (!g) {
-        perror("malloc");
+        report_errno("malloc");
         return NULL;
     }
     g->zip=NULL;
-    g->db=NULL;
+    g->cd_head=NULL;
+    g->cd_tail=NULL;
+    g->cd_size=0;
     g->input_cnt=input_cnt;
+    g->worker_cnt=jobs;
+/*
+ * A single deflate thread is no better than the reader doing
+ * the work itself.
+ */
+    if (opts->threads>1) {
+        g->deflater_cnt=opts->threads;
+    } else {
+        g->deflater_cnt=0;
+    }
+    g->chunk_pages=opts->chunk_pages;
+    g->level=opts->level;
+    g->strategy=opts->strategy;
+    g->sample_pages=opts->sample_pages;
+    g->adaptive=opts->adaptive;
+    g->zero_free=opts->zero_free;
+    g->group_pages=opts->group_pages;
+    g->store=opts->store;
+    g->codec=opts->codec;
+    g->codec_rules=opts->codec_rules;
+    g->codec_rule_cnt=opts->codec_rule_cnt;
+    g->manifest_path=opts->manifest_path;
+    g->manifest_tmp=NULL;
+    g->manifest_fd=-1;
+    g->have_manifest=0;
+    g->verify=opts->verify;
+    g->have_hashes=0;
+    g->check_path=opts->check_path;
+    g->base_path=opts->base_path;
+    g->base=NULL;
+    g->base_size=0;
+    g->base_mapped=0;
+    g->quick=opts->quick;
+    g->direct=opts->direct;
+    g->capture=opts->capture;
+    g->capture_dir=opts->capture_dir;
+    g->copy_warned=0;
+    g->dict_samples=opts->dict_samples;
+    g->dict=NULL;
+    g->dict_len=0;
+    g->dict_end=0;
+    g->seek_pages=opts->seek_pages;
+    if (g->seek_pages && g->deflater_cnt) {
+        g->seek_pages=(g->seek_pages+g->chunk_pages-1)
+            /g->chunk_pages*g->chunk_pages;
+    }
+    g->have_index=0;
+    g->cache_size=opts->cache_size;
+    g->mmap_size=opts->mmap_size;
+    g->max_memory=(off_t)opts->max_memory<<20;
+    g->output_memory=0;
+    g->window_bits=15;
+    g->mem_level=9;
+    g->deflate_pool=NULL;
+    g->deflate_pool_size=0;
+    g->deflate_pool_used=0;
+    g->deflate_extra=0;
+    g->throttle.rate=(uint64_t)opts->io_rate<<20;
+    g->throttle.max_rate=g->throttle.rate;
+    g->throttle.latency=(uint64_t)opts->io_latency*1000;
+    g->throttle.ready=0;
+    g->throttle.window_start=0;
+    g->throttle.window_time=0;
+    g->throttle.window_bytes=0;
+    g->throttle.window_pages=0;
+    g->throttle.io_wait=0;
+    g->throttle.cpu_wait=0;
+    g->throttle.duty=opts->cpu_duty;
+    g->warm=NULL;
+    g->messages=messages();
+    g->conn_cnt=0;
     g->have_output=0;
-    g->have_deflation=0;
-    g->have_transaction=0;
+    g->streaming=0;
+#ifdef S3ZIP_S3
+    g->s3=NULL;
+#endif
+    g->part_size=opts->part_size;
+    g->upload_cnt=opts->upload_cnt;
+    g->write_buffer=opts->write_buffer;
+    g->direct_output=opts->direct_output;
+    g->stats=opts->stats;
+    g->crc_kernel=NULL;
+    memset(g->stage_times,0,sizeof g->stage_times);
+    g->progress=opts->progress;
+    g->progress_path=opts->progress_path;
+    g->progress_tmp=NULL;
+    g->progress_fd=opts->progress_fd;
+    g->progress_out=NULL;
+    g->progress_interval=opts->progress_interval;
+    g->have_progress_thread=0;
+    g->next_input=0;
+    g->failed=0;
+    g->chunk_head=NULL;
+    g->chunk_tail=NULL;
+    g->stopping=0;
+    g->conns=calloc(input_cnt,sizeof (conn_info));
+    g->workers=calloc(g->worker_cnt,sizeof (worker_info));
+    g->deflaters=calloc(g->deflater_cnt+1,sizeof (deflater_info));
+    if (!g->conns || !g->workers || !g->deflaters) {
+        report_errno("calloc");
+        goto cleanup;
+    }
+    if (g->progress_path && g->progress_fd<0) {
+        size_t path_len;
+
+        path_len=strlen(g->progress_path);
+        g->progress_tmp=malloc(path_len+5);
+        if (!g->progress_tmp) {
+            report_errno("malloc");
+            goto cleanup;
+        }
+        memcpy(g->progress_tmp,g->progress_path,path_len);
+        memcpy(g->progress_tmp+path_len,".tmp",5);
+    }
+    for (ix=0; ix<g->worker_cnt; ix++)
+        g->workers[ix].g=g;
+    for (ix=0; ix<g->deflater_cnt; ix++)
+        g->deflaters[ix].g=g;
+    for (ix=0; ix<input_cnt; ix++) {
+        g->inputs[ix].conn=NULL;
+        g->inputs[ix].spool=NULL;
+        g->inputs[ix].entry_path=NULL;
+        g->inputs[ix].base_hashes=NULL;
+        g->inputs[ix].bitmap=NULL;
+        g->inputs[ix].free_map=NULL;
+        g->inputs[ix].groups=NULL;
+        g->inputs[ix].seek_points=NULL;
+        g->inputs[ix].seek_cnt=0;
+        g->inputs[ix].seek_size=0;
+        g->inputs[ix].free_cnt=0;
+        g->inputs[ix].hashed=0;
+        g->inputs[ix].quick=0;
+        g->inputs[ix].streamed=0;
+        g->inputs[ix].attached=0;
+        g->inputs[ix].fd=-1;
+        g->inputs[ix].wal_fd=-1;
+        g->inputs[ix].capture_fd=-1;
+        g->inputs[ix].capture_dirty=NULL;
+        g->inputs[ix].archived_cnt=0;
+        g->inputs[ix].pages_read=0;
+        g->inputs[ix].pages_done=0;
+        memset(g->inputs[ix].times,0,sizeof g->inputs[ix].times);
+        g->inputs[ix].state=input_pending;
+    }
+    if (pthread_mutex_init(&g->lock,NULL)
+            || pthread_cond_init(&g->done,NULL)
+            || pthread_mutex_init(&g->chunk_lock,NULL)
+            || pthread_cond_init(&g->chunk_work,NULL)
+            || pthread_cond_init(&g->chunk_done,NULL)
+            || pthread_mutex_init(&g->progress_lock,NULL)
+            || pthread_cond_init(&g->progress_wake,NULL)
+            || pthread_mutex_init(&g->throttle.lock,NULL)) {
+        fputs("Can't initialise thread synchronisation\n",messages());
+        goto cleanup;
+    }
     return g;
+
+cleanup:
+    free(g->progress_tmp);
+    free(g->conns);
+    free(g->workers);
+    free(g->deflaters);
+    free(g);
+    return NULL;
 }
 
-static int open_db(
+static void free_global(
     global_info *g)
 {
-    int status;
+    int ix;
 
-    status=sqlite3_open_v2(
-        "file:%3Amemory%3A",
-        &g->db,
-        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI,
-        NULL);
-    if (status!=SQLITE_OK) {
-        if (g->db) {
-            fprintf(stderr,"sqlite3_open: %s\n",sqlite3_errmsg(g->db));
-        } else {
-            fprintf(stderr,"sqlite3_open: %s\n",sqlite3_errstr(status));
-        }
-        return -1;
+    pthread_mutex_destroy(&g->throttle.lock);
+    pthread_cond_destroy(&g->progress_wake);
+    pthread_mutex_destroy(&g->progress_lock);
+    pthread_cond_destroy(&g->chunk_done);
+    pthread_cond_destroy(&g->chunk_work);
+    pthread_mutex_destroy(&g->chunk_lock);
+    pthread_cond_destroy(&g->done);
+    pthread_mutex_destroy(&g->lock);
+    for (ix=0; ix<g->input_cnt; ix++) {
+        if (g->inputs[ix].entry_path!=g->inputs[ix].path)
+            free(g->inputs[ix].entry_path);
+        free(g->inputs[ix].bitmap);
+        free(g->inputs[ix].free_map);
+        free(g->inputs[ix].groups);
+        free(g->inputs[ix].seek_points);
+        free(g->inputs[ix].capture_dirty);
     }
-    status=sqlite3_busy_timeout(g->db,999999999);
-    if (status!=SQLITE_OK)
-        return -1;
-    return 0;
+    if (g->base_mapped) {
+        munmap(g->base,g->base_size);
+    } else {
+        free(g->base);
+    }
+    free(g->manifest_tmp);
+    free(g->progress_tmp);
+    free(g->dict);
+    while (g->cd_head) {
+        arena_block *block;
+
+        block=g->cd_head;
+        g->cd_head=block->next;
+        free(block);
+    }
+    free(g->conns);
+    free(g->workers);
+    free(g->deflaters);
+    free(g);
 }
 
-static uint8_t nobuf[1];
+/*
+ * Time accounting.  Each thread keeps a mark, and at every boundary
+ * the time since the mark goes to whatever just ended.
+ */
 
-static int init_compression(
-    global_info *g)
+static void read_clocks(
+    phase_time *now)
 {
-    int status;
+    struct timespec ts;
 
-    g->deflation.next_in=nobuf;
-    g->deflation.avail_in=0;
-    g->deflation.next_out=nobuf;
-    g->deflation.avail_out=0;
-    g->deflation.zalloc=0;
-    g->deflation.zfree=0;
-    g->deflation.opaque=NULL;
-    status=deflateInit2(
-        &g->deflation,
-        Z_BEST_COMPRESSION,
-        Z_DEFLATED,
-        -15,
-        9,
-        Z_DEFAULT_STRATEGY);
-    if (status!=Z_OK) {
-        fprintf(stderr,"deflateInit2: error %d\n",status);
-        return -1;
-    }
-    g->have_deflation=1;
-    return 0;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    now->wall=(uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID,&ts);
+    now->cpu=(uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
 }
 
-static int attach_inputs(
-    global_info *g,
-    char **paths)
+static void lap(
+    phase_time *mark,
+    phase_time *total)
 {
-    static char const base_36[36]="1qa2zws3xed4crf5vtg6byh7nuj8mik9ol0p";
-    static char const base_16[16]="0123456789ABCDEF";
-    int status;
-    int ix;
-    input_info *input,*inputs_end;
-    size_t max_path_len;
-    char *uri_buf=NULL;
-    sqlite3_stmt *attach=NULL;
+    phase_time now;
 
-    inputs_end=g->inputs+g->input_cnt;
-    max_path_len=0;
-    for (input=g->inputs,ix=0; input<inputs_end; input++,ix++) {
-        char *path;
-        size_t path_len;
-        struct stat stat_buf;
-        int name_num,digit_ix;
-        input_info *seen;
+    read_clocks(&now);
+    total->wall+=now.wall-mark->wall;
+    total->cpu+=now.cpu-mark->cpu;
+    *mark=now;
+}
+
+static void end_stage(
+    global_info *g,
+    int stage)
+{
+    if (g->stats==stats_json)
+        lap(&g->stage_mark,g->stage_times+stage);
+}
 
-        path=paths[ix];
-        if (path[0]=='/') {
-            fprintf(stderr,"%s: No absolute paths allowed\n",path);
-            goto cleanup;
-        }
-        path_len=strlen(path);
-        if (!path_len) {
-            fputs("No empty paths allowed\n",stderr);
-            goto cleanup;
-        }
-        if (path_len>0xFFFF) {
-            fprintf(stderr,"%s: Path too long\n",path);
-            goto cleanup;
-        }
-        if (stat(path,&stat_buf)) {
-            fprintf(stderr,"%s: %s\n",path,strerror(errno));
-            goto cleanup;
-        }
-        if (!S_ISREG(stat_buf.st_mode)) {
-            fprintf(stderr,"%s: Not a regular file\n",path);
-            goto cleanup;
-        }
-        for (seen=g->inputs; seen<input; seen++) {
-            if (seen->dev==stat_buf.st_dev && seen->ino==stat_buf.st_ino) {
-                fprintf(stderr,"%s: Duplicate input\n",path);
-                goto cleanup;
-            }
-        }
-        input->path=path;
-        input->path_len=path_len;
-        input->dev=stat_buf.st_dev;
-        input->ino=stat_buf.st_ino;
-        input->mode=stat_buf.st_mode;
-        if (path_len>max_path_len)
-            max_path_len=path_len;
 /*
- * Each input needs a unique internal name.  An underscore followed
- * by six base-36 digits makes an identifier that doesn't collide
- * with any keyword.
+ * A worker's time goes to the input it is working on.
  */
-        name_num=ix;
-        input->name[7]=0;
-        for (digit_ix=6; digit_ix>0; digit_ix--) {
-            input->name[digit_ix]=base_36[name_num%36];
-            name_num/=36;
-        }
-        input->name[0]='_';
-    }
-    uri_buf=malloc(3*max_path_len+sizeof "file://?mode=ro");
-    if (!uri_buf) {
-        perror("malloc");
-        goto cleanup;
-    }
-    for (input=g->inputs; input<inputs_end; input++) {
-        char attach_sql[sizeof attach_fmt+7];
-        int sql_len;
-        char const *src;
-        char *dst;
 
-        sql_len=snprintf(attach_sql,sizeof attach_sql,attach_fmt,input->name);
-        status=sqlite3_prepare_v2(g->db,attach_sql,sql_len+1,&attach,NULL);
-        if (status!=SQLITE_OK) {
-            fprintf(stderr,"sqlite3_prepare(attach): %s\n",
-                    sqlite3_errmsg(g->db));
+static void start_phases(
+    worker_info *w,
+    input_info *input)
+{
+    w->input=input;
+    if (w->g->stats==stats_json)
+        read_clocks(&w->mark);
+}
+
+static void end_phase(
+    worker_info *w,
+    int phase)
+{
+    if (w->g->stats==stats_json)
+        lap(&w->mark,w->input->times+phase);
+}
+
+/*
+ * Throttling.  Sleeping happens outside the lock, so that one thread
+ * waiting for the bucket doesn't hold up another's bookkeeping.
+ */
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+static void nap(
+    uint64_t ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec=ns/1000000000;
+    ts.tv_nsec=ns%1000000000;
+    while (nanosleep(&ts,&ts) && errno==EINTR)
+        ;
+}
+
+static int throttled_io(
+    throttle_info const *t)
+{
+    return t->max_rate || t->latency;
+}
+
+static void throttle_io(
+    throttle_info *t,
+    uint64_t bytes)
+{
+    uint64_t now,wait;
+
+    if (!t || !throttled_io(t))
+        return;
+    now=monotonic_ns();
+    wait=0;
+    pthread_mutex_lock(&t->lock);
+    if (t->rate) {
+        if (t->ready+throttle_burst<now)
+            t->ready=now-throttle_burst;
+        t->ready+=bytes*1000000000/t->rate;
+        if (t->ready>now) {
+            wait=t->ready-now;
+            t->io_wait+=wait;
+        }
+    }
+    pthread_mutex_unlock(&t->lock);
+    if (wait)
+        nap(wait);
+}
+
+/*
+ * Additive increase, multiplicative decrease, as for TCP: once enough
+ * pages have been fetched over long enough, an average fetch slower
+ * than the target cuts the rate to three quarters of what it was
+ * (or of what was actually read, the first time), and a faster one
+ * raises it by a fixed 1 MiB/s, up to --io-rate if there is one.
+ */
+
+static void throttle_fetches(
+    throttle_info *t,
+    off_t pages,
+    uint64_t bytes,
+    uint64_t time)
+{
+    uint64_t now,elapsed,rate;
+
+    if (!t->latency || !pages)
+        return;
+    now=monotonic_ns();
+    pthread_mutex_lock(&t->lock);
+    if (!t->window_start)
+        t->window_start=now;
+    t->window_time+=time;
+    t->window_bytes+=bytes;
+    t->window_pages+=pages;
+    elapsed=now-t->window_start;
+    if (elapsed>=latency_window) {
+        if (t->window_time>t->latency*t->window_pages) {
+            rate=t->rate;
+            if (!rate)
+                rate=t->window_bytes*1000000000/elapsed;
+            rate-=rate/4;
+            if (rate<throttle_rate_min)
+                rate=throttle_rate_min;
+            t->rate=rate;
+        } else if (t->rate) {
+            t->rate+=throttle_rate_min;
+            if (t->max_rate && t->rate>t->max_rate)
+                t->rate=t->max_rate;
+        }
+        t->window_start=now;
+        t->window_time=0;
+        t->window_bytes=0;
+        t->window_pages=0;
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+/*
+ * A thread that has used more than its share of the CPU since
+ * its mark sleeps until it hasn't.
+ */
+
+static void duty_cycle(
+    throttle_info *t,
+    phase_time *mark)
+{
+    phase_time now;
+    uint64_t wall,need;
+
+    if (!t->duty)
+        return;
+    read_clocks(&now);
+    if (!mark->wall) {
+        *mark=now;
+        return;
+    }
+    wall=now.wall-mark->wall;
+    if (wall<duty_slice)
+        return;
+    need=(now.cpu-mark->cpu)*100/t->duty;
+    if (need>wall) {
+        nap(need-wall);
+        pthread_mutex_lock(&t->lock);
+        t->cpu_wait+=need-wall;
+        pthread_mutex_unlock(&t->lock);
+        read_clocks(&now);
+    }
+    *mark=now;
+}
+
+/*
+ * A daemon keeps what it can from one job to the next: connections,
+ * once everything attached to them is detached again, and deflate
+ * streams, which a job with the same window and memLevel takes over
+ * with deflateReset and deflateParams instead of a fresh deflateInit2.
+ * Kept streams use zlib's own allocator, since they outlive the job
+ * whose pool they'd otherwise come out of.  Protected by lock.
+ */
+
+enum {
+    warm_max            = 64
+};
+
+typedef struct warm_stream {
+    z_stream *deflation;
+    int window_bits;
+    int mem_level;
+} warm_stream;
+
+struct warm_info {
+    pthread_mutex_t lock;
+    sqlite3 *dbs[warm_max];
+    int db_cnt;
+    warm_stream streams[warm_max];
+    int stream_cnt;
+};
+
+static sqlite3 *warm_db(
+    warm_info *warm)
+{
+    sqlite3 *db=NULL;
+
+    pthread_mutex_lock(&warm->lock);
+    if (warm->db_cnt)
+        db=warm->dbs[--warm->db_cnt];
+    pthread_mutex_unlock(&warm->lock);
+    return db;
+}
+
+/*
+ * Returns 0 if it kept the connection, which has to have nothing
+ * attached by then.
+ */
+
+static int keep_db(
+    warm_info *warm,
+    sqlite3 *db)
+{
+    int kept=0;
+
+    pthread_mutex_lock(&warm->lock);
+    if (warm->db_cnt<warm_max) {
+        warm->dbs[warm->db_cnt++]=db;
+        kept=1;
+    }
+    pthread_mutex_unlock(&warm->lock);
+    return kept ? 0 : -1;
+}
+
+static z_stream *warm_deflation(
+    warm_info *warm,
+    int window_bits,
+    int mem_level)
+{
+    z_stream *deflation=NULL;
+    int ix;
+
+    pthread_mutex_lock(&warm->lock);
+    for (ix=warm->stream_cnt-1; ix>=0; ix--) {
+        if (warm->streams[ix].window_bits==window_bits
+                && warm->streams[ix].mem_level==mem_level) {
+            deflation=warm->streams[ix].deflation;
+            warm->streams[ix]=warm->streams[--warm->stream_cnt];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&warm->lock);
+    return deflation;
+}
+
+static void keep_deflation(
+    warm_info *warm,
+    z_stream *deflation,
+    int window_bits,
+    int mem_level)
+{
+    pthread_mutex_lock(&warm->lock);
+    if (warm->stream_cnt<warm_max) {
+        warm->streams[warm->stream_cnt].deflation=deflation;
+        warm->streams[warm->stream_cnt].window_bits=window_bits;
+        warm->streams[warm->stream_cnt].mem_level=mem_level;
+        warm->stream_cnt++;
+        deflation=NULL;
+    }
+    pthread_mutex_unlock(&warm->lock);
+    if (deflation) {
+        deflateEnd(deflation);
+        free(deflation);
+    }
+}
+
+static int open_conn(
+    global_info *g,
+    conn_info *conn)
+{
+    int status;
+
+    if (g->warm) {
+        conn->db=warm_db(g->warm);
+        if (conn->db)
+            return 0;
+    }
+    status=sqlite3_open_v2(
+        "file:%3Amemory%3A",
+        &conn->db,
+        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI,
+        NULL);
+    if (status!=SQLITE_OK) {
+        if (conn->db) {
+            fprintf(messages(),"sqlite3_open: %s\n",sqlite3_errmsg(conn->db));
+        } else {
+            fprintf(messages(),"sqlite3_open: %s\n",sqlite3_errstr(status));
+        }
+        return -1;
+    }
+    status=sqlite3_busy_timeout(conn->db,999999999);
+    if (status!=SQLITE_OK)
+        return -1;
+    return 0;
+}
+
+/*
+ * More jobs means a connection per input so that the workers never
+ * need to share one.  A single job attaches as many inputs to each
+ * connection as SQLite allows, which is all of them unless there are
+ * more than SQLITE_MAX_ATTACHED (10 by default).  Either way,
+ * begin_transaction takes every lock before any page is read.
+ */
+
+static int open_db(
+    global_info *g)
+{
+    int ix;
+    int per_conn;
+    conn_info *conn,*conns_end;
+
+    if (g->worker_cnt>1 && !sqlite3_threadsafe()) {
+        fputs("Multiple jobs need a thread-safe SQLite library\n",messages());
+        return -1;
+    }
+    if (open_conn(g,g->conns))
+        return -1;
+    g->conn_cnt=1;
+    if (g->worker_cnt>1) {
+        per_conn=1;
+    } else {
+        per_conn=sqlite3_limit(g->conns->db,SQLITE_LIMIT_ATTACHED,-1);
+        if (per_conn<1) {
+            fputs("This SQLite can't attach databases\n",messages());
+            return -1;
+        }
+    }
+    for (ix=0; ix<g->input_cnt; ix++)
+        g->inputs[ix].conn=g->conns+ix/per_conn;
+    conns_end=g->conns+(g->input_cnt+per_conn-1)/per_conn;
+    for (conn=g->conns+1; conn<conns_end; conn++) {
+        if (open_conn(g,conn))
+            return -1;
+        g->conn_cnt++;
+    }
+    return 0;
+}
+
+static uint8_t nobuf[1];
+
+/*
+ * What freelist leaf pages are archived as.
+ */
+
+static uint8_t zero_page[0x10000];
+
+/*
+ * All the deflate streams are set up at once, before any thread
+ * starts, and their state comes out of one pool sized by the
+ * formula in zlib.h plus room for the state structure.  Anything
+ * that doesn't fit, as with a zlib that needs more, is malloc'd.
+ */
+
+enum {
+    deflate_state_slack = 0x4000
+};
+
+static size_t deflate_memory(
+    int window_bits,
+    int mem_level)
+{
+    return ((size_t)1<<(window_bits+2))+((size_t)1<<(mem_level+9))
+        +deflate_state_slack;
+}
+
+static voidpf deflate_alloc(
+    voidpf opaque,
+    uInt items,
+    uInt size)
+{
+    global_info *g;
+    size_t len;
+    void *p;
+
+    g=opaque;
+    len=((size_t)items*size+15) & ~(size_t)15;
+    if (g->deflate_pool && g->deflate_pool_size-g->deflate_pool_used>=len) {
+        p=g->deflate_pool+g->deflate_pool_used;
+        g->deflate_pool_used+=len;
+        return p;
+    }
+    p=malloc(len);
+    if (p)
+        g->deflate_extra+=len;
+    return p;
+}
+
+static void deflate_free(
+    voidpf opaque,
+    voidpf address)
+{
+    global_info *g;
+    uint8_t *p;
+
+    g=opaque;
+    p=address;
+    if (g->deflate_pool && p>=g->deflate_pool
+            && p<g->deflate_pool+g->deflate_pool_size)
+        return;
+    free(address);
+}
+
+static int reset_deflation(
+    z_stream *deflation)
+{
+    int status;
+
+    deflation->next_in=nobuf;
+    deflation->avail_in=0;
+    deflation->next_out=nobuf;
+    deflation->avail_out=0;
+    status=deflateReset(deflation);
+    if (status!=Z_OK) {
+        fprintf(messages(),"deflateReset: error %d\n",status);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Streams start out at the requested level, or the maximum one
+ * by default or when choosing automatically; deflateParams adjusts
+ * them per input.  A kept stream gets this run's level and strategy
+ * the same way, right after its reset.
+ */
+
+static int init_deflation(
+    global_info *g,
+    z_stream **deflation,
+    int *level)
+{
+    z_stream *strm=NULL;
+    int status;
+
+    *level=g->level;
+    if (*level<0 || *level>Z_BEST_COMPRESSION)
+        *level=Z_BEST_COMPRESSION;
+    if (g->warm)
+        strm=warm_deflation(g->warm,g->window_bits,g->mem_level);
+    if (strm) {
+        status=Z_STREAM_ERROR;
+        if (!reset_deflation(strm)) {
+            status=deflateParams(strm,*level,g->strategy);
+            if (status!=Z_OK)
+                fprintf(messages(),"deflateParams: error %d\n",status);
+        }
+        if (status!=Z_OK) {
+            deflateEnd(strm);
+            free(strm);
+            return -1;
+        }
+        *deflation=strm;
+        return 0;
+    }
+    strm=malloc(sizeof *strm);
+    if (!strm) {
+        report_errno("malloc");
+        return -1;
+    }
+    strm->next_in=nobuf;
+    strm->avail_in=0;
+    strm->next_out=nobuf;
+    strm->avail_out=0;
+    if (g->warm) {
+        strm->zalloc=Z_NULL;
+        strm->zfree=Z_NULL;
+        strm->opaque=Z_NULL;
+    } else {
+        strm->zalloc=deflate_alloc;
+        strm->zfree=deflate_free;
+        strm->opaque=g;
+    }
+    status=deflateInit2(
+        strm,
+        *level,
+        Z_DEFLATED,
+        -g->window_bits,
+        g->mem_level,
+        g->strategy);
+    if (status!=Z_OK) {
+        fprintf(messages(),"deflateInit2: error %d\n",status);
+        free(strm);
+        return -1;
+    }
+    *deflation=strm;
+    return 0;
+}
+
+/*
+ * Only valid right after a reset, when there's nothing to flush.
+ */
+
+static int set_level(
+    global_info *g,
+    z_stream *deflation,
+    int *current,
+    int level)
+{
+    int status;
+
+    if (level==*current)
+        return 0;
+    status=deflateParams(deflation,level,g->strategy);
+    if (status!=Z_OK) {
+        fprintf(messages(),"deflateParams: error %d\n",status);
+        return -1;
+    }
+    *current=level;
+    return 0;
+}
+
+static int init_compression(
+    global_info *g)
+{
+    worker_info *w,*workers_end;
+    deflater_info *d,*deflaters_end;
+
+    g->deflate_pool_size=(size_t)(g->worker_cnt+g->deflater_cnt)
+        *deflate_memory(g->window_bits,g->mem_level);
+/*
+ * A daemon's streams have no pool; they're counted as if they had one.
+ */
+    if (g->warm) {
+        g->deflate_extra+=g->deflate_pool_size;
+        g->deflate_pool_size=0;
+    } else {
+        g->deflate_pool=malloc(g->deflate_pool_size);
+        if (!g->deflate_pool) {
+            report_errno("malloc");
+            return -1;
+        }
+    }
+    workers_end=g->workers+g->worker_cnt;
+    for (w=g->workers; w<workers_end; w++) {
+        if (init_deflation(g,&w->deflation,&w->level))
+            return -1;
+        w->have_deflation=1;
+    }
+    deflaters_end=g->deflaters+g->deflater_cnt;
+    for (d=g->deflaters; d<deflaters_end; d++) {
+        if (init_deflation(g,&d->deflation,&d->level))
+            return -1;
+        d->have_deflation=1;
+    }
+    return 0;
+}
+
+/*
+ * Per-input cache and mmap sizes, if asked for.  The page cache only
+ * serves pages that come through sqlite_dbpage; with mmap, SQLite's
+ * reads of the main file (ours included) become copies from the map.
+ */
+
+static int set_pragma(
+    sqlite3 *db,
+    char const *sql,
+    int sql_len)
+{
+    int status;
+    sqlite3_stmt *pragma=NULL;
+
+    status=sqlite3_prepare_v2(db,sql,sql_len+1,&pragma,NULL);
+    if (status!=SQLITE_OK) {
+        fprintf(messages(),"sqlite3_prepare(pragma): %s\n",sqlite3_errmsg(db));
+        return -1;
+    }
+    do {
+        status=sqlite3_step(pragma);
+    } while (status==SQLITE_ROW);
+    if (status!=SQLITE_DONE) {
+        fprintf(messages(),"sqlite3_step(pragma): %s\n",sqlite3_errmsg(db));
+        sqlite3_finalize(pragma);
+        return -1;
+    }
+    sqlite3_finalize(pragma);
+    return 0;
+}
+
+static int tune_input(
+    global_info *g,
+    input_info *input)
+{
+    char sql[sizeof mmap_size_fmt+7+20];
+    int sql_len;
+    sqlite3 *db;
+
+    db=input->conn->db;
+    if (g->cache_size) {
+        sql_len=snprintf(sql,sizeof sql,cache_size_fmt,
+                         input->name,g->cache_size);
+        if (set_pragma(db,sql,sql_len))
+            return -1;
+    }
+    if (g->mmap_size) {
+        sql_len=snprintf(sql,sizeof sql,mmap_size_fmt,
+                         input->name,(long long)g->mmap_size<<20);
+        if (set_pragma(db,sql,sql_len))
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Inputs are looked up by file identity and by path through open
+ * hash tables of input pointers, at most half full.
+ */
+
+static size_t index_size(
+    int cnt)
+{
+    size_t size;
+
+    size=16;
+    while (size<(size_t)cnt*2)
+        size*=2;
+    return size;
+}
+
+static size_t identity_hash(
+    dev_t dev,
+    ino_t ino)
+{
+    ule64 key[2];
+
+    STORE64(key[0],(uint64_t)dev);
+    STORE64(key[1],(uint64_t)ino);
+    return (size_t)xxh64(key,sizeof key);
+}
+
+/*
+ * Attach groups get around SQLite's limit, but not the kernel's:
+ * each input needs SQLite's descriptors for its main file, log
+ * and shared memory, and one more for a clone with --capture
+ * or a spool file with more jobs.  Our own read-ahead descriptors
+ * make do without.  Short of that, the soft limit goes up as far
+ * as the hard one allows.
+ */
+
+enum {
+    fds_per_input       = 3,
+    fds_reserved        = 32
+};
+
+static int fit_open_files(
+    global_info *g)
+{
+    struct rlimit limit;
+    rlim_t need;
+
+    need=(rlim_t)g->input_cnt
+        *(fds_per_input+(g->capture || g->worker_cnt>1))+fds_reserved;
+    if (getrlimit(RLIMIT_NOFILE,&limit)) {
+        report_errno("getrlimit");
+        return -1;
+    }
+    if (limit.rlim_cur!=RLIM_INFINITY && limit.rlim_cur<need
+            && limit.rlim_cur<limit.rlim_max) {
+        rlim_t old;
+
+        old=limit.rlim_cur;
+        limit.rlim_cur=limit.rlim_max;
+#ifdef OPEN_MAX
+        if (limit.rlim_cur>OPEN_MAX)
+            limit.rlim_cur=OPEN_MAX;
+#endif
+        if (setrlimit(RLIMIT_NOFILE,&limit))
+            limit.rlim_cur=old;
+    }
+    if (limit.rlim_cur!=RLIM_INFINITY && limit.rlim_cur<need) {
+        fprintf(messages(),"Too many inputs for the open file limit"
+                " (need %llu, have %llu)\n",
+                (unsigned long long)need,(unsigned long long)limit.rlim_cur);
+        return -1;
+    }
+    return 0;
+}
+
+static int attach_inputs(
+    global_info *g,
+    char **paths)
+{
+    static char const base_36[36]="1qa2zws3xed4crf5vtg6byh7nuj8mik9ol0p";
+    static char const base_16[16]="0123456789ABCDEF";
+    int status;
+    int ix;
+    input_info *input,*inputs_end;
+    size_t max_path_len;
+    char *uri_buf=NULL;
+    sqlite3_stmt *attach=NULL;
+    input_info **seen=NULL;
+    size_t seen_mask;
+
+    seen_mask=index_size(g->input_cnt)-1;
+    seen=calloc(seen_mask+1,sizeof (input_info *));
+    if (!seen) {
+        report_errno("calloc");
+        goto cleanup;
+    }
+    inputs_end=g->inputs+g->input_cnt;
+    max_path_len=0;
+    for (input=g->inputs,ix=0; input<inputs_end; input++,ix++) {
+        char *path;
+        size_t path_len;
+        struct stat stat_buf;
+        int name_num,digit_ix;
+        size_t slot;
+        codec_rule const *rule,*rules_end;
+
+        path=paths[ix];
+        if (path[0]=='/') {
+            fprintf(messages(),"%s: No absolute paths allowed\n",path);
+            goto cleanup;
+        }
+        path_len=strlen(path);
+        if (!path_len) {
+            fputs("No empty paths allowed\n",messages());
+            goto cleanup;
+        }
+        if (path_len>0xFFFF) {
+            fprintf(messages(),"%s: Path too long\n",path);
+            goto cleanup;
+        }
+        if (!strcmp(path,dictionary_path) || !strcmp(path,index_path)
+                || !strcmp(path,archive_manifest_path)) {
+            fprintf(messages(),"%s: Reserved name\n",path);
+            goto cleanup;
+        }
+        if (stat(path,&stat_buf)) {
+            fprintf(messages(),"%s: %s\n",path,strerror(errno));
+            goto cleanup;
+        }
+        if (!S_ISREG(stat_buf.st_mode)) {
+            fprintf(messages(),"%s: Not a regular file\n",path);
+            goto cleanup;
+        }
+        slot=identity_hash(stat_buf.st_dev,stat_buf.st_ino) & seen_mask;
+        for (; seen[slot]; slot=slot+1 & seen_mask) {
+            if (seen[slot]->dev==stat_buf.st_dev
+                    && seen[slot]->ino==stat_buf.st_ino) {
+                fprintf(messages(),"%s: Duplicate input\n",path);
+                goto cleanup;
+            }
+        }
+        seen[slot]=input;
+        input->path=path;
+        input->path_len=path_len;
+        input->entry_path=path;
+        input->entry_path_len=path_len;
+        input->dev=stat_buf.st_dev;
+        input->ino=stat_buf.st_ino;
+        input->mode=stat_buf.st_mode;
+        input->codec=g->codec;
+        rules_end=g->codec_rules+g->codec_rule_cnt;
+        for (rule=g->codec_rules; rule<rules_end; rule++) {
+            if (!fnmatch(rule->pattern,path,0)) {
+                input->codec=rule->codec;
+                break;
+            }
+        }
+        if (path_len>max_path_len)
+            max_path_len=path_len;
+/*
+ * Each input needs a unique internal name.  An underscore followed
+ * by six base-36 digits makes an identifier that doesn't collide
+ * with any keyword.
+ */
+        name_num=ix;
+        input->name[7]=0;
+        for (digit_ix=6; digit_ix>0; digit_ix--) {
+            input->name[digit_ix]=base_36[name_num%36];
+            name_num/=36;
+        }
+        input->name[0]='_';
+    }
+    free(seen);
+    seen=NULL;
+    if (fit_open_files(g))
+        goto cleanup;
+    uri_buf=malloc(3*max_path_len+sizeof "file://?mode=ro");
+    if (!uri_buf) {
+        report_errno("malloc");
+        goto cleanup;
+    }
+    for (input=g->inputs; input<inputs_end; input++) {
+        char attach_sql[sizeof attach_fmt+7];
+        int sql_len;
+        char const *src;
+        char *dst;
+        sqlite3 *db;
+
+        db=input->conn->db;
+        sql_len=snprintf(attach_sql,sizeof attach_sql,attach_fmt,input->name);
+        status=sqlite3_prepare_v2(db,attach_sql,sql_len+1,&attach,NULL);
+        if (status!=SQLITE_OK) {
+            fprintf(messages(),"sqlite3_prepare(attach): %s\n",
+                    sqlite3_errmsg(db));
+            goto cleanup;
+        }
+        src=input->path;
+        dst=uri_buf;
+        memcpy(dst,"file:",5);
+        dst+=5;
+        if (src[0]=='/') {
+            dst[0]='/';
+            dst[1]='/';
+            dst+=2;
+        }
+        for (;;) {
+            int c;
+
+            c=src[0];
+            src++;
+            if (!c)
+                break;
+            if (c=='%' || c=='#' || c=='?' || c<=' ' || c>=0x7F) {
+                dst[0]='%';
+                dst[1]=base_16[c>>4 & 0xF];
+                dst[2]=base_16[c    & 0xF];
+                dst+=3;
+            } else {
+                dst[0]=c;
+                dst++;
+            }
+        }
+        memcpy(dst,"?mode=ro",8);
+        dst+=8;
+        status=sqlite3_bind_text(attach,1,uri_buf,dst-uri_buf,SQLITE_STATIC);
+        if (status!=SQLITE_OK) {
+            fprintf(messages(),"sqlite3_bind_text(attach): %s\n",
+                    sqlite3_errmsg(db));
+            goto cleanup;
+        }
+        status=sqlite3_step(attach);
+        if (status!=SQLITE_DONE) {
+            fprintf(messages(),"sqlite3_step(attach): %s\n",
+                    sqlite3_errmsg(db));
+            goto cleanup;
+        }
+        sqlite3_finalize(attach);
+        attach=NULL;
+        input->attached=1;
+        if (tune_input(g,input))
+            goto cleanup;
+    }
+    free(uri_buf);
+    uri_buf=NULL;
+    return 0;
+
+cleanup:
+    free(seen);
+    if (uri_buf)
+        free(uri_buf);
+    if (attach)
+        sqlite3_finalize(attach);
+    return -1;
+}
+
+/*
+ * Stdio streams of our own.  A cookie starts with a pointer to its
+ * stream_ops, whose functions return 0 on success or -1 with errno set.
+ * Writes always take all the data given; seek may be NULL.
+ */
+
+typedef struct stream_ops {
+    int (*write)(void *cookie,char const *data,size_t len);
+    int (*seek)(void *cookie,off_t *offset,int whence);
+    int (*close)(void *cookie);
+} stream_ops;
+
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) \
+    || defined(__OpenBSD__) || defined(__DragonFly__)
+
+static int cookie_write(
+    void *cookie,
+    char const *data,
+    int len)
+{
+    stream_ops const *ops;
+
+    ops=*(stream_ops const **)cookie;
+    if (ops->write(cookie,data,len))
+        return -1;
+    return len;
+}
+
+static fpos_t cookie_seek(
+    void *cookie,
+    fpos_t offset,
+    int whence)
+{
+    stream_ops const *ops;
+    off_t pos;
+
+    ops=*(stream_ops const **)cookie;
+    pos=offset;
+    if (ops->seek(cookie,&pos,whence))
+        return -1;
+    return pos;
+}
+
+static int cookie_close(
+    void *cookie)
+{
+    stream_ops const *ops;
+
+    ops=*(stream_ops const **)cookie;
+    return ops->close(cookie);
+}
+
+static FILE *open_stream(
+    void *cookie)
+{
+    stream_ops const *ops;
+
+    ops=*(stream_ops const **)cookie;
+    return funopen(cookie,NULL,cookie_write,
+                   ops->seek ? cookie_seek : NULL,cookie_close);
+}
+
+#else
+
+/*
+ * glibc takes 0, not -1, as the sign of a failed write.
+ */
+
+static ssize_t cookie_write(
+    void *cookie,
+    char const *data,
+    size_t len)
+{
+    stream_ops const *ops;
+
+    ops=*(stream_ops const **)cookie;
+    if (ops->write(cookie,data,len))
+        return 0;
+    return len;
+}
+
+static int cookie_seek(
+    void *cookie,
+    off64_t *offset,
+    int whence)
+{
+    stream_ops const *ops;
+    off_t pos;
+
+    ops=*(stream_ops const **)cookie;
+    pos=*offset;
+    if (ops->seek(cookie,&pos,whence))
+        return -1;
+    *offset=pos;
+    return 0;
+}
+
+static int cookie_close(
+    void *cookie)
+{
+    stream_ops const *ops;
+
+    ops=*(stream_ops const **)cookie;
+    return ops->close(cookie);
+}
+
+static FILE *open_stream(
+    void *cookie)
+{
+    stream_ops const *ops;
+    cookie_io_functions_t funcs;
+
+    ops=*(stream_ops const **)cookie;
+    funcs.read=NULL;
+    funcs.write=cookie_write;
+    funcs.seek=ops->seek ? cookie_seek : NULL;
+    funcs.close=cookie_close;
+    return fopencookie(cookie,"w",funcs);
+}
+
+#endif
+
+/*
+ * Asynchronous output.  The archive is written through a stdio stream
+ * whose bytes are collected into a ring of large buffers, each handed
+ * to a writer thread as soon as it fills and written out with a single
+ * write(2).  So compression only waits for the disk or the pipe once
+ * the whole ring is full, and the many small writes of headers and
+ * deflate output turn into a few big ones.  A seek first waits until
+ * everything before it is written.  Once a write has failed, so does
+ * everything after it, with the same error.
+ *
+ * With direct I/O, the archive bypasses the page cache so that it
+ * doesn't push out the pages of live databases.  That means writing
+ * whole aligned blocks only, at aligned offsets: the buffer being filled
+ * always starts on a block boundary, even after a seek, and one written
+ * while partly filled is padded to a whole block, with what the file
+ * already has there or with zeroes past its end.  Closing the stream
+ * truncates the padding away.
+ */
+
+enum {
+    writer_buffer_cnt   = 4,
+    direct_align        = 4096
+};
+
+typedef struct writer_buffer {
+    uint8_t *buf;
+    size_t len;
+    off_t offset;
+} writer_buffer;
+
+typedef struct async_writer {
+    stream_ops const *ops;
+    throttle_info *throttle;
+    FILE *messages;
+    int fd;
+    char direct;
+    size_t buf_size;
+    writer_buffer bufs[writer_buffer_cnt];
+    uint8_t *block;
+    off_t base;
+    off_t end;
+    pthread_t thread;
+/*
+ * Protected by lock: fill, next, full_cnt, stopping and error.
+ * Buffers next up to fill are full, in order, and belong to the thread;
+ * fill is being filled by whoever writes to the stream, starting
+ * at file offset base.  end is where the archive ends so far.
+ */
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+    int fill;
+    int next;
+    int full_cnt;
+    char stopping;
+    int error;
+} async_writer;
+
+static int writer_put(
+    async_writer *w,
+    uint8_t const *data,
+    size_t len,
+    off_t offset)
+{
+    throttle_io(w->throttle,len);
+    while (len) {
+        ssize_t got;
+
+        if (w->direct) {
+            got=pwrite(w->fd,data,len,offset);
+        } else {
+            got=write(w->fd,data,len);
+        }
+        if (got<0) {
+            if (errno!=EINTR)
+                return errno;
+        } else {
+            data+=got;
+            len-=got;
+            offset+=got;
+        }
+    }
+    return 0;
+}
+
+static void *writer_main(
+    void *arg)
+{
+    async_writer *w;
+
+    w=arg;
+    use_messages(w->messages);
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        writer_buffer *b;
+        int error;
+
+        while (!w->full_cnt && !w->stopping)
+            pthread_cond_wait(&w->work,&w->lock);
+        if (!w->full_cnt)
+            break;
+        b=w->bufs+w->next;
+        error=w->error;
+        pthread_mutex_unlock(&w->lock);
+        if (!error)
+            error=writer_put(w,b->buf,b->len,b->offset);
+        b->len=0;
+        pthread_mutex_lock(&w->lock);
+        w->error=error;
+        w->next=(w->next+1)%writer_buffer_cnt;
+        w->full_cnt--;
+        pthread_cond_signal(&w->idle);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/*
+ * Hand over the buffer being filled, if it has anything in it
+ * and queue is set, and wait until at most limit buffers
+ * are left to write.
+ */
+
+static int writer_queue(
+    async_writer *w,
+    int queue,
+    int limit)
+{
+    int error;
+
+    pthread_mutex_lock(&w->lock);
+    if (queue && w->bufs[w->fill].len) {
+        writer_buffer *b;
+
+        b=w->bufs+w->fill;
+        b->offset=w->base;
+        w->base+=b->len;
+        if (w->end<w->base)
+            w->end=w->base;
+        w->fill=(w->fill+1)%writer_buffer_cnt;
+        w->full_cnt++;
+        pthread_cond_signal(&w->work);
+    }
+    while (w->full_cnt>limit)
+        pthread_cond_wait(&w->idle,&w->lock);
+    error=w->error;
+    pthread_mutex_unlock(&w->lock);
+    if (error) {
+        errno=error;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Write out everything, including a partly filled buffer,
+ * which stays the one being filled.
+ */
+
+static int writer_drain(
+    async_writer *w)
+{
+    writer_buffer *b;
+    size_t len,tail;
+    int error;
+
+    if (!w->direct)
+        return writer_queue(w,1,0);
+    if (writer_queue(w,0,0))
+        return -1;
+    b=w->bufs+w->fill;
+    len=b->len;
+    tail=len%direct_align;
+    if (tail) {
+        off_t offset;
+
+        offset=w->base+len-tail;
+        memset(w->block,0,direct_align);
+        if (offset<w->end && pread(w->fd,w->block,direct_align,offset)<0)
+            return -1;
+        memcpy(b->buf+len,w->block+tail,direct_align-tail);
+        len+=direct_align-tail;
+    }
+    error=writer_put(w,b->buf,len,w->base);
+    if (error) {
+        pthread_mutex_lock(&w->lock);
+        w->error=error;
+        pthread_mutex_unlock(&w->lock);
+        errno=error;
+        return -1;
+    }
+    if (w->end<w->base+(off_t)b->len)
+        w->end=w->base+b->len;
+    return 0;
+}
+
+static int writer_write(
+    void *cookie,
+    char const *data,
+    size_t len)
+{
+    async_writer *w;
+
+    w=cookie;
+    while (len) {
+        writer_buffer *b;
+        size_t part;
+
+        b=w->bufs+w->fill;
+        part=w->buf_size-b->len;
+        if (part>len)
+            part=len;
+        memcpy(b->buf+b->len,data,part);
+        b->len+=part;
+        data+=part;
+        len-=part;
+        if (b->len==w->buf_size
+                && writer_queue(w,1,writer_buffer_cnt-1))
+            return -1;
+    }
+    return 0;
+}
+
+static int writer_seek(
+    void *cookie,
+    off_t *offset,
+    int whence)
+{
+    async_writer *w;
+    writer_buffer *b;
+    off_t pos,base;
+    size_t head;
+
+    w=cookie;
+    if (!w->direct) {
+        if (writer_queue(w,1,0))
+            return -1;
+        pos=lseek(w->fd,*offset,whence);
+        if (pos<0)
+            return -1;
+        *offset=pos;
+        return 0;
+    }
+/*
+ * The first block of the new buffer gets what the file has there,
+ * so that bytes before the new position survive.
+ */
+    b=w->bufs+w->fill;
+    switch (whence) {
+    case SEEK_SET:
+        pos=*offset;
+        break;
+    case SEEK_CUR:
+        pos=w->base+b->len+*offset;
+        break;
+    case SEEK_END:
+        pos=w->end+*offset;
+        break;
+    default:
+        errno=EINVAL;
+        return -1;
+    }
+    if (pos<0) {
+        errno=EINVAL;
+        return -1;
+    }
+    if (pos!=w->base+(off_t)b->len) {
+        if (writer_drain(w))
+            return -1;
+        base=pos-pos%direct_align;
+        head=pos-base;
+        if (head) {
+            memset(b->buf,0,direct_align);
+            if (base<w->end && pread(w->fd,b->buf,direct_align,base)<0)
+                return -1;
+        }
+        w->base=base;
+        b->len=head;
+    }
+    *offset=pos;
+    return 0;
+}
+
+static void writer_free(
+    async_writer *w)
+{
+    int ix;
+
+    for (ix=0; ix<writer_buffer_cnt; ix++)
+        free(w->bufs[ix].buf);
+    free(w->block);
+    pthread_cond_destroy(&w->idle);
+    pthread_cond_destroy(&w->work);
+    pthread_mutex_destroy(&w->lock);
+    free(w);
+}
+
+/*
+ * Everything gets written before the thread is stopped,
+ * and the descriptor is closed either way.
+ */
+
+static int writer_close(
+    void *cookie)
+{
+    async_writer *w;
+    int status,error;
+
+    w=cookie;
+    status=writer_drain(w);
+    if (!status && w->direct)
+        status=ftruncate(w->fd,w->end);
+    error=errno;
+    pthread_mutex_lock(&w->lock);
+    w->stopping=1;
+    pthread_cond_signal(&w->work);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread,NULL);
+    if (close(w->fd) && !status) {
+        status=-1;
+        error=errno;
+    }
+    writer_free(w);
+    errno=error;
+    return status;
+}
+
+static stream_ops const writer_ops={
+    writer_write,
+    writer_seek,
+    writer_close
+};
+
+/*
+ * Direct I/O is O_DIRECT where there is one, or F_NOCACHE on macOS,
+ * turned on for a descriptor that is already open so that standard
+ * output can have it too.
+ */
+
+static int set_direct(
+    int fd,
+    char const *path)
+{
+#if defined(O_DIRECT)
+    int flags;
+
+    flags=fcntl(fd,F_GETFL);
+    if (flags<0 || fcntl(fd,F_SETFL,flags | O_DIRECT)) {
+        fprintf(messages(),"%s: O_DIRECT: %s\n",path,strerror(errno));
+        return -1;
+    }
+    return 0;
+#elif defined(F_NOCACHE)
+    if (fcntl(fd,F_NOCACHE,1)) {
+        fprintf(messages(),"%s: F_NOCACHE: %s\n",path,strerror(errno));
+        return -1;
+    }
+    return 0;
+#else
+    fprintf(messages(),"%s: Direct I/O isn't supported here\n",path);
+    return -1;
+#endif
+}
+
+/*
+ * Take over fd, which is closed with the stream or on failure.
+ * Writes draw on throttle, unless it's NULL.
+ */
+
+static FILE *writer_open(
+    int fd,
+    size_t buf_size,
+    int direct,
+    throttle_info *throttle,
+    char const *path)
+{
+    async_writer *w;
+    FILE *stream;
+    int ix,status;
+
+    w=calloc(1,sizeof *w);
+    if (!w) {
+        report_errno("calloc");
+        close(fd);
+        return NULL;
+    }
+    if (pthread_mutex_init(&w->lock,NULL)
+            || pthread_cond_init(&w->work,NULL)
+            || pthread_cond_init(&w->idle,NULL)) {
+        fputs("Can't initialise thread synchronisation\n",messages());
+        free(w);
+        close(fd);
+        return NULL;
+    }
+    w->ops=&writer_ops;
+    w->throttle=throttle;
+    w->messages=messages();
+    w->fd=fd;
+    w->buf_size=buf_size;
+    for (ix=0; ix<writer_buffer_cnt; ix++) {
+        void *buf;
+
+        status=posix_memalign(&buf,direct_align,buf_size);
+        if (status) {
+            fprintf(messages(),"posix_memalign: %s\n",strerror(status));
+            goto cleanup;
+        }
+        w->bufs[ix].buf=buf;
+    }
+    if (direct) {
+        struct stat stat_buf;
+        void *block;
+        off_t pos;
+        int flags;
+
+        status=posix_memalign(&block,direct_align,direct_align);
+        if (status) {
+            fprintf(messages(),"posix_memalign: %s\n",strerror(status));
+            goto cleanup;
+        }
+        w->block=block;
+        flags=fcntl(fd,F_GETFL);
+        if (flags>=0 && (flags & O_APPEND)) {
+            fprintf(messages(),"%s: Can't append with direct I/O\n",path);
+            goto cleanup;
+        }
+        if (fstat(fd,&stat_buf)) {
+            fprintf(messages(),"%s: fstat: %s\n",path,strerror(errno));
+            goto cleanup;
+        }
+        pos=lseek(fd,0,SEEK_CUR);
+        if (pos<0) {
+            fprintf(messages(),"%s: lseek: %s\n",path,strerror(errno));
+            goto cleanup;
+        }
+        if (set_direct(fd,path))
+            goto cleanup;
+        w->direct=1;
+        w->end=stat_buf.st_size;
+        if (writer_seek(w,&pos,SEEK_SET)) {
+            fprintf(messages(),"%s: pread: %s\n",path,strerror(errno));
+            goto cleanup;
+        }
+    }
+    status=pthread_create(&w->thread,NULL,writer_main,w);
+    if (status) {
+        fprintf(messages(),"pthread_create: %s\n",strerror(status));
+        goto cleanup;
+    }
+    stream=open_stream(w);
+    if (!stream) {
+        fprintf(messages(),"%s: Can't make a stream: %s\n",
+                path,strerror(errno));
+        writer_close(w);
+        return NULL;
+    }
+/*
+ * The ring does all the buffering there is.
+ */
+    setvbuf(stream,NULL,_IONBF,0);
+    return stream;
+
+cleanup:
+    writer_free(w);
+    close(fd);
+    return NULL;
+}
+
+/*
+ * Output straight to S3, as a multipart upload.  The archive is
+ * written through a stdio stream like any other, whose bytes are
+ * collected into parts of part_size bytes and handed to a pool
+ * of upload threads, each with its own curl handle.  Once all the
+ * buffers are in flight, writing blocks until a part is done, which
+ * keeps compression from running arbitrarily far ahead of the network.
+ * The central directory and trailer end up in the last part.
+ * Closing the stream completes the upload, unless s3_abandon has been
+ * called or anything failed, in which case the upload is aborted.
+ *
+ * Requests are signed with curl's SigV4 support, using the usual
+ * AWS_ACCESS_KEY_ID, AWS_SECRET_ACCESS_KEY and AWS_SESSION_TOKEN
+ * variables; AWS_REGION (or AWS_DEFAULT_REGION) names the region.
+ * AWS_ENDPOINT_URL selects another S3-compatible service,
+ * addressed path-style.
+ */
+
+#ifdef S3ZIP_S3
+
+enum {
+    part_free,
+    part_queued,
+    part_busy
+};
+
+enum {
+    s3_max_parts        = 10000,
+    s3_max_response     = 0x10000,
+    s3_attempts         = 4
+};
+
+typedef struct s3_part {
+    struct s3_part *next;
+    uint8_t *buf;
+    size_t len;
+    int part_no;
+    char state;
+} s3_part;
+
+typedef struct s3_uploader {
+    struct s3_sink *sink;
+    pthread_t thread;
+    CURL *curl;
+    char have_thread;
+} s3_uploader;
+
+typedef struct s3_response {
+    char *data;
+    size_t len;
+    char etag[128];
+} s3_response;
+
+struct s3_sink {
+    stream_ops const *ops;
+    FILE *messages;
+    char const *path;
+    char *url;
+    char *userpwd;
+    char *token_header;
+    char *upload_id;
+    char sigv4[64];
+    CURL *curl;
+    char **etags;
+    size_t part_size;
+    int part_cnt;
+    int buf_cnt;
+    int uploader_cnt;
+    s3_part *current;
+    s3_part *parts;
+    s3_uploader *uploaders;
+/*
+ * Protected by lock: the part queue, stopping, failed,
+ * and the state of every part.
+ */
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+    s3_part *head,*tail;
+    char stopping;
+    char failed;
+};
+
+static char *s3_escape(
+    char const *src,
+    int keep_slash)
+{
+    static char const base_16[16]="0123456789ABCDEF";
+    char *result,*dst;
+
+    result=malloc(3*strlen(src)+1);
+    if (!result)
+        return NULL;
+    dst=result;
+    for (; *src; src++) {
+        int c;
+
+        c=*src & 0xFF;
+        if ((c>='A' && c<='Z') || (c>='a' && c<='z') || (c>='0' && c<='9')
+                || c=='-' || c=='.' || c=='_' || c=='~'
+                || (c=='/' && keep_slash)) {
+            *dst++=c;
+        } else {
+            dst[0]='%';
+            dst[1]=base_16[c>>4];
+            dst[2]=base_16[c & 0xF];
+            dst+=3;
+        }
+    }
+    *dst=0;
+    return result;
+}
+
+static size_t s3_body_cb(
+    char *data,
+    size_t size,
+    size_t cnt,
+    void *arg)
+{
+    s3_response *response;
+    size_t len,keep;
+
+    response=arg;
+    len=size*cnt;
+    keep=len;
+    if (keep>s3_max_response-response->len)
+        keep=s3_max_response-response->len;
+    memcpy(response->data+response->len,data,keep);
+    response->len+=keep;
+    return len;
+}
+
+static size_t s3_header_cb(
+    char *data,
+    size_t size,
+    size_t cnt,
+    void *arg)
+{
+    s3_response *response;
+    size_t len;
+
+    response=arg;
+    len=size*cnt;
+    if (len>5 && !strncasecmp(data,"etag:",5)) {
+        char const *p,*end;
+
+        p=data+5;
+        end=data+len;
+        while (p<end && (*p==' ' || *p=='\t'))
+            p++;
+        while (end>p && (end[-1]=='\r' || end[-1]=='\n' || end[-1]==' '))
+            end--;
+        if (end-p<(long)sizeof response->etag) {
+            memcpy(response->etag,p,end-p);
+            response->etag[end-p]=0;
+        }
+    }
+    return len;
+}
+
+/*
+ * Find the text of the first element with the given name.
+ */
+
+static char *s3_element(
+    s3_response *response,
+    char const *name,
+    size_t *len)
+{
+    char open[32],close[32];
+    char *start,*end;
+
+    snprintf(open,sizeof open,"<%s>",name);
+    snprintf(close,sizeof close,"</%s>",name);
+    start=strstr(response->data,open);
+    if (!start)
+        return NULL;
+    start+=strlen(open);
+    end=strstr(start,close);
+    if (!end)
+        return NULL;
+    *len=end-start;
+    return start;
+}
+
+/*
+ * One request, retried a few times if the fault isn't ours.
+ * Returns 0 on a 2xx status without an error document.
+ */
+
+static int s3_request(
+    s3_sink *sink,
+    CURL *curl,
+    char const *method,
+    char const *query,
+    void const *body,
+    size_t body_len,
+    s3_response *response,
+    char const *what)
+{
+    char *url;
+    struct curl_slist *headers=NULL,*more;
+    char const *header_list[4];
+    int header_cnt,ix;
+    int attempt;
+    int result;
+
+    result=-1;
+    url=malloc(strlen(sink->url)+strlen(query)+2);
+    if (!url) {
+        report_errno("malloc");
+        return -1;
+    }
+    sprintf(url,"%s?%s",sink->url,query);
+    header_cnt=0;
+    header_list[header_cnt++]="x-amz-content-sha256: UNSIGNED-PAYLOAD";
+    if (sink->token_header)
+        header_list[header_cnt++]=sink->token_header;
+    header_list[header_cnt++]="Content-Type:";
+    header_list[header_cnt++]="Expect:";
+    for (ix=0; ix<header_cnt; ix++) {
+        more=curl_slist_append(headers,header_list[ix]);
+        if (!more) {
+            fputs("curl_slist_append failed\n",messages());
+            goto cleanup;
+        }
+        headers=more;
+    }
+    for (attempt=1; attempt<=s3_attempts; attempt++) {
+        CURLcode code;
+        long status;
+
+        curl_easy_reset(curl);
+        curl_easy_setopt(curl,CURLOPT_URL,url);
+        curl_easy_setopt(curl,CURLOPT_HTTPHEADER,headers);
+        curl_easy_setopt(curl,CURLOPT_AWS_SIGV4,sink->sigv4);
+        curl_easy_setopt(curl,CURLOPT_USERPWD,sink->userpwd);
+        curl_easy_setopt(curl,CURLOPT_NOSIGNAL,1L);
+        curl_easy_setopt(curl,CURLOPT_WRITEFUNCTION,s3_body_cb);
+        curl_easy_setopt(curl,CURLOPT_WRITEDATA,response);
+        curl_easy_setopt(curl,CURLOPT_HEADERFUNCTION,s3_header_cb);
+        curl_easy_setopt(curl,CURLOPT_HEADERDATA,response);
+        if (body) {
+            curl_easy_setopt(curl,CURLOPT_POST,1L);
+            curl_easy_setopt(curl,CURLOPT_POSTFIELDS,body);
+            curl_easy_setopt(curl,CURLOPT_POSTFIELDSIZE_LARGE,
+                             (curl_off_t)body_len);
+        }
+        curl_easy_setopt(curl,CURLOPT_CUSTOMREQUEST,method);
+        response->len=0;
+        response->etag[0]=0;
+        code=curl_easy_perform(curl);
+        response->data[response->len]=0;
+        if (code!=CURLE_OK) {
+            fprintf(messages(),"%s: %s: %s\n",
+                    sink->path,what,curl_easy_strerror(code));
+        } else {
+            size_t len;
+            char const *error_code;
+
+            curl_easy_getinfo(curl,CURLINFO_RESPONSE_CODE,&status);
+            error_code=s3_element(response,"Code",&len);
+            if (status>=200 && status<300
+                    && !strstr(response->data,"<Error>")) {
+                result=0;
+                break;
+            }
+            if (error_code) {
+                fprintf(messages(),"%s: %s: HTTP %ld, %.*s\n",
+                        sink->path,what,status,(int)len,error_code);
+            } else {
+                fprintf(messages(),"%s: %s: HTTP %ld\n",
+                        sink->path,what,status);
+            }
+            if (status>=400 && status<500 && status!=408 && status!=429)
+                break;
+        }
+        if (attempt<s3_attempts)
+            sleep(1u<<(attempt-1));
+    }
+
+cleanup:
+    curl_slist_free_all(headers);
+    free(url);
+    return result;
+}
+
+static int s3_upload_part(
+    s3_uploader *u,
+    s3_part *part,
+    s3_response *response)
+{
+    s3_sink *sink;
+    char *id,*query;
+    char what[32];
+    int status;
+
+    sink=u->sink;
+    id=s3_escape(sink->upload_id,0);
+    query=id ? malloc(strlen(id)+40) : NULL;
+    if (!query) {
+        report_errno("malloc");
+        free(id);
+        return -1;
+    }
+    sprintf(query,"partNumber=%d&uploadId=%s",part->part_no,id);
+    free(id);
+    snprintf(what,sizeof what,"part %d",part->part_no);
+    status=s3_request(sink,u->curl,"PUT",query,
+                      part->buf,part->len,response,what);
+    free(query);
+    if (status)
+        return -1;
+    if (!response->etag[0]) {
+        fprintf(messages(),"%s: %s: No ETag\n",sink->path,what);
+        return -1;
+    }
+    sink->etags[part->part_no-1]=strdup(response->etag);
+    if (!sink->etags[part->part_no-1]) {
+        report_errno("strdup");
+        return -1;
+    }
+    return 0;
+}
+
+static void *s3_uploader_main(
+    void *arg)
+{
+    s3_uploader *u;
+    s3_sink *sink;
+    s3_response response;
+
+    u=arg;
+    sink=u->sink;
+    use_messages(sink->messages);
+    response.data=malloc(s3_max_response+1);
+    for (;;) {
+        s3_part *part;
+        int failed;
+
+        pthread_mutex_lock(&sink->lock);
+        while (!sink->head && !sink->stopping)
+            pthread_cond_wait(&sink->work,&sink->lock);
+        part=sink->head;
+        if (!part) {
+            pthread_mutex_unlock(&sink->lock);
+            break;
+        }
+        sink->head=part->next;
+        if (!sink->head)
+            sink->tail=NULL;
+        part->state=part_busy;
+        failed=sink->failed;
+        pthread_mutex_unlock(&sink->lock);
+
+        if (!failed) {
+            if (!response.data) {
+                report_errno("malloc");
+                failed=1;
+            } else {
+                failed=s3_upload_part(u,part,&response)!=0;
+            }
+        }
+
+        pthread_mutex_lock(&sink->lock);
+        if (failed)
+            sink->failed=1;
+        part->state=part_free;
+        pthread_cond_broadcast(&sink->idle);
+        pthread_mutex_unlock(&sink->lock);
+    }
+    free(response.data);
+    return NULL;
+}
+
+/*
+ * Hand the current part to the uploaders, and find a free buffer
+ * for the next one, waiting if need be.
+ */
+
+static int s3_queue(
+    s3_sink *sink)
+{
+    s3_part *part;
+
+    part=sink->current;
+    sink->current=NULL;
+    pthread_mutex_lock(&sink->lock);
+    if (sink->failed) {
+        pthread_mutex_unlock(&sink->lock);
+        return -1;
+    }
+    if (sink->part_cnt==s3_max_parts) {
+        sink->failed=1;
+        pthread_mutex_unlock(&sink->lock);
+        fprintf(messages(),"%s: Too many parts, use a larger part size\n",
+                sink->path);
+        return -1;
+    }
+    sink->part_cnt++;
+    part->part_no=sink->part_cnt;
+    part->state=part_queued;
+    part->next=NULL;
+    if (sink->tail) {
+        sink->tail->next=part;
+    } else {
+        sink->head=part;
+    }
+    sink->tail=part;
+    pthread_cond_signal(&sink->work);
+    pthread_mutex_unlock(&sink->lock);
+    return 0;
+}
+
+static int s3_take(
+    s3_sink *sink)
+{
+    int ix;
+
+    pthread_mutex_lock(&sink->lock);
+    for (;;) {
+        if (sink->failed) {
+            pthread_mutex_unlock(&sink->lock);
+            return -1;
+        }
+        for (ix=0; ix<sink->buf_cnt; ix++) {
+            if (sink->parts[ix].state==part_free)
+                break;
+        }
+        if (ix<sink->buf_cnt)
+            break;
+        pthread_cond_wait(&sink->idle,&sink->lock);
+    }
+    sink->current=sink->parts+ix;
+    sink->current->state=part_busy;
+    sink->current->len=0;
+    pthread_mutex_unlock(&sink->lock);
+    return 0;
+}
+
+static int s3_put(
+    s3_sink *sink,
+    char const *data,
+    size_t len)
+{
+    while (len) {
+        size_t room;
+
+        if (!sink->current) {
+            if (s3_take(sink))
+                return -1;
+        }
+        room=sink->part_size-sink->current->len;
+        if (room>len)
+            room=len;
+        memcpy(sink->current->buf+sink->current->len,data,room);
+        sink->current->len+=room;
+        data+=room;
+        len-=room;
+        if (sink->current->len==sink->part_size) {
+            if (s3_queue(sink))
+                return -1;
+        }
+    }
+    return 0;
+}
+
+static int s3_complete(
+    s3_sink *sink)
+{
+    s3_response response;
+    char *xml,*id,*query,*p;
+    size_t xml_size;
+    int ix;
+    int status;
+
+    status=-1;
+    xml=NULL;
+    id=NULL;
+    query=NULL;
+    response.data=malloc(s3_max_response+1);
+    xml_size=128;
+    for (ix=0; ix<sink->part_cnt; ix++)
+        xml_size+=64+strlen(sink->etags[ix]);
+    xml=malloc(xml_size);
+    id=s3_escape(sink->upload_id,0);
+    query=id ? malloc(strlen(id)+16) : NULL;
+    if (!response.data || !xml || !query) {
+        report_errno("malloc");
+        goto cleanup;
+    }
+    p=xml;
+    p+=sprintf(p,"<CompleteMultipartUpload>");
+    for (ix=0; ix<sink->part_cnt; ix++) {
+        p+=sprintf(p,"<Part><PartNumber>%d</PartNumber>"
+                   "<ETag>%s</ETag></Part>",
+                   ix+1,sink->etags[ix]);
+    }
+    p+=sprintf(p,"</CompleteMultipartUpload>");
+    sprintf(query,"uploadId=%s",id);
+    status=s3_request(sink,sink->curl,"POST",query,xml,p-xml,
+                      &response,"complete");
+
+cleanup:
+    free(query);
+    free(id);
+    free(xml);
+    free(response.data);
+    return status;
+}
+
+static void s3_abort(
+    s3_sink *sink)
+{
+    s3_response response;
+    char *id,*query;
+
+    response.data=malloc(s3_max_response+1);
+    id=s3_escape(sink->upload_id,0);
+    query=id ? malloc(strlen(id)+16) : NULL;
+    if (response.data && query) {
+        sprintf(query,"uploadId=%s",id);
+        s3_request(sink,sink->curl,"DELETE",query,NULL,0,&response,"abort");
+    }
+    free(query);
+    free(id);
+    free(response.data);
+}
+
+static void s3_free(
+    s3_sink *sink)
+{
+    int ix;
+
+    if (sink->uploaders) {
+        for (ix=0; ix<sink->uploader_cnt; ix++) {
+            if (sink->uploaders[ix].curl)
+                curl_easy_cleanup(sink->uploaders[ix].curl);
+        }
+        free(sink->uploaders);
+    }
+    if (sink->parts) {
+        for (ix=0; ix<sink->buf_cnt; ix++)
+            free(sink->parts[ix].buf);
+        free(sink->parts);
+    }
+    if (sink->etags) {
+        for (ix=0; ix<sink->part_cnt; ix++)
+            free(sink->etags[ix]);
+        free(sink->etags);
+    }
+    if (sink->curl)
+        curl_easy_cleanup(sink->curl);
+    free(sink->upload_id);
+    free(sink->token_header);
+    free(sink->userpwd);
+    free(sink->url);
+    pthread_mutex_destroy(&sink->lock);
+    pthread_cond_destroy(&sink->work);
+    pthread_cond_destroy(&sink->idle);
+    free(sink);
+}
+
+/*
+ * Closing the stream: send the last part, wait for the uploaders
+ * to finish, and complete or abort the upload.
+ */
+
+static int s3_close(
+    s3_sink *sink)
+{
+    int failed;
+    int ix;
+
+    if (sink->current) {
+        if (sink->current->len || !sink->part_cnt) {
+            s3_queue(sink);
+        } else {
+            sink->current->state=part_free;
+            sink->current=NULL;
+        }
+    }
+    pthread_mutex_lock(&sink->lock);
+    sink->stopping=1;
+    pthread_cond_broadcast(&sink->work);
+    pthread_mutex_unlock(&sink->lock);
+    for (ix=0; ix<sink->uploader_cnt; ix++) {
+        if (sink->uploaders[ix].have_thread)
+            pthread_join(sink->uploaders[ix].thread,NULL);
+    }
+    failed=sink->failed;
+    if (!failed && s3_complete(sink))
+        failed=1;
+    if (failed)
+        s3_abort(sink);
+    s3_free(sink);
+    return failed ? -1 : 0;
+}
+
+/*
+ * Anything that goes wrong before the stream is closed
+ * means the upload must not be completed.
+ */
+
+static void s3_abandon(
+    s3_sink *sink)
+{
+    pthread_mutex_lock(&sink->lock);
+    sink->failed=1;
+    pthread_mutex_unlock(&sink->lock);
+}
+
+static int s3_stream_write(
+    void *cookie,
+    char const *data,
+    size_t len)
+{
+    if (s3_put(cookie,data,len)) {
+        errno=EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static int s3_stream_close(
+    void *cookie)
+{
+    if (s3_close(cookie)) {
+        errno=EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static stream_ops const s3_stream_ops={
+    s3_stream_write,
+    NULL,
+    s3_stream_close
+};
+
+/*
+ * Start the upload described by an s3://bucket/key path.
+ */
+
+static FILE *s3_open(
+    global_info *g,
+    char const *path,
+    s3_sink **result)
+{
+    s3_sink *sink;
+    char const *bucket,*key,*region,*endpoint;
+    char const *access_key,*secret_key,*token;
+    char *escaped_key=NULL;
+    size_t bucket_len;
+    s3_response response;
+    FILE *stream;
+    int ix;
+
+    response.data=NULL;
+    sink=calloc(1,sizeof *sink);
+    if (!sink) {
+        report_errno("calloc");
+        return NULL;
+    }
+    sink->messages=messages();
+    if (pthread_mutex_init(&sink->lock,NULL)
+            || pthread_cond_init(&sink->work,NULL)
+            || pthread_cond_init(&sink->idle,NULL)) {
+        fputs("Can't initialise thread synchronisation\n",messages());
+        free(sink);
+        return NULL;
+    }
+    sink->path=path;
+    bucket=path+5;
+    key=strchr(bucket,'/');
+    if (!key || key==bucket || !key[1]) {
+        fprintf(messages(),"%s: Expected s3://bucket/key\n",path);
+        goto cleanup;
+    }
+    bucket_len=key-bucket;
+    key++;
+    access_key=getenv("AWS_ACCESS_KEY_ID");
+    secret_key=getenv("AWS_SECRET_ACCESS_KEY");
+    token=getenv("AWS_SESSION_TOKEN");
+    if (!access_key || !secret_key) {
+        fputs("AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY must be set\n",
+              messages());
+        goto cleanup;
+    }
+    region=getenv("AWS_REGION");
+    if (!region)
+        region=getenv("AWS_DEFAULT_REGION");
+    if (!region)
+        region="us-east-1";
+    endpoint=getenv("AWS_ENDPOINT_URL");
+    if (curl_global_init(CURL_GLOBAL_DEFAULT)) {
+        fputs("curl_global_init failed\n",messages());
+        goto cleanup;
+    }
+    escaped_key=s3_escape(key,1);
+    if (!escaped_key) {
+        report_errno("malloc");
+        goto cleanup;
+    }
+    if (endpoint) {
+        size_t endpoint_len;
+
+        endpoint_len=strlen(endpoint);
+        while (endpoint_len && endpoint[endpoint_len-1]=='/')
+            endpoint_len--;
+        sink->url=malloc(endpoint_len+bucket_len+strlen(escaped_key)+3);
+        if (sink->url)
+            sprintf(sink->url,"%.*s/%.*s/%s",(int)endpoint_len,endpoint,
+                    (int)bucket_len,bucket,escaped_key);
+    } else {
+        sink->url=malloc(bucket_len+strlen(region)+strlen(escaped_key)+32);
+        if (sink->url)
+            sprintf(sink->url,"https://%.*s.s3.%s.amazonaws.com/%s",
+                    (int)bucket_len,bucket,region,escaped_key);
+    }
+    sink->userpwd=malloc(strlen(access_key)+strlen(secret_key)+2);
+    if (sink->userpwd)
+        sprintf(sink->userpwd,"%s:%s",access_key,secret_key);
+    if (token) {
+        sink->token_header=malloc(strlen(token)+24);
+        if (sink->token_header)
+            sprintf(sink->token_header,"x-amz-security-token: %s",token);
+    }
+    snprintf(sink->sigv4,sizeof sink->sigv4,"aws:amz:%s:s3",region);
+    sink->part_size=(size_t)g->part_size<<20;
+    sink->uploader_cnt=g->upload_cnt;
+    sink->buf_cnt=g->upload_cnt+1;
+    sink->etags=calloc(s3_max_parts,sizeof (char *));
+    sink->parts=calloc(sink->buf_cnt,sizeof (s3_part));
+    sink->uploaders=calloc(sink->uploader_cnt,sizeof (s3_uploader));
+    sink->curl=curl_easy_init();
+    response.data=malloc(s3_max_response+1);
+    if (!sink->url || !sink->userpwd || (token && !sink->token_header)
+            || !sink->etags || !sink->parts || !sink->uploaders
+            || !sink->curl || !response.data) {
+        fputs("Out of memory or something\n",messages());
+        goto cleanup;
+    }
+    for (ix=0; ix<sink->buf_cnt; ix++) {
+        sink->parts[ix].buf=malloc(sink->part_size);
+        if (!sink->parts[ix].buf) {
+            report_errno("malloc");
+            goto cleanup;
+        }
+    }
+    if (s3_request(sink,sink->curl,"POST","uploads",
+                   "",0,&response,"initiate")) {
+        goto cleanup;
+    } else {
+        char const *id;
+        size_t len;
+
+        id=s3_element(&response,"UploadId",&len);
+        if (!id) {
+            fprintf(messages(),"%s: initiate: No UploadId\n",path);
+            goto cleanup;
+        }
+        sink->upload_id=malloc(len+1);
+        if (!sink->upload_id) {
+            report_errno("malloc");
+            goto cleanup;
+        }
+        memcpy(sink->upload_id,id,len);
+        sink->upload_id[len]=0;
+    }
+    free(response.data);
+    response.data=NULL;
+    free(escaped_key);
+    escaped_key=NULL;
+    for (ix=0; ix<sink->uploader_cnt; ix++) {
+        s3_uploader *u;
+        int status;
+
+        u=sink->uploaders+ix;
+        u->sink=sink;
+        u->curl=curl_easy_init();
+        if (!u->curl) {
+            fputs("curl_easy_init failed\n",messages());
+            goto abort;
+        }
+        status=pthread_create(&u->thread,NULL,s3_uploader_main,u);
+        if (status) {
+            fprintf(messages(),"pthread_create: %s\n",strerror(status));
+            goto abort;
+        }
+        u->have_thread=1;
+    }
+    sink->ops=&s3_stream_ops;
+    stream=open_stream(sink);
+    if (!stream) {
+        fprintf(messages(),"%s: Can't make a stream: %s\n",
+                path,strerror(errno));
+        goto abort;
+    }
+    *result=sink;
+    return stream;
+
+abort:
+    s3_abandon(sink);
+    s3_close(sink);
+    return NULL;
+
+cleanup:
+    free(response.data);
+    free(escaped_key);
+    s3_free(sink);
+    return NULL;
+}
+
+/*
+ * The inputs' pages, stored or compressed, come to no more than what
+ * their main files and WALs take up on disk plus the margin size_entry
+ * allows zstd and LZ4, so a part size that fits that in s3_max_parts
+ * fits the archive, unless the inputs grow before they're locked.
+ * The part size goes up to that if it has to, or the run is refused
+ * before anything is uploaded.
+ */
+
+static int fit_parts(
+    global_info *g,
+    char const *path)
+{
+    input_info *input,*inputs_end;
+    off_t total,part_size;
+
+    total=0;
+    inputs_end=g->inputs+g->input_cnt;
+    for (input=g->inputs; input<inputs_end; input++) {
+        char const *filename;
+        struct stat stat_buf;
+
+        filename=sqlite3_db_filename(input->conn->db,input->name);
+        if (!stat(sqlite3_filename_database(filename),&stat_buf))
+            total+=stat_buf.st_size;
+        if (!stat(sqlite3_filename_wal(filename),&stat_buf))
+            total+=stat_buf.st_size;
+        total+=0x10000;
+    }
+    total+=total/128+0x100000;
+    part_size=(total/s3_max_parts>>20)+1;
+    if (part_size<=g->part_size)
+        return 0;
+    if (part_size>5120) {
+        fprintf(messages(),"%s: Too big for %d parts of 5 GiB\n",
+                path,s3_max_parts);
+        return -1;
+    }
+    g->part_size=part_size;
+    fprintf(messages(),"%s: Part size raised to %d MiB\n",path,g->part_size);
+    return 0;
+}
+
+#endif
+
+/*
+ * With --max-memory, the output buffers get up to an eighth of it:
+ * fewer uploads in flight for S3, smaller buffers otherwise.
+ */
+
+static void fit_output(
+    global_info *g,
+    int s3)
+{
+    off_t share;
+    int write_buffer;
+
+    if (!g->max_memory)
+        return;
+    share=g->max_memory/8;
+    if (s3) {
+        while (g->upload_cnt>1
+               && (off_t)(g->upload_cnt+1)*g->part_size<<20>share)
+            g->upload_cnt--;
+        g->output_memory=(off_t)(g->upload_cnt+1)*g->part_size<<20;
+        return;
+    }
+    write_buffer=share/((off_t)writer_buffer_cnt<<20);
+    if (!write_buffer && g->direct_output)
+        write_buffer=1;
+    if (g->write_buffer>write_buffer)
+        g->write_buffer=write_buffer;
+    g->output_memory=(off_t)writer_buffer_cnt*g->write_buffer<<20;
+}
+
+static int open_archive(
+    global_info *g,
+    char const *path)
+{
+    struct stat stat_buf;
+    int fd,to_stdout;
+
+#ifdef S3ZIP_S3
+    if (!strncmp(path,"s3://",5) && fit_parts(g,path))
+        return -1;
+#endif
+    fit_output(g,!strncmp(path,"s3://",5));
+    if (!strncmp(path,"s3://",5)) {
+#ifdef S3ZIP_S3
+        g->zip_path=path;
+        g->zip=s3_open(g,path,&g->s3);
+        if (!g->zip)
+            return -1;
+        g->streaming=1;
+        return 0;
+#else
+        fprintf(messages(),"%s: Built without S3 support\n",path);
+        return -1;
+#endif
+    }
+    if (stat(path,&stat_buf)==0) {
+        input_info *input,*inputs_end;
+
+        inputs_end=g->inputs+g->input_cnt;
+        for (input=g->inputs; input<inputs_end; input++) {
+            if (input->dev==stat_buf.st_dev && input->ino==stat_buf.st_ino) {
+                fprintf(messages(),"%s: Conflicts with an input file\n", path);
+                return -1;
+            }
+        }
+    }
+    if (!strcmp(path,"-")) {
+        if (isatty(STDOUT_FILENO)) {
+            fputs("Not writing an archive to a terminal\n",messages());
+            return -1;
+        }
+        g->zip_path="stdout";
+        fd=STDOUT_FILENO;
+        to_stdout=1;
+    } else {
+        g->zip_path=path;
+/*
+ * Direct I/O reads back partly rewritten blocks.
+ */
+        fd=open(path,(g->direct_output ? O_RDWR : O_WRONLY)|O_CREAT|O_TRUNC,
+                0666);
+        if (fd<0) {
+            fprintf(messages(),"%s: open: %s\n",path,strerror(errno));
+            return -1;
+        }
+        to_stdout=0;
+    }
+/*
+ * Anything but a regular file gets the archive written front to back
+ * with no seeking, and is left alone on failure.
+ */
+    if (fstat(fd,&stat_buf)) {
+        fprintf(messages(),"%s: fstat: %s\n",g->zip_path,strerror(errno));
+        if (!to_stdout)
+            close(fd);
+        return -1;
+    }
+    if (S_ISREG(stat_buf.st_mode) && !to_stdout) {
+        g->have_output=1;
+    } else {
+        g->streaming=1;
+    }
+    if (g->direct_output && !S_ISREG(stat_buf.st_mode)) {
+        fprintf(messages(),"%s: Direct I/O needs a regular file\n",
+                g->zip_path);
+        if (!to_stdout)
+            close(fd);
+        return -1;
+    }
+    if (g->write_buffer) {
+        g->zip=writer_open(fd,(size_t)g->write_buffer<<20,
+                           g->direct_output,&g->throttle,g->zip_path);
+        if (!g->zip)
+            return -1;
+    } else if (to_stdout) {
+        g->zip=stdout;
+    } else {
+        g->zip=fdopen(fd,"w");
+        if (!g->zip) {
+            fprintf(messages(),"%s: fdopen: %s\n",path,strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int begin_transaction(
+    global_info *g)
+{
+    int status;
+    int timing;
+    conn_info *conn,*conns_end;
+    sqlite3_stmt *begin=NULL;
+
+    timing=g->stats==stats_json;
+/*
+ * With more than one connection, the BEGINs follow each other
+ * as closely as separate statements allow.  No pages are read
+ * until all of them are done.
+ */
+    conns_end=g->conns+g->conn_cnt;
+    for (conn=g->conns; conn<conns_end; conn++) {
+        phase_time start,end;
+
+        status=sqlite3_prepare_v2(
+            conn->db,begin_sql,sizeof begin_sql,&begin,NULL);
+        if (status!=SQLITE_OK) {
+            fprintf(messages(),"sqlite3_prepare(begin): %s\n",
+                    sqlite3_errmsg(conn->db));
+            goto cleanup;
+        }
+/*
+ * The busy timeout makes this wait for the locks;
+ * only the wall time is worth knowing.
+ */
+        if (timing)
+            read_clocks(&start);
+        status=sqlite3_step(begin);
+        if (timing) {
+            read_clocks(&end);
+            conn->lock_wait=end.wall-start.wall;
+        }
+        if (status!=SQLITE_DONE) {
+            fprintf(messages(),"sqlite3_step(begin): %s\n",
+                    sqlite3_errmsg(conn->db));
+            goto cleanup;
+        }
+        sqlite3_finalize(begin);
+        begin=NULL;
+        conn->have_transaction=1;
+    }
+    return 0;
+
+cleanup:
+    if (begin)
+        sqlite3_finalize(begin);
+    return -1;
+}
+
+static int get_metainfo(
+    global_info *g)
+{
+    int status;
+    input_info *input,*inputs_end;
+    sqlite3 *db=NULL;
+    sqlite3_stmt *metainfo=NULL;
+
+    inputs_end=g->inputs+g->input_cnt;
+    for (input=g->inputs; input<inputs_end; input++) {
+        struct stat stat_buf;
+        struct tm *pieces;
+        time_t mtime;
+        unsigned char const *journal_mode;
+        char const *filename;
+
+        if (input->conn->db!=db) {
+            if (metainfo) {
+                sqlite3_finalize(metainfo);
+                metainfo=NULL;
+            }
+            db=input->conn->db;
+            status=sqlite3_prepare_v2(
+                db,metainfo_sql,sizeof metainfo_sql,&metainfo,NULL);
+            if (status!=SQLITE_OK) {
+                fprintf(messages(),"sqlite3_prepare(metainfo): %s\n",
+                        sqlite3_errmsg(db));
+                goto cleanup;
+            }
+        }
+        status=sqlite3_bind_text(metainfo,1,input->name,-1,SQLITE_STATIC);
+        if (status!=SQLITE_OK) {
+            fprintf(messages(),"sqlite3_bind_text(metainfo): %s\n",
+                    sqlite3_errmsg(db));
+            goto cleanup;
+        }
+        status=sqlite3_step(metainfo);
+        if (status!=SQLITE_ROW) {
+            fprintf(messages(),"sqlite3_step(metainfo): %s\n",
+                    sqlite3_errmsg(db));
+            goto cleanup;
+        }
+        input->page_size=sqlite3_column_int(metainfo,0);
+        input->page_count=sqlite3_column_int64(metainfo,1);
+        journal_mode=sqlite3_column_text(metainfo,2);
+        if (!journal_mode) {
+            fputs("Out of memory or something\n",messages());
+            goto cleanup;
+        }
+        if (input->page_size>0x10000) {
+            fprintf(messages(),"%s: Unsupported page size %d\n",
+                    input->path,input->page_size);
+            goto cleanup;
+        }
+        filename=sqlite3_db_filename(db,input->name);
+/*
+ * stat-ing again because the first time was before we had a lock.
+ */
+        if (stat(sqlite3_filename_database(filename),&stat_buf)) {
+            report_errno(input->path);
+            goto cleanup;
+        }
+        input->file_size=stat_buf.st_size;
+        input->file_mtime=stat_buf.st_mtime;
+        input->file_mtime_nsec=ST_MTIME_NSEC(stat_buf);
+        input->file_dev=stat_buf.st_dev;
+        input->file_ino=stat_buf.st_ino;
+        input->wal=!strcmp((char const *)journal_mode,"wal");
+/*
+ * Descriptors of our own, for read-ahead hints only.  They stay open
+ * until SQLite has closed the files (see close_db).
+ */
+        input->fd=open(sqlite3_filename_database(filename),O_RDONLY);
+        if (input->wal)
+            input->wal_fd=open(sqlite3_filename_wal(filename),O_RDONLY);
+        mtime=stat_buf.st_mtime;
+/*
+ * If in WAL mode, and the WAL file exists and is newer than the main file,
+ * use that mtime instead.
+ */
+        if (input->wal
+                && stat(sqlite3_filename_wal(filename),&stat_buf)==0
+                && stat_buf.st_mtime>mtime) {
+            mtime=stat_buf.st_mtime;
+        }
+        sqlite3_reset(metainfo);
+        pieces=localtime(&mtime);
+        input->dos_mdate=pieces->tm_year-80<<9
+            | pieces->tm_mon+1<<5 & 0x1E0
+            | pieces->tm_mday & 0x1F;
+        input->dos_mtime=pieces->tm_hour<<11
+            | pieces->tm_min<<5 & 0x7E0
+            | pieces->tm_sec>>1 & 0x1F;
+    }
+    sqlite3_finalize(metainfo);
+    metainfo=NULL;
+    return 0;
+
+cleanup:
+    if (metainfo)
+        sqlite3_finalize(metainfo);
+    return -1;
+}
+
+/*
+ * Delta backups: the manifest of a previous run says which inputs
+ * can be archived as deltas and what their pages used to look like.
+ */
+
+static int match_base(
+    global_info *g,
+    char const *base_path)
+{
+    manifest_header const *header;
+    uint8_t const *p,*end;
+    uint32_t entry_cnt,entry_ix;
+    input_info *input,*inputs_end;
+    input_info **by_path=NULL;
+    size_t by_path_mask;
+
+    header=(manifest_header const *)g->base;
+    if (g->base_size<sizeof *header
+            || memcmp(&header->sig,&manifest_sig,sizeof manifest_sig)) {
+        fprintf(messages(),"%s: Not a manifest\n",base_path);
+        return -1;
+    }
+    by_path_mask=index_size(g->input_cnt)-1;
+    by_path=calloc(by_path_mask+1,sizeof (input_info *));
+    if (!by_path) {
+        report_errno("calloc");
+        return -1;
+    }
+    inputs_end=g->inputs+g->input_cnt;
+    for (input=g->inputs; input<inputs_end; input++) {
+        size_t slot;
+
+        slot=(size_t)xxh64(input->path,input->path_len) & by_path_mask;
+        while (by_path[slot])
+            slot=slot+1 & by_path_mask;
+        by_path[slot]=input;
+    }
+    entry_cnt=LOAD32(header->entry_cnt);
+    p=g->base+sizeof (manifest_header);
+    end=g->base+g->base_size;
+    for (entry_ix=0; entry_ix<entry_cnt; entry_ix++) {
+        manifest_entry const *entry;
+        size_t path_len;
+        uint64_t page_count;
+        size_t slot;
+
+        entry=(manifest_entry const *)p;
+        if ((size_t)(end-p)<sizeof (manifest_entry))
+            goto truncated;
+        p+=sizeof (manifest_entry);
+        path_len=LOAD16(entry->path_len);
+        page_count=LOAD64(entry->page_count);
+        if ((size_t)(end-p)<path_len
+                || (uint64_t)(end-p-path_len)/8<page_count)
+            goto truncated;
+        slot=(size_t)xxh64(p,path_len) & by_path_mask;
+        for (; by_path[slot]; slot=slot+1 & by_path_mask) {
+            input=by_path[slot];
+            if (input->base_hashes
+                    || input->path_len!=path_len
+                    || memcmp(input->path,p,path_len)
+                    || (uint32_t)input->page_size!=LOAD32(entry->page_size))
+                continue;
+            if (path_len+delta_suffix_len>0xFFFF) {
+                fprintf(messages(),"%s: Path too long\n",input->path);
+                goto cleanup;
+            }
+            input->entry_path=malloc(path_len+delta_suffix_len+1);
+            if (!input->entry_path) {
+                report_errno("malloc");
+                goto cleanup;
+            }
+            memcpy(input->entry_path,input->path,path_len);
+            memcpy(input->entry_path+path_len,delta_suffix,delta_suffix_len+1);
+            input->entry_path_len=path_len+delta_suffix_len;
+            input->base_page_count=page_count;
+            input->base_fingerprint=LOAD64(entry->fingerprint);
+            input->base_hashes=(ule64 const *)(p+path_len);
+            input->quick=g->quick
+                && LOAD64(entry->dev)==(uint64_t)input->file_dev
+                && LOAD64(entry->ino)==(uint64_t)input->file_ino
+                && LOAD64(entry->file_size)==(uint64_t)input->file_size
+                && LOAD64(entry->mtime)==(uint64_t)input->file_mtime
+                && LOAD32(entry->mtime_nsec)==(uint32_t)input->file_mtime_nsec;
+            break;
+        }
+        p+=path_len+page_count*8;
+    }
+    free(by_path);
+    return 0;
+
+truncated:
+    fprintf(messages(),"%s: Truncated manifest\n",base_path);
+cleanup:
+    free(by_path);
+    return -1;
+}
+
+/*
+ * The manifest given with --since is mapped rather than read,
+ * since it can be large.
+ */
+
+static int load_base(
+    global_info *g)
+{
+    int fd;
+    struct stat stat_buf;
+    void *map;
+
+    if (!g->base_path)
+        return 0;
+    fd=open(g->base_path,O_RDONLY);
+    if (fd<0) {
+        fprintf(messages(),"%s: open: %s\n",g->base_path,strerror(errno));
+        return -1;
+    }
+    if (fstat(fd,&stat_buf)) {
+        fprintf(messages(),"%s: fstat: %s\n",g->base_path,strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (stat_buf.st_size<(off_t)sizeof (manifest_header)) {
+        fprintf(messages(),"%s: Not a manifest\n",g->base_path);
+        close(fd);
+        return -1;
+    }
+    map=mmap(NULL,stat_buf.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if (map==MAP_FAILED) {
+        fprintf(messages(),"%s: mmap: %s\n",g->base_path,strerror(errno));
+        return -1;
+    }
+    g->base=map;
+    g->base_size=stat_buf.st_size;
+    g->base_mapped=1;
+    return match_base(g,g->base_path);
+}
+
+static int write_at(
+    int fd,
+    char const *path,
+    void const *buf,
+    size_t len,
+    off_t offset)
+{
+    uint8_t const *p;
+
+    p=buf;
+    while (len>0) {
+        ssize_t got;
+
+        got=pwrite(fd,p,len,offset);
+        if (got<0) {
+            if (errno==EINTR)
+                continue;
+            fprintf(messages(),"%s: pwrite: %s\n",path,strerror(errno));
+            return -1;
+        }
+        p+=got;
+        len-=got;
+        offset+=got;
+    }
+    return 0;
+}
+
+/*
+ * The new manifest has a fixed place for every input's hashes,
+ * so the workers can fill it in any order.  It's written under
+ * a temporary name and renamed into place when complete, which
+ * also makes it safe to replace the manifest given with --since.
+ * With --verify and no --manifest, it's an anonymous temporary file.
+ */
+
+static int open_manifest(
+    global_info *g)
+{
+    manifest_header header;
+    input_info *input,*inputs_end;
+    off_t offset;
+    size_t path_len;
+
+    if (g->manifest_path) {
+        path_len=strlen(g->manifest_path);
+        g->manifest_tmp=malloc(path_len+sizeof ".tmp");
+        if (!g->manifest_tmp) {
+            report_errno("malloc");
+            return -1;
+        }
+        memcpy(g->manifest_tmp,g->manifest_path,path_len);
+        memcpy(g->manifest_tmp+path_len,".tmp",sizeof ".tmp");
+        g->manifest_fd=open(g->manifest_tmp,O_RDWR | O_CREAT | O_TRUNC,0666);
+        if (g->manifest_fd<0) {
+            fprintf(messages(),"%s: open: %s\n",
+                    g->manifest_tmp,strerror(errno));
+            return -1;
+        }
+    } else if (g->verify) {
+        FILE *spool;
+
+        g->manifest_tmp=malloc(sizeof archive_manifest_path);
+        if (!g->manifest_tmp) {
+            report_errno("malloc");
+            return -1;
+        }
+        memcpy(g->manifest_tmp,archive_manifest_path,
+               sizeof archive_manifest_path);
+        spool=tmpfile();
+        if (!spool) {
+            fprintf(messages(),"tmpfile: %s\n",strerror(errno));
+            return -1;
+        }
+        g->manifest_fd=dup(fileno(spool));
+        fclose(spool);
+        if (g->manifest_fd<0) {
+            fprintf(messages(),"dup: %s\n",strerror(errno));
+            return -1;
+        }
+    } else {
+        return 0;
+    }
+    g->have_manifest=1;
+    header.sig=manifest_sig;
+    STORE32(header.entry_cnt,g->input_cnt);
+    if (write_at(g->manifest_fd,g->manifest_tmp,&header,sizeof header,0))
+        return -1;
+    offset=sizeof header;
+    inputs_end=g->inputs+g->input_cnt;
+    for (input=g->inputs; input<inputs_end; input++) {
+        input->manifest_offset=offset;
+        offset+=sizeof (manifest_entry)+input->path_len+input->page_count*8;
+    }
+    return 0;
+}
+
+static int flush_hashes(
+    worker_info *w)
+{
+    size_t len;
+
+    len=w->hash_cnt*sizeof (ule64);
+    if (len>0) {
+        if (write_at(w->g->manifest_fd,w->g->manifest_tmp,
+                w->hash_buf,len,w->hash_offset))
+            return -1;
+        w->hash_offset+=len;
+        w->hash_cnt=0;
+    }
+    return 0;
+}
+
+static void start_hashes(
+    worker_info *w,
+    input_info *input)
+{
+    xxh64_init(&input->fingerprint);
+    w->hash_cnt=0;
+    w->hash_offset=input->manifest_offset
+        +sizeof (manifest_entry)+input->path_len;
+}
+
+/*
+ * Hash a page, in pgno order.  A page known to be unchanged
+ * can have its hash noted without reading it.
+ */
+
+static int note_hash(
+    worker_info *w,
+    input_info *input,
+    uint64_t hash)
+{
+    fingerprint_add(&input->fingerprint,hash);
+    if (w->g->have_manifest) {
+        STORE64(w->hash_buf[w->hash_cnt],hash);
+        w->hash_cnt++;
+        if (w->hash_cnt==sizeof w->hash_buf/sizeof w->hash_buf[0])
+            return flush_hashes(w);
+    }
+    return 0;
+}
+
+static int note_page(
+    worker_info *w,
+    input_info *input,
+    void const *page_data,
+    uint64_t *hash)
+{
+    *hash=xxh64(page_data,input->page_size);
+    return note_hash(w,input,*hash);
+}
+
+/*
+ * A delta entry starts with its header and bitmap.
+ */
+
+static size_t delta_prefix_size(
+    input_info *input)
+{
+    return sizeof (delta_header)+(size_t)((input->page_count+7)/8);
+}
+
+/*
+ * The header and map of a grouped entry fill whole pages.
+ */
+
+static off_t grouped_prefix_pages(
+    input_info *input)
+{
+    return (off_t)(sizeof (grouped_header)+input->page_count
+                   +input->page_size-1)/input->page_size;
+}
+
+/*
+ * Compute the worst-case compressed size to see if it fits in 32 bits.
+ * If it doesn't, we need to know that in advance.
+ */
+
+static void size_entry(
+    global_info *g,
+    input_info *input)
+{
+    off_t compressed_size;
+    off_t page_cnt;
+    size_t prefix_size;
+
+    if (input->bitmap) {
+        page_cnt=input->changed_cnt;
+        prefix_size=delta_prefix_size(input);
+    } else if (input->groups) {
+        page_cnt=grouped_prefix_pages(input)+input->page_count;
+        prefix_size=0;
+    } else {
+        page_cnt=input->page_count;
+        prefix_size=0;
+    }
+    input->size=prefix_size+page_cnt*input->page_size;
+    switch (input->codec->method) {
+    case method_stored:
+        compressed_size=input->size;
+        break;
+    case method_deflate:
+        compressed_size=page_cnt*
+            (input->page_size+(input->page_size+0xFFFE)/0xFFFF*5);
+        compressed_size+=prefix_size+(prefix_size/0xFFFF+1)*5;
+        if (g->deflater_cnt)
+            compressed_size+=(page_cnt/g->chunk_pages+1)*5;
+        break;
+    default:
+/*
+ * Generous for both zstd and LZ4 frames, which add no more than
+ * a few bytes per 64 KiB block plus the frame header.
+ */
+        compressed_size=input->size+input->size/128+0x10000;
+        break;
+    }
+    input->l64=(input->size>0xFFFFFFFF || compressed_size>0xFFFFFFFF);
+}
+
+/*
+ * For compressible pages, Z_BLOCK consistently yields better compression
+ * than Z_NO_FLUSH, even for freshly VACUUMed databases that ought to have
+ * similar pages grouped together.  If you need an explanation for this,
+ * hire a zlib expert to analyse the problem.
+ *
+ * On the other hand, a run of incompressible pages (from e.g. a large
+ * random blob) should be flushed as seldom as possible in order
+ * to minimise overhead, and there's no point searching for matches
+ * in them either.  Such pages are stored at level 0 with Z_NO_FLUSH.
+ *
+ * So how do you know in advance whether or not a given page is
+ * compressible?  B-tree pages practically always are.  For anything else
+ * (overflow, freelist, and pointer map pages), look at the byte counts.
+ * The sum of their squares is about n*n/256+n for random data of length n,
+ * and grows quickly with any skew.  Data that's close to flat has
+ * already been compressed or encrypted, and LZ77 matches are rare in it.
+ * This costs a small fraction of what deflating the page does.
+ */
+
+static int page_is_raw(
+    uint8_t const *page,
+    int page_size,
+    off_t pgno)
+{
+    uint32_t counts[256];
+    uint64_t sum,limit;
+    int ix;
+
+    switch (page[pgno==1 ? 100 : 0]) {
+    case 2:
+    case 5:
+    case 10:
+    case 13:
+        return 0;
+    }
+    memset(counts,0,sizeof counts);
+    for (ix=0; ix<page_size; ix++)
+        counts[page[ix]]++;
+    sum=0;
+    for (ix=0; ix<256; ix++)
+        sum+=(uint64_t)counts[ix]*counts[ix];
+    limit=(uint64_t)page_size*page_size;
+    limit+=limit/8+256*(uint64_t)page_size;
+    return sum*256<=limit;
+}
+
+/*
+ * Deflate threads take chunks off the queue and compress them.
+ */
+
+static int grow_chunk(
+    chunk_info *chunk,
+    z_stream *deflation)
+{
+    uint8_t *out;
+    size_t out_len;
+
+    out_len=deflation->next_out-chunk->out;
+    out=realloc(chunk->out,chunk->out_size*2);
+    if (!out) {
+        report_errno("realloc");
+        return -1;
+    }
+    chunk->out=out;
+    chunk->out_size*=2;
+    deflation->next_out=out+out_len;
+    deflation->avail_out=chunk->out_size-out_len;
+    return 0;
+}
+
+static int deflate_chunk(
+    deflater_info *d,
+    chunk_info *chunk)
+{
+    int status;
+    int timing;
+    global_info *g;
+    z_stream *deflation;
+    uint8_t *data,*data_end;
+    off_t pgno;
+    phase_time mark;
+
+    g=d->g;
+    timing=g->stats==stats_json;
+    deflation=d->deflation;
+    memset(&mark,0,sizeof mark);
+    if (timing)
+        read_clocks(&mark);
+    if (reset_deflation(deflation))
+        return -1;
+    if (set_level(g,deflation,&d->level,chunk->level))
+        return -1;
+    data=chunk->buf+dict_max;
+    if (chunk->dict_len) {
+        status=deflateSetDictionary(
+            deflation,data-chunk->dict_len,chunk->dict_len);
+        if (status!=Z_OK) {
+            fprintf(messages(),"deflateSetDictionary: error %d\n",status);
+            return -1;
+        }
+    }
+    chunk->crc=0;
+    memset(&chunk->deflate_time,0,sizeof chunk->deflate_time);
+    memset(&chunk->crc_time,0,sizeof chunk->crc_time);
+    deflation->next_out=chunk->out;
+    deflation->avail_out=chunk->out_size;
+    data_end=data+chunk->data_len;
+    pgno=chunk->first_pgno;
+    for (; data<data_end; data+=chunk->page_size,pgno++) {
+        int raw;
+        int level;
+        int flush;
+
+        raw=g->adaptive && page_is_raw(data,chunk->page_size,pgno);
+        if (raw) {
+            level=0;
+        } else {
+            level=chunk->level;
+        }
+/*
+ * The buffer is sized for the worst case, so running out of space
+ * shouldn't happen, but it isn't worth failing over.
+ */
+        if (level!=d->level) {
+            for (;;) {
+                status=deflateParams(deflation,level,g->strategy);
+                if (status==Z_OK)
+                    break;
+                if (status!=Z_BUF_ERROR || deflation->avail_out>0x40000) {
+                    fprintf(messages(),"deflateParams: error %d\n",status);
+                    return -1;
+                }
+                if (grow_chunk(chunk,deflation))
+                    return -1;
+            }
+            d->level=level;
+        }
+        if (data+chunk->page_size<data_end) {
+            if (raw) {
+                flush=Z_NO_FLUSH;
+            } else {
+                flush=Z_BLOCK;
+            }
+        } else {
+            flush=chunk->flush;
+        }
+        deflation->next_in=data;
+        deflation->avail_in=chunk->page_size;
+        for (;;) {
+            status=deflate(deflation,flush);
+            if (status!=Z_OK && status!=Z_STREAM_END && status!=Z_BUF_ERROR) {
+                fprintf(messages(),"deflate: error %d\n",status);
+                return -1;
+            }
+            if (deflation->avail_out)
+                break;
+            if (grow_chunk(chunk,deflation))
+                return -1;
+        }
+        if (timing)
+            lap(&mark,&chunk->deflate_time);
+/*
+ * The page is still in cache from deflate, which isn't true
+ * of a whole chunk.
+ */
+        chunk->crc=crc_update(chunk->crc,data,chunk->page_size);
+        if (timing)
+            lap(&mark,&chunk->crc_time);
+    }
+    chunk->out_len=deflation->next_out-chunk->out;
+    deflation->next_in=nobuf;
+    deflation->avail_in=0;
+    deflation->next_out=nobuf;
+    deflation->avail_out=0;
+    return 0;
+}
+
+static void *deflater_main(
+    void *arg)
+{
+    deflater_info *d;
+    global_info *g;
+
+    d=arg;
+    g=d->g;
+    use_messages(g->messages);
+    pthread_mutex_lock(&g->chunk_lock);
+    for (;;) {
+        chunk_info *chunk;
+        int failed;
+
+        while (!g->chunk_head && !g->stopping)
+            pthread_cond_wait(&g->chunk_work,&g->chunk_lock);
+        chunk=g->chunk_head;
+        if (!chunk)
+            break;
+        g->chunk_head=chunk->next;
+        if (!g->chunk_head)
+            g->chunk_tail=NULL;
+        pthread_mutex_unlock(&g->chunk_lock);
+
+        failed=deflate_chunk(d,chunk);
+        duty_cycle(&g->throttle,&d->duty_mark);
+
+        pthread_mutex_lock(&g->chunk_lock);
+        if (failed) {
+            chunk->state=chunk_failed;
+        } else {
+            chunk->state=chunk_done;
+        }
+        pthread_cond_broadcast(&g->chunk_done);
+    }
+    pthread_mutex_unlock(&g->chunk_lock);
+    return NULL;
+}
+
+static void stop_deflaters(
+    global_info *g)
+{
+    deflater_info *d,*deflaters_end;
+
+    pthread_mutex_lock(&g->chunk_lock);
+    g->stopping=1;
+    pthread_cond_broadcast(&g->chunk_work);
+    pthread_mutex_unlock(&g->chunk_lock);
+    deflaters_end=g->deflaters+g->deflater_cnt;
+    for (d=g->deflaters; d<deflaters_end; d++) {
+        if (d->have_thread) {
+            pthread_join(d->thread,NULL);
+            d->have_thread=0;
+        }
+    }
+}
+
+static int start_deflaters(
+    global_info *g)
+{
+    int status;
+    deflater_info *d,*deflaters_end;
+
+    g->stopping=0;
+    deflaters_end=g->deflaters+g->deflater_cnt;
+    for (d=g->deflaters; d<deflaters_end; d++) {
+        status=pthread_create(&d->thread,NULL,deflater_main,d);
+        if (status) {
+            fprintf(messages(),"pthread_create: %s\n",strerror(status));
+            stop_deflaters(g);
+            return -1;
+        }
+        d->have_thread=1;
+    }
+    return 0;
+}
+
+/*
+ * Each reader keeps a ring of chunks big enough to keep
+ * all the deflate threads busy.
+ */
+
+static void free_chunks(
+    worker_info *w)
+{
+    chunk_info *chunk,*chunks_end;
+
+    chunks_end=w->chunks+w->chunk_cnt;
+    for (chunk=w->chunks; chunk<chunks_end; chunk++) {
+        free(chunk->buf);
+        free(chunk->out);
+    }
+    free(w->chunks);
+    w->chunks=NULL;
+    w->chunk_cnt=0;
+}
+
+static int alloc_chunks(
+    worker_info *w,
+    input_info *input)
+{
+    global_info *g;
+    chunk_info *chunk,*chunks_end;
+    int chunk_cnt;
+
+    g=w->g;
+    chunk_cnt=2*g->deflater_cnt;
+    w->chunks=calloc(chunk_cnt,sizeof (chunk_info));
+    if (!w->chunks) {
+        report_errno("calloc");
+        return -1;
+    }
+    w->chunk_cnt=chunk_cnt;
+    chunks_end=w->chunks+chunk_cnt;
+    for (chunk=w->chunks; chunk<chunks_end; chunk++) {
+        chunk->page_size=input->page_size;
+        chunk->level=input->level;
+        chunk->state=chunk_free;
+        chunk->out_size=(size_t)g->chunk_pages*
+            (input->page_size+(input->page_size+0xFFFE)/0xFFFF*5+8)+64;
+        chunk->buf=malloc(dict_max+(size_t)g->chunk_pages*input->page_size);
+        chunk->out=malloc(chunk->out_size);
+        if (!chunk->buf || !chunk->out) {
+            report_errno("malloc");
+            free_chunks(w);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Only the thread the chunks belong to looks at in_use, so unlike
+ * state it needs no lock.
+ */
+
+static void queue_chunk(
+    global_info *g,
+    chunk_info *chunk)
+{
+    chunk->in_use=1;
+    pthread_mutex_lock(&g->chunk_lock);
+    chunk->state=chunk_queued;
+    chunk->next=NULL;
+    if (g->chunk_tail) {
+        g->chunk_tail->next=chunk;
+    } else {
+        g->chunk_head=chunk;
+    }
+    g->chunk_tail=chunk;
+    pthread_cond_signal(&g->chunk_work);
+    pthread_mutex_unlock(&g->chunk_lock);
+}
+
+static int wait_chunk(
+    global_info *g,
+    chunk_info *chunk)
+{
+    int state;
+
+    pthread_mutex_lock(&g->chunk_lock);
+    while (chunk->state==chunk_queued)
+        pthread_cond_wait(&g->chunk_done,&g->chunk_lock);
+    state=chunk->state;
+    chunk->state=chunk_free;
+    pthread_mutex_unlock(&g->chunk_lock);
+    chunk->in_use=0;
+    return state;
+}
+
+/*
+ * All compressed data goes out through here.  Whatever the worker
+ * was doing until now counts as compressing.
+ */
+
+static int write_output(
+    worker_info *w,
+    void const *buf,
+    size_t len,
+    FILE *out,
+    char const *out_path,
+    off_t *compressed_size)
+{
+    if (len>0) {
+        end_phase(w,phase_compress);
+        if (!fwrite(buf,len,1,out)) {
+            fprintf(messages(),"%s: fwrite: %s\n",out_path,strerror(errno));
+            return -1;
+        }
+        end_phase(w,phase_write);
+        *compressed_size+=len;
+    }
+    return 0;
+}
+
+/*
+ * Note where deflate started afresh: so many bytes into the input's
+ * data, and so many into its compressed data.
+ */
+
+static int add_seek_point(
+    input_info *input,
+    off_t offset,
+    off_t compressed_offset)
+{
+    if (input->seek_cnt==input->seek_size) {
+        size_t size;
+        uint64_t *points;
+
+        size=input->seek_size ? input->seek_size*2 : 64;
+        points=realloc(input->seek_points,size*2*sizeof *points);
+        if (!points) {
+            report_errno("realloc");
+            return -1;
+        }
+        input->seek_points=points;
+        input->seek_size=size;
+    }
+    input->seek_points[input->seek_cnt*2]=offset;
+    input->seek_points[input->seek_cnt*2+1]=compressed_offset;
+    input->seek_cnt++;
+    return 0;
+}
+
+/*
+ * Wait for the oldest chunk and append its output.
+ */
+
+static int retire_chunk(
+    worker_info *w,
+    chunk_info *chunk,
+    FILE *out,
+    char const *out_path,
+    off_t *compressed_size,
+    uint32_t *crc)
+{
+    if (wait_chunk(w->g,chunk)!=chunk_done)
+        return -1;
+    if (w->g->stats==stats_json) {
+        phase_time *times;
+
+        times=w->input->times;
+        times[phase_chunk_deflate].wall+=chunk->deflate_time.wall;
+        times[phase_chunk_deflate].cpu+=chunk->deflate_time.cpu;
+        times[phase_chunk_crc].wall+=chunk->crc_time.wall;
+        times[phase_chunk_crc].cpu+=chunk->crc_time.cpu;
+    }
+    if (chunk->seek_offset
+            && add_seek_point(w->input,chunk->seek_offset,*compressed_size))
+        return -1;
+    if (write_output(w,chunk->out,chunk->out_len,out,out_path,compressed_size))
+        return -1;
+    *crc=crc32_combine(*crc,chunk->crc,chunk->data_len);
+    return 0;
+}
+
+/*
+ * Codecs other than deflate.
+ */
+
+#ifdef S3ZIP_ZSTD
+
+/*
+ * With deflate threads requested, zstd gets the same number
+ * of workers of its own.  A library built without thread support
+ * refuses, and that's fine.
+ */
+
+static int zstd_begin(
+    worker_info *w,
+    input_info *input,
+    FILE *out,
+    char const *out_path,
+    off_t *compressed_size)
+{
+    size_t status;
+
+    if (!w->zstd) {
+        w->zstd=ZSTD_createCCtx();
+        if (!w->zstd) {
+            fputs("ZSTD_createCCtx: Out of memory\n",messages());
+            return -1;
+        }
+    }
+    ZSTD_CCtx_reset(w->zstd,ZSTD_reset_session_and_parameters);
+    status=ZSTD_CCtx_setParameter(
+        w->zstd,ZSTD_c_compressionLevel,input->level);
+    if (ZSTD_isError(status)) {
+        fprintf(messages(),"ZSTD_CCtx_setParameter: %s\n",
+                ZSTD_getErrorName(status));
+        return -1;
+    }
+    if (w->g->deflater_cnt)
+        ZSTD_CCtx_setParameter(w->zstd,ZSTD_c_nbWorkers,w->g->deflater_cnt);
+/*
+ * The digested dictionary is kept for as long as the level stays.
+ */
+    if (w->g->dict_len) {
+        if (w->zstd_dict && w->zstd_dict_level!=input->level) {
+            ZSTD_freeCDict(w->zstd_dict);
+            w->zstd_dict=NULL;
+        }
+        if (!w->zstd_dict) {
+            w->zstd_dict=ZSTD_createCDict(
+                w->g->dict,w->g->dict_len,input->level);
+            if (!w->zstd_dict) {
+                fputs("ZSTD_createCDict: Out of memory\n",messages());
+                return -1;
+            }
+            w->zstd_dict_level=input->level;
+        }
+        status=ZSTD_CCtx_refCDict(w->zstd,w->zstd_dict);
+        if (ZSTD_isError(status)) {
+            fprintf(messages(),"ZSTD_CCtx_refCDict: %s\n",
+                    ZSTD_getErrorName(status));
+            return -1;
+        }
+    }
+    status=ZSTD_CCtx_setPledgedSrcSize(w->zstd,input->size);
+    if (ZSTD_isError(status)) {
+        fprintf(messages(),"ZSTD_CCtx_setPledgedSrcSize: %s\n",
+                ZSTD_getErrorName(status));
+        return -1;
+    }
+    return 0;
+}
+
+static int zstd_run(
+    worker_info *w,
+    ZSTD_inBuffer *in,
+    ZSTD_EndDirective mode,
+    FILE *out,
+    char const *out_path,
+    off_t *compressed_size)
+{
+    size_t status;
+
+    do {
+        ZSTD_outBuffer out_buf;
+
+        out_buf.dst=w->output_buf;
+        out_buf.size=sizeof w->output_buf;
+        out_buf.pos=0;
+        status=ZSTD_compressStream2(w->zstd,&out_buf,in,mode);
+        if (ZSTD_isError(status)) {
+            fprintf(messages(),"ZSTD_compressStream2: %s\n",
+                    ZSTD_getErrorName(status));
+            return -1;
+        }
+        if (write_output(w,w->output_buf,out_buf.pos,
+                out,out_path,compressed_size))
+            return -1;
+    } while (mode==ZSTD_e_end ? status>0 : in->pos<in->size);
+    return 0;
+}
+
+static int zstd_page(
+    worker_info *w,
+    input_info *input,
+    void const *data,
+    size_t len,
+    FILE *out,
+    char const *out_path,
+    off_t *compressed_size)
+{
+    ZSTD_inBuffer in;
+
+    in.src=data;
+    in.size=len;
+    in.pos=0;
+    return zstd_run(w,&in,ZSTD_e_continue,out,out_path,compressed_size);
+}
+
+static int zstd_finish(
+    worker_info *w,
+    input_info *input,
+    FILE *out,
+    char const *out_path,
+    off_t *compressed_size)
+{
+    ZSTD_inBuffer in;
+
+    in.src=nobuf;
+    in.size=0;
+    in.pos=0;
+    return zstd_run(w,&in,ZSTD_e_end,out,out_path,compressed_size);
+}
+
+static void zstd_end(
+    worker_info *w)
+{
+    if (w->zstd) {
+        ZSTD_freeCCtx(w->zstd);
+        w->zstd=NULL;
+    }
+    if (w->zstd_dict) {
+        ZSTD_freeCDict(w->zstd_dict);
+        w->zstd_dict=NULL;
+    }
+}
+
+#endif
+
+#ifdef S3ZIP_LZ4
+
+/*
+ * LZ4 frames with linked 64 KiB blocks, so that matches may reach
+ * back across page boundaries.  Levels from 3 up select LZ4HC.
+ * The output buffer is sized for the worst case of one page,
+ * which also covers the frame header and the end mark, so anything
+ * bigger goes in page-sized pieces.
+ */
+
+static int lz4_begin(
+    worker_info *w,
+    input_info *input,
+    FILE *out,
+    char const *out_path,
+    off_t *compressed_size)
+{
+    size_t status;
+    size_t bound;
+    LZ4F_preferences_t prefs;
+
+    if (!w->lz4) {
+        status=LZ4F_createCompressionContext(&w->lz4,LZ4F_VERSION);
+        if (LZ4F_isError(status)) {
+            fprintf(messages(),"LZ4F_createCompressionContext: %s\n",
+                    LZ4F_getErrorName(status));
+            w->lz4=NULL;
+            return -1;
+        }
+    }
+    memset(&prefs,0,sizeof prefs);
+    prefs.frameInfo.blockSizeID=LZ4F_max64KB;
+    prefs.frameInfo.blockMode=LZ4F_blockLinked;
+    prefs.frameInfo.contentSize=input->size;
+    prefs.compressionLevel=input->level;
+    bound=LZ4F_compressBound(input->page_size,&prefs);
+    if (bound<LZ4F_HEADER_SIZE_MAX)
+        bound=LZ4F_HEADER_SIZE_MAX;
+    if (bound>w->lz4_buf_size) {
+        free(w->lz4_buf);
+        w->lz4_buf=malloc(bound);
+        if (!w->lz4_buf) {
+            report_errno("malloc");
+            w->lz4_buf_size=0;
+            return -1;
+        }
+        w->lz4_buf_size=bound;
+    }
+    status=LZ4F_compressBegin(w->lz4,w->lz4_buf,w->lz4_buf_size,&prefs);
+    if (LZ4F_isError(status)) {
+        fprintf(messages(),"LZ4F_compressBegin: %s\n",
+                LZ4F_getErrorName(status));
+        return -1;
+    }
+    return write_output(w,w->lz4_buf,status,out,out_path,compressed_size);
+}
+
+static int lz4_page(
+    worker_info *w,
+    input_info *input,
+    void const *data,
+    size_t len,
+    FILE *out,
+    char const *out_path,
+    off_t *compressed_size)
+{
+    uint8_t const *p;
+
+    p=data;
+    while (len>0) {
+        size_t piece;
+        size_t status;
+
+        piece=len;
+        if (piece>(size_t)input->page_size)
+            piece=input->page_size;
+        status=LZ4F_compressUpdate(
+            w->lz4,w->lz4_buf,w->lz4_buf_size,p,piece,NULL);
+        if (LZ4F_isError(status)) {
+            fprintf(messages(),"LZ4F_compressUpdate: %s\n",
+                    LZ4F_getErrorName(status));
+            return -1;
+        }
+        if (write_output(w,w->lz4_buf,status,out,out_path,compressed_size))
+            return -1;
+        p+=piece;
+        len-=piece;
+    }
+    return 0;
+}
+
+static int lz4_finish(
+    worker_info *w,
+    input_info *input,
+    FILE *out,
+    char const *out_path,
+    off_t *compressed_size)
+{
+    size_t status;
+
+    status=LZ4F_compressEnd(w->lz4,w->lz4_buf,w->lz4_buf_size,NULL);
+    if (LZ4F_isError(status)) {
+        fprintf(messages(),"LZ4F_compressEnd: %s\n",LZ4F_getErrorName(status));
+        return -1;
+    }
+    return write_output(w,w->lz4_buf,status,out,out_path,compressed_size);
+}
+
+static void lz4_end(
+    worker_info *w)
+{
+    if (w->lz4) {
+        LZ4F_freeCompressionContext(w->lz4);
+        w->lz4=NULL;
+    }
+    free(w->lz4_buf);
+    w->lz4_buf=NULL;
+    w->lz4_buf_size=0;
+}
+
+#endif
+
+static codec_info const codec_stored={
+    "stored", "st", method_stored, version_stored, 0, 0,
+    NULL, NULL, NULL, NULL
+};
+
+static codec_info const codec_deflate={
+    "deflate", "", method_deflate, version_classic, 9, Z_BEST_COMPRESSION,
+    NULL, NULL, NULL, NULL
+};
+
+#ifdef S3ZIP_ZSTD
+static codec_info const codec_zstd={
+    "zstd", "zstd", method_zstd, version_zstd, 22, 3,
+    zstd_begin, zstd_page, zstd_finish, zstd_end
+};
+#endif
+
+#ifdef S3ZIP_LZ4
+static codec_info const codec_lz4={
+    "lz4", "lz4", method_lz4, version_zstd, 12, 0,
+    lz4_begin, lz4_page, lz4_finish, lz4_end
+};
+#endif
+
+static codec_info const *const codecs[]={
+    &codec_stored,
+    &codec_deflate,
+#ifdef S3ZIP_ZSTD
+    &codec_zstd,
+#endif
+#ifdef S3ZIP_LZ4
+    &codec_lz4,
+#endif
+};
+
+enum {
+    codec_cnt           = sizeof codecs/sizeof codecs[0]
+};
+
+/*
+ * Get a page from a sqlite_dbpage row and check it.
+ */
+
+static void const *page_blob(
+    input_info *input,
+    sqlite3_stmt *stmt)
+{
+    void const *page_data;
+
+    page_data=sqlite3_column_blob(stmt,0);
+    if (!page_data) {
+        fputs("Out of memory or something\n",messages());
+        return NULL;
+    }
+    if (sqlite3_column_bytes(stmt,0)!=input->page_size) {
+        fprintf(messages(),"%s: Inconsistent page size\n",input->path);
+        return NULL;
+    }
+    return page_data;
+}
+
+/*
+ * Pages can be had more cheaply than through sqlite_dbpage by reading
+ * the main database file directly, in large pieces, while the shared
+ * lock is held.  That is only right for the pages that have no frames
+ * in the write-ahead log, if there is one.  The file is read through
+ * SQLite's own handle for it: closing a descriptor of our own would
+ * drop every POSIX lock SQLite holds on the file.
+ *
+ * Knowing those pages is also what lets --quick skip the unchanged
+ * ones: an input whose main file has the same identity as recorded
+ * in the base manifest can only differ from the base in the pages
+ * with frames in the log, and in any pages added since.
+ *
+ * probe_wal reads the frame headers through SQLite's handle for the
+ * log, taking every frame with the current salts.  That may include
+ * frames past the last commit, which only costs a few reads through
+ * sqlite_dbpage that weren't needed.  Returns 1 if dirty has been
+ * filled in, 0 if the log couldn't be made sense of.
+ */
+
+enum {
+    wal_header_size     = 32,
+    wal_frame_header_size = 24,
+
+    read_size           = 0x100000,
+    prefetch_size       = 0x800000
+};
+
+static int probe_wal(
+    input_info *input,
+    uint8_t *dirty)
+{
+    sqlite3_file *wal=NULL;
+    sqlite3_int64 wal_size;
+    uint8_t header[wal_header_size],frame[wal_frame_header_size];
+    uint32_t magic;
+    sqlite3_int64 offset;
+
+    if (!input->wal)
+        return 1;
+    if (sqlite3_file_control(input->conn->db,input->name,
+                             SQLITE_FCNTL_JOURNAL_POINTER,&wal)!=SQLITE_OK
+            || !wal || !wal->pMethods)
+        return 0;
+    if (wal->pMethods->xFileSize(wal,&wal_size)!=SQLITE_OK)
+        return 0;
+    if (wal_size<wal_header_size)
+        return 1;
+    if (wal->pMethods->xRead(wal,header,sizeof header,0)!=SQLITE_OK)
+        return 0;
+    magic=(uint32_t)header[0]<<24 | (uint32_t)header[1]<<16
+        | (uint32_t)header[2]<<8 | header[3];
+    if ((magic & 0xFFFFFFFE)!=0x377F0682)
+        return 0;
+    if (((uint32_t)header[8]<<24 | (uint32_t)header[9]<<16
+         | (uint32_t)header[10]<<8 | header[11])!=(uint32_t)input->page_size
+            && !(input->page_size==65536
+                 && header[8]==0 && header[9]==0
+                 && header[10]==0 && header[11]==1))
+        return 0;
+    for (offset=wal_header_size;
+         offset+wal_frame_header_size+input->page_size<=wal_size;
+         offset+=wal_frame_header_size+input->page_size) {
+        uint32_t pgno;
+
+        if (wal->pMethods->xRead(wal,frame,sizeof frame,offset)!=SQLITE_OK)
+            return 0;
+        if (memcmp(frame+8,header+16,8))
+            break;
+        pgno=(uint32_t)frame[0]<<24 | (uint32_t)frame[1]<<16
+            | (uint32_t)frame[2]<<8 | frame[3];
+        if (pgno>=1 && pgno<=input->page_count)
+            dirty[(pgno-1)>>3]|=1<<((pgno-1)&7);
+    }
+    return 1;
+}
+
+/*
+ * A page reader hands out the pages of one input by pgno, each
+ * valid until the next call.  Direct reads cover up to ahead pages
+ * at a time, as long as they are wanted (all of them, if wanted
+ * is null).  Going through sqlite_dbpage, increasing pgno order
+ * is served by a single full scan for as long as it lasts.
+ */
+
+static int page_is_set(
+    uint8_t const *bitmap,
+    off_t pgno)
+{
+    return bitmap[(pgno-1)>>3]>>((pgno-1)&7) & 1;
+}
+
+typedef struct page_reader {
+    worker_info *w;
+    input_info *input;
+    sqlite3_stmt *pages;
+    sqlite3_stmt *page;
+    sqlite3_file *file;
+    int fd;
+    int advise_fd;
+    uint8_t *dirty;
+    uint8_t const *wanted;
+    uint8_t *buf;
+    off_t buf_pgno;
+    off_t buf_cnt;
+    off_t scan_pgno;
+    off_t advised;
+    off_t fetch_pages;
+    uint64_t fetch_time;
+    int ahead;
+    char probed;
+    char sequential;
+} page_reader;
+
+/*
+ * Full scans keep the kernel reading ahead of them, which matters
+ * on network volumes where every page read waits for a round trip.
+ * The hints are given through our own descriptor, so they can only
+ * populate the page cache, not widen the read-ahead window on
+ * SQLite's descriptor.
+ */
+
+static void advise_willneed(
+    int fd,
+    off_t offset,
+    off_t len)
+{
+#if defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(fd,offset,len,POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE)
+    struct radvisory advice;
+
+    if (!len) {
+        struct stat stat_buf;
+
+        if (fstat(fd,&stat_buf))
+            return;
+        len=stat_buf.st_size-offset;
+    }
+    if (len>0x7FFFFFFF)
+        len=0x7FFFFFFF;
+    advice.ra_offset=offset;
+    advice.ra_count=(int)len;
+    fcntl(fd,F_RDADVISE,&advice);
+#else
+    (void)fd;
+    (void)offset;
+    (void)len;
+#endif
+}
+
+static void prefetch(
+    page_reader *r,
+    off_t pgno)
+{
+    input_info *input;
+    off_t offset,end;
+
+    input=r->input;
+    offset=(pgno-1)*(off_t)input->page_size;
+    if (offset+prefetch_size/2<r->advised)
+        return;
+    if (r->advised<offset)
+        r->advised=offset;
+    end=offset+prefetch_size;
+    if (end>input->page_count*(off_t)input->page_size)
+        end=input->page_count*(off_t)input->page_size;
+    if (end>r->advised) {
+        advise_willneed(r->advise_fd,r->advised,end-r->advised);
+        r->advised=end;
+    }
+}
+
+static void close_reader(
+    page_reader *r)
+{
+    throttle_fetches(&r->w->g->throttle,r->fetch_pages,
+                     r->fetch_pages*r->input->page_size,r->fetch_time);
+    r->fetch_pages=0;
+    r->fetch_time=0;
+    if (r->pages)
+        sqlite3_finalize(r->pages);
+    if (r->page)
+        sqlite3_finalize(r->page);
+    free(r->dirty);
+    free(r->buf);
+}
+
+static int open_reader(
+    worker_info *w,
+    input_info *input,
+    page_reader *r,
+    uint8_t const *wanted,
+    int ahead)
+{
+    int status;
+    sqlite3 *db;
+
+    db=input->conn->db;
+    r->w=w;
+    r->input=input;
+    r->pages=NULL;
+    r->page=NULL;
+    r->file=NULL;
+    r->fd=-1;
+    r->advise_fd=input->fd;
+    r->dirty=NULL;
+    r->wanted=wanted;
+    r->buf=NULL;
+    r->buf_pgno=0;
+    r->buf_cnt=0;
+    r->scan_pgno=0;
+    r->advised=0;
+    r->fetch_pages=0;
+    r->fetch_time=0;
+    r->ahead=ahead;
+    r->probed=0;
+    r->sequential=!wanted && ahead>1;
+    status=sqlite3_prepare_v2(db,page_sql,sizeof page_sql,&r->page,NULL);
+    if (status!=SQLITE_OK) {
+        fprintf(messages(),"sqlite3_prepare(page): %s\n",sqlite3_errmsg(db));
+        goto cleanup;
+    }
+    status=sqlite3_bind_text(r->page,1,input->name,-1,SQLITE_STATIC);
+    if (status!=SQLITE_OK) {
+        fprintf(messages(),"sqlite3_bind_text(page): %s\n",sqlite3_errmsg(db));
+        goto cleanup;
+    }
+/*
+ * A capture has every page, and remembers which ones were in the log.
+ */
+    if (input->capture_fd>=0) {
+        r->fd=input->capture_fd;
+        r->advise_fd=r->fd;
+        r->probed=!input->wal || input->capture_dirty;
+        if (input->capture_dirty) {
+            r->dirty=malloc((size_t)((input->page_count+7)/8)+1);
+            if (!r->dirty) {
+                report_errno("malloc");
+                goto cleanup;
+            }
+            memcpy(r->dirty,input->capture_dirty,
+                   (size_t)((input->page_count+7)/8)+1);
+        }
+        r->buf=malloc((size_t)ahead*input->page_size);
+        if (!r->buf) {
+            report_errno("malloc");
+            goto cleanup;
+        }
+        return 0;
+    }
+    if (w->g->direct || input->quick) {
+        r->probed=1;
+        if (input->wal) {
+            r->dirty=calloc((size_t)((input->page_count+7)/8)+1,1);
+            if (!r->dirty) {
+                report_errno("calloc");
+                goto cleanup;
+            }
+            if (!probe_wal(input,r->dirty))
+                r->probed=0;
+        }
+    }
+    if (w->g->direct && r->probed) {
+        if (sqlite3_file_control(db,input->name,
+                                 SQLITE_FCNTL_FILE_POINTER,&r->file)!=SQLITE_OK
+                || !r->file || !r->file->pMethods) {
+            r->file=NULL;
+        } else {
+            r->buf=malloc((size_t)ahead*input->page_size);
+            if (!r->buf) {
+                report_errno("malloc");
+                goto cleanup;
+            }
+        }
+    }
+    if (input->wal_fd>=0 && (!r->file || r->dirty))
+        advise_willneed(input->wal_fd,0,0);
+    if (!r->file && r->sequential) {
+        status=sqlite3_prepare_v2(db,pages_sql,sizeof pages_sql,
+                                  &r->pages,NULL);
+        if (status!=SQLITE_OK) {
+            fprintf(messages(),"sqlite3_prepare(pages): %s\n",
+                    sqlite3_errmsg(db));
+            goto cleanup;
+        }
+        status=sqlite3_bind_text(r->pages,1,input->name,-1,SQLITE_STATIC);
+        if (status!=SQLITE_OK) {
+            fprintf(messages(),"sqlite3_bind_text(pages): %s\n",
+                    sqlite3_errmsg(db));
+            goto cleanup;
+        }
+    }
+    return 0;
+
+cleanup:
+    close_reader(r);
+    return -1;
+}
+
+/*
+ * Every page that isn't already in a buffer is a fetch: a pread
+ * or xRead of as many pages as are wanted ahead, or a step through
+ * sqlite_dbpage.  Each one is paid for, and timed if need be,
+ * and the thread's duty cycle checked every so often.
+ */
+
+static void fetch_start(
+    page_reader *r,
+    off_t cnt,
+    uint64_t *start)
+{
+    throttle_info *t;
+
+    t=&r->w->g->throttle;
+    throttle_io(t,(uint64_t)cnt*r->input->page_size);
+    if (t->latency)
+        *start=monotonic_ns();
+}
+
+static void fetch_end(
+    page_reader *r,
+    off_t cnt,
+    uint64_t start)
+{
+    throttle_info *t;
+
+    t=&r->w->g->throttle;
+    if (t->latency) {
+        r->fetch_time+=monotonic_ns()-start;
+        r->fetch_pages+=cnt;
+        if (r->fetch_pages>=latency_flush_pages) {
+            throttle_fetches(t,r->fetch_pages,
+                             r->fetch_pages*r->input->page_size,
+                             r->fetch_time);
+            r->fetch_pages=0;
+            r->fetch_time=0;
+        }
+    }
+}
+
+static void const *read_page(
+    page_reader *r,
+    off_t pgno)
+{
+    int status;
+    input_info *input;
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    uint64_t start=0;
+
+    input=r->input;
+    db=input->conn->db;
+    input->pages_read++;
+    if (r->w->g->throttle.duty && ++r->w->duty_pages>=duty_check_pages) {
+        r->w->duty_pages=0;
+        duty_cycle(&r->w->g->throttle,&r->w->duty_mark);
+    }
+    if (r->sequential && r->advise_fd>=0)
+        prefetch(r,pgno);
+    if (r->fd>=0) {
+        if (pgno<r->buf_pgno || pgno>=r->buf_pgno+r->buf_cnt) {
+            off_t cnt;
+            size_t len;
+            ssize_t got;
+
+            cnt=1;
+            while (cnt<r->ahead && pgno+cnt<=input->page_count
+                    && (!r->wanted || page_is_set(r->wanted,pgno+cnt)))
+                cnt++;
+            len=(size_t)cnt*input->page_size;
+            fetch_start(r,cnt,&start);
+            got=pread(r->fd,r->buf,len,(pgno-1)*(off_t)input->page_size);
+            fetch_end(r,cnt,start);
+            if (got<0 || (size_t)got!=len) {
+                r->buf_cnt=0;
+                if (got<0) {
+                    fprintf(messages(),"%s: pread: %s\n",
+                            input->path,strerror(errno));
+                } else {
+                    fprintf(messages(),"%s: Inconsistent page count\n",
+                            input->path);
+                }
+                return NULL;
+            }
+            r->buf_pgno=pgno;
+            r->buf_cnt=cnt;
+        }
+        return r->buf+(size_t)(pgno-r->buf_pgno)*input->page_size;
+    }
+    if (r->file && !(r->dirty && page_is_set(r->dirty,pgno))) {
+        if (pgno<r->buf_pgno || pgno>=r->buf_pgno+r->buf_cnt) {
+            off_t cnt;
+
+            cnt=1;
+            while (cnt<r->ahead && pgno+cnt<=input->page_count
+                    && (!r->wanted || page_is_set(r->wanted,pgno+cnt))
+                    && !(r->dirty && page_is_set(r->dirty,pgno+cnt)))
+                cnt++;
+            fetch_start(r,cnt,&start);
+            status=r->file->pMethods->xRead(
+                r->file,
+                r->buf,
+                (int)(cnt*input->page_size),
+                (sqlite3_int64)(pgno-1)*input->page_size);
+            fetch_end(r,cnt,start);
+            if (status!=SQLITE_OK) {
+                r->buf_cnt=0;
+                if (status==SQLITE_IOERR_SHORT_READ) {
+                    fprintf(messages(),"%s: Inconsistent page count\n",
+                            input->path);
+                } else {
+                    fprintf(messages(),"%s: xRead: %s\n",
+                            input->path,sqlite3_errstr(status));
+                }
+                return NULL;
+            }
+            r->buf_pgno=pgno;
+            r->buf_cnt=cnt;
+        }
+        return r->buf+(size_t)(pgno-r->buf_pgno)*input->page_size;
+    }
+    if (r->pages && pgno!=r->scan_pgno+1) {
+        sqlite3_finalize(r->pages);
+        r->pages=NULL;
+    }
+    if (r->pages) {
+        stmt=r->pages;
+        r->scan_pgno=pgno;
+    } else {
+        stmt=r->page;
+        sqlite3_reset(stmt);
+        status=sqlite3_bind_int64(stmt,2,pgno);
+        if (status!=SQLITE_OK) {
+            fprintf(messages(),"sqlite3_bind_int64(page): %s\n",
+                    sqlite3_errmsg(db));
+            return NULL;
+        }
+    }
+    fetch_start(r,1,&start);
+    status=sqlite3_step(stmt);
+    fetch_end(r,1,start);
+    if (status!=SQLITE_ROW) {
+        if (status==SQLITE_DONE) {
+            fprintf(messages(),"%s: Inconsistent page count\n",input->path);
+        } else {
+            fprintf(messages(),"sqlite3_step(page): %s\n",sqlite3_errmsg(db));
+        }
+        return NULL;
+    }
+    return page_blob(input,stmt);
+}
+
+/*
+ * With --capture, each input's main file gets a copy-on-write clone
+ * while the lock is held, and the pages with frames in the log are
+ * written over the clone from sqlite_dbpage.  The clone then holds
+ * the database exactly as the transaction sees it, and the lock can be
+ * given up before any compression: checkpoints and writers only wait
+ * for the cloning.  Without reflinks (FICLONE on Linux, clonefile
+ * on macOS) the main file is copied instead, which is slower but still
+ * much quicker than compressing it.  Clones go next to their databases,
+ * or in the directory given, and are unlinked as soon as they are open.
+ */
+
+static int copy_file(
+    char const *path,
+    int src,
+    int dst)
+{
+    uint8_t *buf;
+    off_t offset;
+
+    buf=malloc(read_size);
+    if (!buf) {
+        report_errno("malloc");
+        return -1;
+    }
+    offset=0;
+    for (;;) {
+        ssize_t got;
+
+        got=pread(src,buf,read_size,offset);
+        if (got<0) {
+            fprintf(messages(),"%s: pread: %s\n",path,strerror(errno));
+            goto cleanup;
+        }
+        if (!got)
+            break;
+        if (pwrite(dst,buf,got,offset)!=got) {
+            fprintf(messages(),"%s: capture: pwrite: %s\n",
+                    path,strerror(errno));
+            goto cleanup;
+        }
+        offset+=got;
+    }
+    free(buf);
+    return 0;
+
+cleanup:
+    free(buf);
+    return -1;
+}
+
+/*
+ * Whatever stops one input from being cloned is likely to stop them
+ * all, so that's said once a run, for the first.
+ */
+
+static void warn_copy(
+    global_info *g,
+    char const *path,
+    int error)
+{
+    if (g->copy_warned)
+        return;
+    fprintf(messages(),"%s: Can't clone (%s), copying\n",path,strerror(error));
+    g->copy_warned=1;
+}
+
+static int clone_file(
+    global_info *g,
+    char const *path,
+    int src,
+    char *tmp_path)
+{
+    int fd;
+    int cloned;
+
+    fd=mkstemp(tmp_path);
+    if (fd<0) {
+        fprintf(messages(),"%s: mkstemp: %s\n",tmp_path,strerror(errno));
+        return -1;
+    }
+#if defined(__APPLE__)
+    close(fd);
+    unlink(tmp_path);
+    cloned=!fclonefileat(src,AT_FDCWD,tmp_path,0);
+    if (cloned) {
+        fd=open(tmp_path,O_RDWR);
+    } else {
+        warn_copy(g,path,errno);
+        fd=open(tmp_path,O_RDWR|O_CREAT|O_EXCL,0600);
+    }
+    if (fd<0) {
+        fprintf(messages(),"%s: open: %s\n",tmp_path,strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+    unlink(tmp_path);
+#elif defined(FICLONE)
+    unlink(tmp_path);
+    cloned=!ioctl(fd,FICLONE,src);
+    if (!cloned)
+        warn_copy(g,path,errno);
+#else
+    unlink(tmp_path);
+    cloned=0;
+#endif
+    if (!cloned && copy_file(path,src,fd)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int capture_input(
+    global_info *g,
+    input_info *input)
+{
+    int status;
+    sqlite3 *db;
+    char const *db_path;
+    char *tmp_path=NULL;
+    size_t len;
+    uint8_t *dirty=NULL;
+    size_t dirty_len;
+    sqlite3_stmt *page=NULL;
+    off_t pgno;
+
+    db=input->conn->db;
+    if (input->fd<0) {
+        fprintf(messages(),"%s: open: %s\n",input->path,strerror(ENOENT));
+        return -1;
+    }
+    db_path=sqlite3_filename_database(sqlite3_db_filename(db,input->name));
+    if (g->capture_dir) {
+        len=strlen(g->capture_dir);
+        tmp_path=malloc(len+23);
+        if (!tmp_path) {
+            report_errno("malloc");
+            goto cleanup;
+        }
+        memcpy(tmp_path,g->capture_dir,len);
+        strcpy(tmp_path+len,"/.s3zip-capture-XXXXXX");
+    } else {
+        len=strlen(db_path);
+        tmp_path=malloc(len+14);
+        if (!tmp_path) {
+            report_errno("malloc");
+            goto cleanup;
+        }
+        memcpy(tmp_path,db_path,len);
+        strcpy(tmp_path+len,"-s3zip-XXXXXX");
+    }
+    input->capture_fd=clone_file(g,input->path,input->fd,tmp_path);
+    if (input->capture_fd<0)
+        goto cleanup;
+    free(tmp_path);
+    tmp_path=NULL;
+    if (!input->wal)
+        return 0;
+
+/*
+ * A log that can't be made sense of means taking every page
+ * through sqlite_dbpage, and no --quick.
+ */
+    dirty_len=(size_t)((input->page_count+7)/8)+1;
+    dirty=calloc(dirty_len,1);
+    if (!dirty) {
+        report_errno("calloc");
+        goto cleanup;
+    }
+    if (!probe_wal(input,dirty)) {
+        memset(dirty,0xFF,dirty_len);
+    } else {
+        input->capture_dirty=dirty;
+    }
+    status=sqlite3_prepare_v2(db,page_sql,sizeof page_sql,&page,NULL);
+    if (status!=SQLITE_OK) {
+        fprintf(messages(),"sqlite3_prepare(page): %s\n",sqlite3_errmsg(db));
+        goto cleanup;
+    }
+    status=sqlite3_bind_text(page,1,input->name,-1,SQLITE_STATIC);
+    if (status!=SQLITE_OK) {
+        fprintf(messages(),"sqlite3_bind_text(page): %s\n",sqlite3_errmsg(db));
+        goto cleanup;
+    }
+    for (pgno=1; pgno<=input->page_count; pgno++) {
+        void const *page_data;
+
+        if (!page_is_set(dirty,pgno))
+            continue;
+        sqlite3_reset(page);
+        status=sqlite3_bind_int64(page,2,pgno);
+        if (status!=SQLITE_OK) {
+            fprintf(messages(),"sqlite3_bind_int64(page): %s\n",
+                    sqlite3_errmsg(db));
+            goto cleanup;
+        }
+        status=sqlite3_step(page);
+        if (status!=SQLITE_ROW) {
+            if (status==SQLITE_DONE) {
+                fprintf(messages(),"%s: Inconsistent page count\n",
+                        input->path);
+            } else {
+                fprintf(messages(),"sqlite3_step(page): %s\n",
+                        sqlite3_errmsg(db));
+            }
+            goto cleanup;
+        }
+        page_data=page_blob(input,page);
+        if (!page_data)
+            goto cleanup;
+        if (pwrite(input->capture_fd,page_data,input->page_size,
+                (pgno-1)*(off_t)input->page_size)!=input->page_size) {
+            fprintf(messages(),"%s: capture: pwrite: %s\n",
+                    input->path,strerror(errno));
+            goto cleanup;
+        }
+    }
+    sqlite3_finalize(page);
+    if (!input->capture_dirty)
+        free(dirty);
+    return 0;
+
+cleanup:
+    if (page)
+        sqlite3_finalize(page);
+    if (dirty && !input->capture_dirty)
+        free(dirty);
+    free(tmp_path);
+    return -1;
+}
+
+static int capture_inputs(
+    global_info *g)
+{
+    input_info *input,*inputs_end;
+
+    inputs_end=g->inputs+g->input_cnt;
+    for (input=g->inputs; input<inputs_end; input++) {
+        if (capture_input(g,input))
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * With --dictionary, page 1 and the rest of the top of the schema
+ * b-tree of up to dict_samples inputs, spread evenly over them,
+ * make the sample.  Only inputs that deflate or zstd will compress
+ * count.  Given any zstd inputs, zstd trains a dictionary from it;
+ * otherwise, or if training fails (as it does on a small sample),
+ * the end of the sample is the dictionary as it is.  Deflate only
+ * ever uses the last 32 KiB of either kind.
+ */
+
+enum {
+    dict_sample_default = 64,
+    dict_tree_pages     = 16,
+    dict_sample_max     = 0x800000
+};
+
+static int dict_eligible(
+    input_info *input)
+{
+    return input->codec->method==method_deflate
+#ifdef S3ZIP_ZSTD
+        || input->codec==&codec_zstd
+#endif
+        ;
+}
+
+static int sample_schema(
+    worker_info *w,
+    input_info *input,
+    uint8_t *samples,
+    size_t *samples_len,
+    size_t *sizes,
+    unsigned int *sample_cnt)
+{
+    page_reader r;
+    off_t queue[dict_tree_pages];
+    int head,tail;
+
+    if (open_reader(w,input,&r,NULL,1))
+        return -1;
+    queue[0]=1;
+    head=0;
+    tail=1;
+    while (head<tail && *samples_len+input->page_size<=dict_sample_max) {
+        uint8_t const *page,*header;
+        off_t pgno;
+        unsigned int cell_cnt,ix;
+
+        pgno=queue[head++];
+        page=read_page(&r,pgno);
+        if (!page)
+            goto cleanup;
+        memcpy(samples+*samples_len,page,input->page_size);
+        *samples_len+=input->page_size;
+        sizes[(*sample_cnt)++]=input->page_size;
+/*
+ * Interior table b-tree pages lead to more schema pages:
+ * a child page number starts each cell, and the rightmost
+ * one is in the header.
+ */
+        header=page+(pgno==1 ? 100 : 0);
+        if (header[0]!=5)
+            continue;
+        cell_cnt=header[3]<<8 | header[4];
+        if (header-page+12+2*cell_cnt>(unsigned int)input->page_size)
+            continue;
+        for (ix=0; ix<=cell_cnt && tail<dict_tree_pages; ix++) {
+            uint8_t const *p;
+            uint32_t child;
+
+            if (ix<cell_cnt) {
+                unsigned int cell;
+
+                cell=header[12+2*ix]<<8 | header[13+2*ix];
+                if (cell+4>(unsigned int)input->page_size)
+                    continue;
+                p=page+cell;
+            } else {
+                p=header+8;
+            }
+            child=(uint32_t)p[0]<<24 | (uint32_t)p[1]<<16
+                | (uint32_t)p[2]<<8 | p[3];
+            if (child>1 && child<=input->page_count)
+                queue[tail++]=child;
+        }
+    }
+    close_reader(&r);
+    return 0;
+
+cleanup:
+    close_reader(&r);
+    return -1;
+}
+
+/*
+ * Shards of one schema tend to have the same page 1 but for its
+ * header, so pages are only taken once, by what follows the first
+ * 100 bytes, latest first, until the dictionary is full.
+ */
+
+static void raw_dictionary(
+    global_info *g,
+    uint8_t const *samples,
+    size_t samples_len,
+    size_t const *sizes,
+    unsigned int sample_cnt,
+    size_t cap)
+{
+    uint64_t kept[dictionary_max/512];
+    unsigned int kept_cnt,ix,kept_ix;
+    size_t end,start;
+
+    kept_cnt=0;
+    start=cap;
+    end=samples_len;
+    for (ix=sample_cnt; ix-->0 && start>0; ) {
+        uint8_t const *page;
+        size_t len;
+        uint64_t hash;
+
+        end-=sizes[ix];
+        page=samples+end;
+        hash=xxh64(page+100,sizes[ix]-100);
+        for (kept_ix=0; kept_ix<kept_cnt; kept_ix++) {
+            if (kept[kept_ix]==hash)
+                break;
+        }
+        if (kept_ix<kept_cnt)
+            continue;
+        kept[kept_cnt++]=hash;
+        len=sizes[ix]<start ? sizes[ix] : start;
+        start-=len;
+        memcpy(g->dict+start,page+sizes[ix]-len,len);
+    }
+    g->dict_len=cap-start;
+    memmove(g->dict,g->dict+start,g->dict_len);
+}
+
+static int build_dictionary(
+    global_info *g)
+{
+    input_info *input,*inputs_end;
+    int eligible_cnt,step,ix;
+    size_t alloc_len,samples_len;
+    uint8_t *samples=NULL;
+    size_t *sizes=NULL;
+    unsigned int sample_cnt;
+    int trained;
+#ifdef S3ZIP_ZSTD
+    int have_zstd=0;
+#endif
+
+    if (!g->dict_samples)
+        return 0;
+    inputs_end=g->inputs+g->input_cnt;
+    eligible_cnt=0;
+    for (input=g->inputs; input<inputs_end; input++) {
+        if (dict_eligible(input))
+            eligible_cnt++;
+#ifdef S3ZIP_ZSTD
+        if (input->codec==&codec_zstd)
+            have_zstd=1;
+#endif
+    }
+    if (!eligible_cnt)
+        return 0;
+    step=(eligible_cnt+g->dict_samples-1)/g->dict_samples;
+    alloc_len=0;
+    ix=0;
+    for (input=g->inputs; input<inputs_end; input++) {
+        if (!dict_eligible(input) || ix++%step)
+            continue;
+        alloc_len+=(size_t)dict_tree_pages*input->page_size;
+        if (alloc_len>=dict_sample_max) {
+            alloc_len=dict_sample_max;
+            break;
+        }
+    }
+    samples=malloc(alloc_len);
+    sizes=malloc(alloc_len/512*sizeof (size_t));
+    if (!samples || !sizes) {
+        report_errno("malloc");
+        goto cleanup;
+    }
+    samples_len=0;
+    sample_cnt=0;
+    ix=0;
+    for (input=g->inputs; input<inputs_end; input++) {
+        if (!dict_eligible(input) || ix++%step)
+            continue;
+        if (samples_len+(size_t)dict_tree_pages*input->page_size>alloc_len)
+            break;
+        if (sample_schema(g->workers,input,samples,&samples_len,
+                sizes,&sample_cnt))
+            goto cleanup;
+    }
+    if (!samples_len) {
+        free(samples);
+        free(sizes);
+        return 0;
+    }
+    g->dict=malloc(dictionary_max);
+    if (!g->dict) {
+        report_errno("malloc");
+        goto cleanup;
+    }
+    trained=0;
+#ifdef S3ZIP_ZSTD
+    if (have_zstd) {
+        size_t status;
+
+        status=ZDICT_trainFromBuffer(
+            g->dict,dictionary_max,samples,sizes,sample_cnt);
+        if (!ZDICT_isError(status)) {
+            g->dict_len=status;
+            trained=1;
+        }
+    }
+#endif
+    if (!trained) {
+        size_t cap;
+
+        cap=dict_max;
+#ifdef S3ZIP_ZSTD
+        if (have_zstd)
+            cap=dictionary_max;
+#endif
+        raw_dictionary(g,samples,samples_len,sizes,sample_cnt,cap);
+    }
+    if (g->stats==stats_text) {
+        fprintf(messages(),"dictionary %s, %lu bytes from %u pages\n",
+                trained ? "trained" : "raw",
+                (unsigned long)g->dict_len,sample_cnt);
+    }
+    free(samples);
+    free(sizes);
+    return 0;
+
+cleanup:
+    free(samples);
+    free(sizes);
+    return -1;
+}
+
+/*
+ * Freelist leaf pages carry no data, so with --free-pages=zero they
+ * are archived as zeros without being read.  The freelist is a chain
+ * of trunk pages, starting from the page 1 header, each listing
+ * leaf pages; trunks are kept as they are.  Anything that doesn't
+ * add up means the map is dropped and every page archived as usual.
+ */
+
+static uint32_t load_be32(
+    uint8_t const *p)
+{
+    return (uint32_t)p[0]<<24 | (uint32_t)p[1]<<16 | (uint32_t)p[2]<<8 | p[3];
+}
+
+static int map_freelist(
+    worker_info *w,
+    input_info *input)
+{
+    page_reader r;
+    uint8_t const *page;
+    uint8_t *seen=NULL;
+    size_t map_len;
+    off_t trunk,free_total,listed;
+    int usable;
+
+    if (open_reader(w,input,&r,NULL,1))
+        return -1;
+    page=read_page(&r,1);
+    if (!page)
+        goto cleanup;
+/*
+ * Trunks hold as many leaves as fit in the page less its reserved
+ * bytes, whose count is byte 20 of the header.
+ */
+    usable=input->page_size-page[20];
+    trunk=load_be32(page+32);
+    free_total=load_be32(page+36);
+    if (!free_total || free_total>=input->page_count) {
+        close_reader(&r);
+        return 0;
+    }
+    map_len=(size_t)((input->page_count+7)/8)+1;
+    input->free_map=calloc(map_len,1);
+    seen=calloc(map_len,1);
+    if (!input->free_map || !seen) {
+        report_errno("calloc");
+        goto cleanup;
+    }
+    listed=0;
+    input->free_cnt=0;
+    while (trunk) {
+        off_t leaf_cnt,ix;
+
+        if (trunk<2 || trunk>input->page_count || page_is_set(seen,trunk)
+                || listed++>=free_total)
+            goto bad;
+        seen[(trunk-1)>>3]|=1<<((trunk-1)&7);
+        page=read_page(&r,trunk);
+        if (!page)
+            goto cleanup;
+        leaf_cnt=load_be32(page+4);
+        if (leaf_cnt>usable/4-2 || listed+leaf_cnt>free_total)
+            goto bad;
+        for (ix=0; ix<leaf_cnt; ix++) {
+            off_t leaf;
+
+            leaf=load_be32(page+8+4*ix);
+            if (leaf<2 || leaf>input->page_count || page_is_set(seen,leaf))
+                goto bad;
+            seen[(leaf-1)>>3]|=1<<((leaf-1)&7);
+            input->free_map[(leaf-1)>>3]|=1<<((leaf-1)&7);
+        }
+        listed+=leaf_cnt;
+        input->free_cnt+=leaf_cnt;
+        trunk=load_be32(page);
+    }
+    if (listed!=free_total)
+        goto bad;
+    close_reader(&r);
+    free(seen);
+    return 0;
+
+bad:
+    fprintf(messages(),"%s: Bad freelist, archiving it as it is\n",
+            input->path);
+    free(input->free_map);
+    input->free_map=NULL;
+    input->free_cnt=0;
+    close_reader(&r);
+    free(seen);
+    return 0;
+
+cleanup:
+    close_reader(&r);
+    free(seen);
+    return -1;
+}
+
+/*
+ * A free page is only ever read to keep an SQL scan going.
+ */
+
+static void const *read_or_zero(
+    page_reader *r,
+    off_t pgno)
+{
+    input_info *input;
+
+    input=r->input;
+    if (!input->free_map || !page_is_set(input->free_map,pgno))
+        return read_page(r,pgno);
+    if (r->pages && !read_page(r,pgno))
+        return NULL;
+    return zero_page;
+}
+
+/*
+ * Hash every page of an input that has a base, and mark the ones
+ * that differ from it.  This costs a full read but no compression,
+ * unless --quick can rule most pages out.  A delta that would include
+ * most of the pages is hardly smaller than a full copy, and a full
+ * copy ends the chain, so the input gets one of those instead.
+ */
+
+static int scan_input(
+    worker_info *w,
+    input_info *input)
+{
+    page_reader r;
+    int quick;
+    off_t pgno,changed_cnt;
+
+    input->bitmap=calloc((size_t)((input->page_count+7)/8)+1,1);
+    if (!input->bitmap) {
+        report_errno("calloc");
+        return -1;
+    }
+    if (open_reader(w,input,&r,NULL,w->g->read_ahead/input->page_size))
+        return -1;
+    quick=input->quick && r.probed;
+    if (quick)
+        r.sequential=0;
+    start_hashes(w,input);
+    changed_cnt=0;
+    for (pgno=1; pgno<=input->page_count; pgno++) {
+        void const *page_data;
+        uint64_t hash;
+
+        if (quick && pgno<=input->base_page_count
+                && !(r.dirty && page_is_set(r.dirty,pgno))) {
+            if (note_hash(w,input,LOAD64(input->base_hashes[pgno-1])))
+                goto cleanup;
+            continue;
+        }
+        page_data=read_or_zero(&r,pgno);
+        if (!page_data)
+            goto cleanup;
+        end_phase(w,phase_fetch);
+        if (note_page(w,input,page_data,&hash))
+            goto cleanup;
+        end_phase(w,phase_hash);
+        if (pgno>input->base_page_count
+                || LOAD64(input->base_hashes[pgno-1])!=hash) {
+            input->bitmap[(pgno-1)>>3]|=1<<((pgno-1)&7);
+            changed_cnt++;
+        }
+    }
+    close_reader(&r);
+    if (flush_hashes(w))
+        return -1;
+    input->hashed=1;
+    input->changed_cnt=changed_cnt;
+    if (!w->g->check_path && changed_cnt*2>input->page_count) {
+        free(input->bitmap);
+        input->bitmap=NULL;
+        input->entry_path[input->path_len]=0;
+        input->entry_path_len=input->path_len;
+    }
+    return 0;
+
+cleanup:
+    close_reader(&r);
+    return -1;
+}
+
+/*
+ * With --group-pages, the pages of a full copy are sorted into groups
+ * by type (see delta.h), so that, say, the leaves of an index come
+ * together instead of being spread among the table pages.  That takes
+ * an extra pass over every page, which is also where the hashes for
+ * a manifest get done, since those must be in pgno order.
+ */
+
+static int page_group(
+    uint8_t const *page,
+    off_t pgno)
+{
+    switch (page[pgno==1 ? 100 : 0]) {
+    case 2:
+        return group_index_interior;
+    case 10:
+        return group_index_leaf;
+    case 5:
+        return group_table_interior;
+    case 13:
+        return group_table_leaf;
+    }
+    return group_other;
+}
+
+static int group_input(
+    worker_info *w,
+    input_info *input)
+{
+    global_info *g;
+    page_reader r;
+    uint8_t *groups;
+    char *entry_path;
+    off_t pgno;
+    int hashing;
+
+    g=w->g;
+    if (input->path_len+grouped_suffix_len>0xFFFF) {
+        fprintf(messages(),"%s: Path too long\n",input->path);
+        return -1;
+    }
+    groups=malloc((size_t)input->page_count);
+    if (!groups) {
+        report_errno("malloc");
+        return -1;
+    }
+    if (open_reader(w,input,&r,NULL,w->g->read_ahead/input->page_size)) {
+        free(groups);
+        return -1;
+    }
+    hashing=g->have_manifest && !input->hashed;
+    if (hashing)
+        start_hashes(w,input);
+    for (pgno=1; pgno<=input->page_count; pgno++) {
+        void const *page_data;
+
+        page_data=read_or_zero(&r,pgno);
+        if (!page_data)
+            goto cleanup;
+        end_phase(w,phase_fetch);
+        groups[pgno-1]=page_group(page_data,pgno);
+        if (hashing) {
+            uint64_t hash;
+
+            if (note_page(w,input,page_data,&hash))
+                goto cleanup;
+            end_phase(w,phase_hash);
+        }
+    }
+    close_reader(&r);
+    if (hashing) {
+        if (flush_hashes(w)) {
+            free(groups);
+            return -1;
+        }
+        input->hashed=1;
+    }
+    entry_path=malloc(input->path_len+grouped_suffix_len+1);
+    if (!entry_path) {
+        report_errno("malloc");
+        free(groups);
+        return -1;
+    }
+    memcpy(entry_path,input->path,input->path_len);
+    memcpy(entry_path+input->path_len,grouped_suffix,grouped_suffix_len+1);
+    if (input->entry_path!=input->path)
+        free(input->entry_path);
+    input->entry_path=entry_path;
+    input->entry_path_len=input->path_len+grouped_suffix_len;
+    input->groups=groups;
+    return 0;
+
+cleanup:
+    close_reader(&r);
+    free(groups);
+    return -1;
+}
+
+/*
+ * The header and map, laid out as the first pages of the entry.
+ */
+
+static uint8_t *grouped_prefix(
+    input_info *input,
+    off_t *prefix_cnt)
+{
+    uint8_t *prefix;
+    grouped_header header;
+
+    *prefix_cnt=grouped_prefix_pages(input);
+    prefix=calloc((size_t)*prefix_cnt,input->page_size);
+    if (!prefix) {
+        report_errno("calloc");
+        return NULL;
+    }
+    header.sig=grouped_sig;
+    STORE32(header.page_size,input->page_size);
+    STORE64(header.page_count,input->page_count);
+    memcpy(prefix,&header,sizeof header);
+    memcpy(prefix+sizeof header,input->groups,(size_t)input->page_count);
+    return prefix;
+}
+
+/*
+ * The pages of one group, for the reader to fetch.
+ */
+
+static void group_bitmap(
+    input_info *input,
+    int group,
+    uint8_t *bitmap)
+{
+    off_t pgno;
+
+    memset(bitmap,0,(size_t)((input->page_count+7)/8)+1);
+    for (pgno=1; pgno<=input->page_count; pgno++) {
+        if (input->groups[pgno-1]==group)
+            bitmap[(pgno-1)>>3]|=1<<((pgno-1)&7);
+    }
+}
+
+/*
+ * Choosing how to compress an input: compress a sample of pages,
+ * spread evenly over the database, with a flush after every page
+ * like the real thing.
+ *
+ * Automatic level selection tries a few levels and settles for
+ * the cheapest one that comes within 3% of the best result.
+ * Automatic storing gives up on compression if the result
+ * at the chosen level saves less than 2%.
+ *
+ * The sample is always deflated.  For other codecs, automatic level
+ * selection means their default level, and the storing decision
+ * uses deflate at level 1 as a cheap measure of compressibility.
+ */
+
+static int const auto_levels[]={ 1, 6, Z_BEST_COMPRESSION };
+
+enum {
+    auto_level_cnt      = sizeof auto_levels/sizeof auto_levels[0]
+};
+
+static int read_sample(
+    worker_info *w,
+    input_info *input,
+    uint8_t *buf,
+    size_t *sample_len)
+{
+    global_info *g;
+    page_reader r;
+    off_t pgno,step;
+    int ix;
+
+    g=w->g;
+    if (open_reader(w,input,&r,NULL,1))
+        return -1;
+    step=input->page_count/g->sample_pages;
+    if (step<1)
+        step=1;
+    *sample_len=0;
+    pgno=1;
+    for (ix=0; ix<g->sample_pages && pgno<=input->page_count; ix++) {
+        void const *page_data;
+
+        page_data=read_page(&r,pgno);
+        if (!page_data)
+            goto cleanup;
+        end_phase(w,phase_fetch);
+        memcpy(buf+*sample_len,page_data,input->page_size);
+        *sample_len+=input->page_size;
+        pgno+=step;
+    }
+    close_reader(&r);
+    return 0;
+
+cleanup:
+    close_reader(&r);
+    return -1;
+}
+
+static int sample_size(
+    worker_info *w,
+    input_info *input,
+    uint8_t const *buf,
+    size_t sample_len,
+    int level,
+    off_t *size)
+{
+    int status;
+    size_t offset;
+
+    if (set_level(w->g,w->deflation,&w->level,level))
+        return -1;
+    *size=0;
+    for (offset=0; offset<sample_len; offset+=input->page_size) {
+        int flush;
+
+        if (offset+input->page_size<sample_len) {
+            flush=Z_BLOCK;
+        } else {
+            flush=Z_FINISH;
+        }
+        w->deflation->next_in=(uint8_t *)buf+offset;
+        w->deflation->avail_in=input->page_size;
+        do {
+            w->deflation->next_out=w->output_buf;
+            w->deflation->avail_out=sizeof w->output_buf;
+            status=deflate(w->deflation,flush);
+            if (status!=Z_OK && status!=Z_STREAM_END && status!=Z_BUF_ERROR) {
+                fprintf(messages(),"deflate: error %d\n",status);
+                return -1;
+            }
+            *size+=w->deflation->next_out-w->output_buf;
+        } while (!w->deflation->avail_out);
+    }
+    return reset_deflation(w->deflation);
+}
+
+static int plan_input(
+    worker_info *w,
+    input_info *input)
+{
+    global_info *g;
+    uint8_t *buf=NULL;
+    size_t sample_len;
+    off_t sizes[auto_level_cnt];
+    int ix;
+    codec_info const *codec;
+
+    g=w->g;
+    if (g->zero_free && map_freelist(w,input))
+        goto cleanup;
+    if (input->base_hashes && scan_input(w,input))
+        goto cleanup;
+    codec=input->codec;
+    if (g->store==store_always || codec->method==method_stored) {
+        input->codec=&codec_stored;
+        input->level=0;
+        return 0;
+    }
+    if (g->group_pages && !input->bitmap && input->page_count>1
+            && group_input(w,input))
+        goto cleanup;
+    input->level=g->level;
+    if (input->level==level_default
+            || input->level==level_auto && codec->method!=method_deflate) {
+        input->level=codec->default_level;
+    } else if (input->level>codec->max_level) {
+        input->level=codec->max_level;
+    }
+    if (input->level!=level_auto && g->store!=store_auto)
+        return 0;
+    buf=malloc((size_t)g->sample_pages*input->page_size);
+    if (!buf) {
+        report_errno("malloc");
+        goto cleanup;
+    }
+    if (read_sample(w,input,buf,&sample_len))
+        goto cleanup;
+    if (!sample_len) {
+        if (input->level==level_auto)
+            input->level=Z_BEST_COMPRESSION;
+        free(buf);
+        return 0;
+    }
+    if (input->level==level_auto) {
+        for (ix=0; ix<auto_level_cnt; ix++) {
+            if (sample_size(w,input,buf,sample_len,auto_levels[ix],sizes+ix))
+                goto cleanup;
+        }
+        for (ix=0; ix<auto_level_cnt-1; ix++) {
+            if (sizes[ix]*100<=sizes[auto_level_cnt-1]*103)
+                break;
+        }
+        input->level=auto_levels[ix];
+    } else {
+        ix=0;
+        if (sample_size(w,input,buf,sample_len,
+                codec->method==method_deflate ? input->level : 1,sizes))
+            goto cleanup;
+    }
+    if (g->store==store_auto && sizes[ix]*100>=(off_t)sample_len*98) {
+        input->codec=&codec_stored;
+        input->level=0;
+    }
+    free(buf);
+    return 0;
+
+cleanup:
+    if (buf)
+        free(buf);
+    return -1;
+}
+
+/*
+ * Run deflate until it stops filling the output buffer,
+ * writing everything it produces.
+ */
+
+static int deflate_out(
+    worker_info *w,
+    int flush,
+    FILE *out,
+    char const *out_path,
+    off_t *compressed_size)
+{
+    int status;
+
+    do {
+        size_t got;
+
+        w->deflation->next_out=w->output_buf;
+        w->deflation->avail_out=sizeof w->output_buf;
+        status=deflate(w->deflation,flush);
+        if (status!=Z_OK && status!=Z_STREAM_END && status!=Z_BUF_ERROR) {
+            fprintf(messages(),"deflate: error %d\n",status);
+            return -1;
+        }
+        got=w->deflation->next_out-w->output_buf;
+        if (write_output(w,w->output_buf,got,out,out_path,compressed_size))
+            return -1;
+    } while (!w->deflation->avail_out);
+    return 0;
+}
+
+/*
+ * Changing the level in mid-stream flushes the current block,
+ * which may take more than one buffer's worth of output.
+ */
+
+static int change_level(
+    worker_info *w,
+    int level,
+    FILE *out,
+    char const *out_path,
+    off_t *compressed_size)
+{
+    int status;
+
+    for (;;) {
+        size_t got;
+
+        w->deflation->next_out=w->output_buf;
+        w->deflation->avail_out=sizeof w->output_buf;
+        status=deflateParams(w->deflation,level,w->g->strategy);
+        got=w->deflation->next_out-w->output_buf;
+        if (write_output(w,w->output_buf,got,out,out_path,compressed_size))
+            return -1;
+        if (status==Z_OK)
+            break;
+        if (status!=Z_BUF_ERROR || !got) {
+            fprintf(messages(),"deflateParams: error %d\n",status);
+            return -1;
+        }
+    }
+    w->level=level;
+    return 0;
+}
+
+/*
+ * Compress and write some data the simple way, without chunks.
+ * The flush mode only matters for deflate.
+ */
+
+static int compress_data(
+    worker_info *w,
+    input_info *input,
+    void const *data,
+    size_t len,
+    int flush,
+    FILE *out,
+    char const *out_path,
+    off_t *compressed_size)
+{
+    codec_info const *codec;
+
+    codec=input->codec;
+    if (codec->method==method_stored)
+        return write_output(w,data,len,out,out_path,compressed_size);
+    if (codec->page)
+        return codec->page(w,input,data,len,out,out_path,compressed_size);
+    w->deflation->next_in=(uint8_t *)data;
+    w->deflation->avail_in=len;
+    return deflate_out(w,flush,out,out_path,compressed_size);
+}
+
+/*
+ * The header and bitmap of a delta go first.
+ */
+
+static int compress_prefix(
+    worker_info *w,
+    input_info *input,
+    FILE *out,
+    char const *out_path,
+    off_t *compressed_size,
+    uint32_t *crc)
+{
+    delta_header header;
+    size_t bitmap_len;
+    int flush;
+
+    header.sig=delta_sig;
+    STORE32(header.page_size,input->page_size);
+    STORE64(header.page_count,input->page_count);
+    STORE64(header.base_page_count,input->base_page_count);
+    STORE64(header.base_fingerprint,input->base_fingerprint);
+    STORE64(header.fingerprint,xxh64_digest(&input->fingerprint));
+    STORE64(header.changed_cnt,input->changed_cnt);
+    bitmap_len=(size_t)((input->page_count+7)/8);
+    *crc=crc_update(*crc,(uint8_t const *)&header,sizeof header);
+    *crc=crc_update(*crc,input->bitmap,bitmap_len);
+    end_phase(w,phase_crc);
+    if (compress_data(w,input,&header,sizeof header,Z_NO_FLUSH,
+            out,out_path,compressed_size))
+        return -1;
+    if (input->changed_cnt) {
+        flush=Z_BLOCK;
+    } else {
+        flush=Z_FINISH;
+    }
+    if (compress_data(w,input,input->bitmap,bitmap_len,flush,
+            out,out_path,compressed_size))
+        return -1;
+    end_phase(w,phase_compress);
+    return 0;
+}
+
+/*
+ * Get, compress, and write the pages of one input,
+ * or for a delta, only the changed ones.  A grouped entry gets its
+ * header and map pages first, then reads the input once per group.
+ */
+
+static int compress_input(
+    worker_info *w,
+    input_info *input,
+    FILE *out,
+    char const *out_path)
+{
+    global_info *g;
+    page_reader r;
+    char have_reader;
+    off_t page_count,archived_cnt,pgno,compressed_size;
+    uint32_t crc;
+    chunk_info *chunk,*prev_chunk;
+    int chunk_ix;
+    size_t chunk_size;
+    codec_info const *codec;
+    int hashing;
+    uint8_t *prefix=NULL,*group_map=NULL;
+    off_t prefix_cnt,prefix_ix;
+    int group;
+
+    g=w->g;
+    have_reader=0;
+    codec=input->codec;
+    compressed_size=0;
+    crc=0;
+    if (codec->method==method_deflate) {
+        if (g->deflater_cnt && !input->bitmap) {
+            if (alloc_chunks(w,input))
+                goto cleanup;
+        } else {
+            if (set_level(g,w->deflation,&w->level,input->level))
+                goto cleanup;
+            if (g->dict_len) {
+                size_t dict_len;
+                int status;
+
+                dict_len=g->dict_len>dict_max ? dict_max : g->dict_len;
+                status=deflateSetDictionary(
+                    w->deflation,g->dict+g->dict_len-dict_len,dict_len);
+                if (status!=Z_OK) {
+                    fprintf(messages(),"deflateSetDictionary: error %d\n",
+                            status);
+                    goto cleanup;
+                }
+            }
+        }
+    } else if (codec->begin) {
+        if (codec->begin(w,input,out,out_path,&compressed_size))
+            goto cleanup;
+    }
+    prefix_cnt=0;
+    group=0;
+    if (input->bitmap) {
+        if (compress_prefix(w,input,out,out_path,&compressed_size,&crc))
+            goto cleanup;
+        archived_cnt=input->changed_cnt;
+        input->archived_cnt=archived_cnt;
+    } else if (input->groups) {
+        prefix=grouped_prefix(input,&prefix_cnt);
+        group_map=malloc((size_t)((input->page_count+7)/8)+1);
+        if (!prefix || !group_map) {
+            if (prefix)
+                report_errno("malloc");
+            goto cleanup;
+        }
+        group_bitmap(input,group,group_map);
+        archived_cnt=prefix_cnt+input->page_count;
+        input->archived_cnt=input->page_count;
+    } else {
+        archived_cnt=input->page_count;
+        input->archived_cnt=archived_cnt;
+    }
+    if (open_reader(w,input,&r,input->groups ? group_map : input->bitmap,
+            w->g->read_ahead/input->page_size))
+        goto cleanup;
+    have_reader=1;
+    hashing=g->have_manifest && !input->hashed;
+    if (hashing)
+        start_hashes(w,input);
+    page_count=0;
+    pgno=0;
+    prefix_ix=0;
+    chunk=NULL;
+    prev_chunk=NULL;
+    chunk_ix=0;
+    chunk_size=(size_t)g->chunk_pages*input->page_size;
+    for (;;) {
+        void const *page_data;
+        int page_size;
+        int raw;
+        int level;
+        int flush;
+
+        if (prefix_ix<prefix_cnt) {
+            page_data=prefix+(size_t)prefix_ix*input->page_size;
+            prefix_ix++;
+        } else {
+            pgno++;
+            if (input->bitmap) {
+                while (pgno<=input->page_count
+                        && !page_is_set(input->bitmap,pgno))
+                    pgno++;
+            } else if (input->groups) {
+                for (;;) {
+                    while (pgno<=input->page_count
+                            && input->groups[pgno-1]!=group)
+                        pgno++;
+                    if (pgno<=input->page_count || group+1==group_cnt)
+                        break;
+                    group++;
+                    pgno=1;
+                    close_reader(&r);
+                    have_reader=0;
+                    group_bitmap(input,group,group_map);
+                    if (open_reader(w,input,&r,group_map,
+                            w->g->read_ahead/input->page_size))
+                        goto cleanup;
+                    have_reader=1;
+                }
+            }
+            if (pgno>input->page_count)
+                break;
+            page_data=read_or_zero(&r,pgno);
+            if (!page_data)
+                goto cleanup;
+            end_phase(w,phase_fetch);
+            __atomic_store_n(&input->pages_done,
+                             input->groups ? page_count+1-prefix_cnt : pgno,
+                             __ATOMIC_RELAXED);
+        }
+        page_size=input->page_size;
+        page_count++;
+        if (page_count>archived_cnt) {
+            fprintf(messages(),"%s: Inconsistent page count\n",input->path);
+            goto cleanup;
+        }
+        if (hashing) {
+            uint64_t hash;
+
+            if (note_page(w,input,page_data,&hash))
+                goto cleanup;
+            end_phase(w,phase_hash);
+        }
+
+/*
+ * Chunked compression: collect pages, and hand each full chunk over
+ * to the deflate threads.  Reusing a chunk means first waiting for
+ * and writing its previous contents, which also keeps the output
+ * in order.
+ */
+        if (w->chunks) {
+            if (!chunk) {
+                chunk=w->chunks+chunk_ix;
+                if (chunk->in_use) {
+                    if (retire_chunk(w,chunk,out,out_path,
+                            &compressed_size,&crc))
+                        goto cleanup;
+                }
+                chunk->data_len=0;
+                chunk->dict_len=0;
+                chunk->seek_offset=0;
+                if (g->seek_pages && page_count>1
+                        && (page_count-1)%g->seek_pages==0) {
+                    chunk->seek_offset=(page_count-1)*page_size;
+                } else if (prev_chunk) {
+                    chunk->dict_len=prev_chunk->data_len;
+                    if (chunk->dict_len>dict_max)
+                        chunk->dict_len=dict_max;
+                    memcpy(chunk->buf+dict_max-chunk->dict_len,
+                           prev_chunk->buf+dict_max+prev_chunk->data_len
+                               -chunk->dict_len,
+                           chunk->dict_len);
+                } else if (g->dict_len) {
+                    chunk->dict_len=g->dict_len;
+                    if (chunk->dict_len>dict_max)
+                        chunk->dict_len=dict_max;
+                    memcpy(chunk->buf+dict_max-chunk->dict_len,
+                           g->dict+g->dict_len-chunk->dict_len,
+                           chunk->dict_len);
+                }
+            }
+            if (!chunk->data_len)
+                chunk->first_pgno=page_count;
+            memcpy(chunk->buf+dict_max+chunk->data_len,page_data,page_size);
+            chunk->data_len+=page_size;
+            if (page_count==archived_cnt
+                    || chunk->data_len==chunk_size) {
+                if (page_count==archived_cnt) {
+                    chunk->flush=Z_FINISH;
+                } else {
+                    chunk->flush=Z_SYNC_FLUSH;
+                }
+                queue_chunk(g,chunk);
+                prev_chunk=chunk;
+                chunk=NULL;
+                chunk_ix++;
+                if (chunk_ix==w->chunk_cnt)
+                    chunk_ix=0;
+            }
+            end_phase(w,phase_compress);
+            continue;
+        }
+
+        crc=crc_update(crc,page_data,page_size);
+        end_phase(w,phase_crc);
+        if (codec->method!=method_deflate) {
+            if (compress_data(w,input,page_data,page_size,Z_NO_FLUSH,
+                    out,out_path,&compressed_size))
+                goto cleanup;
+            end_phase(w,phase_compress);
+            continue;
+        }
+        raw=g->adaptive && page_data!=zero_page
+            && page_is_raw(page_data,page_size,pgno);
+        if (raw) {
+            level=0;
+        } else {
+            level=input->level;
+        }
+        if (level!=w->level) {
+            if (change_level(w,level,out,out_path,&compressed_size))
+                goto cleanup;
+        }
+        if (page_count==archived_cnt) {
+            flush=Z_FINISH;
+        } else if (g->seek_pages && page_count%g->seek_pages==0) {
+            flush=Z_FULL_FLUSH;
+        } else if (raw) {
+            flush=Z_NO_FLUSH;
+        } else {
+            flush=Z_BLOCK;
+        }
+        if (compress_data(w,input,page_data,page_size,flush,
+                out,out_path,&compressed_size))
+            goto cleanup;
+        if (flush==Z_FULL_FLUSH) {
+            off_t offset;
+
+            offset=page_count*(off_t)page_size;
+            if (input->bitmap)
+                offset+=delta_prefix_size(input);
+            if (add_seek_point(input,offset,compressed_size))
+                goto cleanup;
+        }
+        end_phase(w,phase_compress);
+    }
+    close_reader(&r);
+    have_reader=0;
+    if (page_count<archived_cnt) {
+        fprintf(messages(),"%s: Inconsistent page count\n",input->path);
+        goto cleanup;
+    }
+    if (hashing) {
+        if (flush_hashes(w))
+            goto cleanup;
+        input->hashed=1;
+    }
+    if (w->chunks) {
+        int ix;
+
+        for (ix=0; ix<w->chunk_cnt; ix++) {
+            chunk=w->chunks+chunk_ix;
+            if (chunk->in_use) {
+                if (retire_chunk(w,chunk,out,out_path,&compressed_size,&crc))
+                    goto cleanup;
+            }
+            chunk_ix++;
+            if (chunk_ix==w->chunk_cnt)
+                chunk_ix=0;
+        }
+        free_chunks(w);
+    } else if (codec->method==method_deflate) {
+        if (reset_deflation(w->deflation))
+            goto cleanup;
+    } else if (codec->finish) {
+        if (codec->finish(w,input,out,out_path,&compressed_size))
+            goto cleanup;
+    }
+    end_phase(w,phase_compress);
+    __atomic_store_n(&input->pages_done,input->page_count,__ATOMIC_RELAXED);
+    input->compressed_size=compressed_size;
+    input->crc=crc;
+    free(input->bitmap);
+    input->bitmap=NULL;
+    free(input->free_map);
+    input->free_map=NULL;
+    free(input->groups);
+    input->groups=NULL;
+    free(prefix);
+    free(group_map);
+    return 0;
+
+cleanup:
+    if (have_reader)
+        close_reader(&r);
+    free(prefix);
+    free(group_map);
+    if (w->chunks) {
+        chunk_info *chunks_end;
+
+        chunks_end=w->chunks+w->chunk_cnt;
+        for (chunk=w->chunks; chunk<chunks_end; chunk++) {
+            if (chunk->in_use)
+                wait_chunk(g,chunk);
+        }
+        free_chunks(w);
+    }
+    return -1;
+}
+
+static unsigned int entry_version(
+    input_info *input)
+{
+    unsigned int version;
+
+    version=input->codec->version;
+    if (input->streamed && version<version_classic)
+        version=version_classic;
+    if ((input->l64 || input->local_offset>0xFFFFFFFF)
+            && version<version_zip64)
+        version=version_zip64;
+    return version;
+}
+
+/*
+ * The flag bits for deflate say what level was used.
+ * Bit 3 says that a data descriptor follows the data.
+ */
+
+static unsigned int entry_flags(
+    input_info *input)
+{
+    unsigned int flags;
+
+    flags=0;
+    if (input->streamed)
+        flags|=0x0008;
+    if (input->codec->method!=method_deflate)
+        return flags;
+    switch (input->level) {
+    case 1:
+        return flags | 0x0006;
+    case 2:
+        return flags | 0x0004;
+    case 8:
+    case 9:
+        return flags | 0x0002;
+    default:
+        return flags;
+    }
+}
+
+/*
+ * Prepare and write the local header at the current position.
+ * For a streamed entry, the CRC and sizes are left as zero
+ * and go into the data descriptor instead.
+ */
+
+static int write_local_header(
+    global_info *g,
+    input_info *input)
+{
+    local_entry entry;
+    local_zip64 ext;
+    unsigned int version;
+
+    version=entry_version(input);
+    if (input->l64) {
+        STORE16(entry.needed_version,version);
+        STORE32(entry.compressed_size,0xFFFFFFFF);
+        STORE32(entry.size,0xFFFFFFFF);
+        STORE16(entry.extra_len,sizeof (local_zip64));
+
+        STORE16(ext.ext_id,0x0001);
+        STORE16(ext.ext_size,16);
+        if (input->streamed) {
+            STORE64(ext.size,(uint64_t)0);
+            STORE64(ext.compressed_size,(uint64_t)0);
+        } else {
+            STORE64(ext.size,input->size);
+            STORE64(ext.compressed_size,input->compressed_size);
+        }
+    } else if (input->streamed) {
+        STORE16(entry.needed_version,version);
+        STORE32(entry.compressed_size,0);
+        STORE32(entry.size,0);
+        STORE16(entry.extra_len,0);
+    } else {
+        STORE16(entry.needed_version,version);
+        STORE32(entry.compressed_size,input->compressed_size);
+        STORE32(entry.size,input->size);
+        STORE16(entry.extra_len,0);
+    }
+    entry.sig=local_entry_sig;
+    STORE16(entry.flags,entry_flags(input));
+    STORE16(entry.compression,input->codec->method);
+    STORE16(entry.mod_time,input->dos_mtime);
+    STORE16(entry.mod_date,input->dos_mdate);
+    if (input->streamed) {
+        STORE32(entry.crc,0);
+    } else {
+        STORE32(entry.crc,input->crc);
+    }
+    STORE16(entry.path_len,input->entry_path_len);
+
+    if (!fwrite(&entry,sizeof entry,1,g->zip)) {
+        fprintf(messages(),"%s: fwrite: %s\n",g->zip_path,strerror(errno));
+        return -1;
+    }
+    if (!fwrite(input->entry_path,input->entry_path_len,1,g->zip)) {
+        fprintf(messages(),"%s: fwrite: %s\n",g->zip_path,strerror(errno));
+        return -1;
+    }
+    if (input->l64) {
+        if (!fwrite(&ext,sizeof ext,1,g->zip)) {
+            fprintf(messages(),"%s: fwrite: %s\n",g->zip_path,strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static off_t local_header_size(
+    input_info *input)
+{
+    off_t size;
+
+    size=sizeof (local_entry)+input->entry_path_len;
+    if (input->l64)
+        size+=sizeof (local_zip64);
+    return size;
+}
+
+static int write_data_descriptor(
+    global_info *g,
+    input_info *input,
+    off_t *offset)
+{
+    if (input->l64) {
+        data_descriptor64 desc;
+
+        desc.sig=data_descriptor_sig;
+        STORE32(desc.crc,input->crc);
+        STORE64(desc.compressed_size,input->compressed_size);
+        STORE64(desc.size,input->size);
+        if (!fwrite(&desc,sizeof desc,1,g->zip)) {
+            fprintf(messages(),"%s: fwrite: %s\n",g->zip_path,strerror(errno));
+            return -1;
+        }
+        *offset+=sizeof desc;
+    } else {
+        data_descriptor desc;
+
+        desc.sig=data_descriptor_sig;
+        STORE32(desc.crc,input->crc);
+        STORE32(desc.compressed_size,input->compressed_size);
+        STORE32(desc.size,input->size);
+        if (!fwrite(&desc,sizeof desc,1,g->zip)) {
+            fprintf(messages(),"%s: fwrite: %s\n",g->zip_path,strerror(errno));
+            return -1;
+        }
+        *offset+=sizeof desc;
+    }
+    return 0;
+}
+
+/*
+ * Records never straddle blocks, so a full one just gets a successor.
+ */
+
+static int append_central(
+    global_info *g,
+    central_entry const *entry,
+    char const *path,
+    size_t path_len,
+    central_zip64 const *ext,
+    size_t ext_len)
+{
+    size_t record_len;
+    arena_block *block;
+    uint8_t *p;
+
+    record_len=sizeof (central_entry)+path_len+ext_len;
+    block=g->cd_tail;
+    if (!block || block->size-block->used<record_len) {
+        size_t size;
+
+        size=record_len>arena_block_size ? record_len : arena_block_size;
+        block=malloc(sizeof (arena_block)+size);
+        if (!block) {
+            report_errno("malloc");
+            return -1;
+        }
+        block->next=NULL;
+        block->size=size;
+        block->used=0;
+        if (g->cd_tail) {
+            g->cd_tail->next=block;
+        } else {
+            g->cd_head=block;
+        }
+        g->cd_tail=block;
+    }
+    p=(uint8_t *)(block+1)+block->used;
+    memcpy(p,entry,sizeof (central_entry));
+    p+=sizeof (central_entry);
+    memcpy(p,path,path_len);
+    p+=path_len;
+    if (ext_len)
+        memcpy(p,ext,ext_len);
+    block->used+=record_len;
+    g->cd_size+=record_len;
+    return 0;
+}
+
+/*
+ * Our own entries are stored, with their sizes and CRC known up front,
+ * and dated like the newest input.  The dictionary entry goes first.
+ */
+
+static void newest_date(
+    global_info *g,
+    unsigned int *mod_date,
+    unsigned int *mod_time)
+{
+    input_info *input,*inputs_end;
+
+    *mod_date=0;
+    *mod_time=0;
+    inputs_end=g->inputs+g->input_cnt;
+    for (input=g->inputs; input<inputs_end; input++) {
+        if (input->dos_mdate>*mod_date
+                || input->dos_mdate==*mod_date
+                   && input->dos_mtime>*mod_time) {
+            *mod_date=input->dos_mdate;
+            *mod_time=input->dos_mtime;
+        }
+    }
+}
+
+static int stored_local(
+    global_info *g,
+    char const *path,
+    size_t path_len,
+    uint32_t crc,
+    size_t len)
+{
+    local_entry local;
+    unsigned int mod_date,mod_time;
+
+    newest_date(g,&mod_date,&mod_time);
+    local.sig=local_entry_sig;
+    STORE16(local.needed_version,version_stored);
+    STORE16(local.flags,0);
+    STORE16(local.compression,method_stored);
+    STORE16(local.mod_time,mod_time);
+    STORE16(local.mod_date,mod_date);
+    STORE32(local.crc,crc);
+    STORE32(local.compressed_size,len);
+    STORE32(local.size,len);
+    STORE16(local.path_len,path_len);
+    STORE16(local.extra_len,0);
+    if (!fwrite(&local,sizeof local,1,g->zip)
+            || !fwrite(path,path_len,1,g->zip)) {
+        fprintf(messages(),"%s: fwrite: %s\n",g->zip_path,strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int stored_central(
+    global_info *g,
+    char const *path,
+    size_t path_len,
+    uint32_t crc,
+    size_t len,
+    off_t offset)
+{
+    central_entry entry;
+    central_zip64 ext;
+    size_t ext_len;
+    unsigned int version;
+    unsigned int mod_date,mod_time;
+
+    newest_date(g,&mod_date,&mod_time);
+    if (offset>=0xFFFFFFFF) {
+        version=version_zip64;
+        STORE32(entry.local_offset,0xFFFFFFFF);
+        STORE64(ext.data[0],offset);
+        STORE16(ext.ext_id,1);
+        STORE16(ext.ext_size,8);
+        ext_len=offsetof(central_zip64,data)+8;
+    } else {
+        version=version_stored;
+        STORE32(entry.local_offset,offset);
+        ext_len=0;
+    }
+    entry.sig=central_entry_sig;
+    STORE16(entry.creator_version,version | creator_unix);
+    STORE16(entry.needed_version,version);
+    STORE16(entry.flags,0);
+    STORE16(entry.compression,method_stored);
+    STORE16(entry.mod_time,mod_time);
+    STORE16(entry.mod_date,mod_date);
+    STORE32(entry.crc,crc);
+    STORE32(entry.compressed_size,len);
+    STORE32(entry.size,len);
+    STORE16(entry.path_len,path_len);
+    STORE16(entry.extra_len,ext_len);
+    STORE16(entry.comment_len,0);
+    STORE16(entry.first_diskno,0);
+    STORE16(entry.internal_attribs,0);
+    STORE32(entry.external_attribs,(uint32_t)(S_IFREG | 0644)<<16);
+    return append_central(g,&entry,path,path_len,&ext,ext_len);
+}
+
+static int write_stored(
+    global_info *g,
+    char const *path,
+    size_t path_len,
+    void const *data,
+    size_t len,
+    off_t offset)
+{
+    uint32_t crc;
+
+    crc=crc_update(0,data,len);
+    if (stored_local(g,path,path_len,crc,len))
+        return -1;
+    if (len && !fwrite(data,len,1,g->zip)) {
+        fprintf(messages(),"%s: fwrite: %s\n",g->zip_path,strerror(errno));
+        return -1;
+    }
+    return stored_central(g,path,path_len,crc,len,offset);
+}
+
+static int write_dictionary(
+    global_info *g)
+{
+    if (!g->dict_len)
+        return 0;
+    if (write_stored(g,dictionary_path,dictionary_path_len,
+            g->dict,g->dict_len,0))
+        return -1;
+    g->dict_end=sizeof (local_entry)+dictionary_path_len+g->dict_len;
+    return 0;
+}
+
+/*
+ * The fingerprints go in last, which makes the manifest complete.
+ */
+
+static int finish_manifest(
+    global_info *g)
+{
+    input_info *input,*inputs_end;
+
+    inputs_end=g->inputs+g->input_cnt;
+    for (input=g->inputs; input<inputs_end; input++) {
+        manifest_entry entry;
+
+        STORE64(entry.page_count,input->page_count);
+        STORE64(entry.fingerprint,xxh64_digest(&input->fingerprint));
+        STORE64(entry.dev,(uint64_t)input->file_dev);
+        STORE64(entry.ino,(uint64_t)input->file_ino);
+        STORE64(entry.file_size,input->file_size);
+        STORE64(entry.mtime,(uint64_t)input->file_mtime);
+        STORE32(entry.mtime_nsec,input->file_mtime_nsec);
+        STORE32(entry.page_size,input->page_size);
+        STORE16(entry.path_len,input->path_len);
+        STORE16(entry.reserved,0);
+        if (write_at(g->manifest_fd,g->manifest_tmp,
+                &entry,sizeof entry,input->manifest_offset))
+            return -1;
+        if (write_at(g->manifest_fd,g->manifest_tmp,
+                input->path,input->path_len,
+                input->manifest_offset+sizeof entry))
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * With --verify, the manifest follows the inputs, completed early
+ * (close_manifest does the same again, for a manifest file).
+ * It's read back twice, once for the CRC and once to copy it.
+ */
+
+static int write_hashes(
+    global_info *g)
+{
+    input_info *input,*inputs_end;
+    uint8_t *buf;
+    off_t len,done;
+    uint32_t crc;
+    int pass;
+
+    if (!g->verify)
+        return 0;
+    if (finish_manifest(g))
+        return -1;
+    if (!g->streaming && fseeko(g->zip,g->cd_offset,SEEK_SET)) {
+        fprintf(messages(),"%s: fseeko: %s\n",g->zip_path,strerror(errno));
+        return -1;
+    }
+    len=sizeof (manifest_header);
+    inputs_end=g->inputs+g->input_cnt;
+    for (input=g->inputs; input<inputs_end; input++)
+        len+=sizeof (manifest_entry)+input->path_len+input->page_count*8;
+    if (len>=0xFFFFFFFF) {
+        fputs("Manifest too big to go in the archive\n",messages());
+        return -1;
+    }
+    buf=malloc(read_size);
+    if (!buf) {
+        report_errno("malloc");
+        return -1;
+    }
+    crc=0;
+    for (pass=0; pass<2; pass++) {
+        if (pass && stored_local(g,archive_manifest_path,
+                archive_manifest_path_len,crc,len))
+            goto cleanup;
+        for (done=0; done<len; ) {
+            ssize_t got;
+            size_t piece;
+
+            piece=len-done>read_size ? read_size : len-done;
+            got=pread(g->manifest_fd,buf,piece,done);
+            if (got<0) {
+                fprintf(messages(),"%s: pread: %s\n",
+                        g->manifest_tmp,strerror(errno));
+                goto cleanup;
+            }
+            if (!got) {
+                fprintf(messages(),"%s: Short read\n",g->manifest_tmp);
+                goto cleanup;
+            }
+            if (!pass) {
+                crc=crc_update(crc,buf,got);
+            } else if (!fwrite(buf,got,1,g->zip)) {
+                fprintf(messages(),"%s: fwrite: %s\n",
+                        g->zip_path,strerror(errno));
+                goto cleanup;
+            }
+            done+=got;
+        }
+    }
+    free(buf);
+    if (stored_central(g,archive_manifest_path,archive_manifest_path_len,
+            crc,len,g->cd_offset))
+        return -1;
+    g->cd_offset+=sizeof (local_entry)+archive_manifest_path_len+len;
+    g->have_hashes=1;
+    return 0;
+
+cleanup:
+    free(buf);
+    return -1;
+}
+
+/*
+ * With --seekable, the index goes last, after every input (see zipkit.h).
+ * Every entry is in it, so that the page size is known even for
+ * entries with no points, such as stored ones.
+ */
+
+static int write_index(
+    global_info *g)
+{
+    input_info *input,*inputs_end;
+    uint8_t *buf,*p;
+    size_t len;
+    index_header header;
+    int status;
+
+    if (!g->seek_pages)
+        return 0;
+    if (!g->streaming && fseeko(g->zip,g->cd_offset,SEEK_SET)) {
+        fprintf(messages(),"%s: fseeko: %s\n",g->zip_path,strerror(errno));
+        return -1;
+    }
+    inputs_end=g->inputs+g->input_cnt;
+    len=sizeof header;
+    for (input=g->inputs; input<inputs_end; input++)
+        len+=sizeof (index_entry)+input->seek_cnt*sizeof (index_point);
+    buf=malloc(len);
+    if (!buf) {
+        report_errno("malloc");
+        return -1;
+    }
+    header.sig=index_sig;
+    STORE32(header.entry_cnt,g->input_cnt);
+    memcpy(buf,&header,sizeof header);
+    p=buf+sizeof header;
+    for (input=g->inputs; input<inputs_end; input++) {
+        index_entry entry;
+        size_t ix;
+
+        STORE64(entry.local_offset,input->local_offset);
+        STORE32(entry.page_size,input->page_size);
+        STORE32(entry.point_cnt,input->seek_cnt);
+        memcpy(p,&entry,sizeof entry);
+        p+=sizeof entry;
+        for (ix=0; ix<input->seek_cnt; ix++) {
+            index_point point;
+
+            STORE64(point.offset,input->seek_points[ix*2]);
+            STORE64(point.compressed_offset,input->seek_points[ix*2+1]);
+            memcpy(p,&point,sizeof point);
+            p+=sizeof point;
+        }
+    }
+    status=write_stored(g,index_path,index_path_len,buf,len,g->cd_offset);
+    free(buf);
+    if (status)
+        return -1;
+    g->cd_offset+=sizeof (local_entry)+index_path_len+len;
+    g->have_index=1;
+    return 0;
+}
+
+/*
+ * Prepare the central directory entry and save it for later.
+ *
+ * Yes, greater-or-equal comparisons.  Not a bug.
+ */
+
+static int make_central_entry(
+    global_info *g,
+    input_info *input,
+    off_t end_offset)
+{
+    unsigned int version;
+    off_t archived_size,db_size;
+    central_entry entry;
+    central_zip64 ext;
+    size_t ext_len;
+
+    version=entry_version(input);
+    if (input->l64 || input->local_offset>0xFFFFFFFF) {
+        ule64 *ext_data;
+        unsigned int ext_size;
+
+        ext_data=ext.data;
+        if (input->size>=0xFFFFFFFF) {
+            STORE32(entry.size,0xFFFFFFFF);
+            STORE64(*ext_data,input->size);
+            ext_data++;
+        } else {
+            STORE32(entry.size,input->size);
+        }
+        if (input->compressed_size>=0xFFFFFFFF) {
+            STORE32(entry.compressed_size,0xFFFFFFFF);
+            STORE64(*ext_data,input->compressed_size);
+            ext_data++;
+        } else {
+            STORE32(entry.compressed_size,input->compressed_size);
+        }
+        if (input->local_offset>=0xFFFFFFFF) {
+            STORE32(entry.local_offset,0xFFFFFFFF);
+            STORE64(*ext_data,input->local_offset);
+            ext_data++;
+        } else {
+            STORE32(entry.local_offset,input->local_offset);
+        }
+        ext_size=(ext_data-ext.data)*8;
+        STORE16(ext.ext_id,1);
+        STORE16(ext.ext_size,ext_size);
+        ext_len=offsetof(central_zip64,data)+ext_size;
+    } else {
+        STORE32(entry.size,input->size);
+        STORE32(entry.compressed_size,input->compressed_size);
+        STORE32(entry.local_offset,input->local_offset);
+        ext_len=0;
+    }
+    entry.sig=central_entry_sig;
+    STORE16(entry.creator_version,version | creator_unix);
+    STORE16(entry.needed_version,version);
+    STORE16(entry.flags,entry_flags(input));
+    STORE16(entry.compression,input->codec->method);
+    STORE16(entry.mod_time,input->dos_mtime);
+    STORE16(entry.mod_date,input->dos_mdate);
+    STORE32(entry.crc,input->crc);
+    STORE16(entry.path_len,input->entry_path_len);
+    STORE16(entry.extra_len,ext_len);
+    STORE16(entry.comment_len,0);
+    STORE16(entry.first_diskno,0);
+    STORE16(entry.internal_attribs,0);
+    STORE32(entry.external_attribs,input->mode<<16);
+
+    if (append_central(g,&entry,input->entry_path,input->entry_path_len,
+            &ext,ext_len))
+        return -1;
+
+/*
+ * Deltas are measured against the whole database too.
+ */
+    if (g->stats==stats_json)
+        return 0;
+    archived_size=end_offset-input->local_offset
+        +sizeof (central_entry)+input->entry_path_len+ext_len;
+    db_size=input->page_count*input->page_size;
+    if (input->codec->method==method_stored) {
+        fprintf(messages(),"%.6f  st  %s\n",
+                (double)archived_size/db_size,input->entry_path);
+    } else {
+        fprintf(messages(),"%.6f  %s-%d  %s\n",
+                (double)archived_size/db_size,
+                input->codec->tag,input->level,input->entry_path);
+    }
+    return 0;
+}
+
+/*
+ * With --check, the archive's manifest is the base, and each input
+ * is only scanned, which leaves a bitmap of the pages that differ.
+ */
+
+static int check_input(
+    worker_info *w,
+    input_info *input)
+{
+    start_phases(w,input);
+    if (w->g->zero_free && map_freelist(w,input))
+        return -1;
+    if (input->base_hashes && scan_input(w,input))
+        return -1;
+    end_phase(w,phase_plan);
+    return 0;
+}
+
+/*
+ * Worker threads claim inputs in order and compress them
+ * to anonymous temporary files.
+ */
+
+static int spool_input(
+    worker_info *w,
+    input_info *input)
+{
+    start_phases(w,input);
+    if (plan_input(w,input))
+        return -1;
+    end_phase(w,phase_plan);
+    size_entry(w->g,input);
+    input->spool=tmpfile();
+    if (!input->spool) {
+        fprintf(messages(),"tmpfile: %s\n",strerror(errno));
+        return -1;
+    }
+    if (compress_input(w,input,input->spool,"tmpfile"))
+        return -1;
+    if (fflush(input->spool)) {
+        fprintf(messages(),"tmpfile: fflush: %s\n",strerror(errno));
+        return -1;
+    }
+    end_phase(w,phase_write);
+    return 0;
+}
+
+static void *worker_main(
+    void *arg)
+{
+    worker_info *w;
+    global_info *g;
+
+    w=arg;
+    g=w->g;
+    use_messages(g->messages);
+    for (;;) {
+        input_info *input;
+        int failed;
+
+        pthread_mutex_lock(&g->lock);
+        if (g->failed || g->next_input>=g->input_cnt) {
+            pthread_mutex_unlock(&g->lock);
+            break;
+        }
+        input=g->inputs+g->next_input;
+        g->next_input++;
+        pthread_mutex_unlock(&g->lock);
+
+        if (g->check_path) {
+            failed=check_input(w,input);
+        } else {
+            failed=spool_input(w,input);
+        }
+
+        pthread_mutex_lock(&g->lock);
+        if (failed) {
+            input->state=input_failed;
+            g->failed=1;
+        } else {
+            input->state=input_done;
+        }
+        pthread_cond_broadcast(&g->done);
+        pthread_mutex_unlock(&g->lock);
+    }
+    return NULL;
+}
+
+static int copy_spool(
+    global_info *g,
+    input_info *input,
+    uint8_t *buf,
+    size_t buf_size)
+{
+    FILE *spool;
+
+    spool=input->spool;
+    rewind(spool);
+    for (;;) {
+        size_t got;
+
+        got=fread(buf,1,buf_size,spool);
+        if (!got)
+            break;
+        if (!fwrite(buf,got,1,g->zip)) {
+            fprintf(messages(),"%s: fwrite: %s\n",g->zip_path,strerror(errno));
+            return -1;
+        }
+    }
+    if (ferror(spool)) {
+        fprintf(messages(),"tmpfile: fread: %s\n",strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void join_workers(
+    global_info *g)
+{
+    worker_info *w,*workers_end;
+
+    pthread_mutex_lock(&g->lock);
+    g->failed=1;
+    pthread_mutex_unlock(&g->lock);
+    workers_end=g->workers+g->worker_cnt;
+    for (w=g->workers; w<workers_end; w++) {
+        if (w->have_thread) {
+            pthread_join(w->thread,NULL);
+            w->have_thread=0;
+        }
+    }
+}
+
+static int compress_parallel(
+    global_info *g)
+{
+    int status;
+    int timing;
+    input_info *input,*inputs_end;
+    worker_info *w,*workers_end;
+    off_t offset;
+    uint8_t *copy_buf=NULL;
+
+    inputs_end=g->inputs+g->input_cnt;
+    timing=g->stats==stats_json;
+    copy_buf=malloc(0x10000);
+    if (!copy_buf) {
+        report_errno("malloc");
+        goto cleanup;
+    }
+    workers_end=g->workers+g->worker_cnt;
+    for (w=g->workers; w<workers_end; w++) {
+        status=pthread_create(&w->thread,NULL,worker_main,w);
+        if (status) {
+            fprintf(messages(),"pthread_create: %s\n",strerror(status));
+            goto cleanup;
+        }
+        w->have_thread=1;
+    }
+
+/*
+ * The spooled data is complete, so the local header can be written
+ * before it with no need to go back.
+ */
+    offset=g->dict_end;
+    for (input=g->inputs; input<inputs_end; input++) {
+        int state;
+        phase_time mark;
+
+        pthread_mutex_lock(&g->lock);
+        while (input->state==input_pending)
+            pthread_cond_wait(&g->done,&g->lock);
+        state=input->state;
+        pthread_mutex_unlock(&g->lock);
+        if (state!=input_done)
+            goto cleanup;
+
+        if (timing)
+            read_clocks(&mark);
+        input->local_offset=offset;
+        if (write_local_header(g,input))
+            goto cleanup;
+        if (copy_spool(g,input,copy_buf,0x10000))
+            goto cleanup;
+        fclose(input->spool);
+        input->spool=NULL;
+        if (timing)
+            lap(&mark,input->times+phase_write);
+        offset+=local_header_size(input)+input->compressed_size;
+        if (make_central_entry(g,input,offset))
             goto cleanup;
+    }
+    join_workers(g);
+    free(copy_buf);
+    g->cd_offset=offset;
+    return 0;
+
+cleanup:
+    join_workers(g);
+    for (input=g->inputs; input<inputs_end; input++) {
+        if (input->spool) {
+            fclose(input->spool);
+            input->spool=NULL;
+        }
+    }
+    if (copy_buf)
+        free(copy_buf);
+    return -1;
+}
+
+static int compress_serial(
+    global_info *g)
+{
+    worker_info *w;
+    input_info *input,*inputs_end;
+    off_t offset;
+
+    w=g->workers;
+    inputs_end=g->inputs+g->input_cnt;
+    offset=g->dict_end;
+    for (input=g->inputs; input<inputs_end; input++) {
+        start_phases(w,input);
+        if (plan_input(w,input))
+            return -1;
+        end_phase(w,phase_plan);
+        size_entry(g,input);
+/*
+ * When streaming, the local header goes out first with no CRC or sizes,
+ * and a data descriptor follows the data.
+ */
+        input->local_offset=offset;
+        if (g->streaming) {
+            input->streamed=1;
+            if (write_local_header(g,input))
+                return -1;
+            end_phase(w,phase_write);
+            offset+=local_header_size(input);
+            if (compress_input(w,input,g->zip,g->zip_path))
+                return -1;
+            offset+=input->compressed_size;
+            if (write_data_descriptor(g,input,&offset))
+                return -1;
+            end_phase(w,phase_write);
+            if (make_central_entry(g,input,offset))
+                return -1;
+            continue;
+        }
+/*
+ * Writing a preliminary local header followed by the compressed data
+ * and then returning to fill in only the CRC and the compressed size
+ * is too fiddly.  Instead, leave space for the local header and return
+ * to write all of it once everything is known.
+ */
+        offset+=local_header_size(input);
+        if (fseeko(g->zip,offset,SEEK_SET)) {
+            fprintf(messages(),"%s: fseeko: %s\n",g->zip_path,strerror(errno));
+            return -1;
+        }
+        end_phase(w,phase_seek);
+        if (compress_input(w,input,g->zip,g->zip_path))
+            return -1;
+        offset+=input->compressed_size;
+        if (fseeko(g->zip,input->local_offset,SEEK_SET)) {
+            fprintf(messages(),"%s: fseeko: %s\n",g->zip_path,strerror(errno));
+            return -1;
+        }
+        end_phase(w,phase_seek);
+        if (write_local_header(g,input))
+            return -1;
+        end_phase(w,phase_write);
+        if (make_central_entry(g,input,offset))
+            return -1;
+    }
+    g->cd_offset=offset;
+    return 0;
+}
+
+static void json_string(
+    FILE *out,
+    char const *s)
+{
+    putc('"',out);
+    for (; *s; s++) {
+        unsigned char c;
+
+        c=*s;
+        if (c=='"' || c=='\\') {
+            putc('\\',out);
+            putc(c,out);
+        } else if (c<0x20) {
+            fprintf(out,"\\u%04x",c);
+        } else {
+            putc(c,out);
+        }
+    }
+    putc('"',out);
+}
+
+/*
+ * Progress reports come from a thread of their own, so all the page
+ * loop has to do is store how far it has got.  Standard error gets
+ * a line of text per report.  A file is replaced by a JSON object
+ * every time, and a descriptor (fd:n) gets one JSON object per line.
+ */
+
+static void report_progress(
+    global_info *g)
+{
+    input_info *input,*inputs_end,*current;
+    off_t pages_done,bytes_done;
+    struct timespec ts;
+    double elapsed,rate,eta;
+    FILE *out;
+
+    pages_done=0;
+    bytes_done=0;
+    current=NULL;
+    inputs_end=g->inputs+g->input_cnt;
+    for (input=g->inputs; input<inputs_end; input++) {
+        off_t done;
+
+        done=__atomic_load_n(&input->pages_done,__ATOMIC_RELAXED);
+        pages_done+=done;
+        bytes_done+=done*input->page_size;
+        if (!current && done>0 && done<input->page_count)
+            current=input;
+    }
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    elapsed=ts.tv_sec-g->progress_start.tv_sec
+        +(ts.tv_nsec-g->progress_start.tv_nsec)/1e9;
+    rate=0;
+    if (elapsed>0)
+        rate=bytes_done/elapsed;
+    eta=-1;
+    if (rate>0)
+        eta=(g->progress_bytes-bytes_done)/rate;
+    if (!g->progress_path) {
+        fprintf(messages(),"%5.1f%%  %lld/%lld pages  %.1f MB/s  ",
+                g->progress_bytes ? 100.0*bytes_done/g->progress_bytes : 100.0,
+                (long long)pages_done,(long long)g->progress_pages,
+                rate/1e6);
+        if (eta>=0) {
+            long secs;
+
+            secs=(long)(eta+0.5);
+            fprintf(messages(),"ETA %ld:%02ld:%02ld",
+                    secs/3600,secs/60%60,secs%60);
+        } else {
+            fputs("ETA -:--:--",messages());
+        }
+        if (current)
+            fprintf(messages(),"  %s",current->path);
+        putc('\n',messages());
+        return;
+    }
+    if (g->progress_fd>=0) {
+        out=g->progress_out;
+    } else {
+        out=fopen(g->progress_tmp,"w");
+        if (!out) {
+            fprintf(messages(),"%s: fopen: %s\n",
+                    g->progress_tmp,strerror(errno));
+            return;
+        }
+    }
+    fprintf(out,"{\"pages_done\": %lld, \"pages_total\": %lld,"
+            " \"bytes_done\": %lld, \"bytes_total\": %lld,"
+            " \"elapsed\": %.3f, \"bytes_per_sec\": %.0f, \"eta\": ",
+            (long long)pages_done,(long long)g->progress_pages,
+            (long long)bytes_done,(long long)g->progress_bytes,
+            elapsed,rate);
+    if (eta>=0) {
+        fprintf(out,"%.0f",eta);
+    } else {
+        fputs("null",out);
+    }
+    fputs(", \"input\": ",out);
+    if (current) {
+        json_string(out,current->path);
+    } else {
+        fputs("null",out);
+    }
+    fputs("}\n",out);
+    if (g->progress_fd>=0) {
+        if (fflush(out)) {
+            fprintf(messages(),"%s: fflush: %s\n",
+                    g->progress_path,strerror(errno));
+        }
+        return;
+    }
+    if (fclose(out)) {
+        fprintf(messages(),"%s: fclose: %s\n",g->progress_tmp,strerror(errno));
+        return;
+    }
+    if (rename(g->progress_tmp,g->progress_path))
+        fprintf(messages(),"%s: rename: %s\n",g->progress_tmp,strerror(errno));
+}
+
+static void *progress_main(
+    void *arg)
+{
+    global_info *g;
+    struct timespec deadline;
+
+    g=arg;
+    pthread_mutex_lock(&g->progress_lock);
+    clock_gettime(CLOCK_REALTIME,&deadline);
+    for (;;) {
+        int status;
+
+        deadline.tv_sec+=g->progress_interval;
+        status=0;
+        while (!g->progress_stopping && status!=ETIMEDOUT) {
+            status=pthread_cond_timedwait(
+                &g->progress_wake,&g->progress_lock,&deadline);
+        }
+        if (g->progress_stopping)
+            break;
+        pthread_mutex_unlock(&g->progress_lock);
+        report_progress(g);
+        pthread_mutex_lock(&g->progress_lock);
+    }
+    pthread_mutex_unlock(&g->progress_lock);
+    return NULL;
+}
+
+/*
+ * The totals are known once get_metainfo is done.
+ */
+
+static int start_progress(
+    global_info *g)
+{
+    int status;
+    input_info *input,*inputs_end;
+
+    if (!g->progress)
+        return 0;
+    g->progress_pages=0;
+    g->progress_bytes=0;
+    inputs_end=g->inputs+g->input_cnt;
+    for (input=g->inputs; input<inputs_end; input++) {
+        g->progress_pages+=input->page_count;
+        g->progress_bytes+=input->page_count*input->page_size;
+    }
+    if (g->progress_fd>=0) {
+        g->progress_out=fdopen(g->progress_fd,"w");
+        if (!g->progress_out) {
+            fprintf(messages(),"%s: fdopen: %s\n",
+                    g->progress_path,strerror(errno));
+            return -1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC,&g->progress_start);
+    g->progress_stopping=0;
+    status=pthread_create(&g->progress_thread,NULL,progress_main,g);
+    if (status) {
+        fprintf(messages(),"pthread_create: %s\n",strerror(status));
+        if (g->progress_out) {
+            fclose(g->progress_out);
+            g->progress_out=NULL;
+        }
+        return -1;
+    }
+    g->have_progress_thread=1;
+    return 0;
+}
+
+/*
+ * One last report says how far it got, whether or not it all worked.
+ */
+
+static void stop_progress(
+    global_info *g)
+{
+    if (!g->have_progress_thread)
+        return;
+    pthread_mutex_lock(&g->progress_lock);
+    g->progress_stopping=1;
+    pthread_cond_signal(&g->progress_wake);
+    pthread_mutex_unlock(&g->progress_lock);
+    pthread_join(g->progress_thread,NULL);
+    g->have_progress_thread=0;
+    report_progress(g);
+    if (g->progress_out) {
+        fclose(g->progress_out);
+        g->progress_out=NULL;
+    }
+}
+
+static int compress_inputs(
+    global_info *g)
+{
+    int status;
+
+    if (write_dictionary(g))
+        return -1;
+    if (start_progress(g))
+        return -1;
+    if (start_deflaters(g)) {
+        stop_progress(g);
+        return -1;
+    }
+    if (g->worker_cnt>1) {
+        status=compress_parallel(g);
+    } else {
+        status=compress_serial(g);
+    }
+    stop_deflaters(g);
+    stop_progress(g);
+    if (!status && (write_hashes(g) || write_index(g)))
+        status=-1;
+    return status;
+}
+
+/*
+ * The rest of a --max-memory budget: SQLite's page caches get up to
+ * a quarter of it, through cache_size and a soft heap limit, and what's
+ * left goes to the workers, each with its deflate stream, its read
+ * buffer and, with deflate threads, a ring of chunks, and to the deflate
+ * threads.  Whatever doesn't fit costs deflate threads first, then
+ * workers, then read-ahead, then zlib's memLevel and window size.
+ * Small allocations (bitmaps, hashes, the central directory) don't
+ * count, and zstd takes what it needs on top.
+ */
+
+enum {
+    cache_page_overhead = 0x100,
+    cache_pages_min     = 16,
+    read_ahead_min      = 0x10000,
+    mem_level_min       = 4,
+    window_bits_min     = 12
+};
+
+static off_t worker_memory(
+    global_info *g,
+    off_t page_size)
+{
+    off_t size;
+
+    size=g->read_ahead+page_size;
+    if (g->check_path)
+        return size;
+    size+=deflate_memory(g->window_bits,g->mem_level);
+    if (g->deflater_cnt) {
+        size+=2*g->deflater_cnt*(dict_max+64
+            +g->chunk_pages*(2*page_size+(page_size+0xFFFE)/0xFFFF*5+8));
+    }
+    return size;
+}
+
+static int fit_memory(
+    global_info *g)
+{
+    input_info *input,*inputs_end;
+    off_t page_size,cache_pages,sqlite_memory,need;
+
+    g->read_ahead=read_size;
+    if (!g->max_memory)
+        return 0;
+    page_size=512;
+    inputs_end=g->inputs+g->input_cnt;
+    for (input=g->inputs; input<inputs_end; input++) {
+        if (input->page_size>page_size)
+            page_size=input->page_size;
+    }
+    cache_pages=g->max_memory/4/g->input_cnt/(page_size+cache_page_overhead);
+    if (cache_pages<cache_pages_min)
+        cache_pages=cache_pages_min;
+    if (!g->cache_size || g->cache_size>cache_pages)
+        g->cache_size=cache_pages;
+    sqlite_memory=(off_t)g->cache_size*g->input_cnt
+        *(page_size+cache_page_overhead);
+/*
+ * The limit is the whole process's, so a daemon leaves it alone.
+ */
+    if (!g->warm)
+        sqlite3_soft_heap_limit64(sqlite_memory);
+    for (input=g->inputs; input<inputs_end; input++) {
+        if (tune_input(g,input))
+            return -1;
+    }
+    for (;;) {
+        need=g->output_memory+sqlite_memory
+            +g->worker_cnt*worker_memory(g,page_size);
+        if (!g->check_path) {
+            need+=g->deflater_cnt
+                *(off_t)deflate_memory(g->window_bits,g->mem_level);
+        }
+        if (need<=g->max_memory)
+            break;
+/*
+ * A single deflate thread is no better than none (see make_global).
+ */
+        if (g->deflater_cnt>2) {
+            g->deflater_cnt/=2;
+        } else if (g->deflater_cnt) {
+            g->deflater_cnt=0;
+        } else if (g->worker_cnt>1) {
+            g->worker_cnt--;
+        } else if (g->read_ahead>read_ahead_min) {
+            g->read_ahead/=2;
+        } else if (g->check_path) {
+            break;
+        } else if (g->mem_level>mem_level_min) {
+            g->mem_level--;
+        } else if (g->window_bits>window_bits_min) {
+            g->window_bits--;
+        } else {
+            break;
+        }
+    }
+    if (need>g->max_memory) {
+        fprintf(messages(),"Memory budget too small, %lld MiB needed\n",
+                (long long)(need+0xFFFFF)>>20);
+        return -1;
+    }
+    if (g->stats==stats_text) {
+        fprintf(messages(),"memory %lld MiB: %d jobs, %d threads,"
+                " cache %d pages, read-ahead %d KiB,"
+                " deflate window %d, memLevel %d\n",
+                (long long)g->max_memory>>20,g->worker_cnt,g->deflater_cnt,
+                g->cache_size,g->read_ahead>>10,1<<g->window_bits,
+                g->mem_level);
+    }
+    return 0;
+}
+
+/*
+ * The actual peak, as the kernel saw it.  On Linux that's VmHWM, since
+ * ru_maxrss carries over the peak of whatever process exec'd us.
+ */
+
+static off_t peak_rss(void)
+{
+    struct rusage usage;
+#ifdef __linux__
+    FILE *status;
+    char line[128];
+    long long kib;
+
+    kib=-1;
+    status=fopen("/proc/self/status","r");
+    if (status) {
+        while (fgets(line,sizeof line,status)) {
+            if (sscanf(line,"VmHWM: %lld",&kib)==1)
+                break;
+        }
+        fclose(status);
+    }
+    if (kib>=0)
+        return (off_t)kib<<10;
+#endif
+
+    if (getrusage(RUSAGE_SELF,&usage))
+        return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss;
+#else
+    return (off_t)usage.ru_maxrss<<10;
+#endif
+}
+
+static void rollback_transaction(
+    global_info *g)
+{
+    int status;
+    conn_info *conn,*conns_end;
+
+    conns_end=g->conns+g->conn_cnt;
+    for (conn=g->conns; conn<conns_end; conn++) {
+        sqlite3_stmt *rollback=NULL;
+
+        if (!conn->have_transaction)
+            continue;
+        status=sqlite3_prepare_v2(
+            conn->db,rollback_sql,sizeof rollback_sql,&rollback,NULL);
+        if (status==SQLITE_OK)
+            sqlite3_step(rollback);
+        if (rollback)
+            sqlite3_finalize(rollback);
+        conn->have_transaction=0;
+    }
+}
+
+/*
+ * A connection only goes back to the daemon once every input attached
+ * to it is detached; anything amiss, such as a statement left over
+ * from a failed run, and it's closed instead.
+ */
+
+static int keep_conn(
+    global_info *g,
+    conn_info *conn)
+{
+    input_info *input,*inputs_end;
+    int status;
+
+    inputs_end=g->inputs+g->input_cnt;
+    for (input=g->inputs; input<inputs_end; input++) {
+        char detach_sql[sizeof detach_fmt+7];
+        sqlite3_stmt *detach=NULL;
+        int sql_len;
+
+        if (input->conn!=conn || !input->attached)
+            continue;
+        sql_len=snprintf(detach_sql,sizeof detach_sql,detach_fmt,input->name);
+        status=sqlite3_prepare_v2(conn->db,detach_sql,sql_len+1,&detach,NULL);
+        if (status==SQLITE_OK)
+            status=sqlite3_step(detach);
+        if (detach)
+            sqlite3_finalize(detach);
+        if (status!=SQLITE_DONE)
+            return -1;
+        input->attached=0;
+    }
+    return keep_db(g->warm,conn->db);
+}
+
+static void close_db(
+    global_info *g)
+{
+    conn_info *conn,*conns_end;
+    input_info *input,*inputs_end;
+
+    conns_end=g->conns+g->conn_cnt;
+    for (conn=g->conns; conn<conns_end; conn++) {
+        if (conn->db) {
+            if (!g->warm || keep_conn(g,conn))
+                sqlite3_close_v2(conn->db);
+            conn->db=NULL;
+        }
+    }
+/*
+ * Only now that SQLite has let go of the files is it safe
+ * to close our own descriptors for them.
+ */
+    inputs_end=g->inputs+g->input_cnt;
+    for (input=g->inputs; input<inputs_end; input++) {
+        if (input->fd>=0) {
+            close(input->fd);
+            input->fd=-1;
+        }
+        if (input->wal_fd>=0) {
+            close(input->wal_fd);
+            input->wal_fd=-1;
+        }
+        if (input->capture_fd>=0) {
+            close(input->capture_fd);
+            input->capture_fd=-1;
+        }
+    }
+}
+
+/*
+ * Finding the manifest of an archive made with --verify takes
+ * just enough of a Zip reader to locate one stored entry.
+ */
+
+static int read_at(
+    int fd,
+    char const *path,
+    void *buf,
+    size_t len,
+    off_t offset)
+{
+    uint8_t *p;
+
+    p=buf;
+    while (len>0) {
+        ssize_t got;
+
+        got=pread(fd,p,len,offset);
+        if (got<0) {
+            if (errno==EINTR)
+                continue;
+            fprintf(messages(),"%s: pread: %s\n",path,strerror(errno));
+            return -1;
         }
-        src=input->path;
-        dst=uri_buf;
-        memcpy(dst,"file:",5);
-        dst+=5;
-        if (src[0]=='/') {
-            dst[0]='/';
-            dst[1]='/';
-            dst+=2;
+        if (!got) {
+            fprintf(messages(),"%s: Truncated archive\n",path);
+            return -1;
         }
-        for (;;) {
-            int c;
+        p+=got;
+        len-=got;
+        offset+=got;
+    }
+    return 0;
+}
 
-            c=src[0];
-            src++;
-            if (!c)
+static int find_manifest(
+    char const *path,
+    uint8_t const *cd,
+    size_t cd_size,
+    uint32_t *crc,
+    uint64_t *size,
+    uint64_t *local_offset)
+{
+    uint8_t const *p,*end;
+
+    p=cd;
+    end=cd+cd_size;
+    while ((size_t)(end-p)>=sizeof (central_entry)) {
+        central_entry const *entry;
+        size_t path_len,ext_len,comment_len;
+        uint8_t const *ext,*ext_end;
+        uint64_t fields[3];
+        int ix;
+
+        entry=(central_entry const *)p;
+        if (memcmp(&entry->sig,&central_entry_sig,sizeof central_entry_sig))
+            break;
+        path_len=LOAD16(entry->path_len);
+        ext_len=LOAD16(entry->extra_len);
+        comment_len=LOAD16(entry->comment_len);
+        p+=sizeof (central_entry);
+        if ((size_t)(end-p)<path_len+ext_len+comment_len)
+            break;
+        if (path_len!=archive_manifest_path_len
+                || memcmp(p,archive_manifest_path,path_len)) {
+            p+=path_len+ext_len+comment_len;
+            continue;
+        }
+        if (LOAD16(entry->compression)!=method_stored
+                || LOAD32(entry->compressed_size)!=LOAD32(entry->size)) {
+            fprintf(messages(),"%s: Bad manifest entry\n",path);
+            return -1;
+        }
+        fields[0]=LOAD32(entry->size);
+        fields[1]=LOAD32(entry->compressed_size);
+        fields[2]=LOAD32(entry->local_offset);
+        ext=p+path_len;
+        ext_end=ext+ext_len;
+        while ((size_t)(ext_end-ext)>=4) {
+            central_zip64 const *ext64;
+            size_t ext_size;
+            uint8_t const *data;
+
+            ext64=(central_zip64 const *)ext;
+            ext_size=LOAD16(ext64->ext_size);
+            if ((size_t)(ext_end-ext-4)<ext_size)
                 break;
-            if (c=='%' || c=='#' || c=='?' || c<=' ' || c>=0x7F) {
-                dst[0]='%';
-                dst[1]=base_16[c>>4 & 0xF];
-                dst[2]=base_16[c    & 0xF];
-                dst+=3;
-            } else {
-                dst[0]=c;
-                dst++;
+            if (LOAD16(ext64->ext_id)==1) {
+                data=ext+4;
+                for (ix=0; ix<3; ix++) {
+                    if (fields[ix]!=0xFFFFFFFF)
+                        continue;
+                    if ((size_t)(ext+4+ext_size-data)<8)
+                        break;
+                    fields[ix]=LOAD64(*(ule64 const *)data);
+                    data+=8;
+                }
             }
+            ext+=4+ext_size;
         }
-        memcpy(dst,"?mode=ro",8);
-        dst+=8;
-        status=sqlite3_bind_text(attach,1,uri_buf,dst-uri_buf,SQLITE_STATIC);
-        if (status!=SQLITE_OK) {
-            fprintf(stderr,"sqlite3_bind_text(attach): %s\n",
-                    sqlite3_errmsg(g->db));
-            goto cleanup;
+        *crc=LOAD32(entry->crc);
+        *size=fields[0];
+        *local_offset=fields[2];
+        return 1;
+    }
+    return 0;
+}
+
+static int read_archive_manifest(
+    global_info *g)
+{
+    char const *path;
+    int fd;
+    struct stat stat_buf;
+    uint8_t *tail=NULL;
+    uint8_t *cd=NULL;
+    size_t tail_len,pos;
+    off_t tail_offset;
+    eocd const *end;
+    uint64_t cd_size,cd_offset,size,local_offset;
+    uint32_t crc;
+    local_entry local;
+    int found;
+
+    path=g->check_path;
+    fd=open(path,O_RDONLY);
+    if (fd<0) {
+        fprintf(messages(),"%s: open: %s\n",path,strerror(errno));
+        return -1;
+    }
+    if (fstat(fd,&stat_buf)) {
+        fprintf(messages(),"%s: fstat: %s\n",path,strerror(errno));
+        goto cleanup;
+    }
+    tail_len=0xFFFF+sizeof (eocd)+sizeof (eocd64_locator);
+    if (stat_buf.st_size<(off_t)tail_len)
+        tail_len=stat_buf.st_size;
+    if (tail_len<sizeof (eocd))
+        goto not_zip;
+    tail=malloc(tail_len);
+    if (!tail) {
+        report_errno("malloc");
+        goto cleanup;
+    }
+    tail_offset=stat_buf.st_size-tail_len;
+    if (read_at(fd,path,tail,tail_len,tail_offset))
+        goto cleanup;
+    found=0;
+    for (pos=tail_len-sizeof (eocd)+1; pos-->0; ) {
+        end=(eocd const *)(tail+pos);
+        if (!memcmp(&end->sig,&eocd_sig,sizeof eocd_sig)
+                && LOAD16(end->comment_len)==tail_len-sizeof (eocd)-pos) {
+            found=1;
+            break;
         }
-        status=sqlite3_step(attach);
-        if (status!=SQLITE_DONE) {
-            fprintf(stderr,"sqlite3_step(attach): %s\n",sqlite3_errmsg(g->db));
+    }
+    if (!found)
+        goto not_zip;
+    cd_size=LOAD32(end->cd_size);
+    cd_offset=LOAD32(end->cd_offset);
+    if (pos>=sizeof (eocd64_locator)) {
+        eocd64_locator const *loc64;
+        eocd64 end64;
+
+        loc64=(eocd64_locator const *)(tail+pos-sizeof (eocd64_locator));
+        if (!memcmp(&loc64->sig,&eocd64_locator_sig,
+                sizeof eocd64_locator_sig)) {
+            if (read_at(fd,path,&end64,sizeof end64,
+                    LOAD64(loc64->eocd_offset)))
+                goto cleanup;
+            if (memcmp(&end64.sig,&eocd64_sig,sizeof eocd64_sig))
+                goto not_zip;
+            cd_size=LOAD64(end64.cd_size);
+            cd_offset=LOAD64(end64.cd_offset);
+        }
+    }
+    if (cd_offset>(uint64_t)stat_buf.st_size
+            || cd_size>stat_buf.st_size-cd_offset)
+        goto not_zip;
+    cd=malloc(cd_size+1);
+    if (!cd) {
+        report_errno("malloc");
+        goto cleanup;
+    }
+    if (read_at(fd,path,cd,cd_size,cd_offset))
+        goto cleanup;
+    found=find_manifest(path,cd,cd_size,&crc,&size,&local_offset);
+    if (found<0)
+        goto cleanup;
+    if (!found) {
+        fprintf(messages(),"%s: No manifest in the archive\n",path);
+        goto cleanup;
+    }
+    if (size>(size_t)-1 || local_offset>(uint64_t)stat_buf.st_size) {
+        fprintf(messages(),"%s: Bad manifest entry\n",path);
+        goto cleanup;
+    }
+    if (read_at(fd,path,&local,sizeof local,local_offset))
+        goto cleanup;
+    if (memcmp(&local.sig,&local_entry_sig,sizeof local_entry_sig)) {
+        fprintf(messages(),"%s: Bad local header\n",path);
+        goto cleanup;
+    }
+    g->base=malloc(size+1);
+    if (!g->base) {
+        report_errno("malloc");
+        goto cleanup;
+    }
+    g->base_size=size;
+    if (read_at(fd,path,g->base,size,local_offset+sizeof local
+            +LOAD16(local.path_len)+LOAD16(local.extra_len)))
+        goto cleanup;
+    if (crc_update(0,g->base,size)!=crc) {
+        fprintf(messages(),"%s: Bad manifest CRC\n",path);
+        goto cleanup;
+    }
+    free(tail);
+    free(cd);
+    close(fd);
+    return match_base(g,path);
+
+not_zip:
+    fprintf(messages(),"%s: Not a Zip archive\n",path);
+cleanup:
+    free(tail);
+    free(cd);
+    close(fd);
+    return -1;
+}
+
+static int check_inputs(
+    global_info *g)
+{
+    int status;
+    input_info *input,*inputs_end;
+    worker_info *w,*workers_end;
+
+    inputs_end=g->inputs+g->input_cnt;
+    if (g->worker_cnt<=1) {
+        for (input=g->inputs; input<inputs_end; input++) {
+            if (check_input(g->workers,input))
+                return -1;
+        }
+        return 0;
+    }
+    workers_end=g->workers+g->worker_cnt;
+    for (w=g->workers; w<workers_end; w++) {
+        status=pthread_create(&w->thread,NULL,worker_main,w);
+        if (status) {
+            fprintf(messages(),"pthread_create: %s\n",strerror(status));
             goto cleanup;
         }
-        sqlite3_finalize(attach);
-        attach=NULL;
+        w->have_thread=1;
     }
-    free(uri_buf);
-    uri_buf=NULL;
+    for (input=g->inputs; input<inputs_end; input++) {
+        int state;
+
+        pthread_mutex_lock(&g->lock);
+        while (input->state==input_pending)
+            pthread_cond_wait(&g->done,&g->lock);
+        state=input->state;
+        pthread_mutex_unlock(&g->lock);
+        if (state!=input_done)
+            goto cleanup;
+    }
+    join_workers(g);
     return 0;
 
 cleanup:
-    if (uri_buf)
-        free(uri_buf);
-    if (attach)
-        sqlite3_finalize(attach);
+    join_workers(g);
     return -1;
 }
 
-static int open_archive(
-    global_info *g,
-    char const *path)
+/*
+ * Differing pages are reported as ranges.  Pages past the end
+ * of either version only count towards the page counts differing.
+ */
+
+static int report_check(
+    global_info *g)
 {
-    struct stat stat_buf;
+    input_info *input,*inputs_end;
+    FILE *out;
+    int differ;
 
-    if (stat(path,&stat_buf)==0) {
-        input_info *input,*inputs_end;
+    out=output();
+    differ=0;
+    inputs_end=g->inputs+g->input_cnt;
+    for (input=g->inputs; input<inputs_end; input++) {
+        off_t pgno,first,last;
+        int same;
 
-        inputs_end=g->inputs+g->input_cnt;
-        for (input=g->inputs; input<inputs_end; input++) {
-            if (input->dev=stat_buf.st_dev && input->ino==stat_buf.st_ino) {
-                fprintf(stderr,"%s: Conflicts with an input file\n", path);
-                return -1;
+        if (!input->base_hashes) {
+            fprintf(out,"%s: Not in the archive\n",input->path);
+            differ=1;
+            continue;
+        }
+        same=1;
+        if (input->page_count!=input->base_page_count) {
+            fprintf(out,"%s: %lld pages, %lld in the archive\n",
+                    input->path,(long long)input->page_count,
+                    (long long)input->base_page_count);
+            same=0;
+        }
+        last=input->page_count;
+        if (last>input->base_page_count)
+            last=input->base_page_count;
+        for (pgno=1; pgno<=last; pgno++) {
+            if (!page_is_set(input->bitmap,pgno))
+                continue;
+            first=pgno;
+            while (pgno<last && page_is_set(input->bitmap,pgno+1))
+                pgno++;
+            if (first==pgno) {
+                fprintf(out,"%s: Page %lld differs\n",input->path,
+                        (long long)first);
+            } else {
+                fprintf(out,"%s: Pages %lld-%lld differ\n",input->path,
+                        (long long)first,(long long)pgno);
             }
+            same=0;
+        }
+        if (same) {
+            fprintf(out,"%s: OK\n",input->path);
+        } else {
+            differ=1;
         }
     }
-    g->zip_path=path;
-    g->zip=fopen(path,"w");
-    if (!g->zip) {
-        fprintf(stderr,"%s: fopen: %s\n",path,strerror(errno));
+    if (fflush(out)) {
+        fprintf(messages(),"stdout: %s\n",strerror(errno));
+        return -1;
+    }
+    return differ;
+}
+
+static int check_archive(
+    global_info *g,
+    char **paths)
+{
+    if (attach_inputs(g,paths))
+        return -1;
+    end_stage(g,stage_open);
+    if (begin_transaction(g))
+        return -1;
+    end_stage(g,stage_lock);
+    if (get_metainfo(g))
+        return -1;
+    if (fit_memory(g))
+        return -1;
+    if (read_archive_manifest(g))
+        return -1;
+    end_stage(g,stage_metainfo);
+    if (check_inputs(g))
+        return -1;
+    end_stage(g,stage_compress);
+    rollback_transaction(g);
+    close_db(g);
+    return report_check(g);
+}
+
+static void end_deflation(
+    global_info *g,
+    z_stream *deflation)
+{
+    if (g->warm) {
+        keep_deflation(g->warm,deflation,g->window_bits,g->mem_level);
+    } else {
+        deflateEnd(deflation);
+        free(deflation);
+    }
+}
+
+static void finish_compression(
+    global_info *g)
+{
+    worker_info *w,*workers_end;
+    deflater_info *d,*deflaters_end;
+
+    workers_end=g->workers+g->worker_cnt;
+    for (w=g->workers; w<workers_end; w++) {
+        int ix;
+
+        if (w->have_deflation) {
+            end_deflation(g,w->deflation);
+            w->have_deflation=0;
+        }
+        for (ix=0; ix<codec_cnt; ix++) {
+            if (codecs[ix]->end)
+                codecs[ix]->end(w);
+        }
+    }
+    deflaters_end=g->deflaters+g->deflater_cnt;
+    for (d=g->deflaters; d<deflaters_end; d++) {
+        if (d->have_deflation) {
+            end_deflation(g,d->deflation);
+            d->have_deflation=0;
+        }
+    }
+    free(g->deflate_pool);
+    g->deflate_pool=NULL;
+}
+
+int write_directory(
+    global_info *g)
+{
+    input_info *input,*inputs_end;
+    arena_block *block;
+    off_t total_size;
+
+    if (!g->streaming && fseeko(g->zip,g->cd_offset,SEEK_SET)) {
+        fprintf(messages(),"%s: fseeko: %s\n",g->zip_path,strerror(errno));
+        return -1;
+    }
+    for (block=g->cd_head; block; block=block->next) {
+        if (!fwrite(block+1,block->used,1,g->zip)) {
+            fprintf(messages(),"%s: fwrite: %s\n",g->zip_path,strerror(errno));
+            return -1;
+        }
+    }
+    inputs_end=g->inputs+g->input_cnt;
+    total_size=0;
+    for (input=g->inputs; input<inputs_end; input++)
+        total_size+=input->page_count*input->page_size;
+    g->total_size=total_size;
+    return 0;
+}
+
+static int write_trailer(
+    global_info *g)
+{
+    eocd end;
+    off_t offset;
+    uint64_t entry_cnt;
+
+    offset=g->cd_offset+g->cd_size;
+    entry_cnt=(uint64_t)g->input_cnt+(g->dict_len>0)+g->have_hashes
+        +g->have_index;
+    end.sig=eocd_sig;
+    STORE16(end.this_diskno,0);
+    STORE16(end.cd_diskno,0);
+    STORE16(end.comment_len,0);
+    if (entry_cnt>0xFFFF
+            || g->cd_offset>0xFFFFFFFF
+            || g->cd_size>0xFFFFFFFF) {
+        eocd64 end64;
+        eocd64_locator loc64;
+        off_t eocd_offset;
+
+        eocd_offset=offset;
+        end64.sig=eocd64_sig;
+        STORE64(end64.size,sizeof (eocd64)-12);
+        STORE16(end64.creator_version,version_zip64 | creator_unix);
+        STORE16(end64.needed_version,version_zip64);
+        STORE32(end64.this_diskno,0);
+        STORE32(end64.cd_diskno,0);
+        STORE64(end64.this_entry_cnt,entry_cnt);
+        STORE64(end64.total_entry_cnt,entry_cnt);
+        STORE64(end64.cd_size,g->cd_size);
+        STORE64(end64.cd_offset,g->cd_offset);
+        if (entry_cnt>0xFFFF) {
+            STORE16(end.this_entry_cnt,0xFFFF);
+            STORE16(end.total_entry_cnt,0xFFFF);
+        } else {
+            STORE16(end.this_entry_cnt,entry_cnt);
+            STORE16(end.total_entry_cnt,entry_cnt);
+        }
+        if (g->cd_size>0xFFFFFFFF) {
+            STORE32(end.cd_size,0xFFFFFFFF);
+        } else {
+            STORE32(end.cd_size,g->cd_size);
+        }
+        if (g->cd_offset>0xFFFFFFFF) {
+            STORE32(end.cd_offset,0xFFFFFFFF);
+        } else {
+            STORE32(end.cd_offset,g->cd_offset);
+        }
+        loc64.sig=eocd64_locator_sig;
+        STORE32(loc64.eocd_diskno,0);
+        STORE64(loc64.eocd_offset,eocd_offset);
+        STORE32(loc64.disk_cnt,1);
+
+        if (!fwrite(&end64,sizeof end64,1,g->zip)) {
+            fprintf(messages(),"%s: fwrite: %s\n",g->zip_path,strerror(errno));
+            return -1;
+        }
+        offset+=sizeof end64;
+        if (!fwrite(&loc64,sizeof loc64,1,g->zip)) {
+            fprintf(messages(),"%s: fwrite: %s\n",g->zip_path,strerror(errno));
+            return -1;
+        }
+        offset+=sizeof loc64;
+    } else {
+        STORE16(end.this_entry_cnt,entry_cnt);
+        STORE16(end.total_entry_cnt,entry_cnt);
+        STORE32(end.cd_size,g->cd_size);
+        STORE32(end.cd_offset,g->cd_offset);
+    }
+
+    if (!fwrite(&end,sizeof end,1,g->zip)) {
+        fprintf(messages(),"%s: fwrite: %s\n",g->zip_path,strerror(errno));
+        return -1;
+    }
+    offset+=sizeof end;
+    if (fflush(g->zip)) {
+        fprintf(messages(),"%s: fflush: %s\n",g->zip_path,strerror(errno));
+        return -1;
+    }
+    g->archive_size=offset;
+    if (g->stats==stats_text) {
+        fprintf(messages(),"========\n%.6f  (total)\n",
+                (double)offset/g->total_size);
+    }
+    return 0;
+}
+
+static int close_archive(
+    global_info *g)
+{
+    FILE *zip;
+
+    zip=g->zip;
+    g->zip=NULL;
+#ifdef S3ZIP_S3
+    g->s3=NULL;
+#endif
+    if (fclose(zip)) {
+        fprintf(messages(),"%s: fclose: %s\n",g->zip_path,strerror(errno));
         return -1;
     }
-    g->have_output=1;
     return 0;
 }
 
-static int begin_transaction(
+/*
+ * Once complete, the manifest file is renamed into place.
+ */
+
+static int close_manifest(
     global_info *g)
 {
-    int status;
-    sqlite3_stmt *begin=NULL;
+    int fd;
 
-    status=sqlite3_prepare_v2(g->db,begin_sql,sizeof begin_sql,&begin,NULL);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"sqlite3_prepare(begin): %s\n",sqlite3_errmsg(g->db));
-        goto cleanup;
+    if (!g->have_manifest)
+        return 0;
+    if (finish_manifest(g))
+        return -1;
+    fd=g->manifest_fd;
+    g->manifest_fd=-1;
+    if (close(fd)) {
+        fprintf(messages(),"%s: close: %s\n",g->manifest_tmp,strerror(errno));
+        return -1;
     }
-    status=sqlite3_step(begin);
-    if (status!=SQLITE_DONE) {
-        fprintf(stderr,"sqlite3_step(begin): %s\n",sqlite3_errmsg(g->db));
-        goto cleanup;
+    if (!g->manifest_path) {
+        g->have_manifest=0;
+        return 0;
+    }
+    if (rename(g->manifest_tmp,g->manifest_path)) {
+        fprintf(messages(),"%s: rename: %s\n",g->manifest_tmp,strerror(errno));
+        return -1;
     }
-    sqlite3_finalize(begin);
-    begin=NULL;
-    g->have_transaction=1;
+    g->have_manifest=0;
     return 0;
+}
 
-cleanup:
-    if (begin)
-        sqlite3_finalize(begin);
-    return -1;
+/*
+ * The --stats=json report, on standard error like everything else
+ * since the archive may be on standard output.  Times are in seconds.
+ * Per-stage CPU time is the main thread's own.
+ */
+
+static void json_time(
+    char const *name,
+    phase_time const *t)
+{
+    json_string(messages(),name);
+    fprintf(messages(),": {\"wall\": %.6f, \"cpu\": %.6f}",
+            t->wall/1e9,t->cpu/1e9);
 }
 
-static int get_metainfo(
+static void print_stats(
     global_info *g)
 {
-    int status;
+    phase_time now,total;
+    struct timespec ts;
     input_info *input,*inputs_end;
-    sqlite3_stmt *metainfo=NULL;
+    int ix;
 
-    inputs_end=g->inputs+g->input_cnt;
-    status=sqlite3_prepare_v2(
-        g->db,metainfo_sql,sizeof metainfo_sql,&metainfo,NULL);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"sqlite3_prepare(metainfo): %s\n",
-                sqlite3_errmsg(g->db));
-        goto cleanup;
+    read_clocks(&now);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID,&ts);
+    total.wall=now.wall-g->start.wall;
+    total.cpu=(uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+    fputs("{\n  \"crc32\": ",messages());
+    json_string(messages(),g->crc_kernel);
+    fputs(",\n  \"zlib\": ",messages());
+    json_string(messages(),zlibVersion());
+    fputs(",\n  \"archive\": ",messages());
+    json_string(messages(),g->zip_path);
+    fprintf(messages(),",\n  \"bytes_in\": %lld,\n  \"bytes_out\": %lld,\n  ",
+            (long long)g->total_size,(long long)g->archive_size);
+    if (g->dict_len) {
+        fprintf(messages(),"\"dictionary\": %lu,\n  ",
+                (unsigned long)g->dict_len);
     }
-    for (input=g->inputs; input<inputs_end; input++) {
-        struct stat stat_buf;
-        struct tm *pieces;
-        time_t mtime;
-        unsigned char const *journal_mode;
-        char const *filename;
-
-        status=sqlite3_bind_text(metainfo,1,input->name,-1,SQLITE_STATIC);
-        if (status!=SQLITE_OK) {
-            fprintf(stderr,"sqlite3_bind_text(metainfo): %s\n",
-                    sqlite3_errmsg(g->db));
-            goto cleanup;
-        }
-        status=sqlite3_step(metainfo);
-        if (status!=SQLITE_ROW) {
-            fprintf(stderr,"sqlite3_step(metainfo): %s\n",
-                    sqlite3_errmsg(g->db));
-            goto cleanup;
-        }
-        input->page_size=sqlite3_column_int(metainfo,0);
-        input->page_count=sqlite3_column_int64(metainfo,1);
-        journal_mode=sqlite3_column_text(metainfo,2);
-        if (!journal_mode) {
-            fputs("Out of memory or something\n",stderr);
-            goto cleanup;
-        }
-        if (input->page_size>0x10000) {
-            fprintf(stderr,"%s: Unsupported page size %d\n",
-                    input->path,input->page_size);
-            goto cleanup;
-        }
-        filename=sqlite3_db_filename(g->db,input->name);
 /*
- * stat-ing again because the first time was before we had a lock.
+ * A daemon's peaks are those of every job it has run, so they're
+ * labelled as the process's rather than passed off as this job's.
  */
-        if (stat(sqlite3_filename_database(filename),&stat_buf)) {
-            perror(input->path);
-            goto cleanup;
+    fprintf(messages(),"\"memory\": {\n    \"budget\": %lld,\n"
+            "    \"%speak_rss\": %lld,\n    \"deflate\": %lld,\n"
+            "    \"%ssqlite\": %lld\n  },\n  ",
+            (long long)g->max_memory,g->warm ? "process_" : "",
+            (long long)peak_rss(),
+            (long long)(g->deflate_pool_used+g->deflate_extra),
+            g->warm ? "process_" : "",
+            (long long)sqlite3_memory_highwater(0));
+    fprintf(messages(),"\"throttle\": {\n    \"io_rate\": %llu,\n"
+            "    \"io_wait\": %.3f,\n    \"cpu_wait\": %.3f\n  },\n  ",
+            (unsigned long long)g->throttle.rate,
+            g->throttle.io_wait/1e9,g->throttle.cpu_wait/1e9);
+    json_time("total",&total);
+    fputs(",\n  \"stages\": {",messages());
+    for (ix=0; ix<stage_cnt; ix++) {
+        fputs(ix ? ",\n    " : "\n    ",messages());
+        json_time(stage_names[ix],g->stage_times+ix);
+    }
+    fputs("\n  },\n  \"inputs\": [",messages());
+    inputs_end=g->inputs+g->input_cnt;
+    for (input=g->inputs; input<inputs_end; input++) {
+        fputs(input>g->inputs ? ",\n    {\n" : "\n    {\n",messages());
+        fputs("      \"path\": ",messages());
+        json_string(messages(),input->path);
+        fputs(",\n      \"entry\": ",messages());
+        json_string(messages(),input->entry_path);
+        fputs(",\n      \"codec\": ",messages());
+        json_string(messages(),input->codec->name);
+        fprintf(messages(),",\n      \"level\": %d",input->level);
+        fprintf(messages(),",\n      \"pages\": %lld",
+                (long long)input->page_count);
+        fprintf(messages(),",\n      \"pages_archived\": %lld",
+                (long long)input->archived_cnt);
+        fprintf(messages(),",\n      \"pages_read\": %lld",
+                (long long)input->pages_read);
+        fprintf(messages(),",\n      \"pages_free\": %lld",
+                (long long)input->free_cnt);
+        if (g->seek_pages) {
+            fprintf(messages(),",\n      \"seek_points\": %lu",
+                    (unsigned long)input->seek_cnt);
         }
-        mtime=stat_buf.st_mtime;
-/*
- * If in WAL mode, and the WAL file exists and is newer than the main file,
- * use that mtime instead.
- */
-        if (!strcmp((char const *)journal_mode,"wal")
-                && stat(sqlite3_filename_wal(filename),&stat_buf)==0
-                && stat_buf.st_mtime>mtime) {
-            mtime=stat_buf.st_mtime;
+        fprintf(messages(),",\n      \"bytes_in\": %lld",
+                (long long)input->size);
+        fprintf(messages(),",\n      \"bytes_out\": %lld",
+                (long long)input->compressed_size);
+        fprintf(messages(),",\n      \"lock_wait\": %.6f",
+                input->conn->lock_wait/1e9);
+        fputs(",\n      \"phases\": {",messages());
+        for (ix=0; ix<phase_cnt; ix++) {
+            fputs(ix ? ",\n        " : "\n        ",messages());
+            json_time(phase_names[ix],input->times+ix);
         }
-        sqlite3_reset(metainfo);
-        pieces=localtime(&mtime);
-        input->dos_mdate=pieces->tm_year-80<<9
-            | pieces->tm_mon+1<<5 & 0x1E0
-            | pieces->tm_mday & 0x1F;
-        input->dos_mtime=pieces->tm_hour<<11
-            | pieces->tm_min<<5 & 0x7E0
-            | pieces->tm_sec>>1 & 0x1F;
+        fputs("\n      }\n    }",messages());
     }
-    sqlite3_finalize(metainfo);
-    metainfo=NULL;
-    return 0;
-
-cleanup:
-    if (metainfo)
-        sqlite3_finalize(metainfo);
-    return -1;
+    fputs("\n  ]\n}\n",messages());
 }
 
-static int compress_inputs(
+static void cleanup_global(
     global_info *g)
 {
-    int status;
-    sqlite3_stmt *pages=NULL;
-    input_info *input,*inputs_end;
-    off_t offset;
+    finish_compression(g);
+    rollback_transaction(g);
+    close_db(g);
+#ifdef S3ZIP_S3
+    if (g->s3) {
+        s3_abandon(g->s3);
+        g->s3=NULL;
+    }
+#endif
+    if (g->zip) {
+        fclose(g->zip);
+        g->zip=NULL;
+    }
+    if (g->have_output) {
+        remove(g->zip_path);
+        g->have_output=0;
+    }
+    if (g->manifest_fd>=0) {
+        close(g->manifest_fd);
+        g->manifest_fd=-1;
+    }
+    if (g->have_manifest) {
+        if (g->manifest_path)
+            remove(g->manifest_tmp);
+        g->have_manifest=0;
+    }
+}
 
-    inputs_end=g->inputs+g->input_cnt;
-    status=sqlite3_prepare_v2(g->db,pages_sql,sizeof pages_sql,&pages,NULL);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"sqlite3_prepare(pages): %s\n",sqlite3_errmsg(g->db));
-        goto cleanup;
+static void usage(void)
+{
+    fputs("Usage: s3zip [-j jobs] [-p threads] [--chunk-pages=n]\n"
+          "             [-m codec[:pattern]]... [-l level|auto]"
+          " [--sample-pages=n]\n"
+          "             [-s default|filtered|huffman|rle|fixed]\n"
+          "             [--flush=adaptive|block] [--store=never|auto|always]\n"
+          "             [--free-pages=keep|zero] [--group-pages]"
+          " [--seekable[=pages]]\n"
+          "             [--read=direct|sql] [--cache-size=pages]"
+          " [--mmap-size=MiB]\n"
+          "             [--capture[=dir]] [--dictionary[=inputs]]"
+          " [--max-memory=MiB]\n"
+          "             [--io-rate=MiB/s] [--io-latency=us]"
+          " [--cpu-duty=percent]\n"
+          "             [--manifest=file] [--since=file [--quick]]"
+          " [--verify]\n"
+          "             [--write-buffer=MiB [--direct-output]]"
+          " [--stats=text|json]\n"
+          "             [--progress[=file|fd:n] [--progress-interval=s]]\n"
+          "             [--part-size=MiB] [--uploads=n]\n"
+          "             archive.zip|-|s3://bucket/key database...\n"
+          "       s3zip --check=archive.zip [-j jobs]"
+          " [--free-pages=keep|zero] database...\n"
+          "       s3zip --serve=socket [-j jobs]\n"
+          "       s3zip --submit=socket arguments...\n",messages());
+}
+
+static int parse_count(
+    char const *arg,
+    char const *what,
+    long max,
+    int *result)
+{
+    char *end;
+    long value;
+
+    errno=0;
+    value=strtol(arg,&end,10);
+    if (errno || end==arg || *end || value<1 || value>max) {
+        fprintf(messages(),"%s: Invalid %s\n",arg,what);
+        return -1;
     }
-    offset=0;
-    for (input=g->inputs; input<inputs_end; input++) {
-        local_entry entry;
-        int l64,c64;
-        local_zip64 ext;
-        off_t size,compressed_size,archived_size;
-        off_t page_count;
-        uint32_t crc;
-        unsigned int version;
+    *result=value;
+    return 0;
+}
 
-/*
- * Compute the worst-case compressed size to see if it fits in 32 bits.
- * If it doesn't, we need to know that in advance.
- */
-        size=input->page_count*input->page_size;
-        input->size=size;
-        compressed_size=input->page_count*
-            (input->page_size+(input->page_size+0xFFFE)/0xFFFF*5);
-        l64=(size>0xFFFFFFFF || compressed_size>0xFFFFFFFF);
-        c64=(l64 || offset>0xFFFFFFFF);
-        if (c64) {
-            version=version_zip64;
-        } else {
-            version=version_classic;
+static int parse_strategy(
+    char const *arg,
+    int *result)
+{
+    static struct {
+        char const *name;
+        int strategy;
+    } const strategies[]={
+        { "default",  Z_DEFAULT_STRATEGY },
+        { "filtered", Z_FILTERED },
+        { "huffman",  Z_HUFFMAN_ONLY },
+        { "rle",      Z_RLE },
+        { "fixed",    Z_FIXED }
+    };
+    size_t ix;
+
+    for (ix=0; ix<sizeof strategies/sizeof strategies[0]; ix++) {
+        if (!strcmp(arg,strategies[ix].name)) {
+            *result=strategies[ix].strategy;
+            return 0;
         }
+    }
+    fprintf(messages(),"%s: Invalid compression strategy\n",arg);
+    return -1;
+}
+
 /*
- * Writing a preliminary local header followed by the compressed data
- * and then returning to fill in only the CRC and the compressed size
- * is too fiddly.  Instead, leave space for the local header and return
- * to write all of it once everything is known.
+ * A codec name alone sets the default; with a pattern, it adds a rule.
  */
-        input->local_offset=offset;
-        offset+=sizeof (local_entry)+input->path_len;
-        if (l64)
-            offset+=sizeof (local_zip64);
-        if (fseeko(g->zip,offset,SEEK_SET)) {
-            fprintf(stderr,"%s: fseeko: %s\n",g->zip_path,strerror(errno));
-            goto cleanup;
-        }
+
+static int parse_codec(
+    char *arg,
+    option_info *opts)
+{
+    char *pattern;
+    int ix;
+
+    pattern=strchr(arg,':');
+    if (pattern) {
+        *pattern=0;
+        pattern++;
+    }
+    for (ix=0; ix<codec_cnt; ix++) {
+        if (!strcmp(arg,codecs[ix]->name))
+            break;
+    }
+    if (ix==codec_cnt) {
+        fprintf(messages(),"%s: Invalid or unsupported codec\n",arg);
+        return -1;
+    }
+    if (!pattern) {
+        opts->codec=codecs[ix];
+        return 0;
+    }
+    if (opts->codec_rule_cnt==max_codec_rules) {
+        fputs("Too many codec rules\n",messages());
+        return -1;
+    }
+    opts->codec_rules[opts->codec_rule_cnt].codec=codecs[ix];
+    opts->codec_rules[opts->codec_rule_cnt].pattern=pattern;
+    opts->codec_rule_cnt++;
+    return 0;
+}
 
 /*
- * Get, compress, and write pages.
+ * Everything before the archive and inputs, from the command line
+ * or a job.  Returns the index of the first argument that isn't
+ * an option, or -1 after saying what's wrong.  getopt keeps state
+ * of its own, so this is only ever run once at a time.
  */
-        status=sqlite3_bind_text(pages,1,input->name,-1,SQLITE_STATIC);
-        if (status!=SQLITE_OK) {
-            fprintf(stderr,"sqlite3_bind_text(pages): %s\n",
-                    sqlite3_errmsg(g->db));
-            goto cleanup;
-        }
-        page_count=0;
-        compressed_size=0;
-        crc=0;
-        for (;;) {
-            void const *page_data;
-            int page_size;
-            int flush;
-            int got;
 
-            status=sqlite3_step(pages);
-            if (status!=SQLITE_ROW)
-                break;
-            page_data=sqlite3_column_blob(pages,0);
-            if (!page_data) {
-                fputs("Out of memory or something\n",stderr);
-                goto cleanup;
+static int parse_options(
+    int argc,
+    char **argv,
+    option_info *opts)
+{
+    static struct option const long_opts[]={
+        { "jobs", required_argument, NULL, 'j' },
+        { "threads", required_argument, NULL, 'p' },
+        { "chunk-pages", required_argument, NULL, 'c' },
+        { "level", required_argument, NULL, 'l' },
+        { "strategy", required_argument, NULL, 's' },
+        { "sample-pages", required_argument, NULL, 'S' },
+        { "flush", required_argument, NULL, 'F' },
+        { "store", required_argument, NULL, 'T' },
+        { "free-pages", required_argument, NULL, 'E' },
+        { "group-pages", no_argument, NULL, 'B' },
+        { "seekable", optional_argument, NULL, 'A' },
+        { "codec", required_argument, NULL, 'm' },
+        { "manifest", required_argument, NULL, 'M' },
+        { "since", required_argument, NULL, 'D' },
+        { "quick", no_argument, NULL, 'Q' },
+        { "verify", no_argument, NULL, 'V' },
+        { "check", required_argument, NULL, 'N' },
+        { "read", required_argument, NULL, 'R' },
+        { "cache-size", required_argument, NULL, 'K' },
+        { "mmap-size", required_argument, NULL, 'P' },
+        { "part-size", required_argument, NULL, 'Z' },
+        { "uploads", required_argument, NULL, 'U' },
+        { "write-buffer", required_argument, NULL, 'W' },
+        { "direct-output", no_argument, NULL, 'O' },
+        { "stats", required_argument, NULL, 'X' },
+        { "capture", optional_argument, NULL, 'C' },
+        { "dictionary", optional_argument, NULL, 'Y' },
+        { "progress", optional_argument, NULL, 'G' },
+        { "progress-interval", required_argument, NULL, 'I' },
+        { "max-memory", required_argument, NULL, 'L' },
+        { "serve", required_argument, NULL, 'i' },
+        { "io-rate", required_argument, NULL, 'H' },
+        { "io-latency", required_argument, NULL, 'k' },
+        { "cpu-duty", required_argument, NULL, 'J' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+
+    opts->jobs=1;
+    opts->threads=1;
+    opts->chunk_pages=128;
+    opts->level=level_default;
+    opts->strategy=Z_DEFAULT_STRATEGY;
+    opts->sample_pages=64;
+    opts->adaptive=1;
+    opts->zero_free=0;
+    opts->group_pages=0;
+    opts->seek_pages=0;
+    opts->store=store_never;
+    opts->codec=&codec_deflate;
+    opts->codec_rule_cnt=0;
+    opts->manifest_path=NULL;
+    opts->base_path=NULL;
+    opts->quick=0;
+    opts->verify=0;
+    opts->check_path=NULL;
+    opts->direct=1;
+    opts->capture=0;
+    opts->capture_dir=NULL;
+    opts->dict_samples=0;
+    opts->cache_size=0;
+    opts->mmap_size=0;
+    opts->max_memory=0;
+    opts->io_rate=0;
+    opts->io_latency=0;
+    opts->cpu_duty=0;
+    opts->part_size=16;
+    opts->upload_cnt=4;
+    opts->write_buffer=4;
+    opts->direct_output=0;
+    opts->stats=stats_text;
+    opts->progress=0;
+    opts->progress_path=NULL;
+    opts->progress_fd=-1;
+    opts->progress_interval=10;
+    opts->serve_path=NULL;
+#if defined(__APPLE__) || defined(__FreeBSD__)
+    optreset=1;
+    optind=1;
+#else
+    optind=0;
+#endif
+    while ((opt=getopt_long(argc,argv,"j:p:l:s:m:",long_opts,NULL))!=-1) {
+        switch (opt) {
+        case 'j':
+            if (parse_count(optarg,"job count",1024,&opts->jobs))
+                return -1;
+            break;
+        case 'p':
+            if (parse_count(optarg,"thread count",1024,&opts->threads))
+                return -1;
+            break;
+        case 'c':
+            if (parse_count(optarg,"chunk size",0x10000,&opts->chunk_pages))
+                return -1;
+            break;
+        case 'l':
+            if (!strcmp(optarg,"auto")) {
+                opts->level=level_auto;
+            } else if (!strcmp(optarg,"0")) {
+                opts->level=0;
+            } else if (parse_count(optarg,"compression level",22,
+                    &opts->level)) {
+                return -1;
             }
-            page_size=sqlite3_column_bytes(pages,0);
-            if (page_size!=input->page_size) {
-                fprintf(stderr,"%s: Inconsistent page size\n",input->path);
-                goto cleanup;
+            break;
+        case 'm':
+            if (parse_codec(optarg,opts))
+                return -1;
+            break;
+        case 'M':
+            opts->manifest_path=optarg;
+            break;
+        case 'D':
+            opts->base_path=optarg;
+            break;
+        case 'Q':
+            opts->quick=1;
+            break;
+        case 'V':
+            opts->verify=1;
+            break;
+        case 'N':
+            opts->check_path=optarg;
+            break;
+        case 'K':
+            if (parse_count(optarg,"cache size",0x40000000,&opts->cache_size))
+                return -1;
+            break;
+        case 'P':
+            if (parse_count(optarg,"mmap size",0x100000,&opts->mmap_size))
+                return -1;
+            break;
+        case 'Z':
+            if (parse_count(optarg,"part size",5120,&opts->part_size))
+                return -1;
+            if (opts->part_size<5) {
+                fprintf(messages(),"%s: Invalid part size\n",optarg);
+                return -1;
             }
-            page_count++;
-            if (page_count>input->page_count) {
-                fprintf(stderr,"%s: Inconsistent page count\n",input->path);
-                goto cleanup;
+            break;
+        case 'U':
+            if (parse_count(optarg,"upload count",64,&opts->upload_cnt))
+                return -1;
+            break;
+        case 'W':
+            if (!strcmp(optarg,"0")) {
+                opts->write_buffer=0;
+            } else if (parse_count(optarg,"write buffer size",1024,
+                                   &opts->write_buffer)) {
+                return -1;
             }
-            crc=crc32(crc,page_data,page_size);
-/*
- * For compressible pages, Z_BLOCK consistently yields better compression
- * than Z_NO_FLUSH, even for freshly VACUUMed databases that ought to have
- * similar pages grouped together.  If you need an explanation for this,
- * hire a zlib expert to analyse the problem.
- *
- * On the other hand, a run of incompressible pages (from e.g. a large
- * random blob) should be flushed as seldom as possible in order
- * to minimise overhead.
- *
- * So how do you know in advance whether or not a given page is
- * compressible?  Unfortunately, there's no way that doesn't double
- * the computation cost.
- */
-            if (page_count==input->page_count) {
-                flush=Z_FINISH;
+            break;
+        case 'O':
+            opts->direct_output=1;
+            break;
+        case 'X':
+            if (!strcmp(optarg,"text")) {
+                opts->stats=stats_text;
+            } else if (!strcmp(optarg,"json")) {
+                opts->stats=stats_json;
             } else {
-                flush=Z_BLOCK;
+                fprintf(messages(),"%s: Invalid stats format\n",optarg);
+                return -1;
             }
-            g->deflation.next_in=(uint8_t *)page_data;
-            g->deflation.avail_in=page_size;
-            g->deflation.next_out=g->output_buf;
-            g->deflation.avail_out=sizeof g->output_buf;
-            status=deflate(&g->deflation,flush);
-            if (status!=Z_OK && status!=Z_STREAM_END) {
-                fprintf(stderr,"deflate: error %d\n",status);
-                goto cleanup;
+            break;
+        case 'C':
+            opts->capture=1;
+            opts->capture_dir=optarg;
+            break;
+        case 'Y':
+            opts->dict_samples=dict_sample_default;
+            if (optarg && parse_count(optarg,"dictionary sample",0x10000,
+                    &opts->dict_samples))
+                return -1;
+            break;
+        case 'G':
+            opts->progress=1;
+            opts->progress_path=optarg;
+            if (optarg && !strncmp(optarg,"fd:",3)) {
+                if (parse_count(optarg+3,"descriptor",0x7FFFFFFF,
+                        &opts->progress_fd))
+                    return -1;
             }
-            got=g->deflation.next_out-g->output_buf;
-            if (got>0) {
-                compressed_size+=got;
-                if (!fwrite(g->output_buf,got,1,g->zip)) {
-                    fprintf(stderr,"%s: fwrite: %s\n",
-                            g->zip_path,strerror(errno));
-                    goto cleanup;
-                }
+            break;
+        case 'i':
+            opts->serve_path=optarg;
+            break;
+        case 'L':
+            if (parse_count(optarg,"memory budget",0x800000,
+                    &opts->max_memory))
+                return -1;
+            break;
+        case 'H':
+            if (parse_count(optarg,"I/O rate",0x100000,&opts->io_rate))
+                return -1;
+            break;
+        case 'k':
+            if (parse_count(optarg,"I/O latency",10000000,
+                    &opts->io_latency))
+                return -1;
+            break;
+        case 'J':
+            if (parse_count(optarg,"CPU duty cycle",100,&opts->cpu_duty))
+                return -1;
+            if (opts->cpu_duty==100)
+                opts->cpu_duty=0;
+            break;
+        case 'I':
+            if (parse_count(optarg,"progress interval",86400,
+                    &opts->progress_interval))
+                return -1;
+            break;
+        case 'R':
+            if (!strcmp(optarg,"direct")) {
+                opts->direct=1;
+            } else if (!strcmp(optarg,"sql")) {
+                opts->direct=0;
+            } else {
+                fprintf(messages(),"%s: Invalid read method\n",optarg);
+                return -1;
             }
+            break;
+        case 's':
+            if (parse_strategy(optarg,&opts->strategy))
+                return -1;
+            break;
+        case 'S':
+            if (parse_count(optarg,"sample size",0x10000,&opts->sample_pages))
+                return -1;
+            break;
+        case 'F':
+            if (!strcmp(optarg,"adaptive")) {
+                opts->adaptive=1;
+            } else if (!strcmp(optarg,"block")) {
+                opts->adaptive=0;
+            } else {
+                fprintf(messages(),"%s: Invalid flush policy\n",optarg);
+                return -1;
+            }
+            break;
+        case 'E':
+            if (!strcmp(optarg,"keep")) {
+                opts->zero_free=0;
+            } else if (!strcmp(optarg,"zero")) {
+                opts->zero_free=1;
+            } else {
+                fprintf(messages(),"%s: Invalid free page mode\n",optarg);
+                return -1;
+            }
+            break;
+        case 'B':
+            opts->group_pages=1;
+            break;
+        case 'A':
+            opts->seek_pages=seek_pages_default;
+            if (optarg && parse_count(optarg,"seek interval",0x1000000,
+                    &opts->seek_pages))
+                return -1;
+            break;
+        case 'T':
+            if (!strcmp(optarg,"never")) {
+                opts->store=store_never;
+            } else if (!strcmp(optarg,"auto")) {
+                opts->store=store_auto;
+            } else if (!strcmp(optarg,"always")) {
+                opts->store=store_always;
+            } else {
+                fprintf(messages(),"%s: Invalid store mode\n",optarg);
+                return -1;
+            }
+            break;
+        default:
+            usage();
+            return -1;
         }
-        if (status!=SQLITE_DONE) {
-            fprintf(stderr,"sqlite3_step(pages): %s\n",sqlite3_errmsg(g->db));
-            goto cleanup;
-        }
-        sqlite3_reset(pages);
-        if (page_count<input->page_count) {
-            fprintf(stderr,"%s: Inconsistent page count\n",input->path);
+    }
+    if (opts->direct_output && !opts->write_buffer) {
+        fputs("Direct output needs a write buffer\n",messages());
+        return -1;
+    }
+    if (opts->check_path && (opts->verify || opts->manifest_path
+            || opts->base_path || opts->quick)) {
+        fputs("Checking goes with none of --verify, --manifest,"
+              " --since and --quick\n",messages());
+        return -1;
+    }
+    return optind;
+}
+
+/*
+ * One whole run, with global_info as its context: the archive
+ * and inputs are in paths (only the inputs when checking).
+ * Returns the exit status.  A daemon passes in what it keeps warm.
+ */
+
+static int run_archive(
+    option_info const *opts,
+    char const *crc_kernel,
+    warm_info *warm,
+    int path_cnt,
+    char **paths)
+{
+    global_info *g;
+
+    g=make_global(opts->check_path ? path_cnt : path_cnt-1,opts);
+    if (!g)
+        return 1;
+    g->crc_kernel=crc_kernel;
+    g->warm=warm;
+    if (g->stats==stats_json) {
+        read_clocks(&g->start);
+        g->stage_mark=g->start;
+    }
+    if (open_db(g))
+        goto cleanup;
+    if (g->check_path) {
+        int status;
+
+        status=check_archive(g,paths);
+        if (status<0)
             goto cleanup;
-        }
-        g->deflation.next_in=nobuf;
-        g->deflation.avail_in=0;
-        g->deflation.next_out=nobuf;
-        g->deflation.avail_out=0;
-        status=deflateReset(&g->deflation);
-        if (status!=Z_OK) {
-            fprintf(stderr,"deflateReset: error %d\n",status);
+        free_global(g);
+        return status;
+    }
+    if (attach_inputs(g,paths+1))
+        goto cleanup;
+    if (open_archive(g,paths[0]))
+        goto cleanup;
+    end_stage(g,stage_open);
+    if (begin_transaction(g))
+        goto cleanup;
+    end_stage(g,stage_lock);
+    if (get_metainfo(g))
+        goto cleanup;
+    if (fit_memory(g))
+        goto cleanup;
+    if (load_base(g))
+        goto cleanup;
+    if (open_manifest(g))
+        goto cleanup;
+    if (init_compression(g))
+        goto cleanup;
+    end_stage(g,stage_metainfo);
+    if (g->capture) {
+        if (capture_inputs(g))
             goto cleanup;
+        rollback_transaction(g);
+    }
+    end_stage(g,stage_capture);
+    if (build_dictionary(g))
+        goto cleanup;
+    end_stage(g,stage_dictionary);
+    if (compress_inputs(g))
+        goto cleanup;
+    end_stage(g,stage_compress);
+    rollback_transaction(g);
+    close_db(g);
+    finish_compression(g);
+    if (write_directory(g))
+        goto cleanup;
+    if (write_trailer(g))
+        goto cleanup;
+    if (close_archive(g))
+        goto cleanup;
+    if (close_manifest(g))
+        goto cleanup;
+    end_stage(g,stage_finish);
+    if (g->stats==stats_json)
+        print_stats(g);
+    if (g->stats==stats_text && g->max_memory && !g->warm) {
+        fprintf(messages(),"peak memory %.1f MiB\n",
+                (double)peak_rss()/(1<<20));
+    }
+    if (g->stats==stats_text
+            && (throttled_io(&g->throttle) || g->throttle.duty)) {
+        fprintf(messages(),"throttled %.1f s for I/O, %.1f s for CPU",
+                g->throttle.io_wait/1e9,g->throttle.cpu_wait/1e9);
+        if (g->throttle.latency) {
+            fprintf(messages(),", last rate %.1f MiB/s",
+                    (double)g->throttle.rate/(1<<20));
         }
-        offset+=compressed_size;
+        fputc('\n',messages());
+    }
+    free_global(g);
+    g=NULL;
+    return 0;
+
+cleanup:
+    cleanup_global(g);
+    free_global(g);
+    return 1;
+}
 
 /*
- * Prepare and write the local header.
+ * Daemon mode.  s3zip --serve=socket listens on a Unix socket and
+ * runs the job on each connection on a thread of its own, up to -j
+ * of them at a time.  A job is the arguments it would have on the
+ * command line, each ending in a NUL, up to the end of the stream;
+ * the answer is its exit status as a line of text, then what it
+ * wrote to standard output (the report of --check) and to standard
+ * error, which the client copies to its own.  Progress reports as
+ * text stay on the daemon's standard error, and relative paths are
+ * relative to where it was started.  s3zip --submit=socket arguments
+ * is a client.
  */
-        if (l64) {
-            STORE16(entry.needed_version,version);
-            STORE32(entry.compressed_size,0xFFFFFFFF);
-            STORE32(entry.size,0xFFFFFFFF);
-            STORE16(entry.extra_len,sizeof (local_zip64));
-
-            STORE16(ext.ext_id,0x0001);
-            STORE16(ext.ext_size,16);
-            STORE64(ext.size,size);
-            STORE64(ext.compressed_size,compressed_size);
-        } else {
-            STORE16(entry.needed_version,version);
-            STORE32(entry.compressed_size,compressed_size);
-            STORE32(entry.size,size);
-            STORE16(entry.extra_len,0);
-        }
-        entry.sig=local_entry_sig;
-        STORE16(entry.flags,0x0002);
-        STORE16(entry.compression,8);
-        STORE16(entry.mod_time,input->dos_mtime);
-        STORE16(entry.mod_date,input->dos_mdate);
-        STORE32(entry.crc,crc);
-        STORE16(entry.path_len,input->path_len);
 
-        if (fseeko(g->zip,input->local_offset,SEEK_SET)) {
-            fprintf(stderr,"%s: fseeko: %s\n",g->zip_path,strerror(errno));
-            goto cleanup;
-        }
-        if (!fwrite(&entry,sizeof entry,1,g->zip)) {
-            fprintf(stderr,"%s: fwrite: %s\n",g->zip_path,strerror(errno));
-            goto cleanup;
-        }
-        if (!fwrite(input->path,input->path_len,1,g->zip)) {
-            fprintf(stderr,"%s: fwrite: %s\n",g->zip_path,strerror(errno));
-            goto cleanup;
-        }
-        if (l64) {
-            if (!fwrite(&ext,sizeof ext,1,g->zip)) {
-                fprintf(stderr,"%s: fwrite: %s\n",
-                        g->zip_path,strerror(errno));
-                goto cleanup;
-            }
-        }
+enum {
+    serve_backlog       = 64,
+    job_size_max        = 0x100000
+};
 
+typedef struct serve_info {
+    char const *crc_kernel;
+    int max_jobs;
+    warm_info warm;
 /*
- * Prepare the central directory entry and save it for later.
- *
- * Yes, greater-or-equal comparisons.  Not a bug.
+ * Protected by lock: running, and getopt's own state.
  */
-        if (c64) {
-            ule64 *ext_data;
-            unsigned int ext_size;
-
-            ext_data=input->ext.data;
-            if (size>=0xFFFFFFFF) {
-                STORE32(input->entry.size,0xFFFFFFFF);
-                STORE64(*ext_data,size);
-                ext_data++;
-            } else {
-                STORE32(input->entry.size,size);
-            }
-            if (compressed_size>=0xFFFFFFFF) {
-                STORE32(input->entry.compressed_size,0xFFFFFFFF);
-                STORE64(*ext_data,compressed_size);
-                ext_data++;
-            } else {
-                STORE32(input->entry.compressed_size,compressed_size);
-            }
-            if (input->local_offset>=0xFFFFFFFF) {
-                STORE32(input->entry.local_offset,0xFFFFFFFF);
-                STORE64(*ext_data,input->local_offset);
-                ext_data++;
-            } else {
-                STORE32(input->entry.local_offset,input->local_offset);
-            }
-            ext_size=(ext_data-input->ext.data)*8;
-            STORE16(input->ext.ext_id,1);
-            STORE16(input->ext.ext_size,ext_size);
-            input->ext_len=offsetof(central_zip64,data)+ext_size;
-        } else {
-            STORE32(input->entry.size,size);
-            STORE32(input->entry.compressed_size,compressed_size);
-            STORE32(input->entry.local_offset,input->local_offset);
-            input->ext_len=0;
-        }
-        input->entry.sig=central_entry_sig;
-        STORE16(input->entry.creator_version,version | creator_unix);
-        STORE16(input->entry.needed_version,version);
-        STORE16(input->entry.flags,0x0002);
-        STORE16(input->entry.compression,8);
-        STORE16(input->entry.mod_time,input->dos_mtime);
-        STORE16(input->entry.mod_date,input->dos_mdate);
-        STORE32(input->entry.crc,crc);
-        STORE16(input->entry.path_len,input->path_len);
-        STORE16(input->entry.extra_len,input->ext_len);
-        STORE16(input->entry.comment_len,0);
-        STORE16(input->entry.first_diskno,0);
-        STORE16(input->entry.internal_attribs,0);
-        STORE32(input->entry.external_attribs,input->mode<<16);
-
-        archived_size=offset-input->local_offset
-            +sizeof (central_entry)+input->path_len+input->ext_len;
-        fprintf(stderr,"%.6f  %s\n",(double)archived_size/size,input->path);
-    }
-
-    g->cd_offset=offset;
-    sqlite3_finalize(pages);
-    pages=NULL;
-    return 0;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    int running;
+} serve_info;
 
-cleanup:
-    if (pages)
-        sqlite3_finalize(pages);
-    return -1;
-}
+typedef struct job_info {
+    serve_info *s;
+    int fd;
+} job_info;
 
-static void rollback_transaction(
-    global_info *g)
+static int send_all(
+    int fd,
+    void const *data,
+    size_t len)
 {
-    int status;
-    sqlite3_stmt *rollback=NULL;
-
-    status=sqlite3_prepare_v2(
-        g->db,rollback_sql,sizeof rollback_sql,&rollback,NULL);
-    if (status==SQLITE_OK)
-        sqlite3_step(rollback);
-    if (rollback)
-        sqlite3_finalize(rollback);
-    g->have_transaction=0;
-}
+    uint8_t const *p;
 
-static void close_db(
-    global_info *g)
-{
-    sqlite3_close_v2(g->db);
-    g->db=NULL;
-}
+    p=data;
+    while (len) {
+        ssize_t got;
 
-static void finish_compression(
-    global_info *g)
-{
-    deflateEnd(&g->deflation);
-    g->have_deflation=0;
+        got=write(fd,p,len);
+        if (got<0) {
+            if (errno!=EINTR)
+                return -1;
+        } else {
+            p+=got;
+            len-=got;
+        }
+    }
+    return 0;
 }
 
-int write_directory(
-    global_info *g)
+static int set_socket_path(
+    struct sockaddr_un *addr,
+    char const *path)
 {
-    input_info *input,*inputs_end;
-    off_t offset,total_size;
+    size_t path_len;
 
-    inputs_end=g->inputs+g->input_cnt;
-    offset=g->cd_offset;
-    if (fseeko(g->zip,offset,SEEK_SET)) {
-        fprintf(stderr,"%s: fseeko: %s\n",g->zip_path,strerror(errno));
+    path_len=strlen(path);
+    if (path_len>=sizeof addr->sun_path) {
+        fprintf(messages(),"%s: Socket path too long\n",path);
         return -1;
     }
-    total_size=0;
-    for (input=g->inputs; input<inputs_end; input++) {
-        if (!fwrite(&input->entry,sizeof (central_entry),1,g->zip)) {
-            fprintf(stderr,"%s: fwrite: %s\n",g->zip_path,strerror(errno));
-            return -1;
-        }
-        offset+=sizeof (central_entry);
-        if (!fwrite(input->path,input->path_len,1,g->zip)) {
-            fprintf(stderr,"%s: fwrite: %s\n",g->zip_path,strerror(errno));
-            return -1;
-        }
-        offset+=input->path_len;
-        if (input->ext_len) {
-            if (!fwrite(&input->ext,input->ext_len,1,g->zip)) {
-                fprintf(stderr,"%s: fwrite: %s\n",
-                        g->zip_path,strerror(errno));
-                return -1;
-            }
-            offset+=input->ext_len;
-        }
-        total_size+=input->size;
-    }
-    g->cd_size=offset-g->cd_offset;
-    g->total_size=total_size;
+    memset(addr,0,sizeof *addr);
+    addr->sun_family=AF_UNIX;
+    memcpy(addr->sun_path,path,path_len+1);
     return 0;
 }
 
-static int write_trailer(
-    global_info *g)
+static char *read_job(
+    int fd,
+    size_t *len)
 {
-    eocd end;
-    off_t offset;
+    char *buf=NULL;
+    size_t size;
 
-    offset=g->cd_offset+g->cd_size;
-    end.sig=eocd_sig;
-    STORE16(end.this_diskno,0);
-    STORE16(end.cd_diskno,0);
-    STORE16(end.comment_len,0);
-    if (g->input_cnt>0xFFFF
-            || g->cd_offset>0xFFFFFFFF
-            || g->cd_size>0xFFFFFFFF) {
-        eocd64 end64;
-        eocd64_locator loc64;
-        off_t eocd_offset;
+    size=0;
+    *len=0;
+    for (;;) {
+        ssize_t got;
 
-        eocd_offset=offset;
-        end64.sig=eocd64_sig;
-        STORE64(end64.size,sizeof (eocd64)-12);
-        STORE16(end64.creator_version,version_zip64 | creator_unix);
-        STORE16(end64.needed_version,version_zip64);
-        STORE32(end64.this_diskno,0);
-        STORE32(end64.cd_diskno,0);
-        STORE64(end64.this_entry_cnt,(uint64_t)g->input_cnt);
-        STORE64(end64.total_entry_cnt,(uint64_t)g->input_cnt);
-        STORE64(end64.cd_size,g->cd_size);
-        STORE64(end64.cd_offset,g->cd_offset);
-        if (g->input_cnt>0xFFFF) {
-            STORE16(end.this_entry_cnt,0xFFFF);
-            STORE16(end.total_entry_cnt,0xFFFF);
-        } else {
-            STORE16(end.this_entry_cnt,g->input_cnt);
-            STORE16(end.total_entry_cnt,g->input_cnt);
-        }
-        if (g->cd_size>0xFFFFFFFF) {
-            STORE32(end.cd_size,0xFFFFFFFF);
-        } else {
-            STORE32(end.cd_size,g->cd_size);
-        }
-        if (g->cd_offset>0xFFFFFFFF) {
-            STORE32(end.cd_offset,0xFFFFFFFF);
-        } else {
-            STORE32(end.cd_offset,g->cd_size);
-        }
-        loc64.sig=eocd64_locator_sig;
-        STORE32(loc64.eocd_diskno,0);
-        STORE64(loc64.eocd_offset,eocd_offset);
-        STORE32(loc64.disk_cnt,1);
+        if (*len==size) {
+            char *new_buf;
 
-        if (!fwrite(&end64,sizeof end64,1,g->zip)) {
-            fprintf(stderr,"%s: fwrite: %s\n",g->zip_path,strerror(errno));
-            return -1;
+            if (size>=job_size_max) {
+                fputs("Job too big\n",messages());
+                goto cleanup;
+            }
+            size=size ? 2*size : 0x1000;
+            new_buf=realloc(buf,size);
+            if (!new_buf) {
+                report_errno("realloc");
+                goto cleanup;
+            }
+            buf=new_buf;
         }
-        offset+=sizeof end64;
-        if (!fwrite(&loc64,sizeof loc64,1,g->zip)) {
-            fprintf(stderr,"%s: fwrite: %s\n",g->zip_path,strerror(errno));
-            return -1;
+        got=read(fd,buf+*len,size-*len);
+        if (got<0) {
+            if (errno==EINTR)
+                continue;
+            fprintf(messages(),"job: read: %s\n",strerror(errno));
+            goto cleanup;
         }
-        offset+=sizeof loc64;
-    } else {
-        STORE16(end.this_entry_cnt,g->input_cnt);
-        STORE16(end.total_entry_cnt,g->input_cnt);
-        STORE32(end.cd_size,g->cd_size);
-        STORE32(end.cd_offset,g->cd_offset);
-    }
-
-    if (!fwrite(&end,sizeof end,1,g->zip)) {
-        fprintf(stderr,"%s: fwrite: %s\n",g->zip_path,strerror(errno));
-        return -1;
+        if (!got)
+            break;
+        *len+=got;
     }
-    offset+=sizeof end;
-    if (fflush(g->zip)) {
-        fprintf(stderr,"%s: fflush: %s\n",g->zip_path,strerror(errno));
-        return -1;
+    if (*len && buf[*len-1]) {
+        fputs("Job arguments must each end in a NUL\n",messages());
+        goto cleanup;
     }
-    fprintf(stderr,"========\n%.6f  (total)\n",(double)offset/g->total_size);
-    return 0;
+    return buf;
+
+cleanup:
+    free(buf);
+    return NULL;
 }
 
-static int close_archive(
-    global_info *g)
+/*
+ * The reply is a line with the job's exit status and the length
+ * of what it wrote to output(), then that, then whatever it wrote
+ * to messages(), which also goes to the daemon's standard error
+ * in one piece once the job is done.
+ */
+
+static void *job_main(
+    void *arg)
 {
-    FILE *zip;
+    job_info *job;
+    serve_info *s;
+    option_info opts;
+    FILE *stream,*out_stream;
+    char *buf,*text=NULL,*out=NULL;
+    char **argv=NULL;
+    char reply[48];
+    size_t len,pos,text_len,out_len;
+    int argc,first,status;
 
-    zip=g->zip;
-    g->zip=NULL;
-    if (fclose(zip)) {
-        fprintf(stderr,"%s: fclose: %s\n",g->zip_path,strerror(errno));
-        return -1;
+    job=arg;
+    s=job->s;
+    status=1;
+    text_len=0;
+    out_len=0;
+    stream=open_memstream(&text,&text_len);
+    if (!stream)
+        report_errno("open_memstream");
+    use_messages(stream);
+    out_stream=open_memstream(&out,&out_len);
+    if (!out_stream)
+        report_errno("open_memstream");
+    use_output(out_stream);
+    buf=read_job(job->fd,&len);
+    if (!buf)
+        goto done;
+    argc=1;
+    for (pos=0; pos<len; pos++) {
+        if (!buf[pos])
+            argc++;
     }
-    return 0;
+    argv=malloc((argc+1)*sizeof *argv);
+    if (!argv) {
+        report_errno("malloc");
+        goto done;
+    }
+    argv[0]="s3zip";
+    argc=1;
+    for (pos=0; pos<len; pos+=strlen(buf+pos)+1)
+        argv[argc++]=buf+pos;
+    argv[argc]=NULL;
+    pthread_mutex_lock(&s->lock);
+    first=parse_options(argc,argv,&opts);
+    pthread_mutex_unlock(&s->lock);
+    if (first<0)
+        goto done;
+    if (opts.serve_path) {
+        fputs("A job can't serve jobs\n",messages());
+        goto done;
+    }
+    if (argc-first<(opts.check_path ? 1 : 2)) {
+        fputs("A job needs an archive and inputs\n",messages());
+        goto done;
+    }
+    if (!opts.check_path && !strcmp(argv[first],"-")) {
+        fputs("A job can't write to standard output\n",messages());
+        goto done;
+    }
+    if (opts.progress_fd>=0) {
+        fputs("A job can't report progress to a descriptor\n",messages());
+        goto done;
+    }
+    status=run_archive(&opts,s->crc_kernel,&s->warm,
+                       argc-first,argv+first);
+
+done:
+    use_output(NULL);
+    if (out_stream && fclose(out_stream)) {
+        report_errno("job: fclose");
+        out_len=0;
+    }
+    use_messages(NULL);
+    if (stream && fclose(stream)) {
+        report_errno("job: fclose");
+        text_len=0;
+    }
+    if (text_len)
+        fwrite(text,1,text_len,messages());
+    snprintf(reply,sizeof reply,"%d %lu\n",status,(unsigned long)out_len);
+    if (send_all(job->fd,reply,strlen(reply))
+            || send_all(job->fd,out,out_len)
+            || send_all(job->fd,text,text_len))
+        fprintf(messages(),"job: write: %s\n",strerror(errno));
+    close(job->fd);
+    free(out);
+    free(text);
+    free(argv);
+    free(buf);
+    free(job);
+    pthread_mutex_lock(&s->lock);
+    s->running--;
+    pthread_cond_signal(&s->idle);
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
 }
 
-static void cleanup_global(
-    global_info *g)
+/*
+ * Runs until accept fails, then waits for the jobs still running.
+ */
+
+static int serve_jobs(
+    option_info const *opts,
+    char const *crc_kernel)
 {
-    if (g->have_deflation)
-        finish_compression(g);
-    if (g->have_transaction)
-        rollback_transaction(g);
-    if (g->db)
-        close_db(g);
-    if (g->zip) {
-        fclose(g->zip);
-        g->zip=NULL;
+    serve_info s;
+    struct sockaddr_un addr;
+    struct stat stat_buf;
+    char const *path;
+    int fd;
+
+    path=opts->serve_path;
+    if (set_socket_path(&addr,path))
+        return 1;
+    s.crc_kernel=crc_kernel;
+    s.max_jobs=opts->jobs;
+    s.warm.db_cnt=0;
+    s.warm.stream_cnt=0;
+    s.running=0;
+    if (pthread_mutex_init(&s.warm.lock,NULL)
+            || pthread_mutex_init(&s.lock,NULL)
+            || pthread_cond_init(&s.idle,NULL)
+            || pthread_key_create(&messages_key,NULL)
+            || pthread_key_create(&output_key,NULL)) {
+        fputs("Can't initialise thread synchronisation\n",messages());
+        return 1;
     }
-    if (g->have_output) {
-        remove(g->zip_path);
-        g->have_output=0;
+    have_stream_keys=1;
+#ifdef S3ZIP_S3
+    if (curl_global_init(CURL_GLOBAL_DEFAULT)) {
+        fputs("curl_global_init failed\n",messages());
+        return 1;
+    }
+#endif
+    signal(SIGPIPE,SIG_IGN);
+    if (!lstat(path,&stat_buf) && S_ISSOCK(stat_buf.st_mode))
+        unlink(path);
+    fd=socket(AF_UNIX,SOCK_STREAM,0);
+    if (fd<0) {
+        report_errno("socket");
+        return 1;
+    }
+    if (bind(fd,(struct sockaddr *)&addr,sizeof addr)) {
+        fprintf(messages(),"%s: bind: %s\n",path,strerror(errno));
+        close(fd);
+        return 1;
     }
+    if (listen(fd,serve_backlog)) {
+        fprintf(messages(),"%s: listen: %s\n",path,strerror(errno));
+        close(fd);
+        return 1;
+    }
+    for (;;) {
+        job_info *job;
+        pthread_t thread;
+        int job_fd,status;
+
+        pthread_mutex_lock(&s.lock);
+        while (s.running>=s.max_jobs)
+            pthread_cond_wait(&s.idle,&s.lock);
+        pthread_mutex_unlock(&s.lock);
+        job_fd=accept(fd,NULL,NULL);
+        if (job_fd<0) {
+            if (errno==EINTR || errno==ECONNABORTED)
+                continue;
+            fprintf(messages(),"%s: accept: %s\n",path,strerror(errno));
+            break;
+        }
+        job=malloc(sizeof *job);
+        if (!job) {
+            report_errno("malloc");
+            close(job_fd);
+            continue;
+        }
+        job->s=&s;
+        job->fd=job_fd;
+        pthread_mutex_lock(&s.lock);
+        s.running++;
+        pthread_mutex_unlock(&s.lock);
+        status=pthread_create(&thread,NULL,job_main,job);
+        if (status) {
+            fprintf(messages(),"pthread_create: %s\n",strerror(status));
+            close(job_fd);
+            free(job);
+            pthread_mutex_lock(&s.lock);
+            s.running--;
+            pthread_mutex_unlock(&s.lock);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    close(fd);
+    pthread_mutex_lock(&s.lock);
+    while (s.running)
+        pthread_cond_wait(&s.idle,&s.lock);
+    pthread_mutex_unlock(&s.lock);
+    return 1;
 }
 
-int main(
+/*
+ * Copies the job's output and messages as they come, after its status
+ * line, to standard output and standard error.
+ */
+
+static int submit_job(
+    char const *path,
     int argc,
     char **argv)
 {
-    global_info *g=NULL;
+    struct sockaddr_un addr;
+    char reply[48];
+    char text[0x1000];
+    char *end;
+    size_t len;
+    unsigned long out_len;
+    int fd,ix,status;
 
-    if (argc<3) {
-        fputs("Usage: s3zip archive.zip database...\n",stderr);
+    if (set_socket_path(&addr,path))
+        return 1;
+    fd=socket(AF_UNIX,SOCK_STREAM,0);
+    if (fd<0) {
+        report_errno("socket");
         return 1;
     }
-    g=make_global(argc-2);
-    if (!g)
-        goto cleanup;
-    if (open_db(g))
-        goto cleanup;
-    if (attach_inputs(g,argv+2))
-        goto cleanup;
-    if (open_archive(g,argv[1]))
-        goto cleanup;
-    if (begin_transaction(g))
-        goto cleanup;
-    if (get_metainfo(g))
-        goto cleanup;
-    if (init_compression(g))
-        goto cleanup;
-    if (compress_inputs(g))
+    if (connect(fd,(struct sockaddr *)&addr,sizeof addr)) {
+        fprintf(messages(),"%s: connect: %s\n",path,strerror(errno));
         goto cleanup;
-    rollback_transaction(g);
-    close_db(g);
-    finish_compression(g);
-    if (write_directory(g))
+    }
+    for (ix=0; ix<argc; ix++) {
+        if (send_all(fd,argv[ix],strlen(argv[ix])+1)) {
+            fprintf(messages(),"%s: write: %s\n",path,strerror(errno));
+            goto cleanup;
+        }
+    }
+    if (shutdown(fd,SHUT_WR)) {
+        fprintf(messages(),"%s: shutdown: %s\n",path,strerror(errno));
         goto cleanup;
-    if (write_trailer(g))
+    }
+    len=0;
+    while (len<sizeof reply-1 && (!len || reply[len-1]!='\n')) {
+        ssize_t got;
+
+        got=read(fd,reply+len,1);
+        if (got<0) {
+            if (errno==EINTR)
+                continue;
+            fprintf(messages(),"%s: read: %s\n",path,strerror(errno));
+            goto cleanup;
+        }
+        if (!got)
+            break;
+        len++;
+    }
+    reply[len]=0;
+    if (!len || reply[len-1]!='\n') {
+        fprintf(messages(),"%s: No answer\n",path);
         goto cleanup;
-    if (close_archive(g))
+    }
+    status=(int)strtol(reply,&end,10);
+    out_len=strtoul(end,&end,10);
+    if (*end!='\n') {
+        fprintf(messages(),"%s: Bad answer\n",path);
         goto cleanup;
-    free(g);
-    g=NULL;
-    return 0;
+    }
+    for (;;) {
+        ssize_t got;
+        size_t want;
+
+        want=sizeof text;
+        if (out_len && out_len<want)
+            want=out_len;
+        got=read(fd,text,want);
+        if (got<0) {
+            if (errno==EINTR)
+                continue;
+            fprintf(messages(),"%s: read: %s\n",path,strerror(errno));
+            break;
+        }
+        if (!got)
+            break;
+        if (out_len) {
+            fwrite(text,1,got,output());
+            out_len-=got;
+        } else {
+            fwrite(text,1,got,messages());
+        }
+    }
+    close(fd);
+    if (fflush(output())) {
+        fprintf(messages(),"stdout: %s\n",strerror(errno));
+        return 1;
+    }
+    return status;
 
 cleanup:
-    if (g)
-        cleanup_global(g);
+    close(fd);
     return 1;
 }
+
+int main(
+    int argc,
+    char **argv)
+{
+    option_info opts;
+    char const *crc_kernel;
+    int first;
+
+    if (argc>1 && !strncmp(argv[1],"--submit=",9))
+        return submit_job(argv[1]+9,argc-2,argv+2);
+    first=parse_options(argc,argv,&opts);
+    if (first<0)
+        return 1;
+    argc-=first;
+    argv+=first;
+    if (opts.serve_path ? argc>0 : argc<(opts.check_path ? 1 : 2)) {
+        usage();
+        return 1;
+    }
+    crc_kernel=crc_init();
+    if (opts.stats==stats_text)
+        fprintf(messages(),"crc32 %s, zlib %s\n",crc_kernel,zlibVersion());
+    if (opts.serve_path)
+        return serve_jobs(&opts,crc_kernel);
+    return run_archive(&opts,crc_kernel,NULL,argc,argv);
+}
@@ -0,0 +1,245 @@
+/*
+ * Zip file construction kit, shared by s3zip and s3unzip.
+ */
+
+#ifndef ZIPKIT_H
+#define ZIPKIT_H
+
+#include <stdint.h>
+
+/*
+ * Zip file construction kit, part 1:
+ * Unsigned little-endian integers and how to store and load them.
+ */
+
+typedef struct ule16 {
+    uint8_t a,b;
+} ule16;
+
+typedef struct ule32 {
+    uint8_t c,d,e,f;
+} ule32;
+
+typedef struct ule64 {
+    uint8_t g,h,i,j,k,l,m,n;
+} ule64;
+
+#define STORE16(u,v) \
+    ((u).a=(uint8_t)(v),       (u).b=(uint8_t)((v)>>8))
+
+#define STORE32(u,v) \
+    ((u).c=(uint8_t)(v),       (u).d=(uint8_t)((v)>>8), \
+     (u).e=(uint8_t)((v)>>16), (u).f=(uint8_t)((v)>>24))
+
+#define STORE64(u,v) \
+    ((u).g=(uint8_t)(v),       (u).h=(uint8_t)((v)>>8), \
+     (u).i=(uint8_t)((v)>>16), (u).j=(uint8_t)((v)>>24), \
+     (u).k=(uint8_t)((v)>>32), (u).l=(uint8_t)((v)>>40), \
+     (u).m=(uint8_t)((v)>>48), (u).n=(uint8_t)((v)>>56))
+
+#define LOAD16(u) \
+    ((unsigned int)(u).a | (unsigned int)(u).b<<8)
+
+#define LOAD32(u) \
+    ((uint32_t)(u).c     | (uint32_t)(u).d<<8 | \
+     (uint32_t)(u).e<<16 | (uint32_t)(u).f<<24)
+
+#define LOAD64(u) \
+    ((uint64_t)(u).g     | (uint64_t)(u).h<<8  | \
+     (uint64_t)(u).i<<16 | (uint64_t)(u).j<<24 | \
+     (uint64_t)(u).k<<32 | (uint64_t)(u).l<<40 | \
+     (uint64_t)(u).m<<48 | (uint64_t)(u).n<<56)
+
+/*
+ * Zip file construction kit, part 2:
+ * On-disk data structures.
+ */
+
+typedef struct local_entry {
+    ule32 sig;
+    ule16 needed_version;
+    ule16 flags;
+    ule16 compression;
+    ule16 mod_time;
+    ule16 mod_date;
+    ule32 crc;
+    ule32 compressed_size;
+    ule32 size;
+    ule16 path_len;
+    ule16 extra_len;
+} local_entry;
+
+/*
+ * A Zip64 local extension always contains both sizes and nothing more.
+ */
+
+typedef struct local_zip64 {
+    ule16 ext_id;
+    ule16 ext_size;
+    ule64 size;
+    ule64 compressed_size;
+} local_zip64;
+
+/*
+ * When the sizes and CRC aren't known in time for the local header
+ * (flag bit 3), they follow the data instead, with 64-bit sizes
+ * if the local header has a Zip64 extension.
+ */
+
+typedef struct data_descriptor {
+    ule32 sig;
+    ule32 crc;
+    ule32 compressed_size;
+    ule32 size;
+} data_descriptor;
+
+typedef struct data_descriptor64 {
+    ule32 sig;
+    ule32 crc;
+    ule64 compressed_size;
+    ule64 size;
+} data_descriptor64;
+
+typedef struct central_entry {
+    ule32 sig;
+    ule16 creator_version;
+    ule16 needed_version;
+    ule16 flags;
+    ule16 compression;
+    ule16 mod_time;
+    ule16 mod_date;
+    ule32 crc;
+    ule32 compressed_size;
+    ule32 size;
+    ule16 path_len;
+    ule16 extra_len;
+    ule16 comment_len;
+    ule16 first_diskno;
+    ule16 internal_attribs;
+    ule32 external_attribs;
+    ule32 local_offset;
+} central_entry;
+
+/*
+ * A Zip64 central extension contains up to three 64-bit integers
+ * (size, compressed size, local offset),
+ * but no disk number since we only write single-part archives.
+ */
+
+typedef struct central_zip64 {
+    ule16 ext_id;
+    ule16 ext_size;
+    ule64 data[3];
+} central_zip64;
+
+typedef struct eocd64 {
+    ule32 sig;
+    ule64 size;
+    ule16 creator_version;
+    ule16 needed_version;
+    ule32 this_diskno;
+    ule32 cd_diskno;
+    ule64 this_entry_cnt;
+    ule64 total_entry_cnt;
+    ule64 cd_size;
+    ule64 cd_offset;
+} eocd64;
+
+typedef struct eocd64_locator {
+    ule32 sig;
+    ule32 eocd_diskno;
+    ule64 eocd_offset;
+    ule32 disk_cnt;
+} eocd64_locator;
+
+typedef struct eocd {
+    ule32 sig;
+    ule16 this_diskno;
+    ule16 cd_diskno;
+    ule16 this_entry_cnt;
+    ule16 total_entry_cnt;
+    ule32 cd_size;
+    ule32 cd_offset;
+    ule16 comment_len;
+} eocd;
+
+static ule32 const local_entry_sig =    { 'P', 'K', 3, 4 };
+static ule32 const central_entry_sig =  { 'P', 'K', 1, 2 };
+static ule32 const data_descriptor_sig ={ 'P', 'K', 7, 8 };
+static ule32 const eocd64_sig =         { 'P', 'K', 6, 6 };
+static ule32 const eocd64_locator_sig = { 'P', 'K', 6, 7 };
+static ule32 const eocd_sig =           { 'P', 'K', 5, 6 };
+
+enum {
+    version_stored      = 10,   /* storing needs 1.0 */
+    version_classic     = 20,   /* deflate compression needs 2.0 */
+    version_zip64       = 45,   /* Zip64 needs 4.5 */
+    version_zstd        = 63,   /* zstd needs 6.3.8, and so does our LZ4 */
+
+    method_stored       = 0,
+    method_deflate      = 8,
+    method_zstd         = 93,
+    method_lz4          = 0x344C,   /* private, "L4" in a hex dump */
+
+    creator_unix        = 3<<8
+};
+
+/*
+ * An archive made with a shared dictionary has it as a stored entry
+ * by this name, which is the preset dictionary of every deflate
+ * and zstd entry in the archive.
+ */
+
+static char const dictionary_path[] = ".s3zip-dictionary";
+
+enum {
+    dictionary_path_len = sizeof dictionary_path-1,
+    dictionary_max      = 0x1C000
+};
+
+/*
+ * An archive made with --verify has a stored entry by this name,
+ * holding a manifest of every database entry's page hashes,
+ * in the format of delta.h.
+ */
+
+static char const archive_manifest_path[] = ".s3zip-manifest";
+
+enum {
+    archive_manifest_path_len = sizeof archive_manifest_path-1
+};
+
+/*
+ * An archive made with --seekable has a stored entry by this name last,
+ * after the database entries: an index_header, then for each of those
+ * entries an index_entry and point_cnt index_points, in pgno order.
+ * At each point, deflate starts afresh, so inflating can begin there
+ * without the data before it.  Offsets count from the start of the
+ * entry's data, uncompressed and compressed.
+ */
+
+typedef struct index_header {
+    ule32 sig;
+    ule32 entry_cnt;
+} index_header;
+
+typedef struct index_entry {
+    ule64 local_offset;
+    ule32 page_size;
+    ule32 point_cnt;
+} index_entry;
+
+typedef struct index_point {
+    ule64 offset;
+    ule64 compressed_offset;
+} index_point;
+
+static ule32 const index_sig =          { 'S', '3', 'Z', 'I' };
+
+static char const index_path[] = ".s3zip-index";
+
+enum {
+    index_path_len      = sizeof index_path-1
+};
+
+#endif